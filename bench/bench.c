@@ -0,0 +1,1916 @@
+/*
+ * Benchmarks for the read and convert hot path, against the simulated SMC.
+ * Results are printed as JSON lines, one per benchmark.
+ *
+ * usage: bench.o [--latency ns] [--jitter ns] [--threads n] [--duration ms]
+ *                [--keys n]
+ *
+ * bench.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <dirent.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/smc.h"
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Latency histogram resolution. Values are bucketed by power of two, each power
+of two split into HIST_SUB linear sub-buckets, for ~6% precision.
+*/
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+
+/**
+Max number of threads for the sweep
+*/
+#define MAX_THREADS 64
+
+
+/**
+Scripted sensor trace for the adaptive polling benchmark: step of the virtual
+clock and length of the trace, in nanoseconds
+*/
+#define TRACE_STEP_NS   10000000ULL
+#define TRACE_LENGTH_NS 60000000000ULL
+
+
+/**
+Asynchronous reads kept in flight by the event loop of bench_async()
+*/
+#define ASYNC_IN_FLIGHT 32
+#define ASYNC_KEYS      4
+
+
+/**
+Closed-loop fan control benchmark: step of the thermal model and control
+period of the fan controller, in nanoseconds
+*/
+#define THERMAL_STEP_NS 10000000ULL
+#define FAN_CTL_PERIOD  250000000ULL
+
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Log-linear latency histogram, in nanoseconds
+*/
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+
+/**
+Sweep worker state
+
+- pool     : Context pool to read through, NULL for the default context
+- keys     : Keys to read on every pass
+- num_keys : Number of keys
+- end      : Time to stop at
+- reads    : Number of keys read
+- hist     : Latency of each pass
+*/
+typedef struct {
+    smc_ctx_pool_t *pool;
+    const uint32_t *keys;
+    size_t          num_keys;
+    uint64_t        end;
+    uint64_t        reads;
+    hist_t          hist;
+} sweep_t;
+
+
+/**
+Event loop state of bench_async()
+
+- keys     : Hot set of keys requests pick from
+- num_keys : Number of keys
+- next     : Next key to pick
+- slots    : Requests in flight
+- hist     : Submit to callback latency
+- reads    : Requests completed
+- errors   : Values that failed to read
+- rejected : Submits turned away by backpressure
+*/
+typedef struct async_loop_s async_loop_t;
+
+typedef struct {
+    async_loop_t *loop;
+    uint64_t      submitted;
+} async_slot_t;
+
+struct async_loop_s {
+    const uint32_t *keys;
+    size_t          num_keys;
+    size_t          next;
+    async_slot_t    slots[ASYNC_IN_FLIGHT];
+    hist_t          hist;
+    uint64_t        reads;
+    uint64_t        errors;
+    uint64_t        rejected;
+};
+
+
+/**
+Thermal model of a CPU cooled by one fan, for the fan control benchmark
+
+- tmp      : CPU temperature, in degrees Celsius
+- rpm      : Actual fan speed
+- min_rpm  : Min speed last written to F0Mn, which the fan spins up to
+- writes   : Number of writes to F0Mn seen by the simulated SMC
+*/
+typedef struct {
+    double   tmp;
+    double   rpm;
+    double   min_rpm;
+    uint64_t writes;
+} thermal_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: GLOBAL VARS
+//------------------------------------------------------------------------------
+
+
+/**
+Sink for results, so the compiler can't drop the work being measured
+*/
+static volatile uint64_t sink;
+
+
+/**
+Number of failed checks. Some benchmarks also check the library's results
+against the simulated SMC, main() exits non-zero if any failed.
+*/
+static unsigned int failures;
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static void check(bool ok)
+{
+    if (!ok) {
+        failures++;
+    }
+}
+
+
+static uint64_t now_ns(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
+/**
+Write a whole file, e.g. a corrupted copy of a catalog file
+*/
+static bool write_file(const char *path, const void *data, size_t size)
+{
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    bool ok = fwrite(data, 1, size, file) == size;
+
+    return fclose(file) == 0 && ok;
+}
+
+
+/**
+Remove a directory and the files in it
+*/
+static void remove_dir(const char *dir)
+{
+    DIR *handle = opendir(dir);
+    struct dirent *entry;
+    char path[1024];
+
+    if (handle != NULL) {
+        while ((entry = readdir(handle)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+                unlink(path);
+            }
+        }
+
+        closedir(handle);
+    }
+
+    rmdir(dir);
+}
+
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+
+static void hist_add(hist_t *hist, uint64_t ns)
+{
+    unsigned int bucket = ns;
+
+    if (ns >= HIST_SUB) {
+        // Position of the highest set bit picks the power of two, the next
+        // HIST_SUB_BITS bits the sub-bucket
+        int msb = 63 - __builtin_clzll(ns);
+        int shift = msb - HIST_SUB_BITS;
+        bucket = (shift + 1) * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+}
+
+
+/**
+Lowest value of a bucket, the inverse of hist_add()
+*/
+static uint64_t hist_bucket_value(unsigned int bucket)
+{
+    if (bucket < HIST_SUB) {
+        return bucket;
+    }
+
+    int shift = bucket / HIST_SUB - 1;
+
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+
+static uint64_t hist_percentile(const hist_t *hist, double p)
+{
+    uint64_t target = (uint64_t)(hist->count * p);
+    uint64_t seen = 0;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+
+        if (seen > target) {
+            return hist_bucket_value(i);
+        }
+    }
+
+    return 0;
+}
+
+
+static void hist_merge(hist_t *into, const hist_t *from)
+{
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+
+    into->count += from->count;
+}
+
+
+static void print_hist(const char *name, const hist_t *hist)
+{
+    printf("{\"bench\":\"%s\",\"ops\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+           "\"p999_ns\":%llu}\n", name, (unsigned long long)hist->count,
+           (unsigned long long)hist_percentile(hist, 0.50),
+           (unsigned long long)hist_percentile(hist, 0.99),
+           (unsigned long long)hist_percentile(hist, 0.999));
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: BENCHMARKS
+//------------------------------------------------------------------------------
+
+
+/**
+Key encoding, string to uint32_t
+*/
+static void bench_encode(uint64_t iterations)
+{
+    char *keys[] = { CPU_0_DIODE, FAN_0, NUM_FANS, BATT_PWR };
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += smc_encode_key(keys[i & 3]);
+    }
+
+    printf("{\"bench\":\"encode_key\",\"ops\":%llu,\"ns_per_op\":%.2f}\n",
+           (unsigned long long)iterations,
+           (double)(now_ns() - start) / iterations);
+}
+
+
+/**
+Decoding a recorded sp78 history, one value at a time vs in bulk
+*/
+static void bench_decode(size_t n)
+{
+    uint8_t *raw = malloc(n * 2);
+    double *out = malloc(n * sizeof(double));
+
+    if (raw == NULL || out == NULL) {
+        free(raw);
+        free(out);
+        return;
+    }
+
+    for (size_t i = 0; i < n * 2; i++) {
+        raw[i] = (uint8_t)(i * 7);
+    }
+
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < n; i++) {
+        smc_decode(SMC_TYPE_SP78, raw + i * 2, 2, &out[i]);
+    }
+
+    printf("{\"bench\":\"decode\",\"ops\":%zu,\"ns_per_op\":%.3f}\n", n,
+           (double)(now_ns() - start) / n);
+
+    start = now_ns();
+    smc_decode_batch(SMC_TYPE_SP78, raw, n, out);
+
+    printf("{\"bench\":\"decode_batch\",\"ops\":%zu,\"ns_per_op\":%.3f}\n",
+           n, (double)(now_ns() - start) / n);
+
+    sink += (uint64_t)out[n / 2];
+    free(raw);
+    free(out);
+}
+
+
+/**
+Sensor history - append and scan throughput, and bytes per sample, for a
+second by second sp78 temperature and fpe2 fan speed that drift slowly
+*/
+static void bench_history(size_t n)
+{
+    static const uint32_t keys[] = { SMC_KEY_CPU_0_DIODE, SMC_KEY_FAN_0 };
+    smc_history_t *history = smc_history_create(1000000, 0);
+    smc_history_stats_t stats;
+    uint64_t *timestamps = malloc(4096 * sizeof(uint64_t));
+    double *scanned = malloc(4096 * sizeof(double));
+    double values[2] = { 50, 2000 };
+    uint32_t rng = 1;
+    uint64_t time = 0;
+    uint64_t start;
+    size_t count = 0;
+
+    if (history == NULL || timestamps == NULL || scanned == NULL) {
+        smc_history_destroy(history);
+        free(timestamps);
+        free(scanned);
+        return;
+    }
+
+    start = now_ns();
+
+    for (size_t i = 0; i < n; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+
+        // 1 s period with up to 250 us of jitter, and a random walk in steps
+        // of the sp78 and fpe2 resolution
+        time += 1000000000 + rng % 250000;
+
+        if (rng % 8 == 0) {
+            values[0] += (rng & 0x100) ? 1 / 256.0 : -1 / 256.0;
+        }
+
+        if (rng % 16 == 1) {
+            values[1] += (rng & 0x200) ? 0.25 : -0.25;
+        }
+
+        smc_history_append_frame(history, keys, 2, time, values);
+    }
+
+    printf("{\"bench\":\"history_append\",\"ops\":%zu,"
+           "\"ns_per_op\":%.3f}\n", n * 2,
+           (double)(now_ns() - start) / (n * 2));
+
+    for (size_t i = 0; i < 2; i++) {
+        smc_history_get_stats(history, keys[i], &stats);
+
+        printf("{\"bench\":\"history_size\",\"type\":\"%s\","
+               "\"samples\":%llu,\"bytes_per_sample\":%.3f}\n",
+               i == 0 ? "sp78" : "fpe2", (unsigned long long)stats.samples,
+               (double)stats.encoded_bytes / stats.samples);
+    }
+
+    start = now_ns();
+
+    for (size_t i = 0; i < 2; i++) {
+        uint64_t from = 0;
+        size_t scanned_now;
+
+        while ((scanned_now = smc_history_scan(history, keys[i], from,
+                                               UINT64_MAX, timestamps,
+                                               scanned, 4096)) > 0) {
+            count += scanned_now;
+            from = timestamps[scanned_now - 1] + 1;
+        }
+    }
+
+    printf("{\"bench\":\"history_scan\",\"samples\":%zu,"
+           "\"samples_per_sec\":%.0f}\n", count,
+           count / ((double)(now_ns() - start) / 1e9));
+
+    smc_history_destroy(history);
+    free(timestamps);
+    free(scanned);
+}
+
+
+/**
+Windowed statistics - append throughput with thousands of keys over 10 s, 1 min
+and 5 min windows, fed a frame a second, and the cost of a query
+*/
+static void bench_window(size_t num_keys, size_t frames)
+{
+    static const uint64_t windows[] = {
+        10000000000ULL, 60000000000ULL, 300000000000ULL
+    };
+    smc_window_key_t *window_keys = malloc(num_keys * sizeof(smc_window_key_t));
+    uint32_t *keys = malloc(num_keys * sizeof(uint32_t));
+    double *values = malloc(num_keys * sizeof(double));
+    smc_window_t *window = NULL;
+    smc_window_stats_t stats;
+    uint32_t rng = 1;
+    uint64_t start;
+
+    if (window_keys != NULL && keys != NULL && values != NULL) {
+        for (size_t i = 0; i < num_keys; i++) {
+            keys[i] = SMC_FOURCC('W', i >> 16, i >> 8, i);
+            values[i] = 50;
+            window_keys[i].key = keys[i];
+            window_keys[i].min = 0;
+            window_keys[i].max = 128;
+        }
+
+        window = smc_window_create(window_keys, num_keys, windows, 3,
+                                   1000000000);
+    }
+
+    if (window == NULL) {
+        free(window_keys);
+        free(keys);
+        free(values);
+        return;
+    }
+
+    start = now_ns();
+
+    for (size_t i = 0; i < frames; i++) {
+        // A random walk per key, in steps of the sp78 resolution
+        for (size_t j = 0; j < num_keys; j++) {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            values[j] += (rng & 0x100) ? 1 / 256.0 : -1 / 256.0;
+        }
+
+        smc_window_append_frame(window, keys, num_keys,
+                                (i + 1) * 1000000000ULL, values);
+    }
+
+    printf("{\"bench\":\"window_append\",\"keys\":%zu,\"windows\":3,"
+           "\"ops\":%zu,\"ns_per_op\":%.3f}\n", num_keys, num_keys * frames,
+           (double)(now_ns() - start) / (num_keys * frames));
+
+    start = now_ns();
+
+    for (size_t i = 0; i < num_keys; i++) {
+        smc_window_get(window, keys[i], windows[i % 3], &stats);
+        sink += stats.count;
+    }
+
+    printf("{\"bench\":\"window_get\",\"ops\":%zu,\"ns_per_op\":%.3f}\n",
+           num_keys, (double)(now_ns() - start) / num_keys);
+
+    smc_window_destroy(window);
+    free(window_keys);
+    free(keys);
+    free(values);
+}
+
+
+/**
+Cost of the call statistics - prepared reads (a single call each) against the
+zero latency simulated SMC. Compare with the same run of bench_nostats.o,
+built with SMC_NO_STATS.
+*/
+static void bench_stats(uint64_t iterations)
+{
+    static smc_stats_t stats;
+    smc_value_t value;
+    smc_key_t *handle = smc_prepare_u32(SMC_KEY_CPU_0_DIODE);
+
+    if (handle == NULL) {
+        return;
+    }
+
+    bool enabled = smc_get_stats(&stats) == kIOReturnSuccess;
+    double ns_per_call = 0;
+    uint64_t start;
+
+    // Best of several rounds, the difference being measured is smaller than
+    // the noise of a single one
+    for (int round = 0; round < 10; round++) {
+        start = now_ns();
+
+        for (uint64_t i = 0; i < iterations / 10; i++) {
+            smc_read_prepared(handle, &value);
+        }
+
+        double ns = (double)(now_ns() - start) / (iterations / 10);
+
+        if (round == 0 || ns < ns_per_call) {
+            ns_per_call = ns;
+        }
+    }
+
+    start = now_ns();
+    smc_get_stats(&stats);
+
+    printf("{\"bench\":\"stats_overhead\",\"stats\":\"%s\",\"calls\":%llu,"
+           "\"ns_per_call\":%.3f,\"get_stats_ns\":%llu,\"keys\":%zu}\n",
+           enabled ? "on" : "off", (unsigned long long)iterations,
+           ns_per_call, (unsigned long long)(now_ns() - start),
+           stats.num_keys);
+
+    // I/O Kit failures in the err_get_code() form the I/O Kit transport
+    // returns, must be bucketed by their low byte like the full codes
+    uint64_t failed = 0;
+    kern_return_t code = kIOReturnTimeout & 0x3fff;
+
+    smc_reset_stats();
+    smc_sim_set_io_error(code, 0.25);
+
+    for (uint64_t i = 0; i < 10000; i++) {
+        failed += smc_read_prepared(handle, &value) == code;
+    }
+
+    smc_sim_set_io_error(0, 0);
+    smc_get_stats(&stats);
+
+    bool match = !enabled || (failed > 0 &&
+                              stats.io_errors[code & 0xff] == failed &&
+                              stats.io_errors[0] == 0);
+
+    printf("{\"bench\":\"stats_io_errors\",\"calls\":10000,"
+           "\"failed\":%llu,\"bucketed\":%llu,\"match\":%s}\n",
+           (unsigned long long)failed,
+           (unsigned long long)stats.io_errors[code & 0xff],
+           match ? "true" : "false");
+    check(match);
+
+    smc_release_prepared(handle);
+}
+
+
+/**
+Negative key cache against the simulated SMC - calls saved on absent keys, and
+not founds that must not be cached
+*/
+static void bench_key_cache(uint64_t iterations)
+{
+    static smc_stats_t stats;
+    smc_capabilities_t caps;
+    smc_key_cache_stats_t before;
+    smc_key_cache_stats_t after;
+    smc_value_t value;
+    uint32_t absent = SMC_FOURCC('Z', 'Z', 'Z', 'Z');
+    bool counted = smc_get_stats(&stats) == kIOReturnSuccess;
+
+    smc_clear_key_cache();
+
+    // The probe asks for each key's info once, then caches the absent ones
+    uint64_t calls = smc_sim_get_call_count();
+    smc_probe_capabilities(&caps);
+    uint64_t probe_calls = smc_sim_get_call_count() - calls;
+
+    calls = smc_sim_get_call_count();
+    smc_probe_capabilities(&caps);
+    uint64_t reprobe_calls = smc_sim_get_call_count() - calls;
+
+    smc_get_key_cache_stats(&after);
+
+    bool match = probe_calls == SMC_PROBE_KEYS && reprobe_calls == 0 &&
+                 after.entries == SMC_PROBE_KEYS - caps.num_present;
+
+    // An absent key costs its key info once, then every lookup is a hit
+    smc_get_key_cache_stats(&before);
+    calls = smc_sim_get_call_count();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        smc_is_key_valid_u32(absent);
+    }
+
+    uint64_t absent_calls = smc_sim_get_call_count() - calls;
+    smc_get_key_cache_stats(&after);
+    uint64_t hits = after.hits - before.hits;
+
+    match = match && absent_calls == 1 && hits == iterations - 1 &&
+            (!counted || after.misses - before.misses == 1);
+
+    // Injected not founds, and one from a typed read without the key info,
+    // leave the cache alone
+    smc_clear_key_cache();
+    smc_sim_set_error_rates(1, 0);
+    bool injected = smc_is_key_valid_u32(SMC_KEY_CPU_0_DIODE);
+    smc_sim_set_error_rates(0, 0);
+    smc_read_typed(absent, SMC_TYPE_SP78, 2, &value);
+    smc_get_key_cache_stats(&after);
+
+    match = match && !injected && after.entries == 0 &&
+            smc_is_key_valid_u32(SMC_KEY_CPU_0_DIODE);
+
+    printf("{\"bench\":\"key_cache\",\"lookups\":%llu,\"probe_calls\":%llu,"
+           "\"absent_calls\":%llu,\"hits\":%llu,\"match\":%s}\n",
+           (unsigned long long)iterations, (unsigned long long)probe_calls,
+           (unsigned long long)absent_calls,
+           (unsigned long long)hits,
+           match ? "true" : "false");
+    check(match);
+
+    smc_clear_key_cache();
+}
+
+
+/**
+Full getters - key encoding, two calls, validation and conversion. Against a
+zero latency transport this is the library overhead per read.
+*/
+static void bench_getters(uint64_t iterations)
+{
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += (uint64_t)get_tmp(CPU_0_DIODE, CELSIUS);
+    }
+
+    printf("{\"bench\":\"get_tmp\",\"ops\":%llu,\"ns_per_op\":%.2f}\n",
+           (unsigned long long)iterations,
+           (double)(now_ns() - start) / iterations);
+
+    start = now_ns();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += (uint64_t)smc_get_tmp_u32(SMC_KEY_CPU_0_DIODE, CELSIUS);
+    }
+
+    printf("{\"bench\":\"get_tmp_u32\",\"ops\":%llu,\"ns_per_op\":%.2f}\n",
+           (unsigned long long)iterations,
+           (double)(now_ns() - start) / iterations);
+
+    start = now_ns();
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink += get_fan_rpm(0);
+    }
+
+    printf("{\"bench\":\"get_fan_rpm\",\"ops\":%llu,\"ns_per_op\":%.2f}\n",
+           (unsigned long long)iterations,
+           (double)(now_ns() - start) / iterations);
+}
+
+
+/**
+Per-read latency of the read paths against the transport
+*/
+static void bench_reads(uint64_t iterations)
+{
+    hist_t hist;
+    smc_value_t value;
+    uint32_t key = SMC_KEY_CPU_0_DIODE;
+    smc_key_t *handle = smc_prepare(CPU_0_DIODE);
+
+    memset(&hist, 0, sizeof(hist_t));
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        smc_read_many(&key, 1, &value);
+        hist_add(&hist, now_ns() - start);
+    }
+
+    print_hist("read", &hist);
+
+    if (handle == NULL) {
+        return;
+    }
+
+    memset(&hist, 0, sizeof(hist_t));
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        smc_read_prepared(handle, &value);
+        hist_add(&hist, now_ns() - start);
+    }
+
+    print_hist("read_prepared", &hist);
+    smc_release_prepared(handle);
+}
+
+
+static void async_done(const smc_value_t *values, size_t n, void *userdata);
+
+
+/**
+Submit a read of ASYNC_KEYS keys of the hot set for a slot
+*/
+static void async_submit(async_slot_t *slot)
+{
+    async_loop_t *loop = slot->loop;
+    uint32_t keys[ASYNC_KEYS];
+
+    for (size_t i = 0; i < ASYNC_KEYS; i++) {
+        keys[i] = loop->keys[loop->next++ % loop->num_keys];
+    }
+
+    slot->submitted = now_ns();
+
+    if (smc_read_async(keys, ASYNC_KEYS, async_done, slot) !=
+        kIOReturnSuccess) {
+        loop->rejected++;
+    }
+}
+
+
+static void async_done(const smc_value_t *values, size_t n, void *userdata)
+{
+    async_slot_t *slot = userdata;
+    async_loop_t *loop = slot->loop;
+
+    hist_add(&loop->hist, now_ns() - slot->submitted);
+    loop->reads++;
+
+    for (size_t i = 0; i < n; i++) {
+        loop->errors += values[i].result != kIOReturnSuccess ||
+                        values[i].kSMC != 0;
+    }
+
+    async_submit(slot);
+}
+
+
+/**
+An event loop keeping ASYNC_IN_FLIGHT asynchronous reads in flight, over a hot
+set of keys, polling the completion descriptor. Reports submit to callback
+latency, and how many key reads coalescing saved.
+*/
+static void bench_async(const uint32_t *keys, size_t num_keys,
+                        uint64_t duration)
+{
+    static async_loop_t loop;
+    smc_async_stats_t stats;
+    struct pollfd pfd;
+    uint64_t start;
+    uint64_t end;
+
+    memset(&loop, 0, sizeof(async_loop_t));
+    loop.keys = keys;
+    loop.num_keys = num_keys < 8 ? num_keys : 8;
+
+    pfd.fd = smc_async_fd();
+    pfd.events = POLLIN;
+
+    if (pfd.fd < 0 || loop.num_keys == 0) {
+        return;
+    }
+
+    start = now_ns();
+    end = start + duration;
+
+    for (size_t i = 0; i < ASYNC_IN_FLIGHT; i++) {
+        loop.slots[i].loop = &loop;
+        async_submit(&loop.slots[i]);
+    }
+
+    while (now_ns() < end) {
+        if (poll(&pfd, 1, 100) > 0) {
+            smc_async_dispatch();
+        }
+    }
+
+    end = now_ns();
+    smc_async_get_stats(&stats);
+    smc_async_shutdown();
+
+    print_hist("async", &loop.hist);
+    printf("{\"bench\":\"async_throughput\",\"in_flight\":%d,"
+           "\"reads_per_sec\":%.0f,\"keys_requested\":%llu,"
+           "\"keys_read\":%llu,\"batches\":%llu,\"errors\":%llu,"
+           "\"rejected\":%llu}\n", ASYNC_IN_FLIGHT,
+           loop.reads / ((end - start) / 1e9),
+           (unsigned long long)stats.keys_requested,
+           (unsigned long long)stats.keys_read,
+           (unsigned long long)stats.batches,
+           (unsigned long long)loop.errors,
+           (unsigned long long)loop.rejected);
+}
+
+
+static void *sweep_worker(void *arg)
+{
+    sweep_t *sweep = arg;
+    smc_ctx_t *ctx = NULL;
+    smc_value_t *values = calloc(sweep->num_keys, sizeof(smc_value_t));
+
+    if (values == NULL) {
+        return NULL;
+    }
+
+    if (sweep->pool != NULL && (ctx = smc_ctx_pool_get(sweep->pool)) == NULL) {
+        free(values);
+        return NULL;
+    }
+
+    while (now_ns() < sweep->end) {
+        uint64_t start = now_ns();
+
+        if (ctx != NULL) {
+            smc_ctx_read_many(ctx, sweep->keys, sweep->num_keys, values);
+        } else {
+            smc_read_many(sweep->keys, sweep->num_keys, values);
+        }
+
+        hist_add(&sweep->hist, now_ns() - start);
+        sweep->reads += sweep->num_keys;
+    }
+
+    free(values);
+
+    return NULL;
+}
+
+
+/**
+Sensor sweep throughput - every thread reads the whole key set over and over,
+either through the default context or its own context from a pool
+*/
+static void bench_sweep(smc_ctx_pool_t *pool, const uint32_t *keys,
+                        size_t num_keys, unsigned int threads,
+                        uint64_t duration)
+{
+    pthread_t tids[MAX_THREADS];
+    static sweep_t sweeps[MAX_THREADS];
+    hist_t hist;
+    uint64_t reads = 0;
+    uint64_t start = now_ns();
+
+    memset(&hist, 0, sizeof(hist_t));
+
+    for (unsigned int i = 0; i < threads; i++) {
+        memset(&sweeps[i], 0, sizeof(sweep_t));
+        sweeps[i].pool = pool;
+        sweeps[i].keys = keys;
+        sweeps[i].num_keys = num_keys;
+        sweeps[i].end = start + duration;
+        pthread_create(&tids[i], NULL, sweep_worker, &sweeps[i]);
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        hist_merge(&hist, &sweeps[i].hist);
+        reads += sweeps[i].reads;
+    }
+
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    printf("{\"bench\":\"%s\",\"threads\":%u,\"keys\":%zu,"
+           "\"reads_per_sec\":%.0f,\"sweeps\":%llu,\"p50_ns\":%llu,"
+           "\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+           pool != NULL ? "sweep_ctx" : "sweep", threads, num_keys,
+           reads / seconds, (unsigned long long)hist.count,
+           (unsigned long long)hist_percentile(&hist, 0.50),
+           (unsigned long long)hist_percentile(&hist, 0.99),
+           (unsigned long long)hist_percentile(&hist, 0.999));
+}
+
+
+/**
+Sensor table reader, reads every key over and over
+*/
+typedef struct {
+    smc_table_t    *table;
+    const uint32_t *keys;
+    size_t          num_keys;
+    uint64_t        end;
+    uint64_t        reads;
+} table_reader_t;
+
+
+static void *table_reader(void *arg)
+{
+    table_reader_t *reader = arg;
+    smc_table_entry_t entry;
+
+    while (now_ns() < reader->end) {
+        for (size_t i = 0; i < reader->num_keys; i++) {
+            if (smc_table_get(reader->table, reader->keys[i], &entry)) {
+                sink += entry.timestamp;
+            }
+        }
+
+        reader->reads += reader->num_keys;
+    }
+
+    return NULL;
+}
+
+
+/**
+Sensor table reader throughput while a refresher keeps it up to date
+*/
+static void bench_table(const uint32_t *keys, size_t num_keys,
+                        unsigned int threads, uint64_t duration)
+{
+    pthread_t tids[MAX_THREADS];
+    static table_reader_t readers[MAX_THREADS];
+    uint64_t reads = 0;
+    smc_table_t *table = smc_table_create(keys, num_keys);
+
+    if (table == NULL) {
+        return;
+    }
+
+    smc_table_refresh(table);
+    smc_table_start(table, 1000000);
+
+    uint64_t start = now_ns();
+
+    for (unsigned int i = 0; i < threads; i++) {
+        memset(&readers[i], 0, sizeof(table_reader_t));
+        readers[i].table = table;
+        readers[i].keys = keys;
+        readers[i].num_keys = num_keys;
+        readers[i].end = start + duration;
+        pthread_create(&tids[i], NULL, table_reader, &readers[i]);
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        reads += readers[i].reads;
+    }
+
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    printf("{\"bench\":\"table_read\",\"threads\":%u,\"keys\":%zu,"
+           "\"reads_per_sec\":%.0f}\n", threads, num_keys, reads / seconds);
+
+    smc_table_destroy(table);
+}
+
+
+/**
+End-to-end sample latency - from a frame being sampled to its consumer
+popping it
+*/
+static void bench_sampler(const uint32_t *keys, size_t num_keys,
+                          uint64_t duration)
+{
+    hist_t hist;
+    smc_frame_t frame;
+    double *values = malloc(num_keys * sizeof(double));
+    smc_sampler_t *sampler = smc_sampler_create(keys, num_keys, 1000000);
+    smc_ring_t *ring = sampler ? smc_sampler_add_consumer(sampler, 1024) :
+                                 NULL;
+
+    if (values == NULL || ring == NULL ||
+        smc_sampler_start(sampler) != kIOReturnSuccess) {
+        free(values);
+        smc_sampler_destroy(sampler);
+        return;
+    }
+
+    memset(&hist, 0, sizeof(hist_t));
+
+    uint64_t end = now_ns() + duration;
+
+    while (now_ns() < end) {
+        if (smc_ring_pop(ring, &frame, values)) {
+            hist_add(&hist, now_ns() - frame.timestamp);
+        }
+    }
+
+    smc_sampler_stop(sampler);
+
+    printf("{\"bench\":\"sampler_latency\",\"frames\":%llu,\"overruns\":%llu,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+           (unsigned long long)hist.count,
+           (unsigned long long)smc_ring_get_overruns(ring),
+           (unsigned long long)hist_percentile(&hist, 0.50),
+           (unsigned long long)hist_percentile(&hist, 0.99),
+           (unsigned long long)hist_percentile(&hist, 0.999));
+
+    smc_sampler_destroy(sampler);
+    free(values);
+}
+
+
+/**
+Value of each traced key at time t (seconds), for the adaptive polling
+benchmark. A CPU under a periodic load with noise and a spike past its
+threshold, a GPU stepping up once, the fan following the CPU and flat
+ambient/memory sensors.
+*/
+static void trace_values(double t, uint32_t *rng, double *values)
+{
+    double cpu;
+
+    // xorshift32, for +-0.25 C of sensor noise
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+
+    cpu = 50 + 10 * sin(t * 2 * M_PI / 20) + (*rng % 512) / 1024.0 - 0.25;
+
+    if (t >= 30 && t < 35) {
+        cpu = 95;
+    }
+
+    values[0] = cpu;
+    values[1] = t < 20 ? 45 : 60;
+    values[2] = 1200 + 40 * (cpu - 40);
+    values[3] = 22 + t / 600;
+    values[4] = 40;
+}
+
+
+/**
+Write a traced value into the simulated SMC, sp78 or fpe2
+*/
+static void trace_set(uint32_t key, uint32_t dataType, double value)
+{
+    uint8_t data[2];
+    uint16_t raw = dataType == SMC_TYPE_FPE2 ? (uint16_t)(value * 4) :
+                                               (uint16_t)(int16_t)(value * 256);
+
+    data[0] = raw >> 8;
+    data[1] = raw & 0xff;
+    smc_sim_set_key(key, dataType, 2, 0x80, data);
+}
+
+
+/**
+Adaptive polling against a scripted trace on a virtual clock, compared to
+polling every key at its min period. Reports the calls made, the call budget
+and how far the polled values strayed from the trace, in units of tolerance.
+*/
+static void bench_adaptive(void)
+{
+    static const uint32_t types[] = {
+        SMC_TYPE_SP78, SMC_TYPE_SP78, SMC_TYPE_FPE2, SMC_TYPE_SP78,
+        SMC_TYPE_SP78
+    };
+    smc_poll_key_t keys[] = {
+        { SMC_KEY_CPU_0_DIODE,     TRACE_STEP_NS, 2000000000, 0.5, NAN, 90  },
+        { SMC_KEY_GPU_0_DIODE,     TRACE_STEP_NS, 2000000000, 0.5, NAN, NAN },
+        { SMC_KEY_FAN_0,           TRACE_STEP_NS, 2000000000, 20,  NAN, NAN },
+        { SMC_KEY_AMBIENT_AIR_0,   TRACE_STEP_NS, 2000000000, 0.5, NAN, NAN },
+        { SMC_KEY_MEMORY_SLOT_0,   TRACE_STEP_NS, 2000000000, 0.5, NAN, NAN }
+    };
+    const size_t num_keys = sizeof(keys) / sizeof(keys[0]);
+    double values[sizeof(keys) / sizeof(keys[0])];
+    smc_table_entry_t entry;
+    smc_poller_stats_t stats;
+    smc_poller_t *poller;
+    uint32_t rng = 1;
+    uint64_t steps = 0;
+    uint64_t calls;
+    uint64_t within = 0;
+    double max_err = 0;
+    double sum_err = 0;
+
+    trace_values(0, &rng, values);
+
+    for (size_t i = 0; i < num_keys; i++) {
+        trace_set(keys[i].key, types[i], values[i]);
+    }
+
+    poller = smc_poller_create(keys, num_keys);
+
+    if (poller == NULL) {
+        return;
+    }
+
+    calls = smc_sim_get_call_count();
+
+    for (uint64_t now = 1; now < TRACE_LENGTH_NS; now += TRACE_STEP_NS) {
+        trace_values((double)now / 1e9, &rng, values);
+
+        for (size_t i = 0; i < num_keys; i++) {
+            trace_set(keys[i].key, types[i], values[i]);
+        }
+
+        smc_poller_poll(poller, now);
+
+        for (size_t i = 0; i < num_keys; i++) {
+            double err = INFINITY;
+
+            if (smc_poller_get(poller, keys[i].key, &entry)) {
+                err = fabs(entry.decoded - values[i]) / keys[i].tolerance;
+            }
+
+            max_err = err > max_err ? err : max_err;
+            sum_err += err;
+            within  += err <= 1;
+        }
+
+        steps++;
+    }
+
+    calls = smc_sim_get_call_count() - calls;
+    smc_poller_get_stats(poller, &stats);
+
+    printf("{\"bench\":\"adaptive\",\"keys\":%zu,\"seconds\":%.0f,"
+           "\"calls\":%llu,\"fixed_calls\":%llu,\"reads\":%llu,"
+           "\"forced\":%llu,\"budget_calls_per_sec\":%.1f,"
+           "\"fixed_calls_per_sec\":%.1f,\"within_tolerance\":%.4f,"
+           "\"mean_err\":%.3f,\"max_err\":%.3f}\n", num_keys,
+           TRACE_LENGTH_NS / 1e9,
+           (unsigned long long)calls,
+           (unsigned long long)(steps * num_keys),
+           (unsigned long long)stats.reads,
+           (unsigned long long)stats.forced, stats.calls_per_sec,
+           stats.fixed_calls_per_sec, (double)within / (steps * num_keys),
+           sum_err / (steps * num_keys), max_err);
+
+    smc_poller_destroy(poller);
+}
+
+
+/**
+Write hook of the simulated SMC, the fan takes up new min speeds
+*/
+static void thermal_write(uint32_t key, const uint8_t *data, uint32_t dataSize,
+                                        void *context)
+{
+    thermal_t *model = context;
+
+    if (key == SMC_KEY_FAN_0_MIN_RPM && dataSize == 2) {
+        model->min_rpm = (data[0] << 8 | data[1]) / 4.0;
+        model->writes++;
+    }
+}
+
+
+/**
+Advance the thermal model by dt seconds at the given power, in watts. Heat
+flows out to 25 C ambient through a conductance that grows with fan speed,
+the fan approaches its min speed with a 2 s time constant.
+*/
+static void thermal_step(thermal_t *model, double power, double dt)
+{
+    double conductance = 0.3 + 1.2 * model->rpm / 6000;
+
+    model->tmp += (power - conductance * (model->tmp - 25)) / 20 * dt;
+    model->rpm += (model->min_rpm - model->rpm) * dt / 2;
+
+    trace_set(SMC_KEY_CPU_0_DIODE, SMC_TYPE_SP78, model->tmp);
+    trace_set(SMC_KEY_FAN_0, SMC_TYPE_FPE2, model->rpm);
+}
+
+
+/**
+Fan controller in closed loop with the thermal model, on a virtual clock. The
+CPU idles, runs a 60 W load and then a 30 W one. Reports the writes made, the
+time of a control step, and how well the temperature was held.
+*/
+static void bench_fan_ctl(const char *name, const smc_fan_ctl_config_t *config)
+{
+    thermal_t model = { 50, 1200, 1200, 0 };
+    smc_fan_ctl_stats_t stats;
+    smc_fan_ctl_t *ctl;
+    uint64_t calls;
+    uint64_t samples = 0;
+    double max_tmp = 0;
+    double sum_err = 0;
+
+    smc_sim_set_write_hook(thermal_write, &model);
+    thermal_step(&model, 0, 0);
+
+    ctl = smc_fan_ctl_create(config, 1, FAN_CTL_PERIOD);
+
+    if (ctl == NULL) {
+        smc_sim_set_write_hook(NULL, NULL);
+        return;
+    }
+
+    calls = smc_sim_get_call_count();
+
+    for (uint64_t now = 1; now < TRACE_LENGTH_NS; now += THERMAL_STEP_NS) {
+        double t = (double)now / 1e9;
+        double power = t < 10 ? 15 : t < 40 ? 60 : 30;
+
+        thermal_step(&model, power, THERMAL_STEP_NS / 1e9);
+
+        if (now % FAN_CTL_PERIOD < THERMAL_STEP_NS) {
+            smc_fan_ctl_step(ctl, now);
+        }
+
+        max_tmp = model.tmp > max_tmp ? model.tmp : max_tmp;
+
+        // Tracking error under load, once the loop had time to settle
+        if (t >= 20 && t < 40) {
+            sum_err += fabs(model.tmp - config->setpoint);
+            samples++;
+        }
+    }
+
+    calls = smc_sim_get_call_count() - calls;
+    smc_fan_ctl_get_stats(ctl, &stats);
+
+    printf("{\"bench\":\"fan_ctl\",\"mode\":\"%s\",\"deadband_rpm\":%.0f,"
+           "\"steps\":%llu,\"writes\":%llu,\"writes_seen\":%llu,"
+           "\"calls\":%llu,\"step_ns\":%.1f,\"max_step_ns\":%llu,"
+           "\"max_tmp\":%.2f,\"mean_err\":%.2f}\n", name,
+           config->deadband_rpm,
+           (unsigned long long)stats.steps,
+           (unsigned long long)stats.writes,
+           (unsigned long long)model.writes,
+           (unsigned long long)calls,
+           (double)stats.total_ns / stats.steps,
+           (unsigned long long)stats.max_ns, max_tmp, sum_err / samples);
+
+    smc_fan_ctl_destroy(ctl);
+    smc_sim_set_write_hook(NULL, NULL);
+}
+
+
+/**
+Fan control with a curve and a PID loop, with and without a deadband
+*/
+static void bench_fan_ctls(void)
+{
+    smc_fan_ctl_config_t curve;
+    smc_fan_ctl_config_t pid;
+
+    memset(&curve, 0, sizeof(smc_fan_ctl_config_t));
+    curve.fan          = 0;
+    curve.sensors[0]   = SMC_KEY_CPU_0_DIODE;
+    curve.num_sensors  = 1;
+    curve.mode         = SMC_FAN_CTL_CURVE;
+    curve.curve_tmp[0] = 50;
+    curve.curve_rpm[0] = 1200;
+    curve.curve_tmp[1] = 70;
+    curve.curve_rpm[1] = 4000;
+    curve.curve_tmp[2] = 85;
+    curve.curve_rpm[2] = 6000;
+    curve.num_points   = 3;
+    curve.setpoint     = 70;
+    curve.deadband_rpm = 50;
+
+    pid = curve;
+    pid.mode         = SMC_FAN_CTL_PID;
+    pid.kp           = 800;
+    pid.ki           = 100;
+    pid.kd           = 0;
+
+    bench_fan_ctl("curve", &curve);
+    bench_fan_ctl("pid", &pid);
+
+    pid.deadband_rpm = 0;
+    bench_fan_ctl("pid", &pid);
+}
+
+
+/**
+Watch callback of bench_watch(), counts edges
+*/
+static void watch_fired(const smc_watch_event_t *event, void *userdata)
+{
+    (*(uint64_t *)userdata)++;
+}
+
+
+/**
+Threshold watches - sweeps of many watches spread over the known keys, with the
+temperatures moving between sweeps, against reading each watch's key on its own
+as a polling loop would. Reports time and driver calls per sweep.
+*/
+static void bench_watch(size_t num_watches, unsigned int sweeps)
+{
+    const uint32_t *keys;
+    size_t num_keys = smc_get_probe_keys(&keys);
+    smc_watcher_t *watcher = smc_watcher_create(1000000000);
+    smc_value_t value;
+    uint64_t fired = 0;
+    uint64_t calls;
+    uint64_t naive_calls;
+    uint64_t naive_ns;
+    uint64_t start;
+    uint8_t data[32];
+
+    if (watcher == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < num_watches; i++) {
+        smc_watch_config_t config;
+
+        config.key         = keys[i % num_keys];
+        config.threshold   = 40 + (i / num_keys) % 40;
+        config.hysteresis  = 2;
+        config.debounce_ns = i % 2 ? 0 : 2;
+        config.edges       = SMC_WATCH_RISING | SMC_WATCH_FALLING;
+
+        if (smc_watch_add(watcher, &config, watch_fired, &fired, NULL) !=
+            kIOReturnSuccess) {
+            smc_watcher_destroy(watcher);
+            return;
+        }
+    }
+
+    // First sweep prepares the keys
+    smc_watcher_sweep(watcher, 0);
+
+    calls = smc_sim_get_call_count();
+    start = now_ns();
+
+    for (unsigned int i = 1; i <= sweeps; i++) {
+        // Swing the CPU diode between 40 and 80 degrees
+        memset(data, 0, sizeof(data));
+        data[0] = 60 + 20 * sin(i / 10.0);
+        smc_sim_set_key(SMC_KEY_CPU_0_DIODE, SMC_TYPE_SP78, 2, 0x80, data);
+
+        smc_watcher_sweep(watcher, i);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+
+    calls = smc_sim_get_call_count() - calls;
+
+    // A sweep reading every watch's key on its own
+    naive_calls = smc_sim_get_call_count();
+    start = now_ns();
+
+    for (size_t i = 0; i < num_watches; i++) {
+        double decoded;
+
+        if (smc_read_u32(keys[i % num_keys], &value) == kIOReturnSuccess &&
+            smc_decode_value(&value, &decoded)) {
+            sink += (uint64_t)decoded;
+        }
+    }
+
+    naive_ns = now_ns() - start;
+    naive_calls = smc_sim_get_call_count() - naive_calls;
+
+    printf("{\"bench\":\"watch\",\"watches\":%zu,\"keys\":%zu,"
+           "\"sweeps\":%u,\"ns_per_sweep\":%.0f,\"ns_per_watch\":%.2f,"
+           "\"calls_per_sweep\":%.1f,\"events\":%llu,"
+           "\"naive_ns_per_sweep\":%llu,\"naive_calls_per_sweep\":%llu}\n",
+           num_watches, num_keys, sweeps, (double)elapsed / sweeps,
+           (double)elapsed / sweeps / num_watches, (double)calls / sweeps,
+           (unsigned long long)fired, (unsigned long long)naive_ns,
+           (unsigned long long)naive_calls);
+
+    smc_watcher_destroy(watcher);
+}
+
+
+/**
+Virtual keys read round after round, each round an epoch, against reading them
+with an epoch per read so nothing is shared between them. Reports driver calls
+per round, and whether both agree.
+*/
+static void bench_virtual(unsigned int rounds)
+{
+    static const struct {
+        char *key;
+        const char *expression;
+    } virtuals[] = {
+        { "Tcpu", "max(TC0D, TC0H, TC0P)" },
+        { "Tenc", "avg(TB0T, TB1T, TB2T, TB3T)" },
+        { "Tgpu", "max(TG0D, TG0H, TG0P)" },
+        { "Thot", "max(Tcpu, Tgpu, Tenc)" },
+        { "Tdlt", "Tcpu - Tenc" },
+        { "F0dy", "(F0Ac - F0Mn) / (F0Mx - F0Mn) * 100" },
+        { "F1dy", "(F1Ac - F1Mn) / (F1Mx - F1Mn) * 100" },
+        { "Fdty", "max(F0dy, F1dy)" }
+    };
+    const size_t num_virtuals = sizeof(virtuals) / sizeof(virtuals[0]);
+    smc_virtual_stats_t stats;
+    smc_value_t value;
+    uint64_t calls[2];
+    uint64_t elapsed[2];
+    double sums[2] = { 0, 0 };
+
+    for (size_t i = 0; i < num_virtuals; i++) {
+        if (smc_virtual_define(virtuals[i].key, virtuals[i].expression) !=
+            kIOReturnSuccess) {
+            smc_virtual_clear();
+            return;
+        }
+    }
+
+    // Shared: one epoch per round. Unshared: one per read.
+    for (int shared = 1; shared >= 0; shared--) {
+        smc_virtual_set_epoch(shared ? 3600000000000ULL : 0);
+
+        uint64_t start_calls = smc_sim_get_call_count();
+        uint64_t start = now_ns();
+
+        for (unsigned int i = 0; i < rounds; i++) {
+            smc_virtual_next_epoch();
+
+            for (size_t j = 0; j < num_virtuals; j++) {
+                double decoded = 0;
+
+                smc_read_u32(smc_encode_key(virtuals[j].key), &value);
+                smc_decode_value(&value, &decoded);
+                sums[shared] += decoded;
+            }
+        }
+
+        elapsed[shared] = now_ns() - start;
+        calls[shared] = smc_sim_get_call_count() - start_calls;
+    }
+
+    smc_virtual_get_stats(&stats);
+
+    printf("{\"bench\":\"virtual\",\"virtual_keys\":%zu,\"nodes\":%llu,"
+           "\"rounds\":%u,\"ns_per_round\":%.0f,\"calls_per_round\":%.1f,"
+           "\"unshared_ns_per_round\":%.0f,"
+           "\"unshared_calls_per_round\":%.1f,\"match\":%s}\n",
+           num_virtuals, (unsigned long long)stats.nodes, rounds,
+           (double)elapsed[1] / rounds, (double)calls[1] / rounds,
+           (double)elapsed[0] / rounds, (double)calls[0] / rounds,
+           sums[0] == sums[1] ? "true" : "false");
+
+    smc_virtual_set_epoch(0);
+    smc_virtual_clear();
+}
+
+
+/**
+Setting every fan's min speed, round after round, with set_fan_min_rpm() and
+with a write batch, with and without read-back. The speeds only change every
+fourth round, as a controller holding steady would. Reports driver calls.
+*/
+static void bench_write_batch(unsigned int rounds)
+{
+    const unsigned int num_fans = 2;
+    smc_write_result_t results[2];
+    smc_write_batch_t *batch;
+    uint64_t naive_calls;
+    uint64_t calls[2];
+    uint64_t skipped = 0;
+    uint64_t start;
+
+    start = smc_sim_get_call_count();
+
+    for (unsigned int i = 0; i < rounds; i++) {
+        for (unsigned int fan = 0; fan < num_fans; fan++) {
+            set_fan_min_rpm(fan, 1200 + 100 * (i / 4), false);
+        }
+    }
+
+    naive_calls = smc_sim_get_call_count() - start;
+
+    for (int verify = 0; verify < 2; verify++) {
+        batch = smc_write_batch_create(NULL);
+
+        if (batch == NULL) {
+            return;
+        }
+
+        start = smc_sim_get_call_count();
+
+        for (unsigned int i = 0; i < rounds; i++) {
+            for (unsigned int fan = 0; fan < num_fans; fan++) {
+                smc_value_t value;
+                uint16_t raw = (uint16_t)((1200 + 100 * (i / 4)) << 2);
+
+                memset(&value, 0, sizeof(smc_value_t));
+                value.dataType = SMC_TYPE_FPE2;
+                value.dataSize = 2;
+                value.data[0] = raw >> 8;
+                value.data[1] = raw & 0xff;
+
+                smc_write_batch_add(batch, SMC_FOURCC('F', '0' + fan, 'M', 'n'),
+                                    &value);
+            }
+
+            smc_write_batch_apply(batch, verify, results);
+
+            for (unsigned int fan = 0; fan < num_fans; fan++) {
+                skipped += !verify && results[fan].status == SMC_WRITE_SKIPPED;
+            }
+        }
+
+        calls[verify] = smc_sim_get_call_count() - start;
+        smc_write_batch_destroy(batch);
+    }
+
+    printf("{\"bench\":\"write_batch\",\"writes\":%u,\"skipped\":%llu,"
+           "\"naive_calls\":%llu,\"batch_calls\":%llu,"
+           "\"batch_verify_calls\":%llu}\n", rounds * num_fans,
+           (unsigned long long)skipped,
+           (unsigned long long)naive_calls,
+           (unsigned long long)calls[0],
+           (unsigned long long)calls[1]);
+}
+
+
+/**
+Catalog files against the simulated SMC - a saved catalog maps back to the same
+keys, corrupted files are refused, and a start from a mapped catalog costs no
+driver calls against the enumeration of a cold start
+*/
+static void bench_catalog(void)
+{
+    smc_catalog_t built;
+    smc_catalog_t mapped;
+    char dir[] = "/tmp/smc_catalog_XXXXXX";
+    char path[1024];
+    char bad_path[1024];
+    bool match = true;
+
+    if (mkdtemp(dir) == NULL) {
+        check(false);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/saved.smccat", dir);
+    snprintf(bad_path, sizeof(bad_path), "%s/bad.smccat", dir);
+
+    if (smc_catalog_build(&built, 1) != kIOReturnSuccess) {
+        check(false);
+        remove_dir(dir);
+        return;
+    }
+
+    // Round trip, every key found by binary search in the mapped file
+    match = smc_catalog_save(&built, path) == kIOReturnSuccess &&
+            smc_catalog_map(&mapped, path) == kIOReturnSuccess &&
+            mapped.map != NULL && mapped.count == built.count;
+
+    for (size_t i = 0; match && i < built.count; i++) {
+        const smc_key_info_t *info = smc_catalog_find(&mapped,
+                                                      built.keys[i].key);
+
+        match = info != NULL &&
+                memcmp(info, &built.keys[i], sizeof(smc_key_info_t)) == 0;
+    }
+
+    match = match &&
+            smc_catalog_find(&mapped, SMC_FOURCC('Z', 'Z', 'Z', 'Z')) == NULL;
+
+    // Corrupted copies: bad magic, bad version, truncated. The header starts
+    // with the magic and version, both uint32_t.
+    if (match) {
+        uint8_t *copy = malloc(mapped.map_size);
+        uint32_t bad = 0xffffffff;
+        smc_catalog_t refused;
+
+        match = copy != NULL;
+
+        for (int corruption = 0; match && corruption < 3; corruption++) {
+            size_t size = mapped.map_size;
+
+            memcpy(copy, mapped.map, mapped.map_size);
+
+            if (corruption < 2) {
+                memcpy(copy + corruption * sizeof(uint32_t), &bad,
+                       sizeof(uint32_t));
+            } else {
+                size -= sizeof(smc_key_info_t) / 2;
+            }
+
+            match = write_file(bad_path, copy, size) &&
+                    smc_catalog_map(&refused, bad_path) == kIOReturnError &&
+                    refused.map == NULL;
+        }
+
+        free(copy);
+    }
+
+    smc_catalog_free(&mapped);
+    smc_catalog_free(&built);
+
+    // Cold start enumerates and saves, the next start maps the saved file
+    uint64_t start = smc_sim_get_call_count();
+    match = match && smc_catalog_load(&built, dir, 1) == kIOReturnSuccess;
+    uint64_t cold_calls = smc_sim_get_call_count() - start;
+
+    start = smc_sim_get_call_count();
+    match = match && smc_catalog_load(&mapped, dir, 1) == kIOReturnSuccess;
+    uint64_t mapped_calls = smc_sim_get_call_count() - start;
+
+    match = match && cold_calls > 0 && mapped_calls == 0 &&
+            built.map == NULL && mapped.map != NULL &&
+            mapped.count == built.count &&
+            memcmp(mapped.keys, built.keys,
+                   built.count * sizeof(smc_key_info_t)) == 0;
+
+    printf("{\"bench\":\"catalog\",\"keys\":%zu,\"cold_calls\":%llu,"
+           "\"mapped_calls\":%llu,\"match\":%s}\n", built.count,
+           (unsigned long long)cold_calls, (unsigned long long)mapped_calls,
+           match ? "true" : "false");
+    check(match);
+
+    smc_catalog_free(&mapped);
+    smc_catalog_free(&built);
+    remove_dir(dir);
+}
+
+
+/**
+Read every replay key, each round in the opposite order to the last, so that
+only matching by key serves each its own values
+*/
+static bool replay_round(const uint32_t *keys, size_t num_keys,
+                         unsigned int round, smc_value_t *values)
+{
+    bool ok = true;
+
+    for (size_t i = 0; i < num_keys; i++) {
+        size_t k = round % 2 == 0 ? i : num_keys - 1 - i;
+
+        ok = smc_read_u32(keys[k], &values[k]) == kIOReturnSuccess && ok;
+    }
+
+    return ok;
+}
+
+
+/**
+Switch the default connection to another transport
+*/
+static bool switch_transport(smc_transport_type_t type)
+{
+    close_smc();
+
+    return smc_set_transport(type) == kIOReturnSuccess &&
+           open_smc() == kIOReturnSuccess;
+}
+
+
+/**
+Record reads of the simulated SMC, then replay them - the same values, matched
+by key and selector, as fast as possible and with the original timing
+*/
+static void bench_replay(unsigned int rounds, uint64_t interval_ns)
+{
+    static const uint32_t keys[] = {
+        SMC_KEY_CPU_0_DIODE, SMC_KEY_CPU_0_PROXIMITY, SMC_KEY_FAN_0,
+        SMC_KEY_NUM_FANS
+    };
+    static const size_t num_keys = sizeof(keys) / sizeof(keys[0]);
+    smc_value_t *recorded = calloc(rounds * num_keys, sizeof(smc_value_t));
+    smc_value_t *replayed = calloc(rounds * num_keys, sizeof(smc_value_t));
+    smc_value_t original;
+    char path[] = "/tmp/smc_replay_XXXXXX";
+    int fd = mkstemp(path);
+    bool match = recorded != NULL && replayed != NULL && fd >= 0 &&
+                 smc_sim_get_key(SMC_KEY_CPU_0_DIODE, &original) ==
+                 kIOReturnSuccess;
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    // Record, with the first key changing every round
+    uint64_t start = now_ns();
+    match = match && smc_record_start(path) == kIOReturnSuccess;
+
+    for (unsigned int round = 0; match && round < rounds; round++) {
+        uint8_t data[2] = { (uint8_t)(40 + round), 0 };
+
+        smc_sim_set_key(SMC_KEY_CPU_0_DIODE, original.dataType,
+                        original.dataSize, 0x80, data);
+        match = replay_round(keys, num_keys, round,
+                             &recorded[round * num_keys]);
+        sleep_ns(interval_ns);
+    }
+
+    uint64_t recorded_ns = now_ns() - start - interval_ns;
+
+    smc_record_stop();
+    smc_sim_set_key(SMC_KEY_CPU_0_DIODE, original.dataType, original.dataSize,
+                    0x80, original.data);
+
+    // As fast as possible, and with the original timing
+    uint64_t elapsed[2] = { 0, 0 };
+    smc_replay_mode_t modes[2] = { SMC_REPLAY_FAST, SMC_REPLAY_REALTIME };
+
+    for (int m = 0; match && m < 2; m++) {
+        match = smc_replay_load(path, modes[m]) == kIOReturnSuccess &&
+                switch_transport(SMC_TRANSPORT_REPLAY);
+
+        smc_replay_rewind();
+        start = now_ns();
+
+        for (unsigned int round = 0; match && round < rounds; round++) {
+            match = replay_round(keys, num_keys, round,
+                                 &replayed[round * num_keys]);
+        }
+
+        elapsed[m] = now_ns() - start;
+
+        for (size_t i = 0; match && i < rounds * num_keys; i++) {
+            match = replayed[i].dataType == recorded[i].dataType &&
+                    replayed[i].dataSize == recorded[i].dataSize &&
+                    memcmp(replayed[i].data, recorded[i].data,
+                           sizeof(replayed[i].data)) == 0;
+        }
+
+        // A key that was never recorded has no match
+        match = match && smc_replay_get_misses() == 0 &&
+                !smc_is_key_valid_u32(SMC_FOURCC('Z', 'Z', 'Z', 'Z')) &&
+                smc_replay_get_misses() == 1;
+
+        match = switch_transport(SMC_TRANSPORT_SIM) && match;
+    }
+
+    // Original timing waits out at least the sleeps between the first and the
+    // last round, fast doesn't wait
+    match = match && elapsed[0] < recorded_ns / 2 &&
+            elapsed[1] >= (rounds - 1) * interval_ns;
+
+    printf("{\"bench\":\"replay\",\"calls\":%zu,\"recorded_ns\":%llu,"
+           "\"fast_ns\":%llu,\"realtime_ns\":%llu,\"match\":%s}\n",
+           rounds * num_keys * 2, (unsigned long long)recorded_ns,
+           (unsigned long long)elapsed[0], (unsigned long long)elapsed[1],
+           match ? "true" : "false");
+    check(match);
+
+    unlink(path);
+    free(recorded);
+    free(replayed);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: MAIN
+//------------------------------------------------------------------------------
+
+
+int main(int argc, char *argv[])
+{
+    uint64_t latency = 0;
+    uint64_t jitter = 0;
+    unsigned int threads = 4;
+    uint64_t duration = 1000;
+    size_t num_keys = 64;
+    smc_catalog_t catalog;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--latency") == 0) {
+            latency = strtoull(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--jitter") == 0) {
+            jitter = strtoull(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threads = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            duration = strtoull(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--keys") == 0) {
+            num_keys = strtoul(argv[i + 1], NULL, 10);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "threads must be 1..%d\n", MAX_THREADS);
+        return -1;
+    }
+
+    if (smc_set_transport(SMC_TRANSPORT_SIM) != kIOReturnSuccess ||
+        smc_sim_populate(num_keys) != kIOReturnSuccess ||
+        open_smc() != kIOReturnSuccess) {
+        return -1;
+    }
+
+    // Zero latency first, to measure library overhead alone
+    bench_encode(10000000);
+    bench_decode(10000000);
+    bench_history(1000000);
+    bench_window(4096, 600);
+    bench_getters(1000000);
+    bench_stats(10000000);
+    bench_key_cache(100000);
+    bench_adaptive();
+    bench_fan_ctls();
+    bench_write_batch(1000);
+    bench_watch(10000, 1000);
+    bench_virtual(100000);
+    bench_catalog();
+    bench_replay(20, 2000000);
+
+    smc_sim_set_latency(latency, jitter);
+
+    bench_reads(latency > 0 ? 10000 : 1000000);
+
+    if (smc_catalog_build(&catalog, 1) != kIOReturnSuccess) {
+        return -1;
+    }
+
+    uint32_t *keys = malloc(catalog.count * sizeof(uint32_t));
+
+    if (keys == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < catalog.count; i++) {
+        keys[i] = catalog.keys[i].key;
+    }
+
+    bench_async(keys, catalog.count, duration * 1000000);
+
+    for (unsigned int i = 1; i <= threads; i++) {
+        bench_sweep(NULL, keys, catalog.count, i, duration * 1000000);
+    }
+
+    // A fresh pool per run, so every worker thread opens its own context
+    for (unsigned int i = 1; i <= threads; i++) {
+        smc_ctx_pool_t *pool = smc_ctx_pool_create();
+
+        if (pool == NULL) {
+            return -1;
+        }
+
+        bench_sweep(pool, keys, catalog.count, i, duration * 1000000);
+        smc_ctx_pool_destroy(pool);
+    }
+
+    for (unsigned int i = 1; i <= threads; i++) {
+        bench_table(keys, catalog.count, i, duration * 1000000);
+    }
+
+    bench_sampler(keys, catalog.count, duration * 1000000);
+
+    free(keys);
+    smc_catalog_free(&catalog);
+    close_smc();
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,364 @@
+/*
+ * Benchmarks for the C++ layer (smc.hpp) against the C getters, on the
+ * simulated SMC. Each line reports ns/op, driver calls/op, and whether the
+ * values read agree with the C API. Results are printed as JSON lines. Exits
+ * non-zero if any value, or any of the checks of the C++ layer, doesn't match.
+ *
+ * usage: bench_cpp.o [--iterations n]
+ *
+ * bench.cpp
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include "../include/smc.hpp"
+
+
+//------------------------------------------------------------------------------
+// MARK: GLOBAL VARS
+//------------------------------------------------------------------------------
+
+
+/**
+Keeps the compiler from optimizing reads away
+*/
+static volatile double sink;
+
+
+/**
+Number of benchmarks and checks that didn't match
+*/
+static unsigned int failures;
+
+
+/**
+Keys of the batch benchmark, all sp78 on the simulated SMC
+*/
+static const std::array<std::uint32_t, 4> batch_keys = {
+    smc::fourcc("TC0D"), smc::fourcc("TC0P"), smc::fourcc("TA0P"),
+    smc::fourcc("TG0D")
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static void check(bool ok)
+{
+    if (!ok) {
+        failures++;
+    }
+}
+
+
+static void report(const char *name, std::uint64_t iterations,
+                   std::uint64_t start, std::uint64_t calls, bool match)
+{
+    std::printf("{\"bench\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,"
+                "\"calls_per_op\":%.2f,\"match\":%s}\n", name,
+                (unsigned long long)iterations,
+                (double)(smc_time_ns() - start) / iterations,
+                (double)(smc_sim_get_call_count() - calls) / iterations,
+                match ? "true" : "false");
+    check(match);
+}
+
+
+/**
+Report a check of the C++ layer
+*/
+static void report_check(const char *name, bool match)
+{
+    std::printf("{\"check\":\"%s\",\"match\":%s}\n", name,
+                match ? "true" : "false");
+    check(match);
+}
+
+
+/**
+Time a read, checking each value against the C API's
+*/
+template <typename Read>
+static void bench(const char *name, std::uint64_t iterations, double expected,
+                  Read read)
+{
+    std::uint64_t calls = smc_sim_get_call_count();
+    std::uint64_t start = smc_time_ns();
+    bool match = true;
+
+    for (std::uint64_t i = 0; i < iterations; i++) {
+        double value = read();
+
+        match = match && value == expected;
+        sink = sink + value;
+    }
+
+    report(name, iterations, start, calls, match);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: BENCHMARKS
+//------------------------------------------------------------------------------
+
+
+static void bench_tmp(std::uint64_t iterations)
+{
+    using cpu_0_diode = smc::BasicKey<SMC_KEY_CPU_0_DIODE, smc::sp78>;
+    double expected = smc_get_tmp_u32(SMC_KEY_CPU_0_DIODE, CELSIUS);
+
+    bench("cpp_get_tmp", iterations, expected, [] {
+        return get_tmp((char *)"TC0D", CELSIUS);
+    });
+
+    bench("cpp_get_tmp_u32", iterations, expected, [] {
+        return smc_get_tmp_u32(SMC_KEY_CPU_0_DIODE, CELSIUS);
+    });
+
+    bench("cpp_key_tmp", iterations, expected, [] {
+        return cpu_0_diode::read().value_or(0.0);
+    });
+
+#ifdef __cpp_nontype_template_args
+#if __cpp_nontype_template_args >= 201911L
+    bench("cpp_key_tmp_named", iterations, expected, [] {
+        return smc::Key<"TC0D", smc::sp78>::read().value_or(0.0);
+    });
+#endif
+#endif
+
+    bench("cpp_key_tmp_kelvin", iterations, smc::to_kelvin(expected), [] {
+        return smc::to_kelvin(cpu_0_diode::read().value_or(0.0));
+    });
+}
+
+
+static void bench_fan(std::uint64_t iterations)
+{
+    double expected = get_fan_rpm(0);
+
+    bench("cpp_get_fan_rpm", iterations, expected, [] {
+        return (double)get_fan_rpm(0);
+    });
+
+    bench("cpp_key_fan_rpm", iterations, expected, [] {
+        return smc::keys::fan_0::read().value_or(0.0);
+    });
+}
+
+
+static void bench_batch(std::uint64_t iterations)
+{
+    std::array<smc_value_t, batch_keys.size()> values;
+    std::array<std::optional<double>, batch_keys.size()> tmps;
+    double expected = 0;
+
+    for (std::uint32_t key : batch_keys) {
+        expected += smc_get_tmp_u32(key, CELSIUS);
+    }
+
+    bench("cpp_read_many", iterations, expected, [&values] {
+        double sum = 0;
+
+        smc_read_many(batch_keys.data(), batch_keys.size(), values.data());
+
+        for (const smc_value_t &value : values) {
+            double tmp = 0;
+
+            smc_decode_value(&value, &tmp);
+            sum += tmp;
+        }
+
+        return sum;
+    });
+
+    bench("cpp_read_typed_batch", iterations, expected, [&tmps] {
+        double sum = 0;
+
+#ifdef __cpp_lib_span
+        smc::read<smc::sp78>(batch_keys, tmps);
+#else
+        smc::read<smc::sp78>(batch_keys.data(), batch_keys.size(),
+                             tmps.data());
+#endif
+
+        for (const std::optional<double> &tmp : tmps) {
+            sum += tmp.value_or(0.0);
+        }
+
+        return sum;
+    });
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: CHECKS
+//------------------------------------------------------------------------------
+
+
+/**
+Decode of a key through BasicKey against smc_decode() of the same key read
+through the C API
+*/
+template <typename Key>
+static bool decodes_as_c(void)
+{
+    smc_value_t value;
+    double expected;
+
+    if (smc_read_u32(Key::code, &value) != kIOReturnSuccess ||
+        !smc_decode(value.dataType, value.data, value.dataSize, &expected)) {
+        return false;
+    }
+
+    // Twice, the first read checks the type and the second is typed
+    std::optional<typename Key::value_type> first  = Key::read();
+    std::optional<typename Key::value_type> second = Key::read();
+
+    return first && second && (double)*first == expected &&
+           (double)*second == expected;
+}
+
+
+static void check_keys(void)
+{
+    bool match = decodes_as_c<smc::keys::cpu_0_diode>() &&
+                 decodes_as_c<smc::keys::fan_0>() &&
+                 decodes_as_c<smc::keys::fan_0_max_rpm>();
+
+    report_check("cpp_key_decode", match);
+
+    // An absent key is std::nullopt, every time
+    using absent = smc::BasicKey<SMC_FOURCC('Z', 'Z', 'Z', 'Z'), smc::sp78>;
+
+    report_check("cpp_key_absent", !absent::read() && !absent::read());
+
+#if defined(__cpp_nontype_template_args) && \
+    __cpp_nontype_template_args >= 201911L
+    // F0Ac is fpe2, read as sp78 it must be refused, not decoded as garbage
+    using mistyped = smc::Key<"F0Ac", smc::sp78>;
+
+    report_check("cpp_key_mistyped", !mistyped::read() && !mistyped::read());
+#endif
+}
+
+
+/**
+Moves hand the default connection over, and a moved from Connection doesn't
+close it
+*/
+static void check_connection(smc::Connection &connection)
+{
+    bool match = connection.is_open();
+
+    {
+        smc::Connection moved(std::move(connection));
+
+        match = match && moved && !connection &&
+                connection.result() == kIOReturnNotOpen;
+
+        connection = std::move(moved);
+        match = match && connection && !moved;
+
+        // Self assignment keeps it open, through a reference so the compiler
+        // doesn't warn
+        smc::Connection &self = connection;
+        connection = std::move(self);
+        match = match && connection;
+    }
+
+    // Still open after the moved from one is gone
+    match = match && smc::keys::cpu_0_diode::read().has_value();
+
+    report_check("cpp_connection_move", match);
+}
+
+
+static void check_span_read(void)
+{
+#ifdef __cpp_lib_span
+    std::array<smc_value_t, batch_keys.size()> values;
+    std::array<smc_value_t, batch_keys.size() - 1> short_values;
+    std::array<std::optional<double>, batch_keys.size() - 1> short_tmps;
+
+    // Too short an output is refused, rather than written past
+    bool match = smc::read(batch_keys, short_values) == kIOReturnBadArgument &&
+                 smc::read(batch_keys, values) == kIOReturnSuccess;
+
+    // The typed read stops at the end of the shorter span
+    match = match && smc::read<smc::sp78>(batch_keys, short_tmps) ==
+                     short_tmps.size();
+
+    for (std::size_t i = 0; i < short_tmps.size(); i++) {
+        match = match && short_tmps[i] &&
+                *short_tmps[i] == smc_get_tmp_u32(batch_keys[i], CELSIUS);
+    }
+
+    report_check("cpp_span_read", match);
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: MAIN
+//------------------------------------------------------------------------------
+
+
+int main(int argc, char *argv[])
+{
+    std::uint64_t iterations = 1000000;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::strcmp(argv[i], "--iterations") == 0) {
+            iterations = std::strtoull(argv[i + 1], NULL, 10);
+        } else {
+            std::fprintf(stderr, "unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (iterations == 0 ||
+        smc_set_transport(SMC_TRANSPORT_SIM) != kIOReturnSuccess ||
+        smc_sim_populate(64) != kIOReturnSuccess) {
+        return -1;
+    }
+
+    smc::Connection connection;
+
+    if (!connection) {
+        std::fprintf(stderr, "failed to open a connection to the SMC\n");
+        return -1;
+    }
+
+    check_keys();
+    check_connection(connection);
+    check_span_read();
+
+    bench_tmp(iterations);
+    bench_fan(iterations);
+    bench_batch(iterations / 4);
+
+    return failures == 0 ? 0 : 1;
+}
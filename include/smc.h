@@ -34,7 +34,43 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#ifndef SMC_H
+#define SMC_H
+
+#ifdef __APPLE__
 #include <IOKit/IOKitLib.h>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * No I/O Kit on this platform, only the simulated SMC transport is available.
+ * Stand-ins for the I/O Kit types and return codes used by the API.
+ */
+typedef int          kern_return_t;
+typedef unsigned int mach_port_t;
+typedef mach_port_t  io_connect_t;
+typedef uint32_t     IOByteCount;
+typedef char         io_name_t[128];
+typedef unsigned int UInt;
+
+#define kIOReturnSuccess     0
+#define kIOReturnError       ((kern_return_t)0xe00002bc)
+#define kIOReturnNoMemory    ((kern_return_t)0xe00002bd)
+#define kIOReturnNoResources ((kern_return_t)0xe00002be)
+#define kIOReturnBadArgument ((kern_return_t)0xe00002c2)
+#define kIOReturnUnsupported ((kern_return_t)0xe00002c7)
+#define kIOReturnNotOpen     ((kern_return_t)0xe00002cd)
+#define kIOReturnBusy        ((kern_return_t)0xe00002d5)
+#define kIOReturnTimeout     ((kern_return_t)0xe00002d6)
+#define kIOReturnOverrun     ((kern_return_t)0xe00002e8)
+#define kIOReturnNotFound    ((kern_return_t)0xe00002f0)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 //------------------------------------------------------------------------------
@@ -132,6 +168,86 @@ Sources: See TMP SMC keys
 #define ODD_FULL "MSDI"
 
 
+/**
+Build a 4 byte multi-character constant as a uint32_t, the form the SMC expects
+keys and data types in. Evaluated at compile time for constant arguments.
+*/
+#define SMC_FOURCC(a, b, c, d) ((uint32_t)(uint8_t)(a) << 24 | \
+                                (uint32_t)(uint8_t)(b) << 16 | \
+                                (uint32_t)(uint8_t)(c) << 8  | \
+                                (uint32_t)(uint8_t)(d))
+
+
+/**
+SMC keys above as uint32_t constants, for the uint32_t API (smc_read_u32()
+etc.). No string work is needed to use them.
+*/
+#define SMC_KEY_AMBIENT_AIR_0          SMC_FOURCC('T', 'A', '0', 'P')
+#define SMC_KEY_AMBIENT_AIR_1          SMC_FOURCC('T', 'A', '1', 'P')
+#define SMC_KEY_CPU_0_DIODE            SMC_FOURCC('T', 'C', '0', 'D')
+#define SMC_KEY_CPU_0_HEATSINK         SMC_FOURCC('T', 'C', '0', 'H')
+#define SMC_KEY_CPU_0_PROXIMITY        SMC_FOURCC('T', 'C', '0', 'P')
+#define SMC_KEY_ENCLOSURE_BASE_0       SMC_FOURCC('T', 'B', '0', 'T')
+#define SMC_KEY_ENCLOSURE_BASE_1       SMC_FOURCC('T', 'B', '1', 'T')
+#define SMC_KEY_ENCLOSURE_BASE_2       SMC_FOURCC('T', 'B', '2', 'T')
+#define SMC_KEY_ENCLOSURE_BASE_3       SMC_FOURCC('T', 'B', '3', 'T')
+#define SMC_KEY_GPU_0_DIODE            SMC_FOURCC('T', 'G', '0', 'D')
+#define SMC_KEY_GPU_0_HEATSINK         SMC_FOURCC('T', 'G', '0', 'H')
+#define SMC_KEY_GPU_0_PROXIMITY        SMC_FOURCC('T', 'G', '0', 'P')
+#define SMC_KEY_HARD_DRIVE_BAY         SMC_FOURCC('T', 'H', '0', 'P')
+#define SMC_KEY_MEMORY_SLOT_0          SMC_FOURCC('T', 'M', '0', 'S')
+#define SMC_KEY_MEMORY_SLOTS_PROXIMITY SMC_FOURCC('T', 'M', '0', 'P')
+#define SMC_KEY_NORTHBRIDGE            SMC_FOURCC('T', 'N', '0', 'H')
+#define SMC_KEY_NORTHBRIDGE_DIODE      SMC_FOURCC('T', 'N', '0', 'D')
+#define SMC_KEY_NORTHBRIDGE_PROXIMITY  SMC_FOURCC('T', 'N', '0', 'P')
+#define SMC_KEY_THUNDERBOLT_0          SMC_FOURCC('T', 'I', '0', 'P')
+#define SMC_KEY_THUNDERBOLT_1          SMC_FOURCC('T', 'I', '1', 'P')
+#define SMC_KEY_WIRELESS_MODULE        SMC_FOURCC('T', 'W', '0', 'P')
+
+#define SMC_KEY_FAN_0                  SMC_FOURCC('F', '0', 'A', 'c')
+#define SMC_KEY_FAN_0_MIN_RPM          SMC_FOURCC('F', '0', 'M', 'n')
+#define SMC_KEY_FAN_0_MAX_RPM          SMC_FOURCC('F', '0', 'M', 'x')
+#define SMC_KEY_FAN_0_SAFE_RPM         SMC_FOURCC('F', '0', 'S', 'f')
+#define SMC_KEY_FAN_0_TARGET_RPM       SMC_FOURCC('F', '0', 'T', 'g')
+#define SMC_KEY_FAN_1                  SMC_FOURCC('F', '1', 'A', 'c')
+#define SMC_KEY_FAN_1_MIN_RPM          SMC_FOURCC('F', '1', 'M', 'n')
+#define SMC_KEY_FAN_1_MAX_RPM          SMC_FOURCC('F', '1', 'M', 'x')
+#define SMC_KEY_FAN_1_SAFE_RPM         SMC_FOURCC('F', '1', 'S', 'f')
+#define SMC_KEY_FAN_1_TARGET_RPM       SMC_FOURCC('F', '1', 'T', 'g')
+#define SMC_KEY_FAN_2                  SMC_FOURCC('F', '2', 'A', 'c')
+#define SMC_KEY_FAN_2_MIN_RPM          SMC_FOURCC('F', '2', 'M', 'n')
+#define SMC_KEY_FAN_2_MAX_RPM          SMC_FOURCC('F', '2', 'M', 'x')
+#define SMC_KEY_FAN_2_SAFE_RPM         SMC_FOURCC('F', '2', 'S', 'f')
+#define SMC_KEY_FAN_2_TARGET_RPM       SMC_FOURCC('F', '2', 'T', 'g')
+#define SMC_KEY_NUM_FANS               SMC_FOURCC('F', 'N', 'u', 'm')
+#define SMC_KEY_FORCE_BITS             SMC_FOURCC('F', 'S', '!', ' ')
+
+#define SMC_KEY_BATT_PWR               SMC_FOURCC('B', 'A', 'T', 'P')
+#define SMC_KEY_NUM_KEYS               SMC_FOURCC('#', 'K', 'E', 'Y')
+#define SMC_KEY_ODD_FULL               SMC_FOURCC('M', 'S', 'D', 'I')
+
+
+/**
+SMC data types - 4 byte multi-character constants as uint32_t
+
+Sources: See TMP SMC keys
+
+http://stackoverflow.com/questions/22160746/fpe2-and-sp78-data-types
+*/
+#define SMC_TYPE_UINT8   SMC_FOURCC('u', 'i', '8', ' ')
+#define SMC_TYPE_UINT16  SMC_FOURCC('u', 'i', '1', '6')
+#define SMC_TYPE_UINT32  SMC_FOURCC('u', 'i', '3', '2')
+#define SMC_TYPE_FLAG    SMC_FOURCC('f', 'l', 'a', 'g')
+#define SMC_TYPE_FPE2    SMC_FOURCC('f', 'p', 'e', '2')
+#define SMC_TYPE_SFDS    SMC_FOURCC('{', 'f', 'd', 's')
+#define SMC_TYPE_SP78    SMC_FOURCC('s', 'p', '7', '8')
+#define SMC_TYPE_FP88    SMC_FOURCC('f', 'p', '8', '8')
+#define SMC_TYPE_SINT8   SMC_FOURCC('s', 'i', '8', ' ')
+#define SMC_TYPE_SINT16  SMC_FOURCC('s', 'i', '1', '6')
+#define SMC_TYPE_SINT32  SMC_FOURCC('s', 'i', '3', '2')
+#define SMC_TYPE_FLT     SMC_FOURCC('f', 'l', 't', ' ')
+
+
 //------------------------------------------------------------------------------
 // MARK: TYPES
 //------------------------------------------------------------------------------
@@ -140,6 +256,522 @@ Sources: See TMP SMC keys
 typedef char fan_name_t[13];
 
 
+/**
+Value read from the SMC. Raw bytes as returned by the SMC, along with the type
+info needed to interpret them.
+
+- key      : SMC key the value was read from, as a uint32_t
+- dataType : Type of data, 4 byte multi-character constant as a uint32_t
+- dataSize : Number of valid bytes in data
+- result   : I/O Kit return code of the read
+- kSMC     : SMC return code of the read
+
+Functions reading a single key by uint32_t (smc_read_u32(), smc_read_typed(),
+smc_read_prepared(), smc_ctx_read()) return kIOReturnSuccess only if the value
+was read, i.e. result is kIOReturnSuccess and kSMC zero. If the call went
+through but the SMC reported an error, they return kIOReturnError and leave the
+SMC's code in kSMC. Otherwise they return the I/O Kit code, also in result.
+*/
+typedef struct {
+    uint32_t      key;
+    uint32_t      dataType;
+    uint32_t      dataSize;
+    kern_return_t result;
+    uint8_t       kSMC;
+    uint8_t       data[32];
+} smc_value_t;
+
+
+/**
+Frame of samples from a sampler, see smc_sampler_create(). The sampled values
+themselves are returned alongside, one per key.
+
+- timestamp : When the frame was sampled, see smc_time_ns()
+- sequence  : Frame number, counting from zero. Gaps mean frames were dropped
+              (see smc_ring_get_overruns()).
+*/
+typedef struct {
+    uint64_t timestamp;
+    uint64_t sequence;
+} smc_frame_t;
+
+
+/**
+Background sampler of a set of SMC keys. See smc_sampler_create().
+*/
+typedef struct smc_sampler_s smc_sampler_t;
+
+
+/**
+Ring buffer of frames from a sampler to one consumer. See
+smc_sampler_add_consumer().
+*/
+typedef struct smc_ring_s smc_ring_t;
+
+
+/**
+Latest-value sensor table. See smc_table_create().
+*/
+typedef struct smc_table_s smc_table_t;
+
+
+/**
+Entry read from a sensor table, see smc_table_get().
+
+- value     : Raw value, as last read from the SMC
+- decoded   : Decoded value (see smc_decode()), NAN if the type is not known
+- timestamp : When the value was read, see smc_time_ns()
+*/
+typedef struct {
+    smc_value_t value;
+    double      decoded;
+    uint64_t    timestamp;
+} smc_table_entry_t;
+
+
+/**
+Key info of an SMC key, as returned by the SMC.
+
+- key        : SMC key, as a uint32_t
+- dataType   : Type of data, 4 byte multi-character constant as a uint32_t
+- dataSize   : Number of bytes of data
+- attributes : Key attributes (read/write/function etc.) as reported by the SMC
+*/
+typedef struct {
+    uint32_t key;
+    uint32_t dataType;
+    uint32_t dataSize;
+    uint8_t  attributes;
+    uint8_t  reserved[3];
+} smc_key_info_t;
+
+
+/**
+Catalog of every key on the SMC, sorted by key. See smc_catalog_build() and
+smc_catalog_load().
+
+- keys     : Key info, sorted by key. Read-only if the catalog is mapped.
+- count    : Number of keys
+- map      : Start of the mapped catalog file, NULL if built in memory
+- map_size : Size of the mapping
+*/
+typedef struct {
+    smc_key_info_t *keys;
+    size_t          count;
+    void           *map;
+    size_t          map_size;
+} smc_catalog_t;
+
+
+/**
+Prepared SMC key. Holds the encoded key and its cached key info, so that reads
+only need a single call to the SMC. See smc_prepare().
+*/
+typedef struct smc_key_s smc_key_t;
+
+
+/**
+SMC context. Owns a connection to the SMC and the scratch buffers used to talk
+to it, so that threads with their own context never share state. A context must
+only be used by one thread at a time. See smc_ctx_open().
+*/
+typedef struct smc_ctx_s smc_ctx_t;
+
+
+/**
+Pool handing each thread its own context. See smc_ctx_pool_create().
+*/
+typedef struct smc_ctx_pool_s smc_ctx_pool_t;
+
+
+/**
+Adaptive poller. See smc_poller_create().
+*/
+typedef struct smc_poller_s smc_poller_t;
+
+
+/**
+Compressed sensor history. See smc_history_create().
+*/
+typedef struct smc_history_s smc_history_t;
+
+
+/**
+Publisher of a shared-memory sensor table. See smc_publisher_create().
+*/
+typedef struct smc_publisher_s smc_publisher_t;
+
+
+/**
+Limits of smc_stats_t
+
+- SMC_STATS_SELECTORS   : Function selectors counted. Higher ones are counted
+                          as selector zero.
+- SMC_STATS_BUCKETS     : Latency buckets. Bucket i counts calls that took
+                          [2^i, 2^(i+1)) ns, the last one everything longer.
+- SMC_STATS_MAX_KEYS    : Keys tracked individually
+- SMC_STATS_SAMPLE_RATE : One call in this many is timed
+*/
+#define SMC_STATS_SELECTORS   16
+#define SMC_STATS_BUCKETS     32
+#define SMC_STATS_MAX_KEYS    256
+#define SMC_STATS_SAMPLE_RATE 64
+
+
+/**
+Statistics of calls to one key, see smc_stats_t.
+
+- key      : SMC key, as a uint32_t
+- calls    : Number of calls
+- errors   : Number of failed calls, by I/O Kit or SMC return code
+- timed    : Number of calls timed
+- total_ns : Total time of the timed calls, in nanoseconds
+- max_ns   : Longest timed call, in nanoseconds
+*/
+typedef struct {
+    uint32_t key;
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t timed;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} smc_key_stats_t;
+
+
+/**
+Statistics of calls to the SMC, see smc_get_stats(). Latency is sampled, only
+one call in SMC_STATS_SAMPLE_RATE is timed.
+
+- calls          : Number of calls
+- selector_calls : Number of calls by function selector
+- kSMC_errors    : Number of calls failed by the SMC, by SMC return code
+- io_errors      : Number of calls failed by I/O Kit, by the low byte of the
+                   return code. The same for the full code (0xe00002XX) and
+                   its err_get_code() form (0x2XX) the I/O Kit transport
+                   returns.
+- timed          : Number of calls timed
+- total_ns       : Total time of the timed calls, in nanoseconds
+- latency        : Histogram of the timed calls, see SMC_STATS_BUCKETS
+- keys           : Statistics by key, sorted by key
+- num_keys       : Number of keys
+- keys_dropped   : Calls to keys past SMC_STATS_MAX_KEYS, not in keys
+*/
+typedef struct {
+    uint64_t        calls;
+    uint64_t        selector_calls[SMC_STATS_SELECTORS];
+    uint64_t        kSMC_errors[256];
+    uint64_t        io_errors[256];
+    uint64_t        timed;
+    uint64_t        total_ns;
+    uint64_t        latency[SMC_STATS_BUCKETS];
+    smc_key_stats_t keys[SMC_STATS_MAX_KEYS];
+    size_t          num_keys;
+    uint64_t        keys_dropped;
+} smc_stats_t;
+
+
+/**
+Write hook of the simulated SMC, see smc_sim_set_write_hook().
+
+- key      : SMC key written, as a uint32_t
+- data     : Data written
+- dataSize : Number of bytes of data
+- context  : As given to smc_sim_set_write_hook()
+*/
+typedef void (*smc_sim_write_hook_t)(uint32_t key, const uint8_t *data,
+                                     uint32_t dataSize, void *context);
+
+
+/**
+Client mapping of a shared-memory sensor table. See smc_shm_open().
+*/
+typedef struct smc_shm_s smc_shm_t;
+
+
+/**
+Size of a history, see smc_history_get_stats().
+
+- samples         : Number of samples kept
+- chunks          : Number of chunks
+- encoded_bytes   : Bytes of chunk headers and bit streams actually used
+- allocated_bytes : Bytes allocated for chunks
+*/
+typedef struct {
+    uint64_t samples;
+    uint64_t chunks;
+    uint64_t encoded_bytes;
+    uint64_t allocated_bytes;
+} smc_history_stats_t;
+
+
+/**
+Polling configuration of a key, for smc_poller_create().
+
+- key            : SMC key, as a uint32_t
+- min_period_ns  : Shortest polling period, used while the value moves or is
+                   near a threshold
+- max_period_ns  : Longest polling period, used while the value is flat
+- tolerance      : Change of the decoded value (see smc_decode()) worth a read.
+                   The period is picked so the value is expected to move by
+                   about this much between reads.
+- threshold_low  : Crossing it in either direction forces the min period. NAN
+                   for none.
+- threshold_high : Same as threshold_low. NAN for none.
+*/
+typedef struct {
+    uint32_t key;
+    uint64_t min_period_ns;
+    uint64_t max_period_ns;
+    double   tolerance;
+    double   threshold_low;
+    double   threshold_high;
+} smc_poll_key_t;
+
+
+/**
+Counters and call budget of an adaptive poller, see smc_poller_get_stats().
+
+- reads               : Number of successful reads made
+- forced              : Number of threshold crossings seen
+- calls_per_sec       : Calls to the SMC per second at the current periods
+- fixed_calls_per_sec : Calls to the SMC per second if every key was polled at
+                        its min period
+*/
+typedef struct {
+    uint64_t reads;
+    uint64_t forced;
+    double   calls_per_sec;
+    double   fixed_calls_per_sec;
+} smc_poller_stats_t;
+
+
+/**
+Completion callback of an asynchronous read, see smc_read_async(). Runs on the
+thread calling smc_async_dispatch().
+
+- values   : Values read, one per key, in the order requested. Each carries
+             its own result and kSMC. Only valid during the call.
+- n        : Number of values
+- userdata : As given to smc_read_async()
+*/
+typedef void (*smc_read_callback_t)(const smc_value_t *values, size_t n,
+                                    void *userdata);
+
+
+/**
+Max number of asynchronous reads outstanding (submitted and not yet
+dispatched), see smc_read_async()
+*/
+#define SMC_ASYNC_QUEUE_SIZE 256
+
+
+/**
+Counters of the asynchronous read worker, see smc_async_get_stats().
+
+- submitted      : Requests accepted
+- rejected       : Requests turned away because the queue was full
+- completed      : Requests dispatched
+- outstanding    : Requests submitted and not yet dispatched
+- batches        : Batches read by the worker
+- keys_requested : Keys asked for, over all requests
+- keys_read      : Keys actually read. Fewer than requested when requests for
+                   the same key were coalesced.
+*/
+typedef struct {
+    uint64_t submitted;
+    uint64_t rejected;
+    uint64_t completed;
+    uint64_t outstanding;
+    uint64_t batches;
+    uint64_t keys_requested;
+    uint64_t keys_read;
+} smc_async_stats_t;
+
+
+/**
+Batch of writes to the SMC, see smc_write_batch_create()
+*/
+typedef struct smc_write_batch_s smc_write_batch_t;
+
+
+/**
+Fan controller, see smc_fan_ctl_create()
+*/
+typedef struct smc_fan_ctl_s smc_fan_ctl_t;
+
+
+/**
+Fan controller limits
+
+- SMC_FAN_CTL_MAX_SENSORS : Temperature sensors per fan
+- SMC_FAN_CTL_MAX_POINTS  : Points of a fan curve
+*/
+#define SMC_FAN_CTL_MAX_SENSORS 4
+#define SMC_FAN_CTL_MAX_POINTS  8
+
+
+/**
+Counters of a fan controller, see smc_fan_ctl_get_stats().
+
+- steps     : Control steps run
+- writes    : Speeds written to the SMC
+- errors    : Failed writes
+- failsafes : Steps where a fan ran at its safe speed, as none of its sensors
+              could be read
+- total_ns  : Total time of the steps (read, compute, write), in nanoseconds
+- max_ns    : Longest step, in nanoseconds
+*/
+typedef struct {
+    uint64_t steps;
+    uint64_t writes;
+    uint64_t errors;
+    uint64_t failsafes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} smc_fan_ctl_stats_t;
+
+
+/**
+Number of keys checked by smc_probe_capabilities(). Every SMC_KEY_* constant,
+see smc_get_probe_keys() for their order.
+*/
+#define SMC_PROBE_KEYS 41
+
+
+/**
+Sensors present on the machine, see smc_probe_capabilities().
+
+- present     : Bit i is set if key i of smc_get_probe_keys() was found
+- num_present : Number of keys found
+- num_tmp     : Number of temperature sensors found
+- num_fans    : Number of fans found, by their current speed key
+*/
+typedef struct {
+    uint64_t     present;
+    unsigned int num_present;
+    unsigned int num_tmp;
+    unsigned int num_fans;
+} smc_capabilities_t;
+
+
+/**
+Counters of the negative key cache, see smc_get_key_cache_stats().
+
+- hits    : Lookups of a key known to be absent, answered without the SMC
+- misses  : Lookups that went on to the SMC. Not counted when built with
+            -DSMC_NO_STATS.
+- entries : Keys cached as absent
+*/
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;
+} smc_key_cache_stats_t;
+
+
+/**
+Windowed statistics over a set of keys. See smc_window_create().
+*/
+typedef struct smc_window_s smc_window_t;
+
+
+/**
+Windowed statistics limits
+
+- SMC_WINDOW_MAX  : Windows per smc_window_t
+- SMC_WINDOW_BINS : Histogram bins per key and window, for quantiles
+*/
+#define SMC_WINDOW_MAX  4
+#define SMC_WINDOW_BINS 256
+
+
+/**
+Key of windowed statistics, for smc_window_create().
+
+- key : SMC key, as a uint32_t
+- min : Low end of the quantile histogram. Quantiles are accurate to
+        (max - min) / SMC_WINDOW_BINS, values outside the range fall in the
+        first or last bin.
+- max : High end of the quantile histogram
+*/
+typedef struct {
+    uint32_t key;
+    double   min;
+    double   max;
+} smc_window_key_t;
+
+
+/**
+Statistics of a key over a window, see smc_window_get(). All NAN when the window
+holds no samples.
+
+- count  : Number of samples in the window
+- min    : Smallest sample
+- max    : Largest sample
+- mean   : Mean
+- stddev : Sample standard deviation, zero for a single sample
+- p50    : Median, from the histogram
+- p95    : 95th percentile, from the histogram
+- p99    : 99th percentile, from the histogram
+*/
+typedef struct {
+    uint64_t count;
+    double   min;
+    double   max;
+    double   mean;
+    double   stddev;
+    double   p50;
+    double   p95;
+    double   p99;
+} smc_window_stats_t;
+
+
+/**
+Set of threshold watches. See smc_watcher_create().
+*/
+typedef struct smc_watcher_s smc_watcher_t;
+
+
+/**
+Counters of a watcher, see smc_watcher_get_stats().
+
+- sweeps      : Number of sweeps
+- reads       : Keys read, once per key per sweep however many watches it has
+- read_errors : Reads that failed
+- evaluations : Watches evaluated
+- events      : Callbacks made
+- total_ns    : Time spent sweeping, callbacks aside
+- max_ns      : Longest sweep, callbacks aside
+*/
+typedef struct {
+    uint64_t sweeps;
+    uint64_t reads;
+    uint64_t read_errors;
+    uint64_t evaluations;
+    uint64_t events;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} smc_watcher_stats_t;
+
+
+/**
+Counters of the virtual keys, see smc_virtual_get_stats().
+
+- reads          : Reads of virtual keys
+- physical_reads : Reads of real keys made to evaluate them, at most one per
+                   key per epoch
+- memo_hits      : Values, real or computed, reused within an epoch rather
+                   than worked out again
+- nodes          : Nodes of the expression graph, shared between virtual keys
+*/
+typedef struct {
+    uint64_t reads;
+    uint64_t physical_reads;
+    uint64_t memo_hits;
+    uint64_t nodes;
+} smc_virtual_stats_t;
+
+
 //------------------------------------------------------------------------------
 // MARK: ENUMS
 //------------------------------------------------------------------------------
@@ -152,97 +784,502 @@ typedef enum {
 } tmp_unit_t;
 
 
-//------------------------------------------------------------------------------
-// MARK: PROTOTYPES
-//------------------------------------------------------------------------------
+/**
+Transports for calls to the SMC. See smc_set_transport().
+
+- SMC_TRANSPORT_IOKIT  : AppleSMC.kext via I/O Kit. Default on OS X.
+- SMC_TRANSPORT_SIM    : In-process simulated SMC. Default elsewhere.
+- SMC_TRANSPORT_REPLAY : Responses from a recording, see smc_replay_load()
+*/
+typedef enum {
+    SMC_TRANSPORT_IOKIT,
+    SMC_TRANSPORT_SIM,
+    SMC_TRANSPORT_REPLAY
+} smc_transport_type_t;
 
 
 /**
-Open a connection to the SMC
+Timing of a replay, see smc_replay_load().
 
-:returns: kIOReturnSuccess on successful connection to the SMC.
+- SMC_REPLAY_FAST     : Serve responses as fast as possible
+- SMC_REPLAY_REALTIME : Hold each response until the time it was recorded at,
+                        relative to the start of the replay
 */
-kern_return_t open_smc(void);
+typedef enum {
+    SMC_REPLAY_FAST,
+    SMC_REPLAY_REALTIME
+} smc_replay_mode_t;
 
 
 /**
-Close connection to the SMC
+Outcome of a write in a batch, see smc_write_batch_apply()
 
-:returns: kIOReturnSuccess on successful close of connection to the SMC.
+- SMC_WRITE_OK       : Written (and read back, if verifying)
+- SMC_WRITE_SKIPPED  : Not written, the value is the one last confirmed
+- SMC_WRITE_FAILED   : The key info, write or read-back call failed, or the
+                       value's type or size doesn't match the key
+- SMC_WRITE_MISMATCH : Written, but read back as a different value
 */
-kern_return_t close_smc(void);
+typedef enum {
+    SMC_WRITE_OK,
+    SMC_WRITE_SKIPPED,
+    SMC_WRITE_FAILED,
+    SMC_WRITE_MISMATCH
+} smc_write_status_t;
 
 
 /**
-Check if an SMC key is valid. Useful for determining if a certain machine has
-particular sensor or fan for example.
+Result of a write in a batch, see smc_write_batch_apply().
 
-:param: key The SMC key to check. 4 byte multi-character constant. Must be 4
-            characters in length.
-:returns: True if the key is found, false otherwise
+- key    : SMC key, as a uint32_t
+- status : Outcome
+- result : I/O Kit return code of the last call made for the write
+- kSMC   : SMC return code of the last call made for the write
 */
-bool is_key_valid(char *key);
-
+typedef struct {
+    uint32_t           key;
+    smc_write_status_t status;
+    kern_return_t      result;
+    uint8_t            kSMC;
+} smc_write_result_t;
 
 /**
-Get the current temperature from a sensor
+How a fan's speed is worked out from its temperature, see
+smc_fan_ctl_config_t
 
-:param: key The temperature sensor to read from
-:param: unit The unit for the temperature value.
-:returns: Temperature of sensor. If the sensor is not found, or an error
-          occurs, return will be zero
+- SMC_FAN_CTL_CURVE : Piecewise linear curve of temperature to speed
+- SMC_FAN_CTL_PID   : PID loop holding the temperature at a setpoint
 */
-double get_tmp(char *key, tmp_unit_t unit);
+typedef enum {
+    SMC_FAN_CTL_CURVE,
+    SMC_FAN_CTL_PID
+} smc_fan_ctl_mode_t;
 
 
 /**
-Is the machine being powered by the battery?
+Control configuration of a fan, for smc_fan_ctl_create(). The output is always
+clamped to the fan's F%dMn and F%dMx, as read when the controller is created.
 
-:returns: True if it is, false otherwise
+- fan          : Fan number
+- sensors      : Temperature keys, as uint32_t. The hottest one is followed.
+- num_sensors  : Number of sensors, at least one
+- mode         : Curve or PID
+- curve_tmp    : Curve points, temperatures in ascending order, in degrees
+                 Celsius. The speed is flat beyond the first and last point.
+- curve_rpm    : Speed at each curve point
+- num_points   : Number of curve points
+- setpoint     : PID target temperature, in degrees Celsius
+- kp           : PID proportional gain, RPM per degree
+- ki           : PID integral gain, RPM per degree second
+- kd           : PID derivative gain, RPM per degree per second
+- deadband_rpm : Change of output that is worth a write
+- force        : Drive the target speed (F%dTg) in forced mode, rather than the
+                 min speed (F%dMn), which leaves the SMC free to go faster
 */
-bool is_battery_powered(void);
+typedef struct {
+    unsigned int       fan;
+    uint32_t           sensors[SMC_FAN_CTL_MAX_SENSORS];
+    size_t             num_sensors;
+    smc_fan_ctl_mode_t mode;
+    double             curve_tmp[SMC_FAN_CTL_MAX_POINTS];
+    double             curve_rpm[SMC_FAN_CTL_MAX_POINTS];
+    size_t             num_points;
+    double             setpoint;
+    double             kp;
+    double             ki;
+    double             kd;
+    double             deadband_rpm;
+    bool               force;
+} smc_fan_ctl_config_t;
 
 
 /**
-Is there a CD in the optical disk drive (ODD)?
+Edges of a watch, see smc_watch_config_t. May be ORed together.
 
-:returns: True if there is, false otherwise
+- SMC_WATCH_RISING  : The value went above the threshold
+- SMC_WATCH_FALLING : The value went back below the threshold, less the
+                      hysteresis
 */
-bool is_optical_disk_drive_full(void);
+typedef enum {
+    SMC_WATCH_RISING  = 1,
+    SMC_WATCH_FALLING = 2
+} smc_watch_edge_t;
 
 
 /**
-Get the name of a fan.
-    
-:param: fanNum The number of the fan to check
-:param: name The name of the fan. Return will be empty on error.
-:returns: True if successful, false otherwise.
+Watch on a key, for smc_watch_add(). A watch starts below its threshold.
+
+- key         : SMC key, as a uint32_t
+- threshold   : Rising edge when the decoded value (see smc_decode()) goes
+                above it
+- hysteresis  : Falling edge only once the value goes below threshold -
+                hysteresis, so a value hovering at the threshold doesn't fire
+                edge after edge. Not negative.
+- debounce_ns : How long the value must stay past the edge before it fires, in
+                nanoseconds. Zero to fire on the first sweep that sees it.
+- edges       : Edges to call back on, SMC_WATCH_RISING and/or
+                SMC_WATCH_FALLING. Both are tracked either way.
 */
-bool get_fan_name(unsigned int fan_num, fan_name_t name);
+typedef struct {
+    uint32_t     key;
+    double       threshold;
+    double       hysteresis;
+    uint64_t     debounce_ns;
+    unsigned int edges;
+} smc_watch_config_t;
 
 
 /**
-Get the number of fans on this machine.
+Edge of a watch, passed to its callback
 
-:returns: The number of fans. If an error occurs, return will be -1.
+- id        : The watch, as returned by smc_watch_add()
+- key       : SMC key, as a uint32_t
+- edge      : SMC_WATCH_RISING or SMC_WATCH_FALLING
+- value     : Decoded value that fired the edge
+- timestamp : Time of the sweep that fired it, in nanoseconds
 */
-int get_num_fans(void);
+typedef struct {
+    uint32_t         id;
+    uint32_t         key;
+    smc_watch_edge_t edge;
+    double           value;
+    uint64_t         timestamp;
+} smc_watch_event_t;
 
 
 /**
-Get the current speed (RPM - revolutions per minute) of a fan.
+Callback of a watch, see smc_watch_add(). Runs on the sweeping thread.
 
-:param: fan_num The number of the fan to check
-:returns: The fan RPM. If the fan is not found, or an error occurs, return
-          will be zero
+- event    : The edge. Only valid during the call.
+- userdata : As given to smc_watch_add()
 */
-UInt get_fan_rpm(UInt fan_num);
+typedef void (*smc_watch_callback_t)(const smc_watch_event_t *event,
+                                     void *userdata);
 
 
 /**
-Set the minimum speed (RPM - revolutions per minute) of a fan. This method
-requires root privileges. By minimum we mean that OS X can interject and
-raise the fan speed if needed, however it will not go below this.
+Work done each period by smc_run_periodic()
+
+- context : As given to smc_run_periodic()
+- now_ns  : Time of this run, see smc_time_ns()
+*/
+typedef void (*smc_periodic_t)(void *context, uint64_t now_ns);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES
+//------------------------------------------------------------------------------
+
+
+/**
+Monotonic clock used for all library timestamps
+
+:returns: Time in nanoseconds, from an arbitrary starting point
+*/
+uint64_t smc_time_ns(void);
+
+
+/**
+Call a function every period until asked to stop, as the fan controller,
+watcher, sampler and table threads do. Deadlines are fixed, so the period
+doesn't drift, and runs that were missed are skipped rather than made back to
+back. Sleeps are capped, so a stop is noticed within 100 ms however long the
+period.
+
+:param: period_ns Period, in nanoseconds
+:param: stop Polled before each run and sleep, return once it's true
+:param: run The function
+:param: context Passed to run
+*/
+void smc_run_periodic(uint64_t period_ns, const bool *stop, smc_periodic_t run,
+                      void *context);
+
+
+/**
+Sleep until a time, for at most 100 ms, so that a loop calling it notices a
+stop in time. Returns at once if the time has passed. See smc_run_periodic()
+for loops with a fixed period.
+
+:param: deadline_ns Time to wake up at, see smc_time_ns()
+*/
+void smc_sleep_until(uint64_t deadline_ns);
+
+
+/**
+Open a connection to the SMC
+
+:returns: kIOReturnSuccess on successful connection to the SMC.
+*/
+kern_return_t open_smc(void);
+
+
+/**
+Close connection to the SMC
+
+:returns: kIOReturnSuccess on successful close of connection to the SMC.
+*/
+kern_return_t close_smc(void);
+
+
+/**
+Check if an SMC key is valid. Useful for determining if a certain machine has
+particular sensor or fan for example. Keys found by smc_probe_capabilities(),
+and keys known to be absent, are answered without calling the SMC.
+
+:param: key The SMC key to check. 4 byte multi-character constant. Must be 4
+            characters in length.
+:returns: True if the key is found, false otherwise
+*/
+bool is_key_valid(char *key);
+
+
+/**
+Get the current temperature from a sensor
+
+:param: key The temperature sensor to read from
+:param: unit The unit for the temperature value.
+:returns: Temperature of sensor. If the sensor is not found, or an error
+          occurs, return will be zero
+*/
+double get_tmp(char *key, tmp_unit_t unit);
+
+
+/**
+Encode an SMC key as a uint32_t, the form the SMC expects it in.
+
+:param: key The SMC key. 4 byte multi-character constant.
+:returns: uint32_t translation. Zero if the key is not 4 characters in length.
+*/
+uint32_t smc_encode_key(char *key);
+
+
+/**
+Read many SMC keys in one pass. Duplicate keys are only read once. No
+allocation is done, results are written to the caller owned out array.
+
+:param: keys The SMC keys to read, as uint32_t. See smc_encode_key().
+:param: n Number of keys
+:param: out Array of at least n values. out[i] holds the result for keys[i],
+            with its own status in out[i].result and out[i].kSMC
+:returns: kIOReturnSuccess if every key was read, kIOReturnError otherwise
+*/
+kern_return_t smc_read_many(const uint32_t *keys, size_t n, smc_value_t *out);
+
+
+/**
+Build a catalog of every key on the SMC by walking all key indexes, fetching
+each key and its key info. The index range is split across threads, each with
+its own connection to the SMC.
+
+:param: catalog Catalog to fill. Must be freed with smc_catalog_free().
+:param: num_threads Number of threads to use. 0 or 1 walks serially on the
+                    calling thread.
+:returns: kIOReturnSuccess if every key was enumerated
+*/
+kern_return_t smc_catalog_build(smc_catalog_t *catalog,
+                                unsigned int num_threads);
+
+
+/**
+Find a key in a catalog.
+
+:param: catalog Catalog to search
+:param: key The SMC key, as a uint32_t
+:returns: Key info, NULL if the key is not in the catalog
+*/
+const smc_key_info_t *smc_catalog_find(const smc_catalog_t *catalog,
+                                       uint32_t key);
+
+
+/**
+Save a catalog to a file. The file is a small header (magic, version, machine
+model) followed by the sorted fixed-width key info records, so that it can
+later be mapped as is with smc_catalog_map(). The file is written under a
+temporary name and renamed into place.
+
+:param: catalog Catalog to save
+:param: path Path of the catalog file
+:returns: kIOReturnSuccess if the file was written
+*/
+kern_return_t smc_catalog_save(const smc_catalog_t *catalog, const char *path);
+
+
+/**
+Map a catalog file saved by smc_catalog_save(). The file is mapped read-only
+and used in place, there is no parsing or copying of records.
+
+:param: catalog Catalog to fill. Must be freed with smc_catalog_free().
+:param: path Path of the catalog file
+:returns: kIOReturnSuccess if the file was mapped, kIOReturnNotFound if it
+          doesn't exist, kIOReturnError if it isn't a valid catalog file
+*/
+kern_return_t smc_catalog_map(smc_catalog_t *catalog, const char *path);
+
+
+/**
+Load the catalog for this machine model. If dir holds a catalog file for this
+model it is mapped, otherwise the SMC is enumerated (see smc_catalog_build())
+and the result saved to dir for next time.
+
+:param: catalog Catalog to fill. Must be freed with smc_catalog_free().
+:param: dir Directory the catalog files are kept in
+:param: num_threads Number of threads to use if the SMC must be enumerated
+:returns: kIOReturnSuccess if the catalog was loaded. Failing to save the
+          catalog file is not an error.
+*/
+kern_return_t smc_catalog_load(smc_catalog_t *catalog, const char *dir,
+                               unsigned int num_threads);
+
+
+/**
+Free a catalog.
+
+:param: catalog Catalog to free. Left empty.
+*/
+void smc_catalog_free(smc_catalog_t *catalog);
+
+
+/**
+Prepare an SMC key for repeated reads. The key info (data type and size) is
+fetched once here, instead of on every read.
+
+:param: key The SMC key to prepare. 4 byte multi-character constant. Must be 4
+            characters in length.
+:returns: Handle to the prepared key, NULL if the key is not found or an error
+          occurs. Must be released with smc_release_prepared().
+*/
+smc_key_t *smc_prepare(char *key);
+
+
+/**
+Prepare an SMC key for repeated reads. Same as smc_prepare(), but takes the key
+as a uint32_t (see SMC_FOURCC() and the SMC_KEY_* constants).
+
+:param: key The SMC key to prepare, as a uint32_t
+:returns: Handle to the prepared key, NULL if the key is not found or an error
+          occurs. Must be released with smc_release_prepared().
+*/
+smc_key_t *smc_prepare_u32(uint32_t key);
+
+
+/**
+Read a prepared SMC key. Only a single call to the SMC is made, unless the SMC
+reports that the cached key info no longer matches, in which case it is
+fetched again and the read retried once.
+
+:param: handle Prepared key from smc_prepare()
+:param: value Value read. On error, value->kSMC holds the SMC return code.
+:returns: kIOReturnSuccess if the read succeeded, see smc_value_t
+*/
+kern_return_t smc_read_prepared(smc_key_t *handle, smc_value_t *value);
+
+
+/**
+Release a prepared SMC key.
+
+:param: handle Prepared key from smc_prepare(). May be NULL.
+*/
+void smc_release_prepared(smc_key_t *handle);
+
+
+/**
+Check if an SMC key is valid. Same as is_key_valid(), but takes the key as a
+uint32_t (see SMC_FOURCC() and the SMC_KEY_* constants).
+
+:param: key The SMC key to check, as a uint32_t
+:returns: True if the key is found, false otherwise
+*/
+bool smc_is_key_valid_u32(uint32_t key);
+
+
+/**
+Get the current temperature from a sensor. Same as get_tmp(), but takes the
+key as a uint32_t (see SMC_FOURCC() and the SMC_KEY_* constants).
+
+:param: key The temperature sensor to read from, as a uint32_t
+:param: unit The unit for the temperature value.
+:returns: Temperature of sensor. If the sensor is not found, or an error
+          occurs, return will be zero
+*/
+double smc_get_tmp_u32(uint32_t key, tmp_unit_t unit);
+
+
+/**
+Read an SMC key.
+
+:param: key The SMC key, as a uint32_t (see SMC_FOURCC() and the SMC_KEY_*
+            constants)
+:param: value Value read. On error, value->kSMC holds the SMC return code.
+:returns: kIOReturnSuccess if the read succeeded, see smc_value_t
+*/
+kern_return_t smc_read_u32(uint32_t key, smc_value_t *value);
+
+
+/**
+Read an SMC key whose data type and size are known up front, e.g. from the
+SMC_KEY_* constants or a previous read. A single call to the SMC, the key info
+isn't fetched. The type is taken on trust, only the size is checked by the SMC
+(kSMCKeySizeMismatch). A virtual key (see smc_virtual_define()) is computed,
+and fails unless it has the given type and size.
+
+:param: key The SMC key, as a uint32_t
+:param: dataType Type of data, see the SMC_TYPE_* constants. Stored in value.
+:param: dataSize Number of bytes of data
+:param: value Value read. On error, value->kSMC holds the SMC return code.
+:returns: kIOReturnSuccess if the read succeeded, see smc_value_t
+*/
+kern_return_t smc_read_typed(uint32_t key, uint32_t dataType,
+                             uint32_t dataSize, smc_value_t *value);
+
+
+/**
+Is the machine being powered by the battery?
+
+:returns: True if it is, false otherwise
+*/
+bool is_battery_powered(void);
+
+
+/**
+Is there a CD in the optical disk drive (ODD)?
+
+:returns: True if there is, false otherwise
+*/
+bool is_optical_disk_drive_full(void);
+
+
+/**
+Get the name of a fan.
+    
+:param: fanNum The number of the fan to check
+:param: name The name of the fan. Return will be empty on error.
+:returns: True if successful, false otherwise.
+*/
+bool get_fan_name(unsigned int fan_num, fan_name_t name);
+
+
+/**
+Get the number of fans on this machine.
+
+:returns: The number of fans. If an error occurs, return will be -1.
+*/
+int get_num_fans(void);
+
+
+/**
+Get the current speed (RPM - revolutions per minute) of a fan.
+
+:param: fan_num The number of the fan to check
+:returns: The fan RPM. If the fan is not found, or an error occurs, return
+          will be zero
+*/
+UInt get_fan_rpm(UInt fan_num);
+
+
+/**
+Set the minimum speed (RPM - revolutions per minute) of a fan. This method
+requires root privileges. By minimum we mean that OS X can interject and
+raise the fan speed if needed, however it will not go below this.
 
 WARNING: You are playing with hardware here, BE CAREFUL.
 
@@ -252,3 +1289,1367 @@ WARNING: You are playing with hardware here, BE CAREFUL.
 :return: True if successful, false otherwise
 */
 bool set_fan_min_rpm(unsigned int fan_num, unsigned int rpm, bool auth);
+
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - TRANSPORT & SIMULATED SMC
+//------------------------------------------------------------------------------
+
+
+/**
+Select the transport used for calls to the SMC. Must be called while no
+connection is open.
+
+:param: type The transport to use
+:returns: kIOReturnUnsupported if the transport isn't available on this
+          platform, kIOReturnNotOpen for SMC_TRANSPORT_REPLAY if no recording
+          is loaded
+*/
+kern_return_t smc_set_transport(smc_transport_type_t type);
+
+
+/**
+Add a key to the simulated SMC, or replace it if it already exists. The #KEY
+key is kept up to date with the number of keys.
+
+:param: key The SMC key, as a uint32_t
+:param: dataType Type of data, 4 byte multi-character constant as a uint32_t
+:param: dataSize Number of bytes of data. At most 32.
+:param: attributes Key attributes reported by kSMCGetKeyInfo
+:param: data Initial value, in SMC byte order. NULL for all zeros.
+:returns: kIOReturnSuccess if the key was set
+*/
+kern_return_t smc_sim_set_key(uint32_t key, uint32_t dataType,
+                                            uint32_t dataSize,
+                                            uint8_t  attributes,
+                                            const uint8_t *data);
+
+
+/**
+Get the current value of a key in the simulated SMC, without going through a
+transport or counting as a call. Useful to check what was written.
+
+:param: key The SMC key, as a uint32_t
+:param: value The value of the key
+:returns: kIOReturnNotFound if the key doesn't exist
+*/
+kern_return_t smc_sim_get_key(uint32_t key, smc_value_t *value);
+
+
+/**
+Populate the simulated SMC with every temperature, fan and misc key in this
+header, for two fans, followed by synthetic keys ("Z000", "Z001", ...) until
+the key space holds num_keys keys.
+
+:param: num_keys Total number of keys wanted. Up to 46656 synthetic keys.
+:returns: kIOReturnSuccess if the key space was populated
+*/
+kern_return_t smc_sim_populate(size_t num_keys);
+
+
+/**
+Remove every key from the simulated SMC, and reset latency, error rates and
+call count.
+*/
+void smc_sim_reset(void);
+
+
+/**
+Set the latency of each call to the simulated SMC.
+
+:param: latency_ns Fixed latency per call, in nanoseconds
+:param: jitter_ns Random latency added on top, uniform in [0, jitter_ns]
+*/
+void smc_sim_set_latency(uint64_t latency_ns, uint64_t jitter_ns);
+
+
+/**
+Inject errors into key info, read and write calls to the simulated SMC.
+
+:param: not_found_rate Probability, in [0, 1], of a kSMCKeyNotFound result
+:param: error_rate Probability, in [0, 1], of a kSMCError result
+*/
+void smc_sim_set_error_rates(double not_found_rate, double error_rate);
+
+
+/**
+Inject I/O Kit failures into every call to the simulated SMC. The call then
+returns code rather than an SMC result.
+
+:param: code Return code, e.g. kIOReturnTimeout, or err_get_code() of it
+             (0x2d6) as the I/O Kit transport returns
+:param: rate Probability, in [0, 1], of a failure. Zero to stop.
+*/
+void smc_sim_set_io_error(kern_return_t code, double rate);
+
+
+/**
+Get the number of calls made to the simulated SMC since the last
+smc_sim_reset(). Useful for checking how many driver calls an API makes.
+
+:returns: Number of calls
+*/
+uint64_t smc_sim_get_call_count(void);
+
+
+/**
+Set a function to be called after every successful write to the simulated SMC,
+from the writing thread. Lets a test plug in a model of the machine, e.g. fans
+that spin up when their min speed is written, cooling a simulated sensor.
+Cleared by smc_sim_reset().
+
+:param: hook The function, NULL for none. May call smc_sim_set_key().
+:param: context Passed to the hook
+*/
+void smc_sim_set_write_hook(smc_sim_write_hook_t hook, void *context);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - DECODING
+//------------------------------------------------------------------------------
+
+
+/**
+Decode raw SMC data to a human readable value, according to its data type.
+Known types are every 16-bit fixed point type, unsigned fp1f to fpf1 and signed
+sp1e to spf0 (sp78, fpe2 etc.), along with ui8/16/32, si8/16/32, flt and flag.
+
+:param: dataType Type of data, 4 byte multi-character constant as a uint32_t
+:param: data Raw data, as returned by the SMC
+:param: dataSize Number of bytes of data
+:param: out Decoded value
+:returns: False if the type is not known, or the size doesn't match it
+*/
+bool smc_decode(uint32_t dataType, const uint8_t *data, uint32_t dataSize,
+                                                         double *out);
+
+
+/**
+Decode a value read from the SMC. See smc_decode().
+
+:param: value Value read from the SMC
+:param: out Decoded value
+:returns: False if the type is not known, or the size doesn't match it
+*/
+bool smc_decode_value(const smc_value_t *value, double *out);
+
+
+/**
+Decode an array of raw samples, all of the same data type, packed back to back
+(n * size of the type bytes). 16-bit types are decoded with SIMD where the CPU
+supports it (AVX2 or SSE2), everything else falls back to scalar.
+
+:param: dataType Type of data, 4 byte multi-character constant as a uint32_t
+:param: raw Raw samples, as returned by the SMC
+:param: n Number of samples
+:param: out Array of at least n decoded values
+:returns: Number of samples decoded, n if the type is known, zero otherwise
+*/
+size_t smc_decode_batch(uint32_t dataType, const uint8_t *raw, size_t n,
+                                                               double *out);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - SAMPLING
+//------------------------------------------------------------------------------
+
+
+/**
+Create a sampler, which polls a set of keys at a fixed period on its own thread
+and pushes each frame of decoded values (see smc_decode()) to every consumer.
+Consumers drain frames from their own lock-free ring without touching the
+driver. Keys are prepared up front (see smc_prepare()), keys that can't be read
+are sampled as NAN.
+
+:param: keys The SMC keys to sample, as uint32_t
+:param: num_keys Number of keys
+:param: period_ns Sampling period, in nanoseconds
+:returns: The sampler, NULL on error. Must be destroyed with
+          smc_sampler_destroy().
+*/
+smc_sampler_t *smc_sampler_create(const uint32_t *keys, size_t num_keys,
+                                  uint64_t period_ns);
+
+
+/**
+Add a consumer to a sampler. Must be called before smc_sampler_start(). Each
+ring has a single consumer, which may be on any thread. When a ring is full,
+new frames are dropped and counted rather than blocking the sampler.
+
+:param: sampler The sampler
+:param: capacity Number of frames the ring can hold, rounded up to a power of
+                 two
+:returns: The consumer's ring, NULL on error or if the sampler is running. Owned
+          by the sampler.
+*/
+smc_ring_t *smc_sampler_add_consumer(smc_sampler_t *sampler, size_t capacity);
+
+
+/**
+Start the sampler thread.
+
+:param: sampler The sampler
+:returns: kIOReturnSuccess if the thread was started
+*/
+kern_return_t smc_sampler_start(smc_sampler_t *sampler);
+
+
+/**
+Stop the sampler thread. Waits for the current frame to finish.
+
+:param: sampler The sampler
+*/
+void smc_sampler_stop(smc_sampler_t *sampler);
+
+
+/**
+Stop and destroy a sampler, along with its rings.
+
+:param: sampler The sampler. May be NULL.
+*/
+void smc_sampler_destroy(smc_sampler_t *sampler);
+
+
+/**
+Take the oldest frame from a ring. Only to be called from the ring's single
+consumer.
+
+:param: ring The ring
+:param: frame The frame
+:param: values The values of the frame, one per key sampled. Must hold as many
+               values as keys were given to smc_sampler_create().
+:returns: False if the ring is empty
+*/
+bool smc_ring_pop(smc_ring_t *ring, smc_frame_t *frame, double *values);
+
+
+/**
+Get the number of frames dropped because a ring was full.
+
+:param: ring The ring
+:returns: Number of frames dropped
+*/
+uint64_t smc_ring_get_overruns(smc_ring_t *ring);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - SENSOR TABLE
+//------------------------------------------------------------------------------
+
+
+/**
+Create a latest-value sensor table, with one cache line sized slot per key.
+A single refresher (smc_table_refresh() or the thread from smc_table_start())
+updates the slots, any number of threads read them wait-free through a
+sequence lock, so many readers cost one set of driver calls.
+
+:param: keys The SMC keys to hold, as uint32_t. Duplicates are dropped.
+:param: num_keys Number of keys
+:returns: The table, NULL on error. Must be destroyed with
+          smc_table_destroy().
+*/
+smc_table_t *smc_table_create(const uint32_t *keys, size_t num_keys);
+
+
+/**
+Read every key of the table from the SMC and update its slot. Must only be
+called from a single thread at a time, and not while the refresher thread is
+running.
+
+:param: table The table
+:returns: kIOReturnSuccess if every key was read
+*/
+kern_return_t smc_table_refresh(smc_table_t *table);
+
+
+/**
+Start a refresher thread, which calls smc_table_refresh() every period.
+
+:param: table The table
+:param: period_ns Refresh period, in nanoseconds
+:returns: kIOReturnSuccess if the thread was started
+*/
+kern_return_t smc_table_start(smc_table_t *table, uint64_t period_ns);
+
+
+/**
+Stop the refresher thread.
+
+:param: table The table
+*/
+void smc_table_stop(smc_table_t *table);
+
+
+/**
+Stop and destroy a table. It must no longer be in use by smc_use_table().
+
+:param: table The table. May be NULL.
+*/
+void smc_table_destroy(smc_table_t *table);
+
+
+/**
+Get the latest value of a key from a table. Wait-free for readers, safe to
+call from any number of threads.
+
+:param: table The table
+:param: key The SMC key, as a uint32_t
+:param: entry The latest value
+:returns: False if the key is not in the table, or hasn't been read
+          successfully yet
+*/
+bool smc_table_get(const smc_table_t *table, uint32_t key,
+                   smc_table_entry_t *entry);
+
+
+/**
+Have get_tmp() and get_fan_rpm() (and their uint32_t variants) answer from a
+sensor table, when it holds the key and the value is no older than
+max_staleness_ns. Otherwise they read from the SMC as usual.
+
+:param: sensor_table The table, NULL to stop using one
+:param: max_staleness_ns How old a value may be, in nanoseconds
+*/
+void smc_use_table(smc_table_t *sensor_table, uint64_t max_staleness_ns);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - CONTEXTS
+//------------------------------------------------------------------------------
+
+
+/**
+Open a new context, with its own connection to the SMC (through the current
+transport). open_smc() and close_smc() manage the default context used by every
+function that doesn't take one.
+
+:param: ctx The new context, NULL on failure
+:returns: kIOReturnSuccess on successful connection to the SMC
+*/
+kern_return_t smc_ctx_open(smc_ctx_t **ctx);
+
+
+/**
+Close a context and its connection.
+
+:param: ctx The context. May be NULL.
+:returns: kIOReturnSuccess on successful close of connection to the SMC
+*/
+kern_return_t smc_ctx_close(smc_ctx_t *ctx);
+
+
+/**
+Read a key through a context.
+
+:param: ctx The context
+:param: key The SMC key, as a uint32_t
+:param: value The value read. See smc_read_u32().
+:returns: kIOReturnSuccess if the read succeeded, see smc_value_t
+*/
+kern_return_t smc_ctx_read(smc_ctx_t *ctx, uint32_t key, smc_value_t *value);
+
+
+/**
+Read many keys through a context. See smc_read_many().
+
+:param: ctx The context
+:param: keys SMC keys, as uint32_t
+:param: n Number of keys
+:param: out Values read, n of them
+:returns: kIOReturnSuccess if every key was read successfully
+*/
+kern_return_t smc_ctx_read_many(smc_ctx_t *ctx, const uint32_t *keys, size_t n,
+                                                smc_value_t *out);
+
+
+/**
+Write a key through a context. The value's dataType and dataSize must match the
+key's.
+
+:param: ctx The context
+:param: key The SMC key, as a uint32_t
+:param: value The value to write. result and kSMC are set on return.
+:returns: kIOReturnSuccess if the key was written
+*/
+kern_return_t smc_ctx_write(smc_ctx_t *ctx, uint32_t key, smc_value_t *value);
+
+
+/**
+Create a context pool. Contexts are opened lazily, on a thread's first
+smc_ctx_pool_get(), and closed when the thread exits.
+
+:returns: The pool, NULL on failure
+*/
+smc_ctx_pool_t *smc_ctx_pool_create(void);
+
+
+/**
+Get the calling thread's context from a pool, opening it on first use. Later
+calls from the same thread return the same context without locking.
+
+:param: pool The pool
+:returns: The thread's context, NULL if it could not be opened
+*/
+smc_ctx_t *smc_ctx_pool_get(smc_ctx_pool_t *pool);
+
+
+/**
+Destroy a pool, closing every context it handed out to threads still running.
+No thread may be using them anymore, or exit while the pool is destroyed.
+
+:param: pool The pool. May be NULL.
+*/
+void smc_ctx_pool_destroy(smc_ctx_pool_t *pool);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - ADAPTIVE POLLING
+//------------------------------------------------------------------------------
+
+
+/**
+Create an adaptive poller. Each key's polling period follows a moving average
+and variance of its rate of change, between its min and max period: flat keys
+drift out towards the max period, moving ones are pulled back in straight away.
+A key is also polled ahead of when its value is expected to reach a threshold,
+and drops to the min period on crossing one. Keys that can't be read are polled
+at their max period.
+
+:param: keys Polling configuration, one per key
+:param: num_keys Number of keys
+:returns: The poller, NULL on error. Must be destroyed with
+          smc_poller_destroy().
+*/
+smc_poller_t *smc_poller_create(const smc_poll_key_t *keys, size_t num_keys);
+
+
+/**
+Read every key due at the given time, and work out when each is next due.
+Time is passed in so that polling can be driven by a scripted clock (along with
+smc_sim_set_key()), the poller thread passes smc_time_ns(). Must not be called
+while the poller thread is running.
+
+:param: poller The poller
+:param: now_ns Current time, in nanoseconds
+:returns: Number of keys read
+*/
+size_t smc_poller_poll(smc_poller_t *poller, uint64_t now_ns);
+
+
+/**
+Get when the next key is due.
+
+:param: poller The poller
+:returns: Time, in the clock passed to smc_poller_poll()
+*/
+uint64_t smc_poller_next_deadline(const smc_poller_t *poller);
+
+
+/**
+Get the current polling period of a key.
+
+:param: poller The poller
+:param: key The SMC key, as a uint32_t
+:returns: Period in nanoseconds, zero if the key is not polled
+*/
+uint64_t smc_poller_get_period(const smc_poller_t *poller, uint32_t key);
+
+
+/**
+Get the latest value of a key. Safe to call from any thread.
+
+:param: poller The poller
+:param: key The SMC key, as a uint32_t
+:param: entry The latest value
+:returns: False if the key is not polled, or hasn't been read successfully yet
+*/
+bool smc_poller_get(smc_poller_t *poller, uint32_t key,
+                    smc_table_entry_t *entry);
+
+
+/**
+Get the counters of a poller, and its effective call budget.
+
+:param: poller The poller
+:param: stats The counters
+*/
+void smc_poller_get_stats(smc_poller_t *poller, smc_poller_stats_t *stats);
+
+
+/**
+Start the poller thread, which polls each key as it falls due.
+
+:param: poller The poller
+:returns: kIOReturnSuccess if the thread was started
+*/
+kern_return_t smc_poller_start(smc_poller_t *poller);
+
+
+/**
+Stop the poller thread.
+
+:param: poller The poller
+*/
+void smc_poller_stop(smc_poller_t *poller);
+
+
+/**
+Stop and destroy a poller.
+
+:param: poller The poller. May be NULL.
+*/
+void smc_poller_destroy(smc_poller_t *poller);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - HISTORY
+//------------------------------------------------------------------------------
+
+
+/**
+Create a compressed sensor history. Each key's samples are packed into fixed
+size chunks (Gorilla style): timestamps as the change in the time between
+samples, values XORed against the one before. Steady sampling of a value that
+holds still costs 2 bits a sample, slowly varying sp78 or fpe2 data a byte or
+two.
+
+:param: resolution_ns Timestamps are kept to this resolution, in nanoseconds.
+                      Coarser resolution absorbs sampling jitter, and makes
+                      timestamps cheaper to store.
+:param: max_chunks Chunks kept per key (1 KB each), the oldest are dropped past
+                   it. Zero for no limit.
+:returns: The history, NULL on error. Must be destroyed with
+          smc_history_destroy().
+*/
+smc_history_t *smc_history_create(uint64_t resolution_ns, size_t max_chunks);
+
+
+/**
+Destroy a history. It must no longer be attached to a sampler.
+
+:param: history The history. May be NULL.
+*/
+void smc_history_destroy(smc_history_t *history);
+
+
+/**
+Append a sample of a key. Samples of a key must be appended in time order.
+
+:param: history The history
+:param: key The SMC key, as a uint32_t
+:param: timestamp Time of the sample, in nanoseconds. See smc_time_ns().
+:param: value The sample
+:returns: kIOReturnBadArgument if the sample is older than the last one of the
+          key
+*/
+kern_return_t smc_history_append(smc_history_t *history, uint32_t key,
+                                 uint64_t timestamp, double value);
+
+
+/**
+Append one sample of each of a set of keys, all taken at the same time.
+
+:param: history The history
+:param: keys The SMC keys, as uint32_t
+:param: num_keys Number of keys
+:param: timestamp Time of the samples, in nanoseconds
+:param: values The samples, one per key
+:returns: kIOReturnSuccess if every sample was appended
+*/
+kern_return_t smc_history_append_frame(smc_history_t *history,
+                                       const uint32_t *keys, size_t num_keys,
+                                       uint64_t timestamp,
+                                       const double *values);
+
+
+/**
+Decode the samples of a key within a time range into caller buffers. Only the
+chunks overlapping the range are decoded. To scan a range larger than the
+buffers, call again with from set past the last timestamp returned. Safe to
+call while samples are being appended.
+
+:param: history The history
+:param: key The SMC key, as a uint32_t
+:param: from Start of the range, in nanoseconds, inclusive
+:param: to End of the range, in nanoseconds, inclusive
+:param: timestamps Timestamps of the samples, rounded down to the resolution
+:param: values The samples
+:param: max Size of the buffers
+:returns: Number of samples decoded
+*/
+size_t smc_history_scan(smc_history_t *history, uint32_t key, uint64_t from,
+                        uint64_t to, uint64_t *timestamps, double *values,
+                        size_t max);
+
+
+/**
+Get the size of a history.
+
+:param: history The history
+:param: key The SMC key, as a uint32_t. Zero for every key.
+:param: stats The size
+*/
+void smc_history_get_stats(smc_history_t *history, uint32_t key,
+                           smc_history_stats_t *stats);
+
+
+/**
+Have a sampler append every frame it samples to a history. Must be called
+while the sampler is stopped.
+
+:param: sampler The sampler
+:param: history The history, NULL to stop appending
+:returns: kIOReturnBusy if the sampler is running
+*/
+kern_return_t smc_sampler_set_history(smc_sampler_t *sampler,
+                                      smc_history_t *history);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - RECORD & REPLAY
+//------------------------------------------------------------------------------
+
+
+/**
+Start recording every call made to the SMC, through any transport and from any
+thread, to a file. Each call is appended as a compact binary record (the
+request and response fields that take part in it, plus read or written bytes)
+with a monotonic timestamp. Writes are buffered, the file is only complete once
+smc_record_stop() returns.
+
+:param: path The file to record to. Replaced if it exists.
+:returns: kIOReturnBusy if already recording
+*/
+kern_return_t smc_record_start(const char *path);
+
+
+/**
+Stop recording, and close the file.
+
+:returns: kIOReturnNotOpen if not recording
+*/
+kern_return_t smc_record_stop(void);
+
+
+/**
+Load a recording for SMC_TRANSPORT_REPLAY (see smc_set_transport()). Calls are
+matched to recorded calls by key and selector (index and selector for
+kSMCGetKeyFromIndex), and served the recorded responses in recorded order,
+wrapping around, so a recording can be replayed as a load test for as long as
+needed. Calls without a match get kSMCKeyNotFound. Must not be called while the
+replay transport is in use.
+
+:param: path The recording, see smc_record_start()
+:param: mode Timing of the replay
+:returns: kIOReturnBadArgument if the file isn't a recording, or holds no calls
+*/
+kern_return_t smc_replay_load(const char *path, smc_replay_mode_t mode);
+
+
+/**
+Start the loaded recording over, from its first call and from time zero.
+*/
+void smc_replay_rewind(void);
+
+
+/**
+Get the number of calls with no recorded call to match, since the recording was
+loaded or rewound.
+
+:returns: Number of misses
+*/
+uint64_t smc_replay_get_misses(void);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - SHARED MEMORY
+//------------------------------------------------------------------------------
+
+
+/**
+Default name of the shared-memory sensor table published by smcd
+*/
+#define SMC_SHM_NAME "/libsmc"
+
+
+/**
+Publish a sensor table in POSIX shared memory, for smc_shm_open() clients in
+other processes. Replaces any table already published under the name. There
+must only be one publisher per name.
+
+:param: name Name of the shared memory object, starting with a slash
+:param: keys The SMC keys to publish, as uint32_t
+:param: num_keys Number of keys
+:param: period_ns How often smc_publisher_refresh() will be called, for
+                  clients to judge the heartbeat by
+:returns: The publisher, NULL on error. Must be destroyed with
+          smc_publisher_destroy().
+*/
+smc_publisher_t *smc_publisher_create(const char *name, const uint32_t *keys,
+                                      size_t num_keys, uint64_t period_ns);
+
+
+/**
+Read every key of a published table and update its heartbeat.
+
+:param: publisher The publisher
+:returns: kIOReturnSuccess if every key was read successfully
+*/
+kern_return_t smc_publisher_refresh(smc_publisher_t *publisher);
+
+
+/**
+Stop publishing. Clients see the publisher as dead straight away, and the
+shared memory object is removed.
+
+:param: publisher The publisher. May be NULL.
+*/
+void smc_publisher_destroy(smc_publisher_t *publisher);
+
+
+/**
+Map a published sensor table, read-only. Reads through the mapping need no
+system calls. If the publisher restarts it publishes a new table, so clients
+should reopen once smc_shm_is_alive() turns false.
+
+:param: name Name of the shared memory object, see SMC_SHM_NAME
+:param: shm The mapping, NULL on failure
+:returns: kIOReturnNotFound if nothing is published under the name,
+          kIOReturnBadArgument if the table isn't ready yet or is of another
+          version of the library
+*/
+kern_return_t smc_shm_open(const char *name, smc_shm_t **shm);
+
+
+/**
+Unmap a sensor table.
+
+:param: shm The mapping. May be NULL.
+*/
+void smc_shm_close(smc_shm_t *shm);
+
+
+/**
+Get the latest value of a key from a published table. Wait-free, safe to call
+from any number of threads and processes.
+
+:param: shm The mapping
+:param: key The SMC key, as a uint32_t
+:param: entry The latest value
+:returns: False if the key is not published, or hasn't been read successfully
+          yet
+*/
+bool smc_shm_get(const smc_shm_t *shm, uint32_t key, smc_table_entry_t *entry);
+
+
+/**
+Is the publisher alive? Judged by its heartbeat, which it updates on every
+refresh and clears when shutting down.
+
+:param: shm The mapping
+:param: max_age_ns How old the heartbeat may be, in nanoseconds. Zero for three
+                   of the publisher's refresh periods.
+:returns: False if the publisher is stale or gone
+*/
+bool smc_shm_is_alive(const smc_shm_t *shm, uint64_t max_age_ns);
+
+
+/**
+Get the keys of a published table.
+
+:param: shm The mapping
+:param: keys The keys, sorted
+:param: max Size of keys
+:returns: Number of keys published, which may be more than max
+*/
+size_t smc_shm_get_keys(const smc_shm_t *shm, uint32_t *keys, size_t max);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - STATISTICS
+//------------------------------------------------------------------------------
+
+
+/**
+Get statistics of every call made to the SMC since the last reset, across all
+threads. Each thread counts its own calls, they are only merged here. Building
+the library with SMC_NO_STATS defined removes the counting altogether.
+
+:param: stats The statistics. Large, better not kept on small stacks.
+:returns: kIOReturnUnsupported if the library was built with SMC_NO_STATS
+*/
+kern_return_t smc_get_stats(smc_stats_t *stats);
+
+
+/**
+Reset the statistics of every thread.
+*/
+void smc_reset_stats(void);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - CAPABILITIES
+//------------------------------------------------------------------------------
+
+
+/**
+Check which of the known keys (every SMC_KEY_* constant) the machine has, in
+one pass over a single pair of param structs. Only the key info is fetched,
+one call per key, and keys already known to be absent are skipped. The result
+is kept, so later calls, and is_key_valid() on a present key, don't call the
+SMC. Absent keys go into the negative key cache.
+
+:param: caps Sensors present
+:returns: I/O Kit return code of the first failed call, if any
+*/
+kern_return_t smc_probe_capabilities(smc_capabilities_t *caps);
+
+
+/**
+Get the keys checked by smc_probe_capabilities(), in the order of the bits of
+smc_capabilities_t.present.
+
+:param: keys The keys, SMC_PROBE_KEYS of them
+:returns: Number of keys
+*/
+size_t smc_get_probe_keys(const uint32_t **keys);
+
+
+/**
+Was a key found by a probe?
+
+:param: caps Result of smc_probe_capabilities()
+:param: key The SMC key, as a uint32_t
+:returns: False if the key is absent, or not one of the probed keys
+*/
+bool smc_has_capability(const smc_capabilities_t *caps, uint32_t key);
+
+
+/**
+Forget the probe result and every key cached as absent. Done automatically on
+smc_set_transport() and when the simulated SMC's keys change. Keys read by
+get_tmp(), is_key_valid() etc. whose key info the SMC reports as not found are
+cached as absent, so later calls on them return at once, for 10 s or until the
+next clear. A not found from smc_read_typed(), or injected by
+smc_sim_set_error_rates(), is never cached.
+*/
+void smc_clear_key_cache(void);
+
+
+/**
+Get the counters of the negative key cache. Cleared by smc_clear_key_cache().
+
+:param: stats The counters
+*/
+void smc_get_key_cache_stats(smc_key_cache_stats_t *stats);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - FAN CONTROL
+//------------------------------------------------------------------------------
+
+
+/**
+Create a fan controller. Each fan's F%dMn, F%dMx and F%dSf limits are read once
+here, on the controller's own connection. When none of a fan's sensors can be
+read, it runs at its safe speed (F%dSf, or F%dMx if it has none). Destroying
+the controller puts the fans back as they were.
+
+:param: fans Control configuration, one per fan
+:param: num_fans Number of fans
+:param: period_ns Control period of smc_fan_ctl_start(), in nanoseconds
+:returns: The controller, NULL if the configuration is invalid or a fan's limits
+          can't be read. Must be destroyed with smc_fan_ctl_destroy().
+*/
+smc_fan_ctl_t *smc_fan_ctl_create(const smc_fan_ctl_config_t *fans,
+                                  size_t num_fans, uint64_t period_ns);
+
+
+/**
+Run one control step: read every fan's sensors in one batch, work out the
+speeds, and write those that moved by more than their deadband. Time is passed
+in so the loop can be driven by a scripted clock against the simulated SMC (see
+smc_sim_set_write_hook()), the control thread passes smc_time_ns(). Must not be
+called while the control thread is running.
+
+:param: ctl The controller
+:param: now_ns Current time, in nanoseconds
+:returns: I/O Kit return code of the first failed write, if any
+*/
+kern_return_t smc_fan_ctl_step(smc_fan_ctl_t *ctl, uint64_t now_ns);
+
+
+/**
+Get the state of a fan as of the last step. Safe to call from any thread.
+
+:param: ctl The controller
+:param: fan Fan number
+:param: tmp Hottest of the fan's sensors, NAN if none could be read
+:param: rpm Speed last written, NAN if none yet
+:returns: False if the fan is not controlled
+*/
+bool smc_fan_ctl_get_fan(smc_fan_ctl_t *ctl, unsigned int fan, double *tmp,
+                                                               double *rpm);
+
+
+/**
+Get the counters of a controller. Safe to call from any thread.
+
+:param: ctl The controller
+:param: stats The counters
+*/
+void smc_fan_ctl_get_stats(smc_fan_ctl_t *ctl, smc_fan_ctl_stats_t *stats);
+
+
+/**
+Start a thread that runs a control step every period, at fixed deadlines.
+
+:param: ctl The controller
+:returns: kIOReturnSuccess if the thread is running
+*/
+kern_return_t smc_fan_ctl_start(smc_fan_ctl_t *ctl);
+
+
+/**
+Stop the control thread, if running. The fans are left at their last speed.
+
+:param: ctl The controller
+*/
+void smc_fan_ctl_stop(smc_fan_ctl_t *ctl);
+
+
+/**
+Destroy a controller, stopping its thread, restoring each fan's min speed and
+clearing forced mode.
+
+:param: ctl The controller. May be NULL.
+*/
+void smc_fan_ctl_destroy(smc_fan_ctl_t *ctl);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - WRITE BATCH
+//------------------------------------------------------------------------------
+
+
+/**
+Create a write batch. A batch queues writes and applies them in one pass, and
+is meant to be kept and reused: it caches each key's info, so a write is a
+single call after the first, and remembers the last value confirmed for each
+key, so writing it again is skipped. Not thread safe.
+
+:param: ctx Context to write through, NULL for the default connection
+:returns: The batch, NULL on failure. Must be destroyed with
+          smc_write_batch_destroy().
+*/
+smc_write_batch_t *smc_write_batch_create(smc_ctx_t *ctx);
+
+
+/**
+Queue a write. A key already queued has its value replaced, keeping its place.
+
+:param: batch The batch
+:param: key The SMC key, as a uint32_t
+:param: value The value to write. Its dataType and dataSize must match the
+              key's.
+:returns: kIOReturnNoMemory if the queue can't grow
+*/
+kern_return_t smc_write_batch_add(smc_write_batch_t *batch, uint32_t key,
+                                  const smc_value_t *value);
+
+
+/**
+Get the number of writes queued.
+
+:param: batch The batch
+:returns: Number of writes, one per key
+*/
+size_t smc_write_batch_count(const smc_write_batch_t *batch);
+
+
+/**
+Apply the queued writes, in the order queued, and clear the queue. A write
+whose cached key info turns out to be stale is retried once with fresh info.
+
+:param: batch The batch
+:param: verify Read each written key back, and report a mismatch if the SMC
+               holds a different value
+:param: results Outcome of each write, smc_write_batch_count() of them. May be
+                NULL.
+:returns: kIOReturnError if any write failed or mismatched
+*/
+kern_return_t smc_write_batch_apply(smc_write_batch_t *batch, bool verify,
+                                    smc_write_result_t *results);
+
+
+/**
+Forget the cached key info and confirmed values, e.g. after something else
+wrote to the same keys. The next write to each key goes out in full.
+
+:param: batch The batch
+*/
+void smc_write_batch_invalidate(smc_write_batch_t *batch);
+
+
+/**
+Destroy a write batch. Queued writes are dropped.
+
+:param: batch The batch. May be NULL.
+*/
+void smc_write_batch_destroy(smc_write_batch_t *batch);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - ASYNCHRONOUS READS
+//------------------------------------------------------------------------------
+
+
+/**
+Queue a read of one or more keys to the I/O worker thread, started (with its
+own context) on first use. The worker takes everything queued at once and reads
+each key in it a single time, so requests for the same key are coalesced. When
+a request completes, the descriptor from smc_async_fd() becomes readable, and
+smc_async_dispatch() runs its callback.
+
+:param: keys Keys to read, as uint32_t. Copied, need not outlive the call.
+:param: n Number of keys, at least one
+:param: callback Called with the values on dispatch
+:param: userdata Passed to the callback
+:returns: kIOReturnNoResources if SMC_ASYNC_QUEUE_SIZE requests are already
+          outstanding, so the caller has to dispatch before submitting more
+*/
+kern_return_t smc_read_async(const uint32_t *keys, size_t n,
+                             smc_read_callback_t callback, void *userdata);
+
+
+/**
+Get the completion descriptor, to poll (or select, epoll, kqueue) for
+readability. An eventfd on Linux, the read end of a pipe elsewhere. Starts the
+worker if needed. Must not be read or closed by the caller.
+
+:returns: The descriptor, -1 if the worker can't be started
+*/
+int smc_async_fd(void);
+
+
+/**
+Run the callbacks of every completed request, on the calling thread, and clear
+the completion descriptor. Callbacks may submit new requests.
+
+:returns: Number of callbacks run
+*/
+size_t smc_async_dispatch(void);
+
+
+/**
+Get the counters of the asynchronous read worker.
+
+:param: stats The counters
+*/
+void smc_async_get_stats(smc_async_stats_t *stats);
+
+
+/**
+Stop the worker once it has read everything queued, and close the completion
+descriptor. Completions not yet dispatched are dropped, without their
+callbacks. The next smc_read_async() starts a new worker.
+*/
+void smc_async_shutdown(void);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - WINDOWED STATISTICS
+//------------------------------------------------------------------------------
+
+
+/**
+Create windowed statistics: min, max, mean, standard deviation and quantiles of
+each key over a set of sliding windows (e.g. 10 s, 1 min and 5 min), kept up to
+date as samples are appended. Appending a sample is O(1) amortized per window
+(monotonic deques for min and max, Welford's algorithm for the mean and
+variance, a fixed histogram for quantiles) and queries never rescan the samples.
+Memory is fixed at creation.
+
+:param: keys The keys, with their histogram ranges
+:param: num_keys Number of keys
+:param: windows_ns Window lengths, in nanoseconds. A window holds the samples of
+                   a key taken less than its length before the key's latest.
+:param: num_windows Number of windows, at most SMC_WINDOW_MAX
+:param: period_ns Expected sampling period, in nanoseconds. Sizes the windows,
+                  a window holds at most its length / period_ns + 1 samples. If
+                  sampled faster, the oldest leave it early.
+:returns: The statistics, NULL on error. Must be destroyed with
+          smc_window_destroy().
+*/
+smc_window_t *smc_window_create(const smc_window_key_t *keys, size_t num_keys,
+                                const uint64_t *windows_ns, size_t num_windows,
+                                uint64_t period_ns);
+
+
+/**
+Destroy windowed statistics. They must no longer be attached to a sampler.
+
+:param: window The statistics. May be NULL.
+*/
+void smc_window_destroy(smc_window_t *window);
+
+
+/**
+Append a sample of a key. Samples of a key must be appended in time order. A NAN
+sample (a failed read) is not counted, but still ages the key's windows.
+
+:param: window The statistics
+:param: key The SMC key, as a uint32_t
+:param: timestamp Time of the sample, in nanoseconds. See smc_time_ns().
+:param: value The sample
+:returns: kIOReturnNotFound if the key isn't one of the statistics'.
+          kIOReturnBadArgument if the sample is older than the last one of the
+          key.
+*/
+kern_return_t smc_window_append(smc_window_t *window, uint32_t key,
+                                uint64_t timestamp, double value);
+
+
+/**
+Append one sample of each of a set of keys, all taken at the same time.
+
+:param: window The statistics
+:param: keys The SMC keys, as uint32_t
+:param: num_keys Number of keys
+:param: timestamp Time of the samples, in nanoseconds
+:param: values The samples, one per key
+:returns: kIOReturnSuccess if every sample was appended
+*/
+kern_return_t smc_window_append_frame(smc_window_t *window,
+                                      const uint32_t *keys, size_t num_keys,
+                                      uint64_t timestamp,
+                                      const double *values);
+
+
+/**
+Get the statistics of a key over a window, as of its latest sample. Safe to
+call while samples are being appended.
+
+:param: window The statistics
+:param: key The SMC key, as a uint32_t
+:param: window_ns Length of the window, one of those it was created with
+:param: stats The statistics
+:returns: kIOReturnNotFound if the key isn't one of the statistics'.
+          kIOReturnBadArgument if there is no such window.
+*/
+kern_return_t smc_window_get(smc_window_t *window, uint32_t key,
+                             uint64_t window_ns, smc_window_stats_t *stats);
+
+
+/**
+Get a quantile of a key over a window, see smc_window_get().
+
+:param: window The statistics
+:param: key The SMC key, as a uint32_t
+:param: window_ns Length of the window, one of those it was created with
+:param: q The quantile, 0 to 1
+:returns: The quantile, NAN on error or if the window holds no samples
+*/
+double smc_window_quantile(smc_window_t *window, uint32_t key,
+                           uint64_t window_ns, double q);
+
+
+/**
+Have a sampler append every frame it samples to windowed statistics. Must be
+called while the sampler is stopped.
+
+:param: sampler The sampler
+:param: window The statistics, NULL to stop appending
+:returns: kIOReturnBusy if the sampler is running
+*/
+kern_return_t smc_sampler_set_window(smc_sampler_t *sampler,
+                                     smc_window_t *window);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - WATCHES
+//------------------------------------------------------------------------------
+
+
+/**
+Create a watcher, which evaluates a set of threshold watches in sweeps. Each
+sweep reads every watched key once, however many watches share it, through a
+prepared key (a single call to the SMC), then fires the callbacks of the edges
+crossed. Nothing is called back while a value stays on one side of its
+threshold.
+
+:param: period_ns Sweep period of the watcher thread, in nanoseconds. See
+                  smc_watcher_start().
+:returns: The watcher, NULL on error. Must be destroyed with
+          smc_watcher_destroy().
+*/
+smc_watcher_t *smc_watcher_create(uint64_t period_ns);
+
+
+/**
+Add a watch. May be called at any time, including from a callback. It is first
+evaluated on the next sweep.
+
+:param: watcher The watcher
+:param: config The watch
+:param: callback Called on each of the watch's edges
+:param: userdata Passed to the callback
+:param: id The watch's id, for smc_watch_remove(). May be NULL.
+:returns: kIOReturnBadArgument if the config is invalid
+*/
+kern_return_t smc_watch_add(smc_watcher_t *watcher,
+                            const smc_watch_config_t *config,
+                            smc_watch_callback_t callback, void *userdata,
+                            uint32_t *id);
+
+
+/**
+Remove a watch. May be called at any time, including from a callback. If a
+sweep is running on another thread, the watch may still fire in it.
+
+:param: watcher The watcher
+:param: id The watch's id
+:returns: kIOReturnNotFound if there is no such watch
+*/
+kern_return_t smc_watch_remove(smc_watcher_t *watcher, uint32_t id);
+
+
+/**
+Evaluate every watch once, and call back on the edges crossed. Not to be called
+from a callback.
+
+:param: watcher The watcher
+:param: now_ns Current time, in nanoseconds. Debouncing is measured against it.
+               Must not go backwards.
+:returns: Number of callbacks made
+*/
+size_t smc_watcher_sweep(smc_watcher_t *watcher, uint64_t now_ns);
+
+
+/**
+Get the counters of a watcher.
+
+:param: watcher The watcher
+:param: stats The counters
+*/
+void smc_watcher_get_stats(smc_watcher_t *watcher, smc_watcher_stats_t *stats);
+
+
+/**
+Start sweeping on a thread of the watcher's own, at its period. Callbacks then
+run on that thread.
+
+:param: watcher The watcher
+:returns: kIOReturnNoResources if the thread can't be created
+*/
+kern_return_t smc_watcher_start(smc_watcher_t *watcher);
+
+
+/**
+Stop the watcher thread. Returns once any sweep in flight has finished.
+
+:param: watcher The watcher
+*/
+void smc_watcher_stop(smc_watcher_t *watcher);
+
+
+/**
+Destroy a watcher, stopping it first.
+
+:param: watcher The watcher. May be NULL.
+*/
+void smc_watcher_destroy(smc_watcher_t *watcher);
+
+
+//------------------------------------------------------------------------------
+// MARK: PROTOTYPES - VIRTUAL KEYS
+//------------------------------------------------------------------------------
+
+
+/**
+Define a virtual key, computed from real keys (and other virtual keys) by an
+expression. Virtual keys read through the same getters as real ones:
+smc_read_u32() returns them as type flt, get_tmp() and smc_get_tmp_u32()
+answer for them, and is_key_valid() knows them.
+
+Expressions have + - * /, unary minus, parentheses, numbers, and the functions
+max(), min(), avg() (any number of arguments, skipping keys that can't be read)
+and abs(). Keys are written as is when they are 4 letters and digits (TC0D),
+otherwise quoted ('FS! '). For example:
+
+    max(TC0C, TC1C, TC2C, TC3C)
+    avg(TB0T, TB1T, TB2T, TB3T)
+    (F0Ac - F0Mn) / (F0Mx - F0Mn) * 100
+
+All expressions are compiled into one graph, sharing a node per real key and
+per common subexpression. Evaluation is lazy, and memoized for an epoch (see
+smc_virtual_set_epoch()), so within an epoch each real key is read at most once
+however many virtual keys use it. A real key that can't be read gives NAN,
+which carries through arithmetic.
+
+:param: key The virtual key, 4 characters. Must not be a key on the SMC or an
+            existing virtual key.
+:param: expression The expression
+:returns: kIOReturnBadArgument if the key is taken, or the expression invalid
+          or too deeply nested (64 levels of parentheses or calls, 256
+          operators in a chain)
+*/
+kern_return_t smc_virtual_define(char *key, const char *expression);
+
+
+/**
+Remove every virtual key.
+*/
+void smc_virtual_clear(void);
+
+
+/**
+Set how long an epoch lasts. Values read within an epoch are reused by every
+virtual key read in it.
+
+:param: period_ns Length of an epoch, in nanoseconds. Zero, the default, makes
+                  each read of a virtual key an epoch of its own.
+*/
+void smc_virtual_set_epoch(uint64_t period_ns);
+
+
+/**
+Start a new epoch now, so the next read of a virtual key reads its real keys
+afresh. For example, once per sampling round.
+*/
+void smc_virtual_next_epoch(void);
+
+
+/**
+Read a virtual key.
+
+:param: key The virtual key, as a uint32_t
+:param: value Its value, as type flt (see smc_decode_value())
+:returns: kIOReturnNotFound if it isn't a virtual key. kIOReturnError if its
+          value is NAN, as one of its real keys can't be read.
+*/
+kern_return_t smc_virtual_read(uint32_t key, smc_value_t *value);
+
+
+/**
+Is a key a virtual key?
+
+:param: key The key, as a uint32_t
+*/
+bool smc_virtual_is_defined(uint32_t key);
+
+
+/**
+Get the counters of the virtual keys.
+
+:param: stats The counters
+*/
+void smc_virtual_get_stats(smc_virtual_stats_t *stats);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
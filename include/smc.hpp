@@ -0,0 +1,542 @@
+/*
+ * Header-only C++17 layer over the libsmc C API. Keys are types, with their
+ * FourCC code and data type fixed at compile time. The type is checked against
+ * the SMC on the first read, after which a read is a single call (no key info
+ * fetch, see smc_read_typed()) and decoding is inline.
+ * With C++20, keys can be named by their string (Key<"TC0D", sp78>) and batch
+ * reads take std::span.
+ *
+ * smc.hpp
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SMC_HPP
+#define SMC_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "smc.h"
+
+
+namespace smc {
+
+
+//------------------------------------------------------------------------------
+// MARK: CONVERSIONS
+//------------------------------------------------------------------------------
+
+
+/**
+Build a key or data type code from its 4 characters, see SMC_FOURCC()
+*/
+constexpr std::uint32_t fourcc(const char (&code)[5]) noexcept
+{
+    return SMC_FOURCC(code[0], code[1], code[2], code[3]);
+}
+
+
+/**
+Key of a fan, e.g. fan_key(0, 'A', 'c') for F0Ac
+*/
+constexpr std::uint32_t fan_key(unsigned int fan, char a, char b) noexcept
+{
+    return SMC_FOURCC('F', '0' + fan, a, b);
+}
+
+
+/**
+Celsius to Fahrenheit
+*/
+constexpr double to_fahrenheit(double tmp) noexcept
+{
+    return tmp * 1.8 + 32;
+}
+
+
+/**
+Celsius to Kelvin
+*/
+constexpr double to_kelvin(double tmp) noexcept
+{
+    return tmp + 273.15;
+}
+
+
+/**
+Celsius to the given unit, as get_tmp() returns it
+*/
+constexpr double to_unit(double tmp, tmp_unit_t unit) noexcept
+{
+    return unit == FAHRENHEIT ? to_fahrenheit(tmp) :
+           unit == KELVIN     ? to_kelvin(tmp)     : tmp;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: DATA TYPES
+//------------------------------------------------------------------------------
+
+
+/**
+Data types. Each carries its code, size and decoder, as used by BasicKey.
+Decoding matches smc_decode().
+*/
+namespace detail {
+
+constexpr std::uint32_t be16(const std::uint8_t *data) noexcept
+{
+    return static_cast<std::uint32_t>(data[0]) << 8 | data[1];
+}
+
+
+constexpr std::uint32_t be32(const std::uint8_t *data) noexcept
+{
+    return be16(data) << 16 | be16(data + 2);
+}
+
+} // namespace detail
+
+
+/**
+Signed fixed point, 7 integer bits and 8 fraction bits. Temperatures.
+*/
+struct sp78 {
+    using value_type = double;
+    static constexpr std::uint32_t type = SMC_TYPE_SP78;
+    static constexpr std::uint32_t size = 2;
+
+    static constexpr double decode(const std::uint8_t *data) noexcept
+    {
+        return static_cast<std::int16_t>(detail::be16(data)) / 256.0;
+    }
+};
+
+
+/**
+Unsigned fixed point, 14 integer bits and 2 fraction bits. Fan speeds.
+*/
+struct fpe2 {
+    using value_type = double;
+    static constexpr std::uint32_t type = SMC_TYPE_FPE2;
+    static constexpr std::uint32_t size = 2;
+
+    static constexpr double decode(const std::uint8_t *data) noexcept
+    {
+        return detail::be16(data) / 4.0;
+    }
+};
+
+
+/**
+Unsigned fixed point, 8 integer bits and 8 fraction bits
+*/
+struct fp88 {
+    using value_type = double;
+    static constexpr std::uint32_t type = SMC_TYPE_FP88;
+    static constexpr std::uint32_t size = 2;
+
+    static constexpr double decode(const std::uint8_t *data) noexcept
+    {
+        return detail::be16(data) / 256.0;
+    }
+};
+
+
+struct ui8 {
+    using value_type = std::uint8_t;
+    static constexpr std::uint32_t type = SMC_TYPE_UINT8;
+    static constexpr std::uint32_t size = 1;
+
+    static constexpr std::uint8_t decode(const std::uint8_t *data) noexcept
+    {
+        return data[0];
+    }
+};
+
+
+struct ui16 {
+    using value_type = std::uint16_t;
+    static constexpr std::uint32_t type = SMC_TYPE_UINT16;
+    static constexpr std::uint32_t size = 2;
+
+    static constexpr std::uint16_t decode(const std::uint8_t *data) noexcept
+    {
+        return static_cast<std::uint16_t>(detail::be16(data));
+    }
+};
+
+
+struct ui32 {
+    using value_type = std::uint32_t;
+    static constexpr std::uint32_t type = SMC_TYPE_UINT32;
+    static constexpr std::uint32_t size = 4;
+
+    static constexpr std::uint32_t decode(const std::uint8_t *data) noexcept
+    {
+        return detail::be32(data);
+    }
+};
+
+
+struct si8 {
+    using value_type = std::int8_t;
+    static constexpr std::uint32_t type = SMC_TYPE_SINT8;
+    static constexpr std::uint32_t size = 1;
+
+    static constexpr std::int8_t decode(const std::uint8_t *data) noexcept
+    {
+        return static_cast<std::int8_t>(data[0]);
+    }
+};
+
+
+struct si16 {
+    using value_type = std::int16_t;
+    static constexpr std::uint32_t type = SMC_TYPE_SINT16;
+    static constexpr std::uint32_t size = 2;
+
+    static constexpr std::int16_t decode(const std::uint8_t *data) noexcept
+    {
+        return static_cast<std::int16_t>(detail::be16(data));
+    }
+};
+
+
+struct si32 {
+    using value_type = std::int32_t;
+    static constexpr std::uint32_t type = SMC_TYPE_SINT32;
+    static constexpr std::uint32_t size = 4;
+
+    static constexpr std::int32_t decode(const std::uint8_t *data) noexcept
+    {
+        return static_cast<std::int32_t>(detail::be32(data));
+    }
+};
+
+
+struct flag {
+    using value_type = bool;
+    static constexpr std::uint32_t type = SMC_TYPE_FLAG;
+    static constexpr std::uint32_t size = 1;
+
+    static constexpr bool decode(const std::uint8_t *data) noexcept
+    {
+        return data[0] != 0;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: KEYS
+//------------------------------------------------------------------------------
+
+
+/**
+SMC key of a known data type. The first successful read fetches the key info,
+to check the key's type and size on the SMC are Type's. After that reads are a
+single call (see smc_read_typed()). Answers std::nullopt if the key is absent,
+or of another type or size, e.g. Key<"F0Ac", sp78> on an fpe2 key.
+*/
+template <std::uint32_t Code, typename Type>
+struct BasicKey {
+    using data_type  = Type;
+    using value_type = typename Type::value_type;
+
+    static constexpr std::uint32_t code = Code;
+
+    static std::optional<value_type> read() noexcept
+    {
+        smc_value_t value;
+        int state = checked.load(std::memory_order_relaxed);
+
+        if (state < 0) {
+            return std::nullopt;
+        }
+
+        if (state == 0) {
+            // Absent keys stay unchecked, they may be there on another
+            // transport
+            if (smc_read_u32(Code, &value) != kIOReturnSuccess) {
+                return std::nullopt;
+            }
+
+            bool match = value.dataType == Type::type &&
+                         value.dataSize == Type::size;
+
+            checked.store(match ? 1 : -1, std::memory_order_relaxed);
+
+            if (!match) {
+                return std::nullopt;
+            }
+
+            return Type::decode(value.data);
+        }
+
+        if (smc_read_typed(Code, Type::type, Type::size, &value) !=
+            kIOReturnSuccess) {
+            return std::nullopt;
+        }
+
+        return Type::decode(value.data);
+    }
+
+    static bool is_valid() noexcept
+    {
+        return smc_is_key_valid_u32(Code);
+    }
+
+private:
+    /**
+    Type check of the key, done once: 0 not yet, 1 matches, -1 doesn't
+    */
+    static inline std::atomic<int> checked{0};
+};
+
+
+#if defined(__cpp_nontype_template_args) && \
+    __cpp_nontype_template_args >= 201911L
+
+/**
+Key name as a template argument, see Key
+*/
+template <std::size_t N>
+struct fixed_string {
+    char chars[N];
+
+    constexpr fixed_string(const char (&name)[N]) noexcept : chars()
+    {
+        static_assert(N == 5, "SMC keys are 4 characters");
+
+        for (std::size_t i = 0; i < N; i++) {
+            chars[i] = name[i];
+        }
+    }
+};
+
+
+/**
+SMC key named by its string, e.g. Key<"TC0D", sp78>. C++20.
+*/
+template <fixed_string Name, typename Type>
+using Key = BasicKey<fourcc(Name.chars), Type>;
+
+#endif
+
+
+/**
+The SMC_KEY_* keys, with their data types
+*/
+namespace keys {
+
+using ambient_air_0          = BasicKey<SMC_KEY_AMBIENT_AIR_0,          sp78>;
+using ambient_air_1          = BasicKey<SMC_KEY_AMBIENT_AIR_1,          sp78>;
+using cpu_0_diode            = BasicKey<SMC_KEY_CPU_0_DIODE,            sp78>;
+using cpu_0_heatsink         = BasicKey<SMC_KEY_CPU_0_HEATSINK,         sp78>;
+using cpu_0_proximity        = BasicKey<SMC_KEY_CPU_0_PROXIMITY,        sp78>;
+using enclosure_base_0       = BasicKey<SMC_KEY_ENCLOSURE_BASE_0,       sp78>;
+using enclosure_base_1       = BasicKey<SMC_KEY_ENCLOSURE_BASE_1,       sp78>;
+using enclosure_base_2       = BasicKey<SMC_KEY_ENCLOSURE_BASE_2,       sp78>;
+using enclosure_base_3       = BasicKey<SMC_KEY_ENCLOSURE_BASE_3,       sp78>;
+using gpu_0_diode            = BasicKey<SMC_KEY_GPU_0_DIODE,            sp78>;
+using gpu_0_heatsink         = BasicKey<SMC_KEY_GPU_0_HEATSINK,         sp78>;
+using gpu_0_proximity        = BasicKey<SMC_KEY_GPU_0_PROXIMITY,        sp78>;
+using hard_drive_bay         = BasicKey<SMC_KEY_HARD_DRIVE_BAY,         sp78>;
+using memory_slot_0          = BasicKey<SMC_KEY_MEMORY_SLOT_0,          sp78>;
+using memory_slots_proximity = BasicKey<SMC_KEY_MEMORY_SLOTS_PROXIMITY, sp78>;
+using northbridge            = BasicKey<SMC_KEY_NORTHBRIDGE,            sp78>;
+using northbridge_diode      = BasicKey<SMC_KEY_NORTHBRIDGE_DIODE,      sp78>;
+using northbridge_proximity  = BasicKey<SMC_KEY_NORTHBRIDGE_PROXIMITY,  sp78>;
+using thunderbolt_0          = BasicKey<SMC_KEY_THUNDERBOLT_0,          sp78>;
+using thunderbolt_1          = BasicKey<SMC_KEY_THUNDERBOLT_1,          sp78>;
+using wireless_module        = BasicKey<SMC_KEY_WIRELESS_MODULE,        sp78>;
+
+using fan_0                  = BasicKey<SMC_KEY_FAN_0,                  fpe2>;
+using fan_0_min_rpm          = BasicKey<SMC_KEY_FAN_0_MIN_RPM,          fpe2>;
+using fan_0_max_rpm          = BasicKey<SMC_KEY_FAN_0_MAX_RPM,          fpe2>;
+using fan_0_safe_rpm         = BasicKey<SMC_KEY_FAN_0_SAFE_RPM,         fpe2>;
+using fan_0_target_rpm       = BasicKey<SMC_KEY_FAN_0_TARGET_RPM,       fpe2>;
+using fan_1                  = BasicKey<SMC_KEY_FAN_1,                  fpe2>;
+using fan_1_min_rpm          = BasicKey<SMC_KEY_FAN_1_MIN_RPM,          fpe2>;
+using fan_1_max_rpm          = BasicKey<SMC_KEY_FAN_1_MAX_RPM,          fpe2>;
+using fan_1_safe_rpm         = BasicKey<SMC_KEY_FAN_1_SAFE_RPM,         fpe2>;
+using fan_1_target_rpm       = BasicKey<SMC_KEY_FAN_1_TARGET_RPM,       fpe2>;
+using fan_2                  = BasicKey<SMC_KEY_FAN_2,                  fpe2>;
+using fan_2_min_rpm          = BasicKey<SMC_KEY_FAN_2_MIN_RPM,          fpe2>;
+using fan_2_max_rpm          = BasicKey<SMC_KEY_FAN_2_MAX_RPM,          fpe2>;
+using fan_2_safe_rpm         = BasicKey<SMC_KEY_FAN_2_SAFE_RPM,         fpe2>;
+using fan_2_target_rpm       = BasicKey<SMC_KEY_FAN_2_TARGET_RPM,       fpe2>;
+using num_fans               = BasicKey<SMC_KEY_NUM_FANS,               ui8>;
+using force_bits             = BasicKey<SMC_KEY_FORCE_BITS,             ui16>;
+
+using batt_pwr               = BasicKey<SMC_KEY_BATT_PWR,               flag>;
+using num_keys               = BasicKey<SMC_KEY_NUM_KEYS,               ui32>;
+using odd_full               = BasicKey<SMC_KEY_ODD_FULL,               flag>;
+
+} // namespace keys
+
+
+//------------------------------------------------------------------------------
+// MARK: CONNECTION
+//------------------------------------------------------------------------------
+
+
+/**
+The library's connection to the SMC, open for the lifetime of the object. It
+wraps open_smc()/close_smc(), which share one default connection, so only one
+should be alive at a time. Movable, not copyable.
+*/
+class Connection {
+public:
+    Connection() noexcept : result_(open_smc()) {}
+
+    ~Connection()
+    {
+        if (is_open()) {
+            close_smc();
+        }
+    }
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    Connection(Connection &&other) noexcept
+        : result_(std::exchange(other.result_, kIOReturnNotOpen)) {}
+
+    Connection &operator=(Connection &&other) noexcept
+    {
+        if (this != &other) {
+            if (is_open()) {
+                close_smc();
+            }
+
+            result_ = std::exchange(other.result_, kIOReturnNotOpen);
+        }
+
+        return *this;
+    }
+
+    bool is_open() const noexcept
+    {
+        return result_ == kIOReturnSuccess;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return is_open();
+    }
+
+    /**
+    Return code of open_smc()
+    */
+    kern_return_t result() const noexcept
+    {
+        return result_;
+    }
+
+private:
+    kern_return_t result_;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: BATCH READS
+//------------------------------------------------------------------------------
+
+
+/**
+Read many keys into a caller buffer, see smc_read_many()
+
+:returns: kIOReturnError if any key failed, see each value's result and kSMC
+*/
+inline kern_return_t read(const std::uint32_t *keys, std::size_t n,
+                          smc_value_t *out) noexcept
+{
+    return smc_read_many(keys, n, out);
+}
+
+
+/**
+Read many keys of one data type into a caller buffer, decoded. A single call
+to the SMC per key, see smc_read_typed(). Unlike BasicKey, the type is taken on
+trust: a key of another type but the same size decodes as garbage.
+
+:returns: Number of keys read, absent ones are std::nullopt in out
+*/
+template <typename Type>
+std::size_t read(const std::uint32_t *keys, std::size_t n,
+                 std::optional<typename Type::value_type> *out) noexcept
+{
+    std::size_t count = 0;
+
+    for (std::size_t i = 0; i < n; i++) {
+        smc_value_t value;
+
+        if (smc_read_typed(keys[i], Type::type, Type::size, &value) ==
+            kIOReturnSuccess) {
+            out[i] = Type::decode(value.data);
+            count++;
+        } else {
+            out[i] = std::nullopt;
+        }
+    }
+
+    return count;
+}
+
+
+#ifdef __cpp_lib_span
+
+/**
+read(), over spans. out must be at least as long as keys.
+*/
+inline kern_return_t read(std::span<const std::uint32_t> keys,
+                          std::span<smc_value_t> out) noexcept
+{
+    if (out.size() < keys.size()) {
+        return kIOReturnBadArgument;
+    }
+
+    return smc_read_many(keys.data(), keys.size(), out.data());
+}
+
+
+template <typename Type>
+std::size_t read(std::span<const std::uint32_t> keys,
+                 std::span<std::optional<typename Type::value_type>> out)
+                 noexcept
+{
+    return read<Type>(keys.data(),
+                      keys.size() < out.size() ? keys.size() : out.size(),
+                      out.data());
+}
+
+#endif
+
+
+} // namespace smc
+
+#endif
@@ -0,0 +1,473 @@
+/*
+ * Change-driven adaptive polling. Each key is read at a period that follows
+ * how fast its value moves, between a configured min and max, snapping back to
+ * the min period whenever a threshold is crossed.
+ *
+ * adaptive.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Weight of the newest sample in the moving average and variance of a key's rate
+of change
+*/
+#define RATE_ALPHA 0.25
+
+
+/**
+Number of standard deviations of the rate added to its mean, so noisy keys are
+polled faster than their average drift alone would suggest
+*/
+#define RATE_STDDEVS 2.0
+
+
+/**
+Max factor a key's period may grow by per read. Periods shrink immediately, but
+only grow gradually, so a key that goes quiet for a moment isn't dropped to the
+max period on a single read.
+*/
+#define GROWTH_FACTOR 2
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Polling state of a key. Everything but value, timestamp and valid is only
+touched by smc_poller_poll().
+
+- config    : Configuration, as given to smc_poller_create()
+- handle    : Prepared key, NULL if the key couldn't be prepared
+- period    : Current polling period, in nanoseconds. Only written by
+              smc_poller_poll(), atomically, as the getters read it unlocked.
+- next      : When the key is next due
+- last_read : When the key was last read, zero if never
+- last      : Decoded value of the last read, NAN if not known
+- rate_mean : Moving average of the absolute rate of change, per second
+- rate_var  : Moving variance of the rate of change
+- value     : Raw value of the last successful read, guarded by the lock
+- decoded   : Decoded value of the last successful read, guarded by the lock
+- timestamp : When value was read, guarded by the lock
+- valid     : Has the key been read successfully yet? Guarded by the lock.
+*/
+typedef struct {
+    smc_poll_key_t config;
+    smc_key_t     *handle;
+    uint64_t       period;
+    uint64_t       next;
+    uint64_t       last_read;
+    double         last;
+    double         rate_mean;
+    double         rate_var;
+    smc_value_t    value;
+    double         decoded;
+    uint64_t       timestamp;
+    bool           valid;
+} poll_entry_t;
+
+
+/**
+Adaptive poller
+
+- entries     : One per key
+- num_entries : Number of keys
+- lock        : Guards the latest value of every entry, and the counters
+- reads       : Number of reads made
+- forced      : Number of threshold crossings
+- thread      : Poller thread
+- running     : Is the poller thread running?
+- stop        : Set to ask the poller thread to stop
+*/
+struct smc_poller_s {
+    poll_entry_t   *entries;
+    size_t          num_entries;
+    pthread_mutex_t lock;
+    uint64_t        reads;
+    uint64_t        forced;
+    pthread_t       thread;
+    bool            running;
+    bool            stop;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+/**
+Did a value cross a threshold, in either direction? NAN thresholds are unset.
+*/
+static bool crossed(double threshold, double from, double to)
+{
+    if (isnan(threshold) || isnan(from) || isnan(to)) {
+        return false;
+    }
+
+    return (from < threshold) != (to < threshold);
+}
+
+
+/**
+Time it would take the value to reach the nearest threshold at the given rate,
+in nanoseconds. UINT64_MAX if never.
+*/
+static uint64_t time_to_threshold(const poll_entry_t *entry, double rate)
+{
+    double distance = INFINITY;
+    double low  = entry->config.threshold_low;
+    double high = entry->config.threshold_high;
+
+    if (rate <= 0 || isnan(entry->last)) {
+        return UINT64_MAX;
+    }
+
+    if (!isnan(low)) {
+        distance = fmin(distance, fabs(entry->last - low));
+    }
+
+    if (!isnan(high)) {
+        distance = fmin(distance, fabs(entry->last - high));
+    }
+
+    if (isinf(distance) || distance / rate * 1e9 >= (double)UINT64_MAX) {
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)(distance / rate * 1e9);
+}
+
+
+/**
+Work out a key's next period from a new reading.
+
+:returns: True if a threshold was crossed
+*/
+static bool adapt(poll_entry_t *entry, double value, bool changed,
+                                       uint64_t now)
+{
+    const smc_poll_key_t *config = &entry->config;
+    uint64_t target = config->max_period_ns;
+    bool forced = false;
+
+    if (!isnan(value) && !isnan(entry->last) && entry->last_read != 0 &&
+        now > entry->last_read) {
+        double seconds = (double)(now - entry->last_read) / 1e9;
+        double rate = fabs(value - entry->last) / seconds;
+        double delta = rate - entry->rate_mean;
+
+        entry->rate_mean += RATE_ALPHA * delta;
+        entry->rate_var = (1 - RATE_ALPHA) *
+                          (entry->rate_var + RATE_ALPHA * delta * delta);
+
+        forced = crossed(config->threshold_low,  entry->last, value) ||
+                 crossed(config->threshold_high, entry->last, value);
+    } else if (isnan(value) && changed) {
+        // Type not known, all we can tell is whether the raw bytes moved
+        target = config->min_period_ns;
+    }
+
+    entry->last = value;
+    entry->last_read = now;
+
+    // Pick the period over which the value is expected to move by the
+    // tolerance, and never sleep through a threshold
+    double rate = entry->rate_mean + RATE_STDDEVS * sqrt(entry->rate_var);
+
+    if (!isnan(value) && rate > 0) {
+        double period = config->tolerance / rate * 1e9;
+
+        if (period < (double)target) {
+            target = (uint64_t)period;
+        }
+    }
+
+    uint64_t eta = time_to_threshold(entry, rate);
+
+    if (eta < target) {
+        target = eta;
+    }
+
+    if (forced || target < config->min_period_ns) {
+        target = config->min_period_ns;
+    }
+
+    if (target > entry->period * GROWTH_FACTOR) {
+        target = entry->period * GROWTH_FACTOR;
+    }
+
+    __atomic_store_n(&entry->period, target, __ATOMIC_RELAXED);
+    entry->next = now + target;
+
+    return forced;
+}
+
+
+static void *poller_thread(void *arg)
+{
+    smc_poller_t *poller = arg;
+
+    while (!__atomic_load_n(&poller->stop, __ATOMIC_ACQUIRE)) {
+        smc_poller_poll(poller, smc_time_ns());
+
+        // Deadlines vary per key, so not smc_run_periodic(). Sleeps are
+        // capped, so smc_poller_stop() isn't held up by long periods.
+        smc_sleep_until(smc_poller_next_deadline(poller));
+    }
+
+    return NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+smc_poller_t *smc_poller_create(const smc_poll_key_t *keys, size_t num_keys)
+{
+    smc_poller_t *poller = calloc(1, sizeof(smc_poller_t));
+
+    if (poller == NULL) {
+        return NULL;
+    }
+
+    poller->entries = calloc(num_keys ? num_keys : 1, sizeof(poll_entry_t));
+
+    if (poller->entries == NULL) {
+        free(poller);
+        return NULL;
+    }
+
+    pthread_mutex_init(&poller->lock, NULL);
+    poller->num_entries = num_keys;
+
+    for (size_t i = 0; i < num_keys; i++) {
+        poll_entry_t *entry = &poller->entries[i];
+
+        entry->config = keys[i];
+
+        if (entry->config.min_period_ns == 0) {
+            entry->config.min_period_ns = 1;
+        }
+
+        if (entry->config.max_period_ns < entry->config.min_period_ns) {
+            entry->config.max_period_ns = entry->config.min_period_ns;
+        }
+
+        // Start at the min period, everything is due on the first poll
+        entry->handle  = smc_prepare_u32(keys[i].key);
+        entry->period  = entry->config.min_period_ns;
+        entry->last    = NAN;
+        entry->decoded = NAN;
+    }
+
+    return poller;
+}
+
+
+size_t smc_poller_poll(smc_poller_t *poller, uint64_t now_ns)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < poller->num_entries; i++) {
+        poll_entry_t *entry = &poller->entries[i];
+        smc_value_t   value;
+        double        decoded = NAN;
+        bool          changed;
+
+        if (entry->next > now_ns) {
+            continue;
+        }
+
+        if (entry->handle == NULL) {
+            // Not on this machine, don't keep asking
+            __atomic_store_n(&entry->period, entry->config.max_period_ns,
+                             __ATOMIC_RELAXED);
+            entry->next = now_ns + entry->period;
+            continue;
+        }
+
+        // Read outside the lock, so getters never wait on the driver
+        if (smc_read_prepared(entry->handle, &value) != kIOReturnSuccess) {
+            entry->next = now_ns + entry->period;
+            count++;
+            continue;
+        }
+
+        smc_decode_value(&value, &decoded);
+        changed = memcmp(value.data, entry->value.data, value.dataSize) != 0;
+
+        bool forced = adapt(entry, decoded, changed, now_ns);
+
+        pthread_mutex_lock(&poller->lock);
+        entry->value     = value;
+        entry->decoded   = decoded;
+        entry->timestamp = now_ns;
+        entry->valid     = true;
+        poller->reads++;
+        poller->forced  += forced;
+        pthread_mutex_unlock(&poller->lock);
+
+        count++;
+    }
+
+    return count;
+}
+
+
+uint64_t smc_poller_next_deadline(const smc_poller_t *poller)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; i < poller->num_entries; i++) {
+        if (poller->entries[i].next < next) {
+            next = poller->entries[i].next;
+        }
+    }
+
+    return next;
+}
+
+
+bool smc_poller_get(smc_poller_t *poller, uint32_t key,
+                    smc_table_entry_t *entry)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&poller->lock);
+
+    for (size_t i = 0; i < poller->num_entries; i++) {
+        const poll_entry_t *poll_entry = &poller->entries[i];
+
+        if (poll_entry->config.key != key || !poll_entry->valid) {
+            continue;
+        }
+
+        entry->value     = poll_entry->value;
+        entry->decoded   = poll_entry->decoded;
+        entry->timestamp = poll_entry->timestamp;
+        found = true;
+        break;
+    }
+
+    pthread_mutex_unlock(&poller->lock);
+
+    return found;
+}
+
+
+void smc_poller_get_stats(smc_poller_t *poller, smc_poller_stats_t *stats)
+{
+    memset(stats, 0, sizeof(smc_poller_stats_t));
+
+    pthread_mutex_lock(&poller->lock);
+    stats->reads  = poller->reads;
+    stats->forced = poller->forced;
+    pthread_mutex_unlock(&poller->lock);
+
+    // A prepared read is a single call to the SMC
+    for (size_t i = 0; i < poller->num_entries; i++) {
+        const poll_entry_t *entry = &poller->entries[i];
+
+        if (entry->handle == NULL) {
+            continue;
+        }
+
+        uint64_t period = __atomic_load_n(&entry->period, __ATOMIC_RELAXED);
+
+        stats->calls_per_sec       += 1e9 / (double)period;
+        stats->fixed_calls_per_sec += 1e9 / (double)entry->config.min_period_ns;
+    }
+}
+
+
+uint64_t smc_poller_get_period(const smc_poller_t *poller, uint32_t key)
+{
+    for (size_t i = 0; i < poller->num_entries; i++) {
+        if (poller->entries[i].config.key == key) {
+            return __atomic_load_n(&poller->entries[i].period,
+                                   __ATOMIC_RELAXED);
+        }
+    }
+
+    return 0;
+}
+
+
+kern_return_t smc_poller_start(smc_poller_t *poller)
+{
+    if (poller->running) {
+        return kIOReturnSuccess;
+    }
+
+    poller->stop = false;
+
+    if (pthread_create(&poller->thread, NULL, poller_thread, poller) != 0) {
+        return kIOReturnNoResources;
+    }
+
+    poller->running = true;
+
+    return kIOReturnSuccess;
+}
+
+
+void smc_poller_stop(smc_poller_t *poller)
+{
+    if (!poller->running) {
+        return;
+    }
+
+    __atomic_store_n(&poller->stop, true, __ATOMIC_RELEASE);
+    pthread_join(poller->thread, NULL);
+    poller->running = false;
+}
+
+
+void smc_poller_destroy(smc_poller_t *poller)
+{
+    if (poller == NULL) {
+        return;
+    }
+
+    smc_poller_stop(poller);
+
+    for (size_t i = 0; i < poller->num_entries; i++) {
+        smc_release_prepared(poller->entries[i].handle);
+    }
+
+    pthread_mutex_destroy(&poller->lock);
+    free(poller->entries);
+    free(poller);
+}
@@ -0,0 +1,556 @@
+/*
+ * Asynchronous reads. Requests are queued to a single I/O worker thread, which
+ * reads every key queued at the time once, however many requests asked for it.
+ * Completions are signalled through a file descriptor that can be polled from
+ * an event loop, and their callbacks run on whichever thread dispatches them.
+ *
+ * async.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../include/smc.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Read request. Allocated in one block along with its keys and values.
+
+- next     : Next request in the queue or completion list
+- callback : Called with the values on dispatch
+- userdata : Passed to the callback
+- n        : Number of keys
+- values   : Values read, one per key
+- keys     : Keys to read
+*/
+typedef struct async_request_s {
+    struct async_request_s *next;
+    smc_read_callback_t     callback;
+    void                   *userdata;
+    size_t                  n;
+    smc_value_t            *values;
+    uint32_t               *keys;
+} async_request_t;
+
+
+/**
+FIFO list of requests
+*/
+typedef struct {
+    async_request_t *head;
+    async_request_t *tail;
+} async_list_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: GLOBAL VARS
+//------------------------------------------------------------------------------
+
+
+/**
+Guards everything below but the worker's scratch buffers
+*/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queued_cond = PTHREAD_COND_INITIALIZER;
+
+
+/**
+Requests waiting for the worker, and completed ones waiting to be dispatched
+*/
+static async_list_t queue;
+static async_list_t completed;
+
+
+/**
+Requests submitted and not yet dispatched or dropped, bounded by
+SMC_ASYNC_QUEUE_SIZE. Only ever decremented by the requests taken off a list,
+never reset, so a dispatch racing smc_async_shutdown() stays balanced.
+*/
+static size_t outstanding;
+
+
+/**
+Worker thread, its context and its state
+*/
+static pthread_t  worker;
+static smc_ctx_t *worker_ctx;
+static bool       running;
+static bool       stop;
+
+
+/**
+Completion notifier. An eventfd on Linux, where both ends are the same
+descriptor, a pipe elsewhere.
+*/
+static int notify_read  = -1;
+static int notify_write = -1;
+
+
+static smc_async_stats_t stats;
+
+
+/**
+Worker scratch: every key of a drained batch, then the unique ones, and their
+values. Only touched by the worker.
+*/
+static uint32_t    *batch_keys;
+static smc_value_t *batch_values;
+static size_t       batch_capacity;
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static void list_push(async_list_t *list, async_request_t *request)
+{
+    request->next = NULL;
+
+    if (list->tail != NULL) {
+        list->tail->next = request;
+    } else {
+        list->head = request;
+    }
+
+    list->tail = request;
+}
+
+
+/**
+Take every request off a list
+
+:returns: The first request, the rest are linked from it
+*/
+static async_request_t *list_take(async_list_t *list)
+{
+    async_request_t *head = list->head;
+
+    list->head = NULL;
+    list->tail = NULL;
+
+    return head;
+}
+
+
+static void free_list(async_request_t *request)
+{
+    while (request != NULL) {
+        async_request_t *next = request->next;
+
+        free(request);
+        request = next;
+    }
+}
+
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+
+static kern_return_t notify_open(void)
+{
+#ifdef __linux__
+    notify_read = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    notify_write = notify_read;
+
+    return notify_read < 0 ? kIOReturnNoResources : kIOReturnSuccess;
+#else
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        return kIOReturnNoResources;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    notify_read = fds[0];
+    notify_write = fds[1];
+
+    return kIOReturnSuccess;
+#endif
+}
+
+
+static void notify_close(void)
+{
+    if (notify_write != notify_read && notify_write >= 0) {
+        close(notify_write);
+    }
+
+    if (notify_read >= 0) {
+        close(notify_read);
+    }
+
+    notify_read = -1;
+    notify_write = -1;
+}
+
+
+/**
+Make the notifier readable. A full pipe is already readable, so a failed write
+is fine.
+*/
+static void notify_signal(void)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t written = write(notify_write, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t written = write(notify_write, &one, sizeof(one));
+#endif
+
+    (void)written;
+}
+
+
+/**
+Drain the notifier, so it only polls readable again once there are new
+completions
+*/
+static void notify_clear(void)
+{
+    uint64_t buffer[8];
+
+    while (read(notify_read, buffer, sizeof(buffer)) > 0) {
+        ;
+    }
+}
+
+
+/**
+Read every key of a batch of requests, each unique key once.
+
+:returns: False if the scratch buffers couldn't grow, the requests are failed
+*/
+static bool read_batch(async_request_t *requests)
+{
+    size_t total = 0;
+    size_t unique = 0;
+
+    for (async_request_t *r = requests; r != NULL; r = r->next) {
+        total += r->n;
+    }
+
+    if (total > batch_capacity) {
+        uint32_t    *keys   = realloc(batch_keys, total * sizeof(uint32_t));
+        smc_value_t *values = keys ? realloc(batch_values,
+                                             total * sizeof(smc_value_t))
+                                   : NULL;
+
+        if (keys != NULL) {
+            batch_keys = keys;
+        }
+
+        if (values == NULL) {
+            return false;
+        }
+
+        batch_values = values;
+        batch_capacity = total;
+    }
+
+    for (async_request_t *r = requests; r != NULL; r = r->next) {
+        memcpy(&batch_keys[unique], r->keys, r->n * sizeof(uint32_t));
+        unique += r->n;
+    }
+
+    qsort(batch_keys, total, sizeof(uint32_t), compare_keys);
+    unique = 0;
+
+    for (size_t i = 0; i < total; i++) {
+        if (unique == 0 || batch_keys[unique - 1] != batch_keys[i]) {
+            batch_keys[unique++] = batch_keys[i];
+        }
+    }
+
+    smc_ctx_read_many(worker_ctx, batch_keys, unique, batch_values);
+
+    for (async_request_t *r = requests; r != NULL; r = r->next) {
+        for (size_t i = 0; i < r->n; i++) {
+            uint32_t *key = bsearch(&r->keys[i], batch_keys, unique,
+                                    sizeof(uint32_t), compare_keys);
+
+            r->values[i] = batch_values[key - batch_keys];
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    stats.batches++;
+    stats.keys_requested += total;
+    stats.keys_read += unique;
+    pthread_mutex_unlock(&lock);
+
+    return true;
+}
+
+
+static void *worker_thread(void *arg)
+{
+    pthread_mutex_lock(&lock);
+
+    // Queued requests are still served after a stop
+    while (true) {
+        while (queue.head == NULL && !stop) {
+            pthread_cond_wait(&queued_cond, &lock);
+        }
+
+        if (queue.head == NULL) {
+            break;
+        }
+
+        // Everything queued so far goes in one batch, which is where
+        // requests for the same key are coalesced
+        async_request_t *requests = list_take(&queue);
+
+        pthread_mutex_unlock(&lock);
+
+        if (!read_batch(requests)) {
+            for (async_request_t *r = requests; r != NULL; r = r->next) {
+                for (size_t i = 0; i < r->n; i++) {
+                    memset(&r->values[i], 0, sizeof(smc_value_t));
+                    r->values[i].key = r->keys[i];
+                    r->values[i].result = kIOReturnNoMemory;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&lock);
+
+        while (requests != NULL) {
+            async_request_t *next = requests->next;
+
+            list_push(&completed, requests);
+            requests = next;
+        }
+
+        notify_signal();
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+
+/**
+Start the worker if not running. lock must be held.
+*/
+static kern_return_t start_worker(void)
+{
+    if (running) {
+        return kIOReturnSuccess;
+    }
+
+    if (smc_ctx_open(&worker_ctx) != kIOReturnSuccess) {
+        return kIOReturnNotOpen;
+    }
+
+    if (notify_open() != kIOReturnSuccess) {
+        smc_ctx_close(worker_ctx);
+        return kIOReturnNoResources;
+    }
+
+    stop = false;
+
+    if (pthread_create(&worker, NULL, worker_thread, NULL) != 0) {
+        notify_close();
+        smc_ctx_close(worker_ctx);
+        return kIOReturnNoResources;
+    }
+
+    running = true;
+
+    return kIOReturnSuccess;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_read_async(const uint32_t *keys, size_t n,
+                             smc_read_callback_t callback, void *userdata)
+{
+    kern_return_t result;
+
+    if (n == 0 || callback == NULL) {
+        return kIOReturnBadArgument;
+    }
+
+    async_request_t *request = malloc(sizeof(async_request_t) +
+                                      n * sizeof(smc_value_t) +
+                                      n * sizeof(uint32_t));
+
+    if (request == NULL) {
+        return kIOReturnNoMemory;
+    }
+
+    request->callback = callback;
+    request->userdata = userdata;
+    request->n = n;
+    request->values = (smc_value_t *)(request + 1);
+    request->keys = (uint32_t *)(request->values + n);
+    memcpy(request->keys, keys, n * sizeof(uint32_t));
+
+    pthread_mutex_lock(&lock);
+
+    result = start_worker();
+
+    // Backpressure, the caller has to dispatch before submitting more
+    if (result == kIOReturnSuccess && outstanding >= SMC_ASYNC_QUEUE_SIZE) {
+        result = kIOReturnNoResources;
+        stats.rejected++;
+    }
+
+    if (result == kIOReturnSuccess) {
+        list_push(&queue, request);
+        outstanding++;
+        stats.submitted++;
+        pthread_cond_signal(&queued_cond);
+    } else {
+        free(request);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+
+int smc_async_fd(void)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&lock);
+
+    if (start_worker() == kIOReturnSuccess) {
+        fd = notify_read;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return fd;
+}
+
+
+size_t smc_async_dispatch(void)
+{
+    size_t count = 0;
+
+    pthread_mutex_lock(&lock);
+
+    // Clear before taking the list, a completion landing in between signals
+    // again
+    if (notify_read >= 0) {
+        notify_clear();
+    }
+
+    async_request_t *requests = list_take(&completed);
+
+    pthread_mutex_unlock(&lock);
+
+    // Callbacks run unlocked, so they may submit new requests
+    for (async_request_t *r = requests; r != NULL; r = r->next) {
+        r->callback(r->values, r->n, r->userdata);
+        count++;
+    }
+
+    free_list(requests);
+
+    pthread_mutex_lock(&lock);
+    outstanding -= count;
+    stats.completed += count;
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+
+void smc_async_get_stats(smc_async_stats_t *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    out->outstanding = outstanding;
+    pthread_mutex_unlock(&lock);
+}
+
+
+void smc_async_shutdown(void)
+{
+    pthread_mutex_lock(&lock);
+
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    stop = true;
+    pthread_cond_signal(&queued_cond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(worker, NULL);
+
+    pthread_mutex_lock(&lock);
+
+    async_request_t *requests = list_take(&completed);
+
+    // Dropped undispatched, a dispatch that took its list already accounts
+    // for its own
+    for (async_request_t *r = requests; r != NULL; r = r->next) {
+        outstanding--;
+    }
+
+    running = false;
+    notify_close();
+    smc_ctx_close(worker_ctx);
+    worker_ctx = NULL;
+
+    pthread_mutex_unlock(&lock);
+
+    free_list(requests);
+    free(batch_keys);
+    free(batch_values);
+    batch_keys = NULL;
+    batch_values = NULL;
+    batch_capacity = 0;
+}
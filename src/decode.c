@@ -0,0 +1,358 @@
+/*
+ * Decoding of SMC data types to human readable values, one at a time or in
+ * bulk.
+ *
+ * decode.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "../include/smc.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+AVX2 is used when the CPU has it, checked at runtime. Needs a compiler that
+supports per-function target attributes.
+*/
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#define DECODE_AVX2
+#include <immintrin.h>
+#endif
+
+
+//------------------------------------------------------------------------------
+// MARK: ENUMS
+//------------------------------------------------------------------------------
+
+
+/**
+How the bytes of a data type are interpreted
+
+- DECODE_UNSIGNED : Big endian unsigned integer, with frac_bits fractional
+                    bits (ui8/16/32, fpXY)
+- DECODE_SIGNED   : Big endian two's complement integer, with frac_bits
+                    fractional bits (si8/16/32, spXY)
+- DECODE_FLOAT    : IEEE 754 single precision, little endian (flt)
+- DECODE_FLAG     : Boolean, 0 or 1 (flag)
+*/
+typedef enum {
+    DECODE_UNSIGNED,
+    DECODE_SIGNED,
+    DECODE_FLOAT,
+    DECODE_FLAG
+} decode_kind_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Entry in the type dispatch table
+
+- dataType  : SMC data type, 4 byte multi-character constant as a uint32_t
+- dataSize  : Number of bytes of a value of this type
+- kind      : How the bytes are interpreted
+- frac_bits : Number of fractional bits, for fixed point types
+*/
+typedef struct {
+    uint32_t      dataType;
+    uint8_t       dataSize;
+    decode_kind_t kind;
+    uint8_t       frac_bits;
+} decoder_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: GLOBAL VARS
+//------------------------------------------------------------------------------
+
+
+/**
+Type dispatch table, sorted by dataType for binary search.
+
+For fixed point types the name gives the split - fpXY is unsigned with X
+integer and Y fractional bits, spXY is signed with X integer and Y fractional
+bits (plus the sign bit). Digits are in hex.
+
+Sources:
+
+- http://stackoverflow.com/questions/22160746/fpe2-and-sp78-data-types
+- https://github.com/hholtmann/smcFanControl
+*/
+static const decoder_t decoders[] = {
+    { SMC_FOURCC('f', 'l', 'a', 'g'), 1, DECODE_FLAG,      0 },
+    { SMC_FOURCC('f', 'l', 't', ' '), 4, DECODE_FLOAT,     0 },
+    { SMC_FOURCC('f', 'p', '1', 'f'), 2, DECODE_UNSIGNED, 15 },
+    { SMC_FOURCC('f', 'p', '2', 'e'), 2, DECODE_UNSIGNED, 14 },
+    { SMC_FOURCC('f', 'p', '3', 'd'), 2, DECODE_UNSIGNED, 13 },
+    { SMC_FOURCC('f', 'p', '4', 'c'), 2, DECODE_UNSIGNED, 12 },
+    { SMC_FOURCC('f', 'p', '5', 'b'), 2, DECODE_UNSIGNED, 11 },
+    { SMC_FOURCC('f', 'p', '6', 'a'), 2, DECODE_UNSIGNED, 10 },
+    { SMC_FOURCC('f', 'p', '7', '9'), 2, DECODE_UNSIGNED,  9 },
+    { SMC_FOURCC('f', 'p', '8', '8'), 2, DECODE_UNSIGNED,  8 },
+    { SMC_FOURCC('f', 'p', '9', '7'), 2, DECODE_UNSIGNED,  7 },
+    { SMC_FOURCC('f', 'p', 'a', '6'), 2, DECODE_UNSIGNED,  6 },
+    { SMC_FOURCC('f', 'p', 'b', '5'), 2, DECODE_UNSIGNED,  5 },
+    { SMC_FOURCC('f', 'p', 'c', '4'), 2, DECODE_UNSIGNED,  4 },
+    { SMC_FOURCC('f', 'p', 'd', '3'), 2, DECODE_UNSIGNED,  3 },
+    { SMC_FOURCC('f', 'p', 'e', '2'), 2, DECODE_UNSIGNED,  2 },
+    { SMC_FOURCC('f', 'p', 'f', '1'), 2, DECODE_UNSIGNED,  1 },
+    { SMC_FOURCC('s', 'i', '1', '6'), 2, DECODE_SIGNED,    0 },
+    { SMC_FOURCC('s', 'i', '3', '2'), 4, DECODE_SIGNED,    0 },
+    { SMC_FOURCC('s', 'i', '8', ' '), 1, DECODE_SIGNED,    0 },
+    { SMC_FOURCC('s', 'p', '1', 'e'), 2, DECODE_SIGNED,   14 },
+    { SMC_FOURCC('s', 'p', '2', 'd'), 2, DECODE_SIGNED,   13 },
+    { SMC_FOURCC('s', 'p', '3', 'c'), 2, DECODE_SIGNED,   12 },
+    { SMC_FOURCC('s', 'p', '4', 'b'), 2, DECODE_SIGNED,   11 },
+    { SMC_FOURCC('s', 'p', '5', 'a'), 2, DECODE_SIGNED,   10 },
+    { SMC_FOURCC('s', 'p', '6', '9'), 2, DECODE_SIGNED,    9 },
+    { SMC_FOURCC('s', 'p', '7', '8'), 2, DECODE_SIGNED,    8 },
+    { SMC_FOURCC('s', 'p', '8', '7'), 2, DECODE_SIGNED,    7 },
+    { SMC_FOURCC('s', 'p', '9', '6'), 2, DECODE_SIGNED,    6 },
+    { SMC_FOURCC('s', 'p', 'a', '5'), 2, DECODE_SIGNED,    5 },
+    { SMC_FOURCC('s', 'p', 'b', '4'), 2, DECODE_SIGNED,    4 },
+    { SMC_FOURCC('s', 'p', 'c', '3'), 2, DECODE_SIGNED,    3 },
+    { SMC_FOURCC('s', 'p', 'd', '2'), 2, DECODE_SIGNED,    2 },
+    { SMC_FOURCC('s', 'p', 'e', '1'), 2, DECODE_SIGNED,    1 },
+    { SMC_FOURCC('s', 'p', 'f', '0'), 2, DECODE_SIGNED,    0 },
+    { SMC_FOURCC('u', 'i', '1', '6'), 2, DECODE_UNSIGNED,  0 },
+    { SMC_FOURCC('u', 'i', '3', '2'), 4, DECODE_UNSIGNED,  0 },
+    { SMC_FOURCC('u', 'i', '8', ' '), 1, DECODE_UNSIGNED,  0 }
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static int compare_decoder(const void *a, const void *b)
+{
+    uint32_t type_a = ((const decoder_t *)a)->dataType;
+    uint32_t type_b = ((const decoder_t *)b)->dataType;
+
+    return (type_a > type_b) - (type_a < type_b);
+}
+
+
+/**
+Look up the decoder for a data type
+
+:returns: Decoder, NULL if the type is not known
+*/
+static const decoder_t *find_decoder(uint32_t dataType)
+{
+    decoder_t target;
+
+    target.dataType = dataType;
+
+    return bsearch(&target, decoders, sizeof(decoders) / sizeof(decoders[0]),
+                   sizeof(decoder_t), compare_decoder);
+}
+
+
+/**
+Decode a single value. data must hold decoder->dataSize bytes.
+*/
+static double decode_one(const decoder_t *decoder, const uint8_t *data)
+{
+    uint32_t raw = 0;
+    float    flt;
+
+    switch (decoder->kind) {
+        case DECODE_FLAG:
+            return data[0] ? 1.0 : 0.0;
+        case DECODE_FLOAT:
+            // Unlike the other types, flt is in host (little endian) order
+            raw = (uint32_t)data[3] << 24 | (uint32_t)data[2] << 16 |
+                  (uint32_t)data[1] << 8  | (uint32_t)data[0];
+            memcpy(&flt, &raw, sizeof(flt));
+            return flt;
+        case DECODE_UNSIGNED:
+        case DECODE_SIGNED:
+            break;
+    }
+
+    for (int i = 0; i < decoder->dataSize; i++) {
+        raw = raw << 8 | data[i];
+    }
+
+    if (decoder->kind == DECODE_SIGNED) {
+        // Sign extend from dataSize bytes
+        int shift = 32 - decoder->dataSize * 8;
+        int32_t val = (int32_t)(raw << shift) >> shift;
+
+        return (double)val / (1 << decoder->frac_bits);
+    }
+
+    return (double)raw / (1 << decoder->frac_bits);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: BULK DECODING
+//------------------------------------------------------------------------------
+
+
+/**
+Bulk decode 16-bit fixed point and integer values, SSE2. Decodes as many
+whole groups of 8 as there are, returns how many were done.
+*/
+#if defined(__SSE2__)
+static size_t decode_16_sse2(const uint8_t *raw, size_t n, bool is_signed,
+                                                           double scale,
+                                                           double *out)
+{
+    size_t  i;
+    __m128d vscale = _mm_set1_pd(scale);
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(raw + i * 2));
+        __m128i lo, hi;
+
+        // Big endian to host order
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+        // Widen to 32-bit
+        if (is_signed) {
+            lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        } else {
+            lo = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+            hi = _mm_unpackhi_epi16(v, _mm_setzero_si128());
+        }
+
+        _mm_storeu_pd(out + i,     _mm_mul_pd(_mm_cvtepi32_pd(lo), vscale));
+        _mm_storeu_pd(out + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(
+                                   _mm_srli_si128(lo, 8)), vscale));
+        _mm_storeu_pd(out + i + 4, _mm_mul_pd(_mm_cvtepi32_pd(hi), vscale));
+        _mm_storeu_pd(out + i + 6, _mm_mul_pd(_mm_cvtepi32_pd(
+                                   _mm_srli_si128(hi, 8)), vscale));
+    }
+
+    return i;
+}
+#endif
+
+
+/**
+Bulk decode 16-bit fixed point and integer values, AVX2. Same as
+decode_16_sse2(), in groups of 16.
+*/
+#ifdef DECODE_AVX2
+__attribute__((target("avx2")))
+static size_t decode_16_avx2(const uint8_t *raw, size_t n, bool is_signed,
+                                                           double scale,
+                                                           double *out)
+{
+    size_t  i;
+    __m256d vscale = _mm256_set1_pd(scale);
+    __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10,
+                                    13, 12, 15, 14, 1, 0, 3, 2, 5, 4, 7, 6,
+                                    9, 8, 11, 10, 13, 12, 15, 14);
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(raw + i * 2));
+
+        // Big endian to host order
+        v = _mm256_shuffle_epi8(v, swap);
+
+        for (int half = 0; half < 2; half++) {
+            __m128i h = half ? _mm256_extracti128_si256(v, 1) :
+                               _mm256_castsi256_si128(v);
+            __m256i w = is_signed ? _mm256_cvtepi16_epi32(h) :
+                                    _mm256_cvtepu16_epi32(h);
+            double *dst = out + i + half * 8;
+
+            _mm256_storeu_pd(dst,     _mm256_mul_pd(_mm256_cvtepi32_pd(
+                                      _mm256_castsi256_si128(w)), vscale));
+            _mm256_storeu_pd(dst + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(
+                                      _mm256_extracti128_si256(w, 1)),
+                                      vscale));
+        }
+    }
+
+    return i;
+}
+#endif
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+bool smc_decode(uint32_t dataType, const uint8_t *data, uint32_t dataSize,
+                                                         double *out)
+{
+    const decoder_t *decoder = find_decoder(dataType);
+
+    if (decoder == NULL || decoder->dataSize != dataSize) {
+        return false;
+    }
+
+    *out = decode_one(decoder, data);
+
+    return true;
+}
+
+
+bool smc_decode_value(const smc_value_t *value, double *out)
+{
+    return smc_decode(value->dataType, value->data, value->dataSize, out);
+}
+
+
+size_t smc_decode_batch(uint32_t dataType, const uint8_t *raw, size_t n,
+                                                               double *out)
+{
+    size_t i = 0;
+    const decoder_t *decoder = find_decoder(dataType);
+
+    if (decoder == NULL) {
+        return 0;
+    }
+
+    if (decoder->dataSize == 2 && decoder->kind != DECODE_FLAG) {
+        bool   is_signed = decoder->kind == DECODE_SIGNED;
+        double scale = 1.0 / (1 << decoder->frac_bits);
+
+#ifdef DECODE_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            i = decode_16_avx2(raw, n, is_signed, scale, out);
+        }
+#endif
+#if defined(__SSE2__)
+        i += decode_16_sse2(raw + i * 2, n - i, is_signed, scale, out + i);
+#endif
+    }
+
+    // Scalar for the rest, and for types without a vector path
+    for (; i < n; i++) {
+        out[i] = decode_one(decoder, raw + i * decoder->dataSize);
+    }
+
+    return n;
+}
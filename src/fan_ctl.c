@@ -0,0 +1,586 @@
+/*
+ * Closed-loop fan control. Each fan follows the hottest of its temperature
+ * sensors, through a piecewise linear curve or a PID loop, clamped to the
+ * fan's own limits. Writes only go out when the output moves by more than a
+ * deadband.
+ *
+ * fan_ctl.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Control state of a fan. Only touched by smc_fan_ctl_step(), but for written
+and tmp, which are guarded by the lock.
+
+- config     : Configuration, as given to smc_fan_ctl_create()
+- out_key    : Key the output is written to, F%dMn or F%dTg
+- min_rpm    : F%dMn as read at creation, restored on destroy
+- max_rpm    : F%dMx
+- safe_rpm   : F%dSf, or max_rpm if the fan has none. Used when none of the
+               fan's sensors can be read.
+- sensors    : Index of each of the fan's sensors in the controller's keys
+- integral   : PID integral term, in degrees second
+- last_tmp   : Temperature at the previous step, NAN if not known
+- last_step  : Time of the previous step, zero if none
+- pending    : Speed queued for writing in the current step, NAN if none
+- written    : Speed last written, NAN if none
+- tmp        : Hottest sensor at the last step, NAN if none could be read
+*/
+typedef struct {
+    smc_fan_ctl_config_t config;
+    uint32_t             out_key;
+    double               min_rpm;
+    double               max_rpm;
+    double               safe_rpm;
+    size_t               sensors[SMC_FAN_CTL_MAX_SENSORS];
+    double               integral;
+    double               last_tmp;
+    uint64_t             last_step;
+    double               pending;
+    double               written;
+    double               tmp;
+} fan_entry_t;
+
+
+/**
+Fan controller
+
+- fans        : One per controlled fan
+- num_fans    : Number of fans
+- ctx         : Connection the controller reads and writes through
+- writes      : Write batch on ctx, so a speed is written in a single call
+- results     : Outcome of each write of a step, one per fan
+- period      : Control period of the thread, in nanoseconds
+- keys        : Every sensor of every fan, read in one batch
+- num_keys    : Number of keys
+- values      : Values of the last read of keys
+- force_bits  : FS! as read at creation, restored on destroy
+- forced      : Was FS! changed?
+- lock        : Guards the fans' written and tmp, and the counters
+- stats       : Counters
+- thread      : Control thread
+- running     : Is the control thread running?
+- stop        : Set to ask the control thread to stop
+*/
+struct smc_fan_ctl_s {
+    fan_entry_t        *fans;
+    size_t              num_fans;
+    smc_ctx_t          *ctx;
+    smc_write_batch_t  *writes;
+    smc_write_result_t *results;
+    uint64_t            period;
+    uint32_t           *keys;
+    size_t              num_keys;
+    smc_value_t        *values;
+    smc_value_t         force_bits;
+    bool                forced;
+    pthread_mutex_t     lock;
+    smc_fan_ctl_stats_t stats;
+    pthread_t           thread;
+    bool                running;
+    bool                stop;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static uint32_t fan_key(unsigned int fan, char a, char b)
+{
+    return SMC_FOURCC('F', '0' + fan, a, b);
+}
+
+
+/**
+Read a fan speed key. fpe2, same as get_fan_rpm().
+
+:returns: Speed in RPM, NAN if the key can't be read
+*/
+static double read_rpm(smc_ctx_t *ctx, uint32_t key)
+{
+    smc_value_t value;
+    double rpm;
+
+    if (smc_ctx_read(ctx, key, &value) != kIOReturnSuccess ||
+        value.dataType != SMC_TYPE_FPE2 ||
+        !smc_decode_value(&value, &rpm)) {
+        return NAN;
+    }
+
+    return rpm;
+}
+
+
+/**
+Encode a fan speed, fpe2
+*/
+static void rpm_value(double rpm, smc_value_t *value)
+{
+    uint16_t raw = (uint16_t)(lround(rpm) << 2);
+
+    memset(value, 0, sizeof(smc_value_t));
+    value->dataType = SMC_TYPE_FPE2;
+    value->dataSize = 2;
+    value->data[0] = raw >> 8;
+    value->data[1] = raw & 0xff;
+}
+
+
+/**
+Speed for a temperature on a piecewise linear curve, flat beyond its ends
+*/
+static double curve_rpm(const smc_fan_ctl_config_t *config, double tmp)
+{
+    size_t n = config->num_points;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (tmp <= config->curve_tmp[0]) {
+        return config->curve_rpm[0];
+    }
+
+    for (size_t i = 1; i < n; i++) {
+        if (tmp < config->curve_tmp[i]) {
+            double t0 = config->curve_tmp[i - 1];
+            double t1 = config->curve_tmp[i];
+            double r0 = config->curve_rpm[i - 1];
+            double r1 = config->curve_rpm[i];
+
+            return r0 + (r1 - r0) * (tmp - t0) / (t1 - t0);
+        }
+    }
+
+    return config->curve_rpm[n - 1];
+}
+
+
+/**
+Speed from the PID loop. The output is relative to the fan's min speed, and
+the derivative is taken on the temperature rather than the error, so a change
+of setpoint doesn't kick the fan. The integral only runs while the output is
+within the fan's range, or heading back into it, so it can't wind up while the
+fan is pinned at a limit (e.g. at min speed while idle).
+*/
+static double pid_rpm(fan_entry_t *fan, double tmp, uint64_t now)
+{
+    const smc_fan_ctl_config_t *config = &fan->config;
+    double error = tmp - config->setpoint;
+    double integral = fan->integral;
+    double derivative = 0;
+
+    if (fan->last_step != 0 && now > fan->last_step && !isnan(fan->last_tmp)) {
+        double seconds = (double)(now - fan->last_step) / 1e9;
+
+        integral += error * seconds;
+        derivative = (tmp - fan->last_tmp) / seconds;
+    }
+
+    double rpm = fan->min_rpm + config->kp * error + config->ki * integral
+                              + config->kd * derivative;
+
+    if (!((rpm > fan->max_rpm && error > 0) ||
+          (rpm < fan->min_rpm && error < 0))) {
+        fan->integral = integral;
+    }
+
+    return rpm;
+}
+
+
+static void fan_ctl_run(void *context, uint64_t now_ns)
+{
+    smc_fan_ctl_step(context, now_ns);
+}
+
+
+static void *fan_ctl_thread(void *arg)
+{
+    smc_fan_ctl_t *ctl = arg;
+
+    smc_run_periodic(ctl->period, &ctl->stop, fan_ctl_run, ctl);
+
+    return NULL;
+}
+
+
+/**
+Find a key in the controller's key list, adding it if not there yet. Sized by
+smc_fan_ctl_create() for every sensor of every fan.
+*/
+static size_t add_key(smc_fan_ctl_t *ctl, uint32_t key)
+{
+    for (size_t i = 0; i < ctl->num_keys; i++) {
+        if (ctl->keys[i] == key) {
+            return i;
+        }
+    }
+
+    ctl->keys[ctl->num_keys] = key;
+
+    return ctl->num_keys++;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+smc_fan_ctl_t *smc_fan_ctl_create(const smc_fan_ctl_config_t *fans,
+                                  size_t num_fans, uint64_t period_ns)
+{
+    size_t max_keys = 0;
+    uint16_t force_mask = 0;
+
+    if (num_fans == 0 || period_ns == 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_fans; i++) {
+        if (fans[i].fan > 9 || fans[i].num_sensors == 0 ||
+            fans[i].num_sensors > SMC_FAN_CTL_MAX_SENSORS ||
+            fans[i].num_points > SMC_FAN_CTL_MAX_POINTS ||
+            (fans[i].mode == SMC_FAN_CTL_CURVE && fans[i].num_points == 0)) {
+            return NULL;
+        }
+
+        // A fan controlled twice would fight itself
+        for (size_t j = 0; j < i; j++) {
+            if (fans[j].fan == fans[i].fan) {
+                return NULL;
+            }
+        }
+
+        max_keys += fans[i].num_sensors;
+    }
+
+    smc_fan_ctl_t *ctl = calloc(1, sizeof(smc_fan_ctl_t));
+
+    if (ctl == NULL) {
+        return NULL;
+    }
+
+    ctl->fans   = calloc(num_fans, sizeof(fan_entry_t));
+    ctl->keys   = calloc(max_keys, sizeof(uint32_t));
+    ctl->values = calloc(max_keys, sizeof(smc_value_t));
+    ctl->results = calloc(num_fans, sizeof(smc_write_result_t));
+
+    // num_fans stays 0 until the fans are set up, so a failure below doesn't
+    // have smc_fan_ctl_destroy() hand back fans it never took
+    pthread_mutex_init(&ctl->lock, NULL);
+    ctl->period = period_ns;
+
+    if (ctl->fans == NULL || ctl->keys == NULL || ctl->values == NULL ||
+        ctl->results == NULL ||
+        smc_ctx_open(&ctl->ctx) != kIOReturnSuccess ||
+        (ctl->writes = smc_write_batch_create(ctl->ctx)) == NULL) {
+        smc_fan_ctl_destroy(ctl);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_fans; i++) {
+        fan_entry_t *fan = &ctl->fans[i];
+        unsigned int num = fans[i].fan;
+
+        fan->config   = fans[i];
+        fan->out_key  = fan_key(num, fans[i].force ? 'T' : 'M',
+                                     fans[i].force ? 'g' : 'n');
+        fan->last_tmp = NAN;
+        fan->pending  = NAN;
+        fan->written  = NAN;
+        fan->tmp      = NAN;
+
+        for (size_t j = 0; j < fans[i].num_sensors; j++) {
+            fan->sensors[j] = add_key(ctl, fans[i].sensors[j]);
+        }
+
+        // Limits are read once, F%dMn is overwritten from here on
+        fan->min_rpm  = read_rpm(ctl->ctx, fan_key(num, 'M', 'n'));
+        fan->max_rpm  = read_rpm(ctl->ctx, fan_key(num, 'M', 'x'));
+        fan->safe_rpm = read_rpm(ctl->ctx, fan_key(num, 'S', 'f'));
+
+        if (isnan(fan->min_rpm) || isnan(fan->max_rpm) ||
+            fan->max_rpm < fan->min_rpm) {
+            smc_fan_ctl_destroy(ctl);
+            return NULL;
+        }
+
+        if (isnan(fan->safe_rpm)) {
+            fan->safe_rpm = fan->max_rpm;
+        }
+
+        fan->safe_rpm = fmax(fan->min_rpm, fmin(fan->max_rpm, fan->safe_rpm));
+
+        if (fans[i].force) {
+            force_mask |= 1 << num;
+        }
+    }
+
+    ctl->num_fans = num_fans;
+
+    // Targets are only honoured in forced mode. Machines without FS! (newer
+    // ones) take F%dTg as is.
+    if (force_mask != 0 &&
+        smc_ctx_read(ctl->ctx, SMC_KEY_FORCE_BITS, &ctl->force_bits) ==
+        kIOReturnSuccess && ctl->force_bits.dataSize == 2) {
+        smc_value_t bits = ctl->force_bits;
+
+        force_mask |= bits.data[0] << 8 | bits.data[1];
+        bits.data[0] = force_mask >> 8;
+        bits.data[1] = force_mask & 0xff;
+
+        ctl->forced = smc_ctx_write(ctl->ctx, SMC_KEY_FORCE_BITS, &bits) ==
+                      kIOReturnSuccess;
+    }
+
+    return ctl;
+}
+
+
+kern_return_t smc_fan_ctl_step(smc_fan_ctl_t *ctl, uint64_t now_ns)
+{
+    kern_return_t result = kIOReturnSuccess;
+    uint64_t start = smc_time_ns();
+    uint64_t writes = 0;
+    uint64_t errors = 0;
+    uint64_t failsafes = 0;
+
+    // One batch for every fan, shared sensors are read once
+    smc_ctx_read_many(ctl->ctx, ctl->keys, ctl->num_keys, ctl->values);
+
+    for (size_t i = 0; i < ctl->num_fans; i++) {
+        fan_entry_t *fan = &ctl->fans[i];
+        double tmp = NAN;
+        double rpm;
+
+        for (size_t j = 0; j < fan->config.num_sensors; j++) {
+            const smc_value_t *value = &ctl->values[fan->sensors[j]];
+            double decoded;
+
+            if (value->result == kIOReturnSuccess &&
+                value->kSMC == 0 &&
+                smc_decode_value(value, &decoded) &&
+                (isnan(tmp) || decoded > tmp)) {
+                tmp = decoded;
+            }
+        }
+
+        if (isnan(tmp)) {
+            // Flying blind, fail safe and start the loop over once the
+            // sensors are back
+            rpm = fan->safe_rpm;
+            fan->integral = 0;
+            fan->last_step = 0;
+            failsafes++;
+        } else if (fan->config.mode == SMC_FAN_CTL_PID) {
+            rpm = pid_rpm(fan, tmp, now_ns);
+            fan->last_step = now_ns;
+        } else {
+            rpm = curve_rpm(&fan->config, tmp);
+            fan->last_step = now_ns;
+        }
+
+        fan->last_tmp = tmp;
+        rpm = fmax(fan->min_rpm, fmin(fan->max_rpm, rpm));
+
+        // Outside the deadband? Always write the first time.
+        fan->pending = NAN;
+
+        if (isnan(fan->written) ||
+            fabs(rpm - fan->written) > fan->config.deadband_rpm) {
+            smc_value_t value;
+
+            rpm_value(rpm, &value);
+
+            if (smc_write_batch_add(ctl->writes, fan->out_key, &value) ==
+                kIOReturnSuccess) {
+                fan->pending = rpm;
+            }
+        }
+
+        pthread_mutex_lock(&ctl->lock);
+        fan->tmp = tmp;
+        pthread_mutex_unlock(&ctl->lock);
+    }
+
+    // Every fan's write in one pass. Results come back in the order queued.
+    smc_write_batch_apply(ctl->writes, false, ctl->results);
+
+    for (size_t i = 0, k = 0; i < ctl->num_fans; i++) {
+        fan_entry_t *fan = &ctl->fans[i];
+        const smc_write_result_t *written = &ctl->results[k];
+
+        if (isnan(fan->pending)) {
+            continue;
+        }
+
+        k++;
+
+        if (written->status == SMC_WRITE_FAILED) {
+            errors++;
+
+            if (result == kIOReturnSuccess) {
+                result = written->result != kIOReturnSuccess ? written->result
+                                                             : kIOReturnError;
+            }
+
+            continue;
+        }
+
+        writes += written->status == SMC_WRITE_OK;
+
+        pthread_mutex_lock(&ctl->lock);
+        fan->written = fan->pending;
+        pthread_mutex_unlock(&ctl->lock);
+    }
+
+    uint64_t elapsed = smc_time_ns() - start;
+
+    pthread_mutex_lock(&ctl->lock);
+    ctl->stats.steps++;
+    ctl->stats.writes    += writes;
+    ctl->stats.errors    += errors;
+    ctl->stats.failsafes += failsafes;
+    ctl->stats.total_ns  += elapsed;
+
+    if (elapsed > ctl->stats.max_ns) {
+        ctl->stats.max_ns = elapsed;
+    }
+
+    pthread_mutex_unlock(&ctl->lock);
+
+    return result;
+}
+
+
+bool smc_fan_ctl_get_fan(smc_fan_ctl_t *ctl, unsigned int fan, double *tmp,
+                                                               double *rpm)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&ctl->lock);
+
+    for (size_t i = 0; i < ctl->num_fans; i++) {
+        if (ctl->fans[i].config.fan != fan) {
+            continue;
+        }
+
+        *tmp = ctl->fans[i].tmp;
+        *rpm = ctl->fans[i].written;
+        found = true;
+        break;
+    }
+
+    pthread_mutex_unlock(&ctl->lock);
+
+    return found;
+}
+
+
+void smc_fan_ctl_get_stats(smc_fan_ctl_t *ctl, smc_fan_ctl_stats_t *stats)
+{
+    pthread_mutex_lock(&ctl->lock);
+    *stats = ctl->stats;
+    pthread_mutex_unlock(&ctl->lock);
+}
+
+
+kern_return_t smc_fan_ctl_start(smc_fan_ctl_t *ctl)
+{
+    if (ctl->running) {
+        return kIOReturnSuccess;
+    }
+
+    ctl->stop = false;
+
+    if (pthread_create(&ctl->thread, NULL, fan_ctl_thread, ctl) != 0) {
+        return kIOReturnNoResources;
+    }
+
+    ctl->running = true;
+
+    return kIOReturnSuccess;
+}
+
+
+void smc_fan_ctl_stop(smc_fan_ctl_t *ctl)
+{
+    if (!ctl->running) {
+        return;
+    }
+
+    __atomic_store_n(&ctl->stop, true, __ATOMIC_RELEASE);
+    pthread_join(ctl->thread, NULL);
+    ctl->running = false;
+}
+
+
+void smc_fan_ctl_destroy(smc_fan_ctl_t *ctl)
+{
+    if (ctl == NULL) {
+        return;
+    }
+
+    smc_fan_ctl_stop(ctl);
+
+    // Hand the fans back to the SMC as they were
+    for (size_t i = 0; ctl->ctx != NULL && i < ctl->num_fans; i++) {
+        fan_entry_t *fan = &ctl->fans[i];
+
+        if (!fan->config.force && !isnan(fan->written)) {
+            smc_value_t value;
+
+            rpm_value(fan->min_rpm, &value);
+            smc_ctx_write(ctl->ctx, fan->out_key, &value);
+        }
+    }
+
+    if (ctl->forced) {
+        smc_ctx_write(ctl->ctx, SMC_KEY_FORCE_BITS, &ctl->force_bits);
+    }
+
+    smc_write_batch_destroy(ctl->writes);
+
+    if (ctl->ctx != NULL) {
+        smc_ctx_close(ctl->ctx);
+    }
+
+    pthread_mutex_destroy(&ctl->lock);
+    free(ctl->fans);
+    free(ctl->keys);
+    free(ctl->values);
+    free(ctl->results);
+    free(ctl);
+}
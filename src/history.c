@@ -0,0 +1,681 @@
+/*
+ * Compressed in-memory sensor history. Samples are packed into fixed-size
+ * chunks per key, timestamps as delta-of-deltas and values XORed against the
+ * previous one, as in Facebook's Gorilla time series database.
+ *
+ * history.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Size of the bit stream of a chunk, in bytes
+*/
+#define CHUNK_BYTES 1024
+
+
+/**
+Most bits a single sample can take: a 4 bit prefix and 64 bit delta-of-delta,
+then 2 control bits, 5 bits of leading zeros, 6 bits of length and 64 bits of
+value. A chunk with less room than this left is closed.
+*/
+#define MAX_SAMPLE_BITS (4 + 64 + 2 + 5 + 6 + 64)
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Chunk of samples of one key. The first sample is kept in the header, every
+later one is appended to the bit stream.
+
+- first_time  : Time of the first sample, in ticks of the history resolution
+- first_value : First value, as its IEEE 754 bits
+- last_time   : Time of the last sample, in ticks
+- last_delta  : Time between the last two samples, in ticks
+- last_value  : Last value, as its IEEE 754 bits
+- leading     : Leading zeros of the current XOR window
+- trailing    : Trailing zeros of the current XOR window
+- has_window  : Has an XOR window been written yet?
+- count       : Number of samples
+- bits        : Number of bits of data used
+- data        : Bit stream, most significant bit first
+*/
+typedef struct {
+    uint64_t first_time;
+    uint64_t first_value;
+    uint64_t last_time;
+    int64_t  last_delta;
+    uint64_t last_value;
+    uint8_t  leading;
+    uint8_t  trailing;
+    bool     has_window;
+    uint32_t count;
+    uint32_t bits;
+    uint8_t  data[CHUNK_BYTES];
+} chunk_t;
+
+
+/**
+History of one key
+
+- key        : SMC key, as a uint32_t
+- chunks     : Chunks, oldest first. Only the last one is appended to.
+- num_chunks : Number of chunks
+- capacity   : Size of chunks
+- samples    : Number of samples across every chunk
+*/
+typedef struct {
+    uint32_t  key;
+    chunk_t **chunks;
+    size_t    num_chunks;
+    size_t    capacity;
+    uint64_t  samples;
+} series_t;
+
+
+/**
+Bit stream reader, with the decoding state of a chunk
+
+- chunk    : Chunk being read
+- pos      : Position in the bit stream, in bits
+- index    : Index of the next sample
+- time     : Time of the current sample, in ticks
+- delta    : Time between the last two samples, in ticks
+- value    : Current value, as its IEEE 754 bits
+- leading  : Leading zeros of the current XOR window
+- trailing : Trailing zeros of the current XOR window
+*/
+typedef struct {
+    const chunk_t *chunk;
+    uint32_t       pos;
+    uint32_t       index;
+    uint64_t       time;
+    int64_t        delta;
+    uint64_t       value;
+    uint8_t        leading;
+    uint8_t        trailing;
+} reader_t;
+
+
+/**
+Sensor history
+
+- series      : One per key, sorted by key
+- num_series  : Number of keys
+- resolution  : Timestamp resolution, in nanoseconds
+- max_chunks  : Chunks kept per key, zero for no limit
+- lock        : Appends take it for writing, scans for reading
+*/
+struct smc_history_s {
+    series_t        *series;
+    size_t           num_series;
+    uint64_t         resolution;
+    size_t           max_chunks;
+    pthread_rwlock_t lock;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - BIT STREAM
+//------------------------------------------------------------------------------
+
+
+/**
+Append the low n bits of value to a chunk
+*/
+static void put_bits(chunk_t *chunk, uint64_t value, unsigned int n)
+{
+    while (n > 0) {
+        unsigned int room = 8 - (chunk->bits & 7);
+        unsigned int take = n < room ? n : room;
+        uint8_t part = (value >> (n - take)) & ((1u << take) - 1);
+
+        chunk->data[chunk->bits >> 3] |= part << (room - take);
+        chunk->bits += take;
+        n -= take;
+    }
+}
+
+
+/**
+Read the next n bits of a chunk
+*/
+static uint64_t get_bits(reader_t *reader, unsigned int n)
+{
+    uint64_t value = 0;
+
+    while (n > 0) {
+        unsigned int room = 8 - (reader->pos & 7);
+        unsigned int take = n < room ? n : room;
+        uint8_t byte = reader->chunk->data[reader->pos >> 3];
+
+        value = (value << take) | ((byte >> (room - take)) &
+                                   ((1u << take) - 1));
+        reader->pos += take;
+        n -= take;
+    }
+
+    return value;
+}
+
+
+static uint64_t double_bits(double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    return bits;
+}
+
+
+static double bits_double(uint64_t bits)
+{
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - ENCODING
+//------------------------------------------------------------------------------
+
+
+/**
+Write a timestamp as the difference between its delta and the last one. Steady
+sampling makes this zero, a single bit.
+
+  0                      : zero
+  10   + 7 bits          : -63 to 64
+  110  + 9 bits          : -255 to 256
+  1110 + 12 bits         : -2047 to 2048
+  1111 + 64 bits         : anything else
+*/
+static void put_time(chunk_t *chunk, uint64_t time)
+{
+    int64_t delta = (int64_t)(time - chunk->last_time);
+    int64_t dod = delta - chunk->last_delta;
+
+    if (dod == 0) {
+        put_bits(chunk, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        put_bits(chunk, 2, 2);
+        put_bits(chunk, (uint64_t)(dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+        put_bits(chunk, 6, 3);
+        put_bits(chunk, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        put_bits(chunk, 14, 4);
+        put_bits(chunk, (uint64_t)(dod + 2047), 12);
+    } else {
+        put_bits(chunk, 15, 4);
+        put_bits(chunk, (uint64_t)dod, 64);
+    }
+
+    chunk->last_time = time;
+    chunk->last_delta = delta;
+}
+
+
+/**
+Write a value XORed against the last one. Unchanged values are a single bit.
+Otherwise only the meaningful bits of the XOR are written, reusing the last
+window of leading and trailing zeros when they fit in it.
+
+  0                                   : same value
+  10 + meaningful bits                : fits the last window
+  11 + 5 bits leading zeros + 6 bits
+     length + meaningful bits         : new window
+*/
+static void put_value(chunk_t *chunk, uint64_t value)
+{
+    uint64_t xor = value ^ chunk->last_value;
+
+    chunk->last_value = value;
+
+    if (xor == 0) {
+        put_bits(chunk, 0, 1);
+        return;
+    }
+
+    unsigned int leading  = __builtin_clzll(xor);
+    unsigned int trailing = __builtin_ctzll(xor);
+
+    // Only 5 bits to store it in
+    if (leading > 31) {
+        leading = 31;
+    }
+
+    if (chunk->has_window && leading >= chunk->leading &&
+        trailing >= chunk->trailing) {
+        put_bits(chunk, 2, 2);
+        put_bits(chunk, xor >> chunk->trailing,
+                 64 - chunk->leading - chunk->trailing);
+        return;
+    }
+
+    unsigned int length = 64 - leading - trailing;
+
+    // A length of 64 doesn't fit in 6 bits, but zero is never written
+    put_bits(chunk, 3, 2);
+    put_bits(chunk, leading, 5);
+    put_bits(chunk, length & 63, 6);
+    put_bits(chunk, xor >> trailing, length);
+
+    chunk->leading = leading;
+    chunk->trailing = trailing;
+    chunk->has_window = true;
+}
+
+
+static int64_t get_dod(reader_t *reader)
+{
+    if (get_bits(reader, 1) == 0) {
+        return 0;
+    }
+
+    if (get_bits(reader, 1) == 0) {
+        return (int64_t)get_bits(reader, 7) - 63;
+    }
+
+    if (get_bits(reader, 1) == 0) {
+        return (int64_t)get_bits(reader, 9) - 255;
+    }
+
+    if (get_bits(reader, 1) == 0) {
+        return (int64_t)get_bits(reader, 12) - 2047;
+    }
+
+    return (int64_t)get_bits(reader, 64);
+}
+
+
+static void get_value(reader_t *reader)
+{
+    if (get_bits(reader, 1) == 0) {
+        return;
+    }
+
+    if (get_bits(reader, 1) == 1) {
+        unsigned int length;
+
+        reader->leading = get_bits(reader, 5);
+        length = get_bits(reader, 6);
+
+        if (length == 0) {
+            length = 64;
+        }
+
+        reader->trailing = 64 - reader->leading - length;
+    }
+
+    unsigned int length = 64 - reader->leading - reader->trailing;
+
+    reader->value ^= get_bits(reader, length) << reader->trailing;
+}
+
+
+static void reader_init(reader_t *reader, const chunk_t *chunk)
+{
+    memset(reader, 0, sizeof(reader_t));
+    reader->chunk = chunk;
+    reader->time  = chunk->first_time;
+    reader->value = chunk->first_value;
+}
+
+
+/**
+Move a reader to the next sample of its chunk.
+
+:returns: False if there are no more samples
+*/
+static bool reader_next(reader_t *reader)
+{
+    if (reader->index >= reader->chunk->count) {
+        return false;
+    }
+
+    // First sample is in the header
+    if (reader->index++ == 0) {
+        return true;
+    }
+
+    reader->delta += get_dod(reader);
+    reader->time  += reader->delta;
+    get_value(reader);
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - SERIES
+//------------------------------------------------------------------------------
+
+
+/**
+Find the series of a key.
+
+:param: insert Add the series if it doesn't exist
+:returns: The series, NULL if it doesn't exist and wasn't added
+*/
+static series_t *find_series(smc_history_t *history, uint32_t key, bool insert)
+{
+    size_t lo = 0;
+    size_t hi = history->num_series;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (history->series[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < history->num_series && history->series[lo].key == key) {
+        return &history->series[lo];
+    }
+
+    if (!insert) {
+        return NULL;
+    }
+
+    series_t *series = realloc(history->series, (history->num_series + 1) *
+                                                sizeof(series_t));
+
+    if (series == NULL) {
+        return NULL;
+    }
+
+    history->series = series;
+    memmove(&series[lo + 1], &series[lo],
+            (history->num_series - lo) * sizeof(series_t));
+    memset(&series[lo], 0, sizeof(series_t));
+    series[lo].key = key;
+    history->num_series++;
+
+    return &series[lo];
+}
+
+
+/**
+Start a new chunk with a first sample, dropping the oldest chunk if the series
+is at its limit
+*/
+static kern_return_t new_chunk(smc_history_t *history, series_t *series,
+                               uint64_t time, uint64_t value)
+{
+    chunk_t *chunk;
+
+    if (history->max_chunks != 0 && series->num_chunks == history->max_chunks) {
+        // Reuse the oldest chunk
+        chunk = series->chunks[0];
+        series->samples -= chunk->count;
+        memmove(&series->chunks[0], &series->chunks[1],
+                (series->num_chunks - 1) * sizeof(chunk_t *));
+        series->num_chunks--;
+        memset(chunk, 0, sizeof(chunk_t));
+    } else {
+        if (series->num_chunks == series->capacity) {
+            size_t capacity = series->capacity ? series->capacity * 2 : 4;
+            chunk_t **chunks = realloc(series->chunks,
+                                       capacity * sizeof(chunk_t *));
+
+            if (chunks == NULL) {
+                return kIOReturnNoMemory;
+            }
+
+            series->chunks = chunks;
+            series->capacity = capacity;
+        }
+
+        chunk = calloc(1, sizeof(chunk_t));
+
+        if (chunk == NULL) {
+            return kIOReturnNoMemory;
+        }
+    }
+
+    chunk->first_time  = time;
+    chunk->first_value = value;
+    chunk->last_time   = time;
+    chunk->last_value  = value;
+    chunk->count       = 1;
+
+    series->chunks[series->num_chunks++] = chunk;
+    series->samples++;
+
+    return kIOReturnSuccess;
+}
+
+
+static kern_return_t append(smc_history_t *history, uint32_t key,
+                            uint64_t timestamp, double value)
+{
+    uint64_t time = timestamp / history->resolution;
+    uint64_t bits = double_bits(value);
+    series_t *series = find_series(history, key, true);
+    chunk_t *chunk;
+
+    if (series == NULL) {
+        return kIOReturnNoMemory;
+    }
+
+    if (series->num_chunks == 0) {
+        return new_chunk(history, series, time, bits);
+    }
+
+    chunk = series->chunks[series->num_chunks - 1];
+
+    if (time < chunk->last_time) {
+        return kIOReturnBadArgument;
+    }
+
+    if (chunk->bits + MAX_SAMPLE_BITS > CHUNK_BYTES * 8) {
+        return new_chunk(history, series, time, bits);
+    }
+
+    put_time(chunk, time);
+    put_value(chunk, bits);
+    chunk->count++;
+    series->samples++;
+
+    return kIOReturnSuccess;
+}
+
+
+static void add_stats(const series_t *series, smc_history_stats_t *stats)
+{
+    stats->samples += series->samples;
+    stats->chunks  += series->num_chunks;
+
+    for (size_t i = 0; i < series->num_chunks; i++) {
+        stats->encoded_bytes += offsetof(chunk_t, data) +
+                                (series->chunks[i]->bits + 7) / 8;
+        stats->allocated_bytes += sizeof(chunk_t);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+smc_history_t *smc_history_create(uint64_t resolution_ns, size_t max_chunks)
+{
+    smc_history_t *history = calloc(1, sizeof(smc_history_t));
+
+    if (history == NULL) {
+        return NULL;
+    }
+
+    if (pthread_rwlock_init(&history->lock, NULL) != 0) {
+        free(history);
+        return NULL;
+    }
+
+    history->resolution = resolution_ns ? resolution_ns : 1;
+    history->max_chunks = max_chunks;
+
+    return history;
+}
+
+
+void smc_history_destroy(smc_history_t *history)
+{
+    if (history == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < history->num_series; i++) {
+        for (size_t j = 0; j < history->series[i].num_chunks; j++) {
+            free(history->series[i].chunks[j]);
+        }
+
+        free(history->series[i].chunks);
+    }
+
+    pthread_rwlock_destroy(&history->lock);
+    free(history->series);
+    free(history);
+}
+
+
+kern_return_t smc_history_append(smc_history_t *history, uint32_t key,
+                                  uint64_t timestamp, double value)
+{
+    kern_return_t result;
+
+    pthread_rwlock_wrlock(&history->lock);
+    result = append(history, key, timestamp, value);
+    pthread_rwlock_unlock(&history->lock);
+
+    return result;
+}
+
+
+kern_return_t smc_history_append_frame(smc_history_t *history,
+                                       const uint32_t *keys, size_t num_keys,
+                                       uint64_t timestamp,
+                                       const double *values)
+{
+    kern_return_t result = kIOReturnSuccess;
+
+    pthread_rwlock_wrlock(&history->lock);
+
+    for (size_t i = 0; i < num_keys; i++) {
+        kern_return_t key_result = append(history, keys[i], timestamp,
+                                                            values[i]);
+
+        if (key_result != kIOReturnSuccess) {
+            result = key_result;
+        }
+    }
+
+    pthread_rwlock_unlock(&history->lock);
+
+    return result;
+}
+
+
+size_t smc_history_scan(smc_history_t *history, uint32_t key, uint64_t from,
+                        uint64_t to, uint64_t *timestamps, double *values,
+                        size_t max)
+{
+    size_t count = 0;
+    series_t *series;
+    reader_t reader;
+
+    pthread_rwlock_rdlock(&history->lock);
+
+    series = find_series(history, key, false);
+
+    for (size_t i = 0; series != NULL && i < series->num_chunks &&
+                       count < max; i++) {
+        const chunk_t *chunk = series->chunks[i];
+
+        // Skip chunks entirely outside the range, without decoding them
+        if (chunk->last_time * history->resolution < from) {
+            continue;
+        }
+
+        if (chunk->first_time * history->resolution > to) {
+            break;
+        }
+
+        reader_init(&reader, chunk);
+
+        while (count < max && reader_next(&reader)) {
+            uint64_t timestamp = reader.time * history->resolution;
+
+            if (timestamp < from) {
+                continue;
+            }
+
+            if (timestamp > to) {
+                break;
+            }
+
+            timestamps[count] = timestamp;
+            values[count] = bits_double(reader.value);
+            count++;
+        }
+    }
+
+    pthread_rwlock_unlock(&history->lock);
+
+    return count;
+}
+
+
+void smc_history_get_stats(smc_history_t *history, uint32_t key,
+                           smc_history_stats_t *stats)
+{
+    memset(stats, 0, sizeof(smc_history_stats_t));
+
+    pthread_rwlock_rdlock(&history->lock);
+
+    for (size_t i = 0; i < history->num_series; i++) {
+        if (key == 0 || history->series[i].key == key) {
+            add_stats(&history->series[i], stats);
+        }
+    }
+
+    pthread_rwlock_unlock(&history->lock);
+}
@@ -0,0 +1,398 @@
+/*
+ * Background sampling of a set of SMC keys, published to consumers through
+ * lock-free single-producer/single-consumer ring buffers.
+ *
+ * sampler.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Max number of consumers (rings) per sampler
+*/
+#define MAX_CONSUMERS 16
+
+
+/**
+Size of a cache line. Producer and consumer indexes are kept on separate lines
+so they don't false share.
+*/
+#define CACHE_LINE 64
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Single-producer/single-consumer ring of frames. The sampler thread is the
+only writer of head, the consumer the only writer of tail.
+
+- head      : Number of frames pushed
+- tail      : Number of frames popped
+- overruns  : Number of frames dropped because the ring was full
+- capacity  : Number of slots, a power of two
+- num_keys  : Number of values per frame
+- frames    : Frame headers, one per slot
+- values    : Frame values, num_keys per slot
+*/
+struct smc_ring_s {
+    uint64_t     head;
+    char         pad_head[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t     tail;
+    char         pad_tail[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t     overruns;
+    size_t       capacity;
+    size_t       num_keys;
+    smc_frame_t *frames;
+    double      *values;
+};
+
+
+/**
+Sampler
+
+- keys          : Keys to sample
+- handles       : Prepared keys, NULL where a key couldn't be prepared
+- num_keys      : Number of keys
+- period        : Sampling period, in nanoseconds
+- rings         : One ring per consumer
+- num_rings     : Number of consumers
+- history       : History every frame is appended to, NULL for none
+- window        : Windowed statistics every frame is appended to, NULL for none
+- scratch       : Values of the frame being sampled
+- sequence      : Sequence number of the next frame
+- thread        : Sampler thread
+- running       : Is the sampler thread running?
+- stop          : Set to ask the sampler thread to stop
+*/
+struct smc_sampler_s {
+    uint32_t    *keys;
+    smc_key_t  **handles;
+    size_t       num_keys;
+    uint64_t     period;
+    smc_ring_t  *rings[MAX_CONSUMERS];
+    size_t       num_rings;
+    smc_history_t *history;
+    smc_window_t  *window;
+    double      *scratch;
+    uint64_t     sequence;
+    pthread_t    thread;
+    bool         running;
+    bool         stop;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+/**
+Push a frame. Never blocks, if the ring is full the frame is dropped and
+counted as an overrun.
+*/
+static void ring_push(smc_ring_t *ring, const smc_frame_t *frame,
+                                        const double *values)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == ring->capacity) {
+        __atomic_add_fetch(&ring->overruns, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t slot = head & (ring->capacity - 1);
+
+    ring->frames[slot] = *frame;
+    memcpy(&ring->values[slot * ring->num_keys], values,
+           ring->num_keys * sizeof(double));
+
+    // Publish the frame
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+Take one sample of every key and push it to every ring
+*/
+static void sample(smc_sampler_t *sampler)
+{
+    smc_value_t value;
+    smc_frame_t frame;
+
+    for (size_t i = 0; i < sampler->num_keys; i++) {
+        double decoded = NAN;
+
+        if (sampler->handles[i] != NULL &&
+            smc_read_prepared(sampler->handles[i], &value) ==
+            kIOReturnSuccess) {
+            smc_decode_value(&value, &decoded);
+        }
+
+        sampler->scratch[i] = decoded;
+    }
+
+    frame.timestamp = smc_time_ns();
+    frame.sequence  = sampler->sequence++;
+
+    for (size_t i = 0; i < sampler->num_rings; i++) {
+        ring_push(sampler->rings[i], &frame, sampler->scratch);
+    }
+
+    if (sampler->history != NULL) {
+        smc_history_append_frame(sampler->history, sampler->keys,
+                                 sampler->num_keys, frame.timestamp,
+                                 sampler->scratch);
+    }
+
+    if (sampler->window != NULL) {
+        smc_window_append_frame(sampler->window, sampler->keys,
+                                sampler->num_keys, frame.timestamp,
+                                sampler->scratch);
+    }
+}
+
+
+static void sampler_run(void *context, uint64_t now_ns)
+{
+    sample(context);
+}
+
+
+/**
+Sampler thread entry point. Samples at fixed deadlines, so the period doesn't
+drift with the time the reads take.
+*/
+static void *sampler_thread(void *arg)
+{
+    smc_sampler_t *sampler = arg;
+
+    smc_run_periodic(sampler->period, &sampler->stop, sampler_run, sampler);
+
+    return NULL;
+}
+
+
+static void ring_free(smc_ring_t *ring)
+{
+    if (ring == NULL) {
+        return;
+    }
+
+    free(ring->frames);
+    free(ring->values);
+    free(ring);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+smc_sampler_t *smc_sampler_create(const uint32_t *keys, size_t num_keys,
+                                  uint64_t period_ns)
+{
+    smc_sampler_t *sampler = calloc(1, sizeof(smc_sampler_t));
+
+    if (sampler == NULL) {
+        return NULL;
+    }
+
+    sampler->keys = malloc(num_keys * sizeof(uint32_t));
+    sampler->handles = calloc(num_keys, sizeof(smc_key_t *));
+    sampler->scratch = calloc(num_keys, sizeof(double));
+
+    if (sampler->keys == NULL || sampler->handles == NULL ||
+        sampler->scratch == NULL) {
+        smc_sampler_destroy(sampler);
+        return NULL;
+    }
+
+    memcpy(sampler->keys, keys, num_keys * sizeof(uint32_t));
+    sampler->num_keys = num_keys;
+    sampler->period = period_ns;
+
+    // Prepared keys only need a single call to the SMC per sample. Keys that
+    // can't be prepared (not found) are sampled as NAN.
+    for (size_t i = 0; i < num_keys; i++) {
+        sampler->handles[i] = smc_prepare_u32(keys[i]);
+    }
+
+    return sampler;
+}
+
+
+smc_ring_t *smc_sampler_add_consumer(smc_sampler_t *sampler, size_t capacity)
+{
+    size_t      size = 1;
+    smc_ring_t *ring;
+
+    if (sampler->running || sampler->num_rings == MAX_CONSUMERS) {
+        return NULL;
+    }
+
+    // Round up to a power of two, so a slot is just a mask away
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring = calloc(1, sizeof(smc_ring_t));
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->capacity = size;
+    ring->num_keys = sampler->num_keys;
+    ring->frames = calloc(size, sizeof(smc_frame_t));
+    ring->values = calloc(size * (sampler->num_keys ? sampler->num_keys : 1),
+                          sizeof(double));
+
+    if (ring->frames == NULL || ring->values == NULL) {
+        ring_free(ring);
+        return NULL;
+    }
+
+    sampler->rings[sampler->num_rings++] = ring;
+
+    return ring;
+}
+
+
+kern_return_t smc_sampler_start(smc_sampler_t *sampler)
+{
+    if (sampler->running) {
+        return kIOReturnSuccess;
+    }
+
+    sampler->stop = false;
+
+    if (pthread_create(&sampler->thread, NULL, sampler_thread, sampler) != 0) {
+        return kIOReturnNoResources;
+    }
+
+    sampler->running = true;
+
+    return kIOReturnSuccess;
+}
+
+
+void smc_sampler_stop(smc_sampler_t *sampler)
+{
+    if (!sampler->running) {
+        return;
+    }
+
+    __atomic_store_n(&sampler->stop, true, __ATOMIC_RELEASE);
+    pthread_join(sampler->thread, NULL);
+    sampler->running = false;
+}
+
+
+void smc_sampler_destroy(smc_sampler_t *sampler)
+{
+    if (sampler == NULL) {
+        return;
+    }
+
+    smc_sampler_stop(sampler);
+
+    for (size_t i = 0; i < sampler->num_rings; i++) {
+        ring_free(sampler->rings[i]);
+    }
+
+    for (size_t i = 0; sampler->handles != NULL && i < sampler->num_keys;
+         i++) {
+        smc_release_prepared(sampler->handles[i]);
+    }
+
+    free(sampler->keys);
+    free(sampler->handles);
+    free(sampler->scratch);
+    free(sampler);
+}
+
+
+kern_return_t smc_sampler_set_history(smc_sampler_t *sampler,
+                                      smc_history_t *history)
+{
+    if (sampler->running) {
+        return kIOReturnBusy;
+    }
+
+    sampler->history = history;
+
+    return kIOReturnSuccess;
+}
+
+
+kern_return_t smc_sampler_set_window(smc_sampler_t *sampler,
+                                     smc_window_t *window)
+{
+    if (sampler->running) {
+        return kIOReturnBusy;
+    }
+
+    sampler->window = window;
+
+    return kIOReturnSuccess;
+}
+
+
+bool smc_ring_pop(smc_ring_t *ring, smc_frame_t *frame, double *values)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail == head) {
+        return false;
+    }
+
+    size_t slot = tail & (ring->capacity - 1);
+
+    *frame = ring->frames[slot];
+    memcpy(values, &ring->values[slot * ring->num_keys],
+           ring->num_keys * sizeof(double));
+
+    // Hand the slot back to the sampler
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+uint64_t smc_ring_get_overruns(smc_ring_t *ring)
+{
+    return __atomic_load_n(&ring->overruns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,502 @@
+/*
+ * Sensor table shared between processes through POSIX shared memory. A single
+ * publisher (see tools/smcd.c) samples the SMC, any number of client processes
+ * map the table read-only and read it through per-slot sequence locks, without
+ * any system calls.
+ *
+ * shm.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Shared table magic ("SMCS") and layout version. See shm_header_t. The magic is
+written last, so a client never maps a table that is still being set up.
+*/
+#define SHM_MAGIC   0x534d4353
+#define SHM_VERSION 1
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Header of the shared table, followed by num_slots slots. One cache line, so
+the heartbeat doesn't false share with the first slot.
+
+- magic     : SHM_MAGIC, once the table is ready
+- version   : SHM_VERSION
+- slot_size : sizeof(shm_slot_t)
+- num_slots : Number of slots
+- period    : Refresh period of the publisher, in nanoseconds
+- heartbeat : When the publisher last finished a refresh, see smc_time_ns().
+              Zero once the publisher has shut down.
+- pid       : Process ID of the publisher
+- reserved  : Zero
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t num_slots;
+    uint64_t period;
+    uint64_t heartbeat;
+    uint32_t pid;
+    uint8_t  reserved[28];
+} shm_header_t;
+
+
+/**
+Slot of the shared table, one cache line. Same layout as a sensor table slot.
+
+- sequence  : Sequence lock. Odd while the slot is being written.
+- key       : SMC key, fixed when the table is published
+- dataType  : Type of data
+- dataSize  : Number of valid bytes in data
+- kSMC      : SMC return code of the last read
+- valid     : Has the slot been read successfully yet?
+- value     : Decoded value, NAN if the type is not known
+- timestamp : When the slot was last refreshed, see smc_time_ns()
+- data      : Raw bytes, as returned by the SMC
+*/
+typedef struct {
+    uint32_t sequence;
+    uint32_t key;
+    uint32_t dataType;
+    uint8_t  dataSize;
+    uint8_t  kSMC;
+    uint8_t  valid;
+    uint8_t  reserved;
+    double   value;
+    uint64_t timestamp;
+    uint8_t  data[32];
+} shm_slot_t;
+
+
+/**
+Publisher of a shared table
+
+- name     : Name of the shared memory object
+- header   : Mapped table
+- slots    : Slots of the mapped table, sorted by key
+- handles  : Prepared keys, one per slot. NULL where a key couldn't be
+             prepared.
+- size     : Size of the mapping
+*/
+struct smc_publisher_s {
+    char         *name;
+    shm_header_t *header;
+    shm_slot_t   *slots;
+    smc_key_t   **handles;
+    size_t        size;
+};
+
+
+/**
+Client mapping of a shared table
+
+- header : Mapped table, read-only
+- slots  : Slots of the mapped table
+- size   : Size of the mapping
+*/
+struct smc_shm_s {
+    const shm_header_t *header;
+    const shm_slot_t   *slots;
+    size_t              size;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint32_t key_a = *(const uint32_t *)a;
+    uint32_t key_b = *(const uint32_t *)b;
+
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+
+/**
+Write a value into a slot, under the sequence lock. Only the publisher writes.
+*/
+static void write_slot(shm_slot_t *slot, const smc_value_t *value,
+                                         double decoded, uint64_t timestamp)
+{
+    uint32_t sequence = slot->sequence;
+
+    // Odd - readers retry until the write is done
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->dataType  = value->dataType;
+    slot->dataSize  = (uint8_t)value->dataSize;
+    slot->kSMC      = value->kSMC;
+    slot->valid     = value->result == kIOReturnSuccess && value->kSMC == 0;
+    slot->value     = decoded;
+    slot->timestamp = timestamp;
+    memcpy(slot->data, value->data, sizeof(slot->data));
+
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+static const shm_slot_t *find_slot(const smc_shm_t *shm, uint32_t key)
+{
+    size_t lo = 0;
+    size_t hi = shm->header->num_slots;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (shm->slots[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < shm->header->num_slots && shm->slots[lo].key == key) {
+        return &shm->slots[lo];
+    }
+
+    return NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS - PUBLISHER
+//------------------------------------------------------------------------------
+
+
+smc_publisher_t *smc_publisher_create(const char *name, const uint32_t *keys,
+                                      size_t num_keys, uint64_t period_ns)
+{
+    int              fd;
+    void            *map;
+    uint32_t        *sorted;
+    size_t           count = 0;
+    smc_publisher_t *publisher = calloc(1, sizeof(smc_publisher_t));
+
+    if (publisher == NULL) {
+        return NULL;
+    }
+
+    sorted = malloc((num_keys ? num_keys : 1) * sizeof(uint32_t));
+    publisher->name = strdup(name);
+
+    if (sorted == NULL || publisher->name == NULL) {
+        free(sorted);
+        free(publisher->name);
+        free(publisher);
+        return NULL;
+    }
+
+    // Sort and drop duplicates, so clients can binary search
+    memcpy(sorted, keys, num_keys * sizeof(uint32_t));
+    qsort(sorted, num_keys, sizeof(uint32_t), compare_keys);
+
+    for (size_t i = 0; i < num_keys; i++) {
+        if (count == 0 || sorted[i] != sorted[count - 1]) {
+            sorted[count++] = sorted[i];
+        }
+    }
+
+    publisher->size = sizeof(shm_header_t) + count * sizeof(shm_slot_t);
+
+    // Replace any table left by an earlier publisher. Its clients keep their
+    // old mapping, and see its heartbeat stop.
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if (fd == -1) {
+        free(sorted);
+        free(publisher->name);
+        free(publisher);
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t)publisher->size) != 0 ||
+        (map = mmap(NULL, publisher->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0)) == MAP_FAILED) {
+        close(fd);
+        shm_unlink(name);
+        free(sorted);
+        free(publisher->name);
+        free(publisher);
+        return NULL;
+    }
+
+    close(fd);
+
+    publisher->header  = map;
+    publisher->slots   = (shm_slot_t *)(publisher->header + 1);
+    publisher->handles = calloc(count ? count : 1, sizeof(smc_key_t *));
+
+    if (publisher->handles == NULL) {
+        free(sorted);
+        smc_publisher_destroy(publisher);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        publisher->slots[i].key = sorted[i];
+        publisher->slots[i].value = NAN;
+        publisher->handles[i] = smc_prepare_u32(sorted[i]);
+    }
+
+    free(sorted);
+
+    publisher->header->version   = SHM_VERSION;
+    publisher->header->slot_size = sizeof(shm_slot_t);
+    publisher->header->num_slots = (uint32_t)count;
+    publisher->header->period    = period_ns;
+    publisher->header->pid       = (uint32_t)getpid();
+
+    // Ready
+    __atomic_store_n(&publisher->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return publisher;
+}
+
+
+kern_return_t smc_publisher_refresh(smc_publisher_t *publisher)
+{
+    kern_return_t result = kIOReturnSuccess;
+    smc_value_t   value;
+
+    for (size_t i = 0; i < publisher->header->num_slots; i++) {
+        double decoded = NAN;
+
+        if (publisher->handles[i] == NULL) {
+            result = kIOReturnError;
+            continue;
+        }
+
+        if (smc_read_prepared(publisher->handles[i], &value) !=
+            kIOReturnSuccess) {
+            result = kIOReturnError;
+        } else {
+            smc_decode_value(&value, &decoded);
+        }
+
+        write_slot(&publisher->slots[i], &value, decoded, smc_time_ns());
+    }
+
+    __atomic_store_n(&publisher->header->heartbeat, smc_time_ns(),
+                     __ATOMIC_RELEASE);
+
+    return result;
+}
+
+
+void smc_publisher_destroy(smc_publisher_t *publisher)
+{
+    if (publisher == NULL) {
+        return;
+    }
+
+    if (publisher->header != NULL) {
+        // Tell clients straight away rather than have them wait out the
+        // heartbeat
+        __atomic_store_n(&publisher->header->heartbeat, 0, __ATOMIC_RELEASE);
+
+        for (size_t i = 0; publisher->handles != NULL &&
+                           i < publisher->header->num_slots; i++) {
+            smc_release_prepared(publisher->handles[i]);
+        }
+
+        munmap(publisher->header, publisher->size);
+        shm_unlink(publisher->name);
+    }
+
+    free(publisher->handles);
+    free(publisher->name);
+    free(publisher);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS - CLIENT
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_shm_open(const char *name, smc_shm_t **shm)
+{
+    int           fd;
+    void         *map;
+    struct stat   st;
+    shm_header_t  header;
+    uint32_t      magic;
+    smc_shm_t    *new_shm;
+
+    *shm = NULL;
+    fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd == -1) {
+        return kIOReturnNotFound;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(shm_header_t)) {
+        close(fd);
+        return kIOReturnBadArgument;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return kIOReturnError;
+    }
+
+    // Also rejects a table that isn't ready yet. The magic is loaded first, so
+    // the rest of the header copied after it is the publisher's finished one.
+    magic = __atomic_load_n(&((const shm_header_t *)map)->magic,
+                            __ATOMIC_ACQUIRE);
+
+    memcpy(&header, map, sizeof(shm_header_t));
+
+    if (magic != SHM_MAGIC ||
+        header.version != SHM_VERSION ||
+        header.slot_size != sizeof(shm_slot_t) ||
+        sizeof(shm_header_t) + (size_t)header.num_slots * sizeof(shm_slot_t) >
+        (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return kIOReturnBadArgument;
+    }
+
+    new_shm = malloc(sizeof(smc_shm_t));
+
+    if (new_shm == NULL) {
+        munmap(map, (size_t)st.st_size);
+        return kIOReturnNoMemory;
+    }
+
+    new_shm->header = map;
+    new_shm->slots  = (const shm_slot_t *)(new_shm->header + 1);
+    new_shm->size   = (size_t)st.st_size;
+    *shm = new_shm;
+
+    return kIOReturnSuccess;
+}
+
+
+void smc_shm_close(smc_shm_t *shm)
+{
+    if (shm == NULL) {
+        return;
+    }
+
+    munmap((void *)shm->header, shm->size);
+    free(shm);
+}
+
+
+bool smc_shm_get(const smc_shm_t *shm, uint32_t key, smc_table_entry_t *entry)
+{
+    uint32_t          before;
+    uint32_t          after;
+    shm_slot_t        copy;
+    const shm_slot_t *slot = find_slot(shm, key);
+
+    if (slot == NULL) {
+        return false;
+    }
+
+    do {
+        before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        // Being written, try again
+        if (before & 1) {
+            continue;
+        }
+
+        memcpy(&copy, slot, sizeof(shm_slot_t));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    if (!copy.valid) {
+        return false;
+    }
+
+    memset(entry, 0, sizeof(smc_table_entry_t));
+    entry->value.key      = key;
+    entry->value.dataType = copy.dataType;
+    entry->value.dataSize = copy.dataSize;
+    entry->value.result   = kIOReturnSuccess;
+    entry->value.kSMC     = copy.kSMC;
+    memcpy(entry->value.data, copy.data, sizeof(copy.data));
+    entry->decoded   = copy.value;
+    entry->timestamp = copy.timestamp;
+
+    return true;
+}
+
+
+bool smc_shm_is_alive(const smc_shm_t *shm, uint64_t max_age_ns)
+{
+    uint64_t heartbeat = __atomic_load_n(&shm->header->heartbeat,
+                                         __ATOMIC_ACQUIRE);
+
+    if (heartbeat == 0) {
+        return false;
+    }
+
+    // Default to allowing a couple of missed refreshes
+    if (max_age_ns == 0) {
+        max_age_ns = 3 * shm->header->period;
+    }
+
+    uint64_t now = smc_time_ns();
+
+    return now < heartbeat || now - heartbeat <= max_age_ns;
+}
+
+
+size_t smc_shm_get_keys(const smc_shm_t *shm, uint32_t *keys, size_t max)
+{
+    size_t count = shm->header->num_slots;
+
+    for (size_t i = 0; i < count && i < max; i++) {
+        keys[i] = shm->slots[i].key;
+    }
+
+    return count;
+}
@@ -35,9 +35,23 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "../include/smc.h"
 
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#else
+// IOReturn error code lookup, as from mach/error.h
+#define err_get_code(err) ((err) & 0x3fff)
+#endif
+
 
 //------------------------------------------------------------------------------
 // MARK: MACROS
@@ -52,6 +66,13 @@ developer site - Hardware IO Tools for Xcode)
 #define IOSERVICE_SMC "AppleSMC"
 
 
+/**
+Longest smc_sleep_until() sleeps at once, so a stop isn't held up by a long
+period
+*/
+#define MAX_SLEEP_NS 100000000ULL
+
+
 /**
 IOService for getting machine model name
 */
@@ -59,19 +80,39 @@ IOService for getting machine model name
 
 
 /**
-SMC data types - 4 byte multi-character constants
+Catalog file magic ("SMCC") and format version. See catalog_header_t. The
+magic is stored in native byte order, so a file from a machine of the other
+endianness is rejected.
+*/
+#define CATALOG_MAGIC   0x534d4343
+#define CATALOG_VERSION 1
+
+
+/**
+Machine model reported by the simulated SMC
+*/
+#define SIM_MODEL "SimulatedSMC"
+
+
+/**
+Recording file magic ("SMCR") and format version. See recording_header_t. Like
+the catalog, stored in native byte order.
+*/
+#define RECORDING_MAGIC   0x534d4352
+#define RECORDING_VERSION 1
+
+
+/**
+Slots of the negative key cache. A power of two, see key_cache_slot().
+*/
+#define KEY_CACHE_SLOTS 256
 
-Sources: See TMP SMC keys in smc.h
 
-http://stackoverflow.com/questions/22160746/fpe2-and-sp78-data-types
+/**
+How long a key stays cached as absent, in nanoseconds. A stray not found, e.g.
+replayed from a trace, is only believed for this long.
 */
-#define DATA_TYPE_UINT8  "ui8 "
-#define DATA_TYPE_UINT16 "ui16"
-#define DATA_TYPE_UINT32 "ui32"
-#define DATA_TYPE_FLAG   "flag"
-#define DATA_TYPE_FPE2   "fpe2"
-#define DATA_TYPE_SFDS   "{fds"
-#define DATA_TYPE_SP78   "sp78"
+#define KEY_CACHE_TTL_NS 10000000000ULL
 
 
 //------------------------------------------------------------------------------
@@ -80,9 +121,11 @@ http://stackoverflow.com/questions/22160746/fpe2-and-sp78-data-types
 
 
 /**
-Our connection to the SMC
+Sensor table get_tmp() and get_fan_rpm() answer from, and how old its values
+may be, in nanoseconds. See smc_use_table().
 */
-static io_connect_t conn;
+static smc_table_t *table;
+static uint64_t     table_max_staleness;
 
 
 /**
@@ -111,7 +154,9 @@ These are SMC specific return codes
 typedef enum {
     kSMCSuccess     = 0,
     kSMCError       = 1,
-    kSMCKeyNotFound = 0x84
+    kSMCKeyNotFound = 0x84,
+    kSMCKeySizeMismatch = 0x87,
+    kSMCKeyIndexRangeError = 0xb8
 } kSMC_t;
 
 
@@ -200,14 +245,247 @@ typedef struct {
 
 
 /**
-Used for returning data from the SMC.
+Transport for calls to the SMC. The I/O Kit transport talks to AppleSMC.kext,
+the simulated one to an in-process key store.
+
+- open      : Open a connection
+- close     : Close a connection
+- call      : Make a call over a connection
+- get_model : Get the model name of the machine
 */
 typedef struct {
-    uint8_t  data[32];
+    kern_return_t (*open)(io_connect_t *connection);
+    kern_return_t (*close)(io_connect_t connection);
+    kern_return_t (*call)(io_connect_t    connection,
+                          SMCParamStruct *inputStruct,
+                          SMCParamStruct *outputStruct);
+    kern_return_t (*get_model)(io_name_t model);
+} transport_t;
+
+
+/**
+Key in the simulated SMC key store
+*/
+typedef struct {
+    uint32_t key;
     uint32_t dataType;
     uint32_t dataSize;
-    kSMC_t   kSMC;
-} smc_return_t;
+    uint8_t  attributes;
+    uint8_t  data[32];
+} sim_key_t;
+
+
+/**
+Header of a catalog file. Followed by count smc_key_info_t records, sorted by
+key.
+
+- magic       : CATALOG_MAGIC
+- version     : CATALOG_VERSION
+- count       : Number of records
+- record_size : sizeof(smc_key_info_t) at the time of writing
+- model       : Machine model the catalog was built on
+*/
+typedef struct {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  count;
+    uint32_t  record_size;
+    io_name_t model;
+} catalog_header_t;
+
+
+/**
+Header of a recording file. Followed by one record_t per call, each followed by
+payload_size bytes of payload.
+
+- magic       : RECORDING_MAGIC
+- version     : RECORDING_VERSION
+- record_size : sizeof(record_t) at the time of writing
+- reserved    : Zero
+- model       : Machine model the recording was made on
+*/
+typedef struct {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  record_size;
+    uint32_t  reserved;
+    io_name_t model;
+} recording_header_t;
+
+
+/**
+Recorded call to the SMC. Only the fields of SMCParamStruct that take part in
+a call are kept, which makes a record a quarter of the size of the two structs.
+
+- time         : When the call returned, in nanoseconds since recording
+                 started
+- key          : Requested key
+- data32       : Requested index, for kSMCGetKeyFromIndex
+- result       : I/O Kit return code of the call
+- out_key      : Key returned, for kSMCGetKeyFromIndex
+- out_data32   : Number returned, for kSMCGetKeyCount
+- dataSize     : Key info returned, for kSMCGetKeyInfo
+- dataType     : Key info returned
+- selector     : Function selector (data8)
+- kSMC         : SMC return code
+- attributes   : Key info returned
+- payload_size : Number of bytes of payload following the record. Bytes read
+                 for kSMCReadKey, bytes written for kSMCWriteKey.
+*/
+typedef struct {
+    uint64_t time;
+    uint32_t key;
+    uint32_t data32;
+    int32_t  result;
+    uint32_t out_key;
+    uint32_t out_data32;
+    uint32_t dataSize;
+    uint32_t dataType;
+    uint8_t  selector;
+    uint8_t  kSMC;
+    uint8_t  attributes;
+    uint8_t  payload_size;
+} record_t;
+
+
+/**
+Recorded call, with its payload, as loaded for replay
+*/
+typedef struct {
+    record_t record;
+    uint8_t  payload[32];
+} replay_record_t;
+
+
+/**
+Recorded calls with the same key (or index, for kSMCGetKeyFromIndex) and
+selector. They are served in recorded order, wrapping around at the end.
+
+- match    : Key, or index for kSMCGetKeyFromIndex
+- selector : Function selector
+- first    : Index of the first call in replay_order
+- count    : Number of calls
+- cursor   : Number of calls served
+*/
+typedef struct {
+    uint32_t match;
+    uint8_t  selector;
+    size_t   first;
+    size_t   count;
+    uint64_t cursor;
+} replay_group_t;
+
+
+/**
+Slice of the key index range walked by one enumeration thread. See
+smc_catalog_build().
+
+- keys     : Catalog entries, indexed by key index
+- first    : First key index of the slice
+- last     : One past the last key index of the slice
+- own_conn : Should the slice open its own connection to the SMC?
+- result   : I/O Kit return code of the walk
+*/
+typedef struct {
+    smc_key_info_t *keys;
+    uint32_t        first;
+    uint32_t        last;
+    bool            own_conn;
+    kern_return_t   result;
+} enum_shard_t;
+
+
+/**
+SMC context. See smc_ctx_open().
+
+- conn         : Connection to the SMC, owned by the context
+- inputStruct  : Scratch param struct for calls made through the context
+- outputStruct : Scratch param struct for responses
+- pool         : Pool that handed the context out, NULL if opened on its own
+*/
+struct smc_ctx_s {
+    io_connect_t    conn;
+    SMCParamStruct  inputStruct;
+    SMCParamStruct  outputStruct;
+    smc_ctx_pool_t *pool;
+};
+
+
+/**
+Our default context, used by open_smc(), close_smc() and every function not
+taking a context. Only its connection is used, calls keep their param structs
+on the stack so they stay safe to make from any thread.
+*/
+static smc_ctx_t default_ctx;
+
+
+/**
+Pool of contexts, one per thread. See smc_ctx_pool_create().
+
+- key      : Thread specific key holding each thread's context
+- lock     : Guards ctxs
+- ctxs     : Every context handed out, so they can be closed with the pool
+- num_ctxs : Number of contexts handed out
+*/
+struct smc_ctx_pool_s {
+    pthread_key_t   key;
+    pthread_mutex_t lock;
+    smc_ctx_t     **ctxs;
+    size_t          num_ctxs;
+};
+
+
+/**
+Prepared SMC key. See smc_prepare().
+
+- inputStruct  : Pre-filled for a kSMCReadKey call, including the cached key
+                 info
+- keyInfoValid : False if the key info must be fetched again before a read
+*/
+struct smc_key_s {
+    SMCParamStruct inputStruct;
+    bool           keyInfoValid;
+};
+
+
+/**
+What a write batch knows about a key, kept across smc_write_batch_apply().
+
+- key          : SMC key, as a uint32_t
+- keyInfo      : Cached key info
+- keyInfoValid : False if the key info must be fetched before the next write
+- confirmed    : Was data written successfully (and read back, if verifying)?
+- data         : Value last confirmed
+*/
+typedef struct {
+    uint32_t       key;
+    SMCKeyInfoData keyInfo;
+    bool           keyInfoValid;
+    bool           confirmed;
+    uint8_t        data[32];
+} write_state_t;
+
+
+/**
+Write batch. See smc_write_batch_create().
+
+- ctx            : Context writes go through, NULL for the default one
+- queue          : Writes queued for the next apply, at most one per key
+- num_queued     : Number of writes queued
+- queue_capacity : Size of queue
+- states         : State of every key ever queued
+- num_states     : Number of keys
+- capacity       : Size of states
+*/
+struct smc_write_batch_s {
+    smc_ctx_t     *ctx;
+    smc_value_t   *queue;
+    size_t         num_queued;
+    size_t         queue_capacity;
+    write_state_t *states;
+    size_t         num_states;
+    size_t         capacity;
+};
 
 
 //------------------------------------------------------------------------------
@@ -229,12 +507,27 @@ static unsigned int from_fpe2(uint8_t data[32])
     // This is assumend to mean floating point, with 2 exponent bits
     // http://stackoverflow.com/questions/22160746/fpe2-and-sp78-data-types
     ans += data[0] << 6;
-    ans += data[1] << 2;
+    ans += data[1] >> 2;
 
     return ans;
 }
 
 
+/**
+Convert data from SMC of sp78 type to human readable.
+
+:param: data Data from the SMC to be converted. Assumed data size of 2.
+:returns: Converted data
+*/
+static double from_sp78(uint8_t data[32])
+{
+    // Signed, 7 integer bits and 8 fraction bits
+    int16_t ans = (int16_t)(data[0] << 8 | data[1]);
+
+    return ans / 256.0;
+}
+
+
 /**
 Convert to fpe2 data type to be passed to SMC.
 
@@ -291,6 +584,51 @@ static void to_string(uint32_t val, char *dataType)
 }
 
 
+/**
+SMC key for a fan, "F<fan_num><a><b>" as a uint32_t. For example, fan 0 with
+'A', 'c' gives "F0Ac".
+
+:returns: uint32_t translation.
+          Returns zero if fan_num doesn't fit in the key (above 9).
+*/
+static uint32_t fan_key(unsigned int fan_num, char a, char b)
+{
+    if (fan_num > 9) {
+        return 0;
+    }
+
+    return SMC_FOURCC('F', '0' + fan_num, a, b);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - TIME
+//------------------------------------------------------------------------------
+
+
+/**
+Monotonic clock, in nanoseconds
+*/
+static uint64_t monotonic_ns(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+
 //------------------------------------------------------------------------------
 // MARK: HELPERS - TMP CONVERSION
 //------------------------------------------------------------------------------
@@ -317,25 +655,49 @@ static double to_kelvin(double tmp)
 
 
 //------------------------------------------------------------------------------
-// MARK: "PRIVATE" FUNCTIONS
+// MARK: TRANSPORT - I/O KIT
 //------------------------------------------------------------------------------
 
 
-/**
-Make a call to the SMC
+#ifdef __APPLE__
 
-:param: inputStruct Struct that holds data telling the SMC what you want
-:param: outputStruct Struct holding the SMC's response
-:returns: I/O Kit return code
-*/
-static kern_return_t call_smc(SMCParamStruct *inputStruct,
-                              SMCParamStruct *outputStruct)
+
+static kern_return_t iokit_open(io_connect_t *connection)
+{
+    kern_return_t result;
+    io_service_t service;
+
+    service = IOServiceGetMatchingService(kIOMasterPortDefault,
+                                          IOServiceMatching(IOSERVICE_SMC));
+
+    if (service == 0) {
+        // NOTE: IOServiceMatching documents 0 on failure
+        printf("ERROR: %s NOT FOUND\n", IOSERVICE_SMC);
+        return kIOReturnError;
+    }
+
+    result = IOServiceOpen(service, mach_task_self(), 0, connection);
+    IOObjectRelease(service);
+
+    return result;
+}
+
+
+static kern_return_t iokit_close(io_connect_t connection)
+{
+    return IOServiceClose(connection);
+}
+
+
+static kern_return_t iokit_call(io_connect_t    connection,
+                                SMCParamStruct *inputStruct,
+                                SMCParamStruct *outputStruct)
 {
     kern_return_t result;
     size_t inputStructCnt  = sizeof(SMCParamStruct);
     size_t outputStructCnt = sizeof(SMCParamStruct);
 
-    result = IOConnectCallStructMethod(conn, kSMCHandleYPCEvent,
+    result = IOConnectCallStructMethod(connection, kSMCHandleYPCEvent,
                                              inputStruct,
                                              inputStructCnt,
                                              outputStruct,
@@ -351,350 +713,3446 @@ static kern_return_t call_smc(SMCParamStruct *inputStruct,
 }
 
 
-/**
-Read data from the SMC
-
-:param: key The SMC key
-*/
-static kern_return_t read_smc(char *key, smc_return_t *result_smc)
+static kern_return_t iokit_get_model(io_name_t model)
 {
+    io_service_t  service;
     kern_return_t result;
-    SMCParamStruct inputStruct;
-    SMCParamStruct outputStruct;
+    
+    service = IOServiceGetMatchingService(kIOMasterPortDefault,
+                                          IOServiceMatching(IOSERVICE_MODEL));
+    
+    if (service == 0) {
+        printf("ERROR: %s NOT FOUND\n", IOSERVICE_MODEL);
+        return kIOReturnError;
+    }
 
-    memset(&inputStruct,  0, sizeof(SMCParamStruct));
-    memset(&outputStruct, 0, sizeof(SMCParamStruct));
-    memset(result_smc,    0, sizeof(smc_return_t));
+    // Get the model name
+    result = IORegistryEntryGetName(service, model);
+    IOObjectRelease(service);
 
-    // First call to AppleSMC - get key info
-    inputStruct.key = to_uint32_t(key);
-    inputStruct.data8 = kSMCGetKeyInfo;
+    return result;
+} 
 
-    result = call_smc(&inputStruct, &outputStruct);
-    result_smc->kSMC = outputStruct.result;
 
-    if (result != kIOReturnSuccess || outputStruct.result != kSMCSuccess) {
-        return result;
-    }
+static const transport_t iokit_transport = {
+    iokit_open,
+    iokit_close,
+    iokit_call,
+    iokit_get_model
+};
 
-    // Store data for return
-    result_smc->dataSize = outputStruct.keyInfo.dataSize;
-    result_smc->dataType = outputStruct.keyInfo.dataType;    
-    
 
-    // Second call to AppleSMC - now we can get the data
-    inputStruct.keyInfo.dataSize = outputStruct.keyInfo.dataSize;
-    inputStruct.data8 = kSMCReadKey;
+#endif
 
-    result = call_smc(&inputStruct, &outputStruct);
-    result_smc->kSMC = outputStruct.result;
 
-    if (result != kIOReturnSuccess || outputStruct.result != kSMCSuccess) {
-        return result;
-    }
+//------------------------------------------------------------------------------
+// MARK: TRANSPORT - SIMULATED SMC
+//------------------------------------------------------------------------------
 
-    memcpy(result_smc->data, outputStruct.bytes, sizeof(outputStruct.bytes));
 
-    return result;
-}
+/**
+Simulated SMC key store, sorted by key. Guarded by sim_lock.
+*/
+static sim_key_t *sim_keys;
+static size_t     sim_count;
+static size_t     sim_capacity;
 
 
 /**
-Write data to the SMC.
+Simulated per-call latency and uniform jitter on top of it, in nanoseconds
+*/
+static uint64_t sim_latency;
+static uint64_t sim_jitter;
 
-:returns: IOReturn IOKit return code
+
+/**
+Simulated error rates, as probabilities in [0, 1]
 */
-static kern_return_t write_smc(char *key, smc_return_t *result_smc)
-{
-    kern_return_t result;
-    SMCParamStruct inputStruct;
-    SMCParamStruct outputStruct;
+static double sim_not_found_rate;
+static double sim_error_rate;
 
-    memset(&inputStruct,  0, sizeof(SMCParamStruct));
-    memset(&outputStruct, 0, sizeof(SMCParamStruct));
 
-    // First call to AppleSMC - get key info
-    inputStruct.key = to_uint32_t(key);
-    inputStruct.data8 = kSMCGetKeyInfo;
+/**
+Was the calling thread's last not found injected? Such a key is not cached as
+absent.
+*/
+static __thread bool sim_injected;
 
-    result = call_smc(&inputStruct, &outputStruct);
-    result_smc->kSMC = outputStruct.result;
 
-    if (result != kIOReturnSuccess || outputStruct.result != kSMCSuccess) {
-        return result;
-    }
+/**
+Simulated I/O Kit failures: the code returned, and its probability in [0, 1]
+*/
+static kern_return_t sim_io_error_code;
+static double        sim_io_error_rate;
 
-    // Check data is correct
-    if (result_smc->dataSize != outputStruct.keyInfo.dataSize ||
-        result_smc->dataType != outputStruct.keyInfo.dataType) {
-        return kIOReturnBadArgument;
-    }
 
-    // Second call to AppleSMC - now we can write the data
-    inputStruct.data8 = kSMCWriteKey;
-    inputStruct.keyInfo.dataSize = outputStruct.keyInfo.dataSize;
+/**
+Number of calls made to the simulated SMC
+*/
+static uint64_t sim_calls;
 
-    // Set data to write
-    memcpy(inputStruct.bytes, result_smc->data, sizeof(result_smc->data));
 
-    result = call_smc(&inputStruct, &outputStruct);
-    result_smc->kSMC = outputStruct.result;
+/**
+Called after every successful write to the simulated SMC, see
+smc_sim_set_write_hook()
+*/
+static smc_sim_write_hook_t sim_write_hook;
+static void                *sim_write_context;
 
-    return result;
-}
+
+static pthread_rwlock_t sim_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 
 /**
-Get the model name of the machine.
+Next pseudo random number, xorshift64*. Per thread, so no locking is needed.
 */
-static kern_return_t get_machine_model(io_name_t model)
+static uint64_t sim_random(void)
 {
-    io_service_t  service;
-    kern_return_t result;
-    
-    service = IOServiceGetMatchingService(kIOMasterPortDefault,
-                                          IOServiceMatching(IOSERVICE_MODEL));
-    
-    if (service == 0) {
-        printf("ERROR: %s NOT FOUND\n", IOSERVICE_MODEL);
-        return kIOReturnError;
-    }
+    static __thread uint64_t state;
 
-    // Get the model name
-    result = IORegistryEntryGetName(service, model);
-    IOObjectRelease(service);
+    if (state == 0) {
+        state = (uintptr_t)&state ^ monotonic_ns() ^ 0x9e3779b97f4a7c15ULL;
+    }
 
-    return result;
-} 
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
 
+    return state * 0x2545f4914f6cdd1dULL;
+}
 
-//------------------------------------------------------------------------------
-// MARK: "PUBLIC" FUNCTIONS
-//------------------------------------------------------------------------------
 
+/**
+Uniform random number in [0, 1)
+*/
+static double sim_random_unit(void)
+{
+    return (sim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+Find a key in the simulated key store. sim_lock must be held.
+
+:returns: Index of the key, or where it would be inserted if not found
+*/
+static size_t sim_find(uint32_t key, bool *found)
+{
+    size_t lo = 0;
+    size_t hi = sim_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (sim_keys[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *found = lo < sim_count && sim_keys[lo].key == key;
+
+    return lo;
+}
+
+
+/**
+Add or replace a key in the simulated key store. sim_lock must be held for
+writing.
+*/
+static kern_return_t sim_upsert(const sim_key_t *entry)
+{
+    bool   found;
+    size_t i = sim_find(entry->key, &found);
+
+    if (!found) {
+        if (sim_count == sim_capacity) {
+            size_t capacity = sim_capacity ? sim_capacity * 2 : 64;
+            sim_key_t *keys = realloc(sim_keys, capacity * sizeof(sim_key_t));
+
+            if (keys == NULL) {
+                return kIOReturnNoMemory;
+            }
+
+            sim_keys = keys;
+            sim_capacity = capacity;
+        }
+
+        memmove(&sim_keys[i + 1], &sim_keys[i],
+                (sim_count - i) * sizeof(sim_key_t));
+        sim_count++;
+    }
+
+    sim_keys[i] = *entry;
+
+    return kIOReturnSuccess;
+}
+
+
+/**
+Keep the #KEY key (total number of keys, ui32) in step with the key store, as
+the real SMC does. sim_lock must be held for writing.
+*/
+static kern_return_t sim_update_key_count(void)
+{
+    bool      found;
+    sim_key_t entry;
+
+    memset(&entry, 0, sizeof(sim_key_t));
+    entry.key = SMC_KEY_NUM_KEYS;
+    entry.dataType = SMC_TYPE_UINT32;
+    entry.dataSize = 4;
+
+    // Count #KEY itself
+    sim_find(entry.key, &found);
+    uint32_t count = (uint32_t)sim_count + (found ? 0 : 1);
+
+    entry.data[0] = count >> 24;
+    entry.data[1] = count >> 16;
+    entry.data[2] = count >> 8;
+    entry.data[3] = count;
+
+    return sim_upsert(&entry);
+}
+
+
+/**
+Wait out the simulated latency. Short waits spin, as sleeping can't be that
+precise.
+*/
+static void sim_delay(void)
+{
+    uint64_t delay = sim_latency;
+
+    if (sim_jitter > 0) {
+        delay += sim_random() % (sim_jitter + 1);
+    }
+
+    if (delay == 0) {
+        return;
+    }
+
+    if (delay >= 100000) {
+        struct timespec ts;
+
+        ts.tv_sec  = delay / 1000000000;
+        ts.tv_nsec = delay % 1000000000;
+        nanosleep(&ts, NULL);
+        return;
+    }
+
+    uint64_t end = monotonic_ns() + delay;
+
+    while (monotonic_ns() < end) {
+        ;
+    }
+}
+
+
+static kern_return_t sim_open(io_connect_t *connection)
+{
+    *connection = 1;
+
+    return kIOReturnSuccess;
+}
+
+
+static kern_return_t sim_close(io_connect_t connection)
+{
+    return kIOReturnSuccess;
+}
+
+
+static kern_return_t sim_call(io_connect_t    connection,
+                              SMCParamStruct *inputStruct,
+                              SMCParamStruct *outputStruct)
+{
+    bool   found;
+    size_t i;
+
+    __atomic_add_fetch(&sim_calls, 1, __ATOMIC_RELAXED);
+
+    sim_delay();
+
+    memset(outputStruct, 0, sizeof(SMCParamStruct));
+    outputStruct->key = inputStruct->key;
+    sim_injected = false;
+
+    if (sim_io_error_rate > 0 && sim_random_unit() < sim_io_error_rate) {
+        return sim_io_error_code;
+    }
+
+    if (inputStruct->data8 == kSMCGetKeyInfo ||
+        inputStruct->data8 == kSMCReadKey    ||
+        inputStruct->data8 == kSMCWriteKey) {
+        if (sim_not_found_rate > 0 && sim_random_unit() < sim_not_found_rate) {
+            outputStruct->result = kSMCKeyNotFound;
+            sim_injected = true;
+            return kIOReturnSuccess;
+        }
+
+        if (sim_error_rate > 0 && sim_random_unit() < sim_error_rate) {
+            outputStruct->result = kSMCError;
+            return kIOReturnSuccess;
+        }
+    }
+
+    if (inputStruct->data8 == kSMCWriteKey) {
+        pthread_rwlock_wrlock(&sim_lock);
+    } else {
+        pthread_rwlock_rdlock(&sim_lock);
+    }
+
+    switch (inputStruct->data8) {
+        case kSMCGetKeyInfo:
+            i = sim_find(inputStruct->key, &found);
+
+            if (!found) {
+                outputStruct->result = kSMCKeyNotFound;
+                break;
+            }
+
+            outputStruct->keyInfo.dataSize = sim_keys[i].dataSize;
+            outputStruct->keyInfo.dataType = sim_keys[i].dataType;
+            outputStruct->keyInfo.dataAttributes = sim_keys[i].attributes;
+            break;
+        case kSMCReadKey:
+        case kSMCWriteKey:
+            i = sim_find(inputStruct->key, &found);
+
+            if (!found) {
+                outputStruct->result = kSMCKeyNotFound;
+                break;
+            }
+
+            if (inputStruct->keyInfo.dataSize != sim_keys[i].dataSize) {
+                outputStruct->result = kSMCKeySizeMismatch;
+                break;
+            }
+
+            if (inputStruct->data8 == kSMCReadKey) {
+                memcpy(outputStruct->bytes, sim_keys[i].data,
+                                            sim_keys[i].dataSize);
+            } else {
+                memcpy(sim_keys[i].data, inputStruct->bytes,
+                                         sim_keys[i].dataSize);
+            }
+            break;
+        case kSMCGetKeyCount:
+            outputStruct->data32 = (uint32_t)sim_count;
+            break;
+        case kSMCGetKeyFromIndex:
+            if (inputStruct->data32 >= sim_count) {
+                outputStruct->result = kSMCKeyIndexRangeError;
+                break;
+            }
+
+            outputStruct->key = sim_keys[inputStruct->data32].key;
+            break;
+        default:
+            outputStruct->result = kSMCError;
+            break;
+    }
+
+    smc_sim_write_hook_t hook = sim_write_hook;
+    void *context = sim_write_context;
+
+    pthread_rwlock_unlock(&sim_lock);
+
+    // Outside the lock, so the hook may update other keys
+    if (inputStruct->data8 == kSMCWriteKey &&
+        outputStruct->result == kSMCSuccess && hook != NULL) {
+        hook(inputStruct->key, inputStruct->bytes,
+             inputStruct->keyInfo.dataSize, context);
+    }
+
+    return kIOReturnSuccess;
+}
+
+
+static kern_return_t sim_get_model(io_name_t model)
+{
+    strncpy(model, SIM_MODEL, sizeof(io_name_t));
+
+    return kIOReturnSuccess;
+}
+
+
+static const transport_t sim_transport = {
+    sim_open,
+    sim_close,
+    sim_call,
+    sim_get_model
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: TRANSPORT - REPLAY
+//------------------------------------------------------------------------------
+
+
+/**
+Loaded recording, see smc_replay_load(). Read-only once loaded.
+
+- replay_records : Every recorded call
+- replay_order   : Indexes of replay_records, grouped by replay_groups
+- replay_groups  : Sorted by match then selector
+*/
+static replay_record_t *replay_records;
+static size_t           replay_num_records;
+static size_t          *replay_order;
+static replay_group_t  *replay_groups;
+static size_t           replay_num_groups;
+static io_name_t        replay_model;
+
+
+/**
+Replay mode, and when the replay started, for SMC_REPLAY_REALTIME
+*/
+static smc_replay_mode_t replay_mode;
+static uint64_t          replay_start;
+
+
+/**
+Number of calls that had no recorded call to match
+*/
+static uint64_t replay_misses;
+
+
+/**
+What a call is matched on. Index lookups all have the same (zero) key, so they
+are told apart by index.
+*/
+static uint32_t replay_match(uint8_t selector, uint32_t key, uint32_t data32)
+{
+    return selector == kSMCGetKeyFromIndex ? data32 : key;
+}
+
+
+static int compare_replay_order(const void *a, const void *b)
+{
+    const record_t *record_a = &replay_records[*(const size_t *)a].record;
+    const record_t *record_b = &replay_records[*(const size_t *)b].record;
+    uint32_t match_a = replay_match(record_a->selector, record_a->key,
+                                                        record_a->data32);
+    uint32_t match_b = replay_match(record_b->selector, record_b->key,
+                                                        record_b->data32);
+
+    if (match_a != match_b) {
+        return (match_a > match_b) - (match_a < match_b);
+    }
+
+    if (record_a->selector != record_b->selector) {
+        return record_a->selector - record_b->selector;
+    }
+
+    // Keep recorded order within a group
+    return (*(const size_t *)a > *(const size_t *)b) -
+           (*(const size_t *)a < *(const size_t *)b);
+}
+
+
+static replay_group_t *replay_find(uint32_t match, uint8_t selector)
+{
+    size_t lo = 0;
+    size_t hi = replay_num_groups;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const replay_group_t *group = &replay_groups[mid];
+
+        if (group->match < match ||
+            (group->match == match && group->selector < selector)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < replay_num_groups && replay_groups[lo].match == match &&
+        replay_groups[lo].selector == selector) {
+        return &replay_groups[lo];
+    }
+
+    return NULL;
+}
+
+
+static void replay_free(void)
+{
+    free(replay_records);
+    free(replay_order);
+    free(replay_groups);
+
+    replay_records     = NULL;
+    replay_order       = NULL;
+    replay_groups      = NULL;
+    replay_num_records = 0;
+    replay_num_groups  = 0;
+}
+
+
+static kern_return_t replay_open(io_connect_t *connection)
+{
+    if (replay_records == NULL) {
+        return kIOReturnNotOpen;
+    }
+
+    *connection = 1;
+
+    return kIOReturnSuccess;
+}
+
+
+static kern_return_t replay_close(io_connect_t connection)
+{
+    return kIOReturnSuccess;
+}
+
+
+static kern_return_t replay_call(io_connect_t    connection,
+                                 SMCParamStruct *inputStruct,
+                                 SMCParamStruct *outputStruct)
+{
+    const replay_record_t *entry;
+    replay_group_t *group = replay_find(replay_match(inputStruct->data8,
+                                                     inputStruct->key,
+                                                     inputStruct->data32),
+                                        inputStruct->data8);
+
+    memset(outputStruct, 0, sizeof(SMCParamStruct));
+    outputStruct->key = inputStruct->key;
+
+    if (group == NULL) {
+        __atomic_add_fetch(&replay_misses, 1, __ATOMIC_RELAXED);
+        outputStruct->result = kSMCKeyNotFound;
+        return kIOReturnSuccess;
+    }
+
+    uint64_t n = __atomic_fetch_add(&group->cursor, 1, __ATOMIC_RELAXED);
+
+    entry = &replay_records[replay_order[group->first + n % group->count]];
+
+    if (replay_mode == SMC_REPLAY_REALTIME) {
+        uint64_t now = monotonic_ns() - replay_start;
+
+        if (entry->record.time > now) {
+            struct timespec ts;
+
+            ts.tv_sec  = (entry->record.time - now) / 1000000000;
+            ts.tv_nsec = (entry->record.time - now) % 1000000000;
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    outputStruct->result                 = entry->record.kSMC;
+    outputStruct->data32                 = entry->record.out_data32;
+    outputStruct->keyInfo.dataSize       = entry->record.dataSize;
+    outputStruct->keyInfo.dataType       = entry->record.dataType;
+    outputStruct->keyInfo.dataAttributes = entry->record.attributes;
+
+    if (inputStruct->data8 == kSMCGetKeyFromIndex) {
+        outputStruct->key = entry->record.out_key;
+    }
+
+    if (inputStruct->data8 == kSMCReadKey) {
+        memcpy(outputStruct->bytes, entry->payload,
+                                    entry->record.payload_size);
+    }
+
+    return entry->record.result;
+}
+
+
+static kern_return_t replay_get_model(io_name_t model)
+{
+    strncpy(model, replay_model, sizeof(io_name_t));
+
+    return kIOReturnSuccess;
+}
+
+
+static const transport_t replay_transport = {
+    replay_open,
+    replay_close,
+    replay_call,
+    replay_get_model
+};
+
+
+/**
+Transport all calls to the SMC go through. I/O Kit where available.
+*/
+#ifdef __APPLE__
+static const transport_t *transport = &iokit_transport;
+#else
+static const transport_t *transport = &sim_transport;
+#endif
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - STATISTICS
+//------------------------------------------------------------------------------
+
+
+#ifndef SMC_NO_STATS
+
+
+/**
+Statistics of one thread. Only the owning thread writes them, smc_get_stats()
+merges every thread's on demand.
+
+- stats     : Counters. keys is used as an open addressed hash table.
+- epoch     : stats_epoch the counters were last reset at
+- countdown : Calls left until the next one is timed
+- misses    : Negative key cache misses, see smc_get_key_cache_stats(). Not
+              reset by smc_reset_stats().
+- next      : Next thread's statistics
+*/
+typedef struct stats_block_s {
+    smc_stats_t           stats;
+    uint64_t              epoch;
+    unsigned int          countdown;
+    uint64_t              misses;
+    struct stats_block_s *next;
+} stats_block_t;
+
+
+/**
+Statistics of live threads, and those merged from exited threads. Guarded by
+stats_lock.
+*/
+static stats_block_t  *stats_blocks;
+static smc_stats_t     stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+Negative key cache misses of exited threads, and the total at the last
+smc_clear_key_cache(). Guarded by stats_lock.
+*/
+static uint64_t misses_retired;
+static uint64_t misses_cleared;
+
+
+/**
+Bumped by smc_reset_stats(). Each thread zeroes its own counters on its next
+call, so they are never written by two threads.
+*/
+static uint64_t stats_epoch;
+
+
+/**
+initial-exec TLS makes the per-call lookup of the thread's statistics a single
+load, but it takes from the static TLS surplus, which a dlopen()ed library may
+find used up. Only the static library (make static) asks for it.
+*/
+#ifdef SMC_STATIC_TLS
+#define STATS_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define STATS_TLS_MODEL
+#endif
+
+
+/**
+Statistics of the calling thread, and the key used to merge them on exit
+*/
+static __thread stats_block_t *stats_block STATS_TLS_MODEL;
+static pthread_key_t           stats_key;
+static pthread_once_t          stats_once = PTHREAD_ONCE_INIT;
+
+
+/**
+Add to a counter. Only the owning thread writes, so a plain add will do, but it
+must not tear for smc_get_stats() reading it on another thread.
+*/
+#define STAT_ADD(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+#define STAT_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+
+/**
+Find the entry of a key in a hash table of key statistics.
+
+:param: insert Claim an empty entry if the key isn't there
+:returns: The entry, NULL if not found (or the table is full)
+*/
+static smc_key_stats_t *stats_find_key(smc_stats_t *stats, uint32_t key,
+                                                           bool insert)
+{
+    size_t i = (key * 0x9e3779b1u) >> 24;
+
+    for (size_t probe = 0; probe < SMC_STATS_MAX_KEYS; probe++) {
+        smc_key_stats_t *entry = &stats->keys[(i + probe) %
+                                              SMC_STATS_MAX_KEYS];
+
+        if (entry->key == key) {
+            return entry;
+        }
+
+        if (entry->key == 0) {
+            if (!insert) {
+                return NULL;
+            }
+
+            __atomic_store_n(&entry->key, key, __ATOMIC_RELAXED);
+            STAT_ADD(stats->num_keys, 1);
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+Add the counters of one thread into a total
+*/
+static void stats_merge(smc_stats_t *into, smc_stats_t *from)
+{
+    into->calls += STAT_LOAD(from->calls);
+    into->timed += STAT_LOAD(from->timed);
+    into->total_ns += STAT_LOAD(from->total_ns);
+    into->keys_dropped += STAT_LOAD(from->keys_dropped);
+
+    for (size_t i = 0; i < SMC_STATS_SELECTORS; i++) {
+        into->selector_calls[i] += STAT_LOAD(from->selector_calls[i]);
+    }
+
+    for (size_t i = 0; i < 256; i++) {
+        into->kSMC_errors[i] += STAT_LOAD(from->kSMC_errors[i]);
+        into->io_errors[i] += STAT_LOAD(from->io_errors[i]);
+    }
+
+    for (size_t i = 0; i < SMC_STATS_BUCKETS; i++) {
+        into->latency[i] += STAT_LOAD(from->latency[i]);
+    }
+
+    for (size_t i = 0; i < SMC_STATS_MAX_KEYS; i++) {
+        smc_key_stats_t *entry = &from->keys[i];
+        uint32_t key = STAT_LOAD(entry->key);
+        smc_key_stats_t *total;
+
+        if (key == 0) {
+            continue;
+        }
+
+        total = stats_find_key(into, key, true);
+
+        if (total == NULL) {
+            into->keys_dropped += STAT_LOAD(entry->calls);
+            continue;
+        }
+
+        uint64_t max_ns = STAT_LOAD(entry->max_ns);
+
+        total->calls += STAT_LOAD(entry->calls);
+        total->errors += STAT_LOAD(entry->errors);
+        total->timed += STAT_LOAD(entry->timed);
+        total->total_ns += STAT_LOAD(entry->total_ns);
+        total->max_ns = max_ns > total->max_ns ? max_ns : total->max_ns;
+    }
+}
+
+
+static int compare_key_stats(const void *a, const void *b)
+{
+    uint32_t key_a = ((const smc_key_stats_t *)a)->key;
+    uint32_t key_b = ((const smc_key_stats_t *)b)->key;
+
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+
+/**
+Thread exit - keep the thread's counters, and free them
+*/
+static void stats_thread_exit(void *arg)
+{
+    stats_block_t *block = arg;
+
+    pthread_mutex_lock(&stats_lock);
+
+    if (block->epoch == stats_epoch) {
+        stats_merge(&stats_retired, &block->stats);
+    }
+
+    misses_retired += STAT_LOAD(block->misses);
+
+    for (stats_block_t **link = &stats_blocks; *link != NULL;
+         link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&stats_lock);
+
+    free(block);
+}
+
+
+static void stats_init(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+
+/**
+Get the calling thread's statistics, creating them on its first call
+
+:returns: NULL if they couldn't be allocated, the call then goes uncounted
+*/
+static stats_block_t *stats_get_block(void)
+{
+    stats_block_t *block = stats_block;
+
+    if (block != NULL) {
+        return block;
+    }
+
+    pthread_once(&stats_once, stats_init);
+    block = calloc(1, sizeof(stats_block_t));
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    block->countdown = 1;
+
+    pthread_mutex_lock(&stats_lock);
+    block->epoch = stats_epoch;
+    block->next  = stats_blocks;
+    stats_blocks = block;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, block);
+    stats_block = block;
+
+    return block;
+}
+
+
+/**
+Start accounting for a call.
+
+:param: start Time the call started, if this call is timed, otherwise zero
+*/
+static stats_block_t *stats_begin(uint64_t *start)
+{
+    stats_block_t *block = stats_get_block();
+
+    *start = 0;
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    // Reset since the last call?
+    uint64_t epoch = __atomic_load_n(&stats_epoch, __ATOMIC_RELAXED);
+
+    if (block->epoch != epoch) {
+        memset(&block->stats, 0, sizeof(smc_stats_t));
+        __atomic_store_n(&block->epoch, epoch, __ATOMIC_RELEASE);
+    }
+
+    // Timing every call would cost more than everything else here put
+    // together, so only one in SMC_STATS_SAMPLE_RATE is
+    if (--block->countdown == 0) {
+        block->countdown = SMC_STATS_SAMPLE_RATE;
+        *start = monotonic_ns();
+    }
+
+    return block;
+}
+
+
+/**
+Account for a finished call
+*/
+static void stats_end(stats_block_t *block, uint64_t start,
+                      const SMCParamStruct *inputStruct,
+                      const SMCParamStruct *outputStruct,
+                      kern_return_t result)
+{
+    smc_stats_t *stats;
+    smc_key_stats_t *entry = NULL;
+    bool failed = result != kIOReturnSuccess ||
+                  outputStruct->result != kSMCSuccess;
+
+    if (block == NULL) {
+        return;
+    }
+
+    stats = &block->stats;
+    STAT_ADD(stats->calls, 1);
+    STAT_ADD(stats->selector_calls[inputStruct->data8 < SMC_STATS_SELECTORS ?
+                                   inputStruct->data8 : 0], 1);
+
+    // Index lookups have no key
+    if (inputStruct->key != 0) {
+        entry = stats_find_key(stats, inputStruct->key, true);
+
+        if (entry == NULL) {
+            STAT_ADD(stats->keys_dropped, 1);
+        } else {
+            STAT_ADD(entry->calls, 1);
+        }
+    }
+
+    if (failed) {
+        if (result != kIOReturnSuccess) {
+            // By the low byte, which both the full code (0xe00002XX) and the
+            // err_get_code() form iokit_call() returns (0x2XX) share
+            STAT_ADD(stats->io_errors[(uint32_t)result & 0xff], 1);
+        } else {
+            STAT_ADD(stats->kSMC_errors[outputStruct->result], 1);
+        }
+
+        if (entry != NULL) {
+            STAT_ADD(entry->errors, 1);
+        }
+    }
+
+    if (start != 0) {
+        uint64_t elapsed = monotonic_ns() - start;
+        unsigned int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+
+        if (bucket >= SMC_STATS_BUCKETS) {
+            bucket = SMC_STATS_BUCKETS - 1;
+        }
+
+        STAT_ADD(stats->timed, 1);
+        STAT_ADD(stats->total_ns, elapsed);
+        STAT_ADD(stats->latency[bucket], 1);
+
+        if (entry != NULL) {
+            STAT_ADD(entry->timed, 1);
+            STAT_ADD(entry->total_ns, elapsed);
+
+            if (elapsed > entry->max_ns) {
+                __atomic_store_n(&entry->max_ns, elapsed, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+
+/**
+Negative key cache misses of every thread, live or exited, since the process
+started. Must hold stats_lock.
+*/
+static uint64_t stats_total_misses(void)
+{
+    uint64_t total = misses_retired;
+
+    for (stats_block_t *block = stats_blocks; block != NULL;
+         block = block->next) {
+        total += STAT_LOAD(block->misses);
+    }
+
+    return total;
+}
+
+
+#endif
+
+
+//------------------------------------------------------------------------------
+// MARK: RECORDING
+//------------------------------------------------------------------------------
+
+
+/**
+File calls are being recorded to, NULL when not recording. Writes are
+serialised by record_lock, the pointer itself is checked without it on every
+call.
+*/
+static FILE           *record_file;
+static uint64_t        record_start;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+Append a call to the recording
+*/
+static void record_call(const SMCParamStruct *inputStruct,
+                        const SMCParamStruct *outputStruct,
+                        kern_return_t result)
+{
+    record_t record;
+    const uint8_t *payload = NULL;
+
+    memset(&record, 0, sizeof(record_t));
+    record.key        = inputStruct->key;
+    record.data32     = inputStruct->data32;
+    record.result     = result;
+    record.out_key    = outputStruct->key;
+    record.out_data32 = outputStruct->data32;
+    record.dataSize   = outputStruct->keyInfo.dataSize;
+    record.dataType   = outputStruct->keyInfo.dataType;
+    record.selector   = inputStruct->data8;
+    record.kSMC       = outputStruct->result;
+    record.attributes = outputStruct->keyInfo.dataAttributes;
+
+    if (inputStruct->data8 == kSMCReadKey) {
+        payload = outputStruct->bytes;
+    } else if (inputStruct->data8 == kSMCWriteKey) {
+        payload = inputStruct->bytes;
+    }
+
+    if (payload != NULL) {
+        record.payload_size = inputStruct->keyInfo.dataSize < 32 ?
+                              inputStruct->keyInfo.dataSize : 32;
+    }
+
+    pthread_mutex_lock(&record_lock);
+
+    if (record_file != NULL) {
+        record.time = monotonic_ns() - record_start;
+        fwrite(&record, sizeof(record_t), 1, record_file);
+        fwrite(payload, 1, record.payload_size, record_file);
+    }
+
+    pthread_mutex_unlock(&record_lock);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - KEY CACHE
+//------------------------------------------------------------------------------
+
+
+/**
+Keys checked by smc_probe_capabilities(), in bit order. Every SMC_KEY_*
+constant.
+*/
+static const uint32_t probe_keys[SMC_PROBE_KEYS] = {
+    SMC_KEY_AMBIENT_AIR_0, SMC_KEY_AMBIENT_AIR_1, SMC_KEY_CPU_0_DIODE,
+    SMC_KEY_CPU_0_HEATSINK, SMC_KEY_CPU_0_PROXIMITY, SMC_KEY_ENCLOSURE_BASE_0,
+    SMC_KEY_ENCLOSURE_BASE_1, SMC_KEY_ENCLOSURE_BASE_2,
+    SMC_KEY_ENCLOSURE_BASE_3, SMC_KEY_GPU_0_DIODE, SMC_KEY_GPU_0_HEATSINK,
+    SMC_KEY_GPU_0_PROXIMITY, SMC_KEY_HARD_DRIVE_BAY, SMC_KEY_MEMORY_SLOT_0,
+    SMC_KEY_MEMORY_SLOTS_PROXIMITY, SMC_KEY_NORTHBRIDGE,
+    SMC_KEY_NORTHBRIDGE_DIODE, SMC_KEY_NORTHBRIDGE_PROXIMITY,
+    SMC_KEY_THUNDERBOLT_0, SMC_KEY_THUNDERBOLT_1, SMC_KEY_WIRELESS_MODULE,
+
+    SMC_KEY_FAN_0, SMC_KEY_FAN_0_MIN_RPM, SMC_KEY_FAN_0_MAX_RPM,
+    SMC_KEY_FAN_0_SAFE_RPM, SMC_KEY_FAN_0_TARGET_RPM,
+    SMC_KEY_FAN_1, SMC_KEY_FAN_1_MIN_RPM, SMC_KEY_FAN_1_MAX_RPM,
+    SMC_KEY_FAN_1_SAFE_RPM, SMC_KEY_FAN_1_TARGET_RPM,
+    SMC_KEY_FAN_2, SMC_KEY_FAN_2_MIN_RPM, SMC_KEY_FAN_2_MAX_RPM,
+    SMC_KEY_FAN_2_SAFE_RPM, SMC_KEY_FAN_2_TARGET_RPM,
+    SMC_KEY_NUM_FANS, SMC_KEY_FORCE_BITS,
+
+    SMC_KEY_BATT_PWR, SMC_KEY_NUM_KEYS, SMC_KEY_ODD_FULL
+};
+
+
+/**
+Result of the last probe, valid once probed is set. See
+smc_probe_capabilities().
+*/
+static uint64_t probed_present;
+static bool     probed;
+
+
+/**
+Keys the SMC reported as not found, an open addressed hash set. Zero marks an
+empty slot, entries are only ever added, or all dropped at once by
+smc_clear_key_cache(). Each entry holds until its expiry, after which lookups
+go on to the SMC again, and a fresh not found renews it. Lock free, a lookup
+racing with a clear or an insert at worst misses and goes on to the SMC.
+*/
+static uint32_t key_cache[KEY_CACHE_SLOTS];
+static uint64_t key_cache_expiry[KEY_CACHE_SLOTS];
+static uint64_t key_cache_entries;
+static uint64_t key_cache_hits;
+
+
+static size_t key_cache_slot(uint32_t key)
+{
+    // Fibonacci hashing, the top bits of the product
+    return (key * 0x9e3779b1u) >> 24;
+}
+
+
+/**
+Count a lookup that goes on to the SMC. On every read, so it goes in the
+thread's own statistics rather than a shared counter.
+*/
+static void key_cache_miss(void)
+{
+#ifndef SMC_NO_STATS
+    stats_block_t *block = stats_get_block();
+
+    if (block != NULL) {
+        STAT_ADD(block->misses, 1);
+    }
+#endif
+}
+
+
+/**
+Is the key known to be absent?
+*/
+static bool key_cache_lookup(uint32_t key)
+{
+    size_t slot = key_cache_slot(key);
+
+    // Nothing cached, the common case on a machine that was never asked for
+    // a missing key
+    if (__atomic_load_n(&key_cache_entries, __ATOMIC_RELAXED) == 0) {
+        key_cache_miss();
+        return false;
+    }
+
+    for (size_t i = 0; i < KEY_CACHE_SLOTS; i++) {
+        uint32_t cached = __atomic_load_n(&key_cache[slot], __ATOMIC_RELAXED);
+
+        if (cached == key) {
+            uint64_t expiry = __atomic_load_n(&key_cache_expiry[slot],
+                                              __ATOMIC_RELAXED);
+
+            if (monotonic_ns() >= expiry) {
+                break;
+            }
+
+            __atomic_fetch_add(&key_cache_hits, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+
+        if (cached == 0) {
+            break;
+        }
+
+        slot = (slot + 1) % KEY_CACHE_SLOTS;
+    }
+
+    key_cache_miss();
+    return false;
+}
+
+
+/**
+Cache a key as absent, or renew its entry. Only for a not found from a key info
+lookup, the read itself may fail transiently. Once the cache is full, further
+keys just aren't cached.
+*/
+static void key_cache_insert(uint32_t key)
+{
+    size_t slot = key_cache_slot(key);
+
+    // Zero marks an empty slot, and an injected not found says nothing about
+    // the key
+    if (key == 0 || sim_injected) {
+        return;
+    }
+
+    for (size_t i = 0; i < KEY_CACHE_SLOTS; i++) {
+        uint32_t expected = 0;
+
+        if (__atomic_compare_exchange_n(&key_cache[slot], &expected, key,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            __atomic_store_n(&key_cache_expiry[slot],
+                             monotonic_ns() + KEY_CACHE_TTL_NS,
+                             __ATOMIC_RELAXED);
+            __atomic_fetch_add(&key_cache_entries, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        if (expected == key) {
+            __atomic_store_n(&key_cache_expiry[slot],
+                             monotonic_ns() + KEY_CACHE_TTL_NS,
+                             __ATOMIC_RELAXED);
+            return;
+        }
+
+        slot = (slot + 1) % KEY_CACHE_SLOTS;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PRIVATE" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+/**
+Open a new connection to the SMC, through the current transport
+
+:param: connection The opened connection
+:returns: kIOReturnSuccess on successful connection to the SMC.
+*/
+static kern_return_t open_conn(io_connect_t *connection)
+{
+    return transport->open(connection);
+}
+
+
+/**
+Close a connection to the SMC, through the current transport
+
+:param: connection Connection to close
+:returns: kIOReturnSuccess on successful close of connection to the SMC.
+*/
+static kern_return_t close_conn(io_connect_t connection)
+{
+    return transport->close(connection);
+}
+
+
+/**
+Make a call to the SMC over a given connection, through the current transport
+
+:param: connection Connection to the SMC
+:param: inputStruct Struct that holds data telling the SMC what you want
+:param: outputStruct Struct holding the SMC's response
+:returns: I/O Kit return code
+*/
+static kern_return_t call_smc_conn(io_connect_t    connection,
+                                   SMCParamStruct *inputStruct,
+                                   SMCParamStruct *outputStruct)
+{
+    kern_return_t result;
+#ifndef SMC_NO_STATS
+    uint64_t start;
+    stats_block_t *block = stats_begin(&start);
+#endif
+
+    result = transport->call(connection, inputStruct, outputStruct);
+
+#ifndef SMC_NO_STATS
+    stats_end(block, start, inputStruct, outputStruct, result);
+#endif
+
+    if (__atomic_load_n(&record_file, __ATOMIC_RELAXED) != NULL) {
+        record_call(inputStruct, outputStruct, result);
+    }
+
+    return result;
+}
+
+
+/**
+Make a call to the SMC
+
+:param: inputStruct Struct that holds data telling the SMC what you want
+:param: outputStruct Struct holding the SMC's response
+:returns: I/O Kit return code
+*/
+static kern_return_t call_smc(SMCParamStruct *inputStruct,
+                              SMCParamStruct *outputStruct)
+{
+    return call_smc_conn(default_ctx.conn, inputStruct, outputStruct);
+}
+
+
+/**
+Get the key info (data type and size) of an SMC key
+
+:param: key The SMC key, as a uint32_t
+:param: keyInfo Key info returned by the SMC
+:param: kSMC SMC return code
+:returns: I/O Kit return code
+*/
+static kern_return_t get_key_info(uint32_t key, SMCKeyInfoData *keyInfo,
+                                                uint8_t *kSMC)
+{
+    kern_return_t result;
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+
+    memset(&inputStruct,  0, sizeof(SMCParamStruct));
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+    inputStruct.key = key;
+    inputStruct.data8 = kSMCGetKeyInfo;
+
+    result = call_smc(&inputStruct, &outputStruct);
+    *kSMC = outputStruct.result;
+
+    if (result == kIOReturnSuccess && outputStruct.result == kSMCSuccess) {
+        *keyInfo = outputStruct.keyInfo;
+    }
+
+    return result;
+}
+
+
+/**
+Fetch the key info of a prepared key and store it in its pre-filled input
+struct.
+*/
+static kern_return_t prepare_key_info(smc_key_t *handle, uint8_t *kSMC)
+{
+    kern_return_t  result;
+    SMCKeyInfoData keyInfo;
+
+    handle->keyInfoValid = false;
+
+    result = get_key_info(handle->inputStruct.key, &keyInfo, kSMC);
+
+    if (result != kIOReturnSuccess || *kSMC != kSMCSuccess) {
+        return result;
+    }
+
+    handle->inputStruct.keyInfo = keyInfo;
+    handle->keyInfoValid = true;
+
+    return result;
+}
+
+
+/**
+Read data from the SMC for a prepared key. A single call, given the key info
+is still valid.
+*/
+static kern_return_t read_prepared(smc_key_t *handle, smc_value_t *value)
+{
+    kern_return_t result;
+    SMCParamStruct outputStruct;
+
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+    result = call_smc(&handle->inputStruct, &outputStruct);
+    value->kSMC = outputStruct.result;
+
+    if (result != kIOReturnSuccess || outputStruct.result != kSMCSuccess) {
+        return result;
+    }
+
+    memcpy(value->data, outputStruct.bytes, sizeof(outputStruct.bytes));
+
+    return result;
+}
+
+
+/**
+Read a key using caller provided param structs, so that they can be reused
+across keys. Only the fields that matter are reset.
+*/
+static kern_return_t read_key(io_connect_t    connection,
+                              uint32_t        key,
+                              SMCParamStruct *inputStruct,
+                              SMCParamStruct *outputStruct,
+                              smc_value_t    *value)
+{
+    kern_return_t result;
+
+    memset(value, 0, sizeof(smc_value_t));
+    value->key = key;
+
+    // First call to AppleSMC - get key info
+    inputStruct->key = key;
+    inputStruct->data8 = kSMCGetKeyInfo;
+    inputStruct->keyInfo.dataSize = 0;
+
+    result = call_smc_conn(connection, inputStruct, outputStruct);
+    value->kSMC = outputStruct->result;
+
+    if (result != kIOReturnSuccess || outputStruct->result != kSMCSuccess) {
+        return result;
+    }
+
+    value->dataSize = outputStruct->keyInfo.dataSize;
+    value->dataType = outputStruct->keyInfo.dataType;
+
+    // Second call to AppleSMC - now we can get the data
+    inputStruct->keyInfo.dataSize = outputStruct->keyInfo.dataSize;
+    inputStruct->data8 = kSMCReadKey;
+
+    result = call_smc_conn(connection, inputStruct, outputStruct);
+    value->kSMC = outputStruct->result;
+
+    if (result != kIOReturnSuccess || outputStruct->result != kSMCSuccess) {
+        return result;
+    }
+
+    memcpy(value->data, outputStruct->bytes, sizeof(outputStruct->bytes));
+
+    return result;
+}
+
+
+/**
+Read many keys, reusing one pair of param structs. See smc_read_many().
+*/
+static kern_return_t read_many(io_connect_t    connection,
+                               SMCParamStruct *inputStruct,
+                               SMCParamStruct *outputStruct,
+                               const uint32_t *keys,
+                               size_t          n,
+                               smc_value_t    *out)
+{
+    kern_return_t result = kIOReturnSuccess;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t j = 0;
+
+        // Already read this key? Batches are small, a linear scan is cheaper
+        // than a driver call
+        while (j < i && keys[j] != keys[i]) {
+            j++;
+        }
+
+        if (j < i) {
+            out[i] = out[j];
+        } else {
+            out[i].result = read_key(connection, keys[i], inputStruct,
+                                                          outputStruct,
+                                                          &out[i]);
+        }
+
+        if (out[i].result != kIOReturnSuccess || out[i].kSMC != kSMCSuccess) {
+            result = kIOReturnError;
+        }
+    }
+
+    return result;
+}
+
+
+/**
+Read data from the SMC
+
+:param: key The SMC key, as a uint32_t
+:param: value Value read
+*/
+static kern_return_t read_smc(uint32_t key, smc_value_t *value)
+{
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+
+    // Known to be absent, answer as the SMC would
+    if (key_cache_lookup(key)) {
+        memset(value, 0, sizeof(smc_value_t));
+        value->key = key;
+        value->kSMC = kSMCKeyNotFound;
+        value->result = kIOReturnSuccess;
+
+        return value->result;
+    }
+
+    memset(&inputStruct,  0, sizeof(SMCParamStruct));
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+    value->result = read_key(default_ctx.conn, key, &inputStruct,
+                                                    &outputStruct, value);
+
+    // Only a not found from the key info, before the size is known
+    if (value->result == kIOReturnSuccess && value->kSMC == kSMCKeyNotFound &&
+        value->dataSize == 0) {
+        key_cache_insert(key);
+    }
+
+    return value->result;
+}
+
+
+/**
+Read data for a getter. Virtual keys are computed, see smc_virtual_define().
+Otherwise answers from the attached sensor table if it holds a fresh enough
+value, then reads from the SMC. See smc_use_table().
+*/
+static kern_return_t read_smc_cached(uint32_t key, smc_value_t *value)
+{
+    smc_table_entry_t entry;
+    smc_table_t *current = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    kern_return_t result = smc_virtual_read(key, value);
+
+    if (result != kIOReturnNotFound) {
+        return result;
+    }
+
+    if (current != NULL && smc_table_get(current, key, &entry) &&
+        smc_time_ns() - entry.timestamp <= table_max_staleness) {
+        *value = entry.value;
+        return kIOReturnSuccess;
+    }
+
+    return read_smc(key, value);
+}
+
+
+/**
+Write a key using caller provided param structs. The key info is fetched first
+to check the value matches the key's type and size.
+
+:returns: IOReturn IOKit return code
+*/
+static kern_return_t write_key(io_connect_t    connection,
+                               uint32_t        key,
+                               SMCParamStruct *inputStruct,
+                               SMCParamStruct *outputStruct,
+                               smc_value_t    *value)
+{
+    kern_return_t result;
+
+    // First call to AppleSMC - get key info
+    inputStruct->key = key;
+    inputStruct->data8 = kSMCGetKeyInfo;
+    inputStruct->keyInfo.dataSize = 0;
+
+    result = call_smc_conn(connection, inputStruct, outputStruct);
+    value->kSMC = outputStruct->result;
+
+    if (result != kIOReturnSuccess || outputStruct->result != kSMCSuccess) {
+        return result;
+    }
+
+    // Check data is correct
+    if (value->dataSize != outputStruct->keyInfo.dataSize ||
+        value->dataType != outputStruct->keyInfo.dataType) {
+        return kIOReturnBadArgument;
+    }
+
+    // Second call to AppleSMC - now we can write the data
+    inputStruct->data8 = kSMCWriteKey;
+    inputStruct->keyInfo.dataSize = outputStruct->keyInfo.dataSize;
+
+    // Set data to write
+    memcpy(inputStruct->bytes, value->data, sizeof(value->data));
+
+    result = call_smc_conn(connection, inputStruct, outputStruct);
+    value->kSMC = outputStruct->result;
+
+    return result;
+}
+
+
+/**
+Write data to the SMC.
+
+:returns: IOReturn IOKit return code
+*/
+static kern_return_t write_smc(uint32_t key, smc_value_t *value)
+{
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+
+    memset(&inputStruct,  0, sizeof(SMCParamStruct));
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+    return write_key(default_ctx.conn, key, &inputStruct, &outputStruct,
+                                            value);
+}
+
+
+/**
+Get the model name of the machine, through the current transport
+*/
+static kern_return_t get_machine_model(io_name_t model)
+{
+    return transport->get_model(model);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+uint64_t smc_time_ns(void)
+{
+    return monotonic_ns();
+}
+
+
+void smc_run_periodic(uint64_t period_ns, const bool *stop, smc_periodic_t run,
+                      void *context)
+{
+    uint64_t deadline = monotonic_ns();
+
+    while (!__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+        uint64_t now = monotonic_ns();
+
+        if (now >= deadline) {
+            run(context, now);
+
+            // Fixed deadlines, so the period doesn't drift. Skip runs that
+            // were missed rather than making them back to back.
+            deadline += period_ns;
+
+            if (deadline <= now) {
+                deadline = now + period_ns;
+            }
+
+            continue;
+        }
+
+        smc_sleep_until(deadline);
+    }
+}
+
+
+void smc_sleep_until(uint64_t deadline_ns)
+{
+    uint64_t now = monotonic_ns();
+
+    if (deadline_ns <= now) {
+        return;
+    }
+
+    struct timespec ts;
+    uint64_t wait = deadline_ns - now;
+
+    if (wait > MAX_SLEEP_NS) {
+        wait = MAX_SLEEP_NS;
+    }
+
+    ts.tv_sec  = wait / 1000000000;
+    ts.tv_nsec = wait % 1000000000;
+    nanosleep(&ts, NULL);
+}
+
+
+void smc_use_table(smc_table_t *sensor_table, uint64_t max_staleness_ns)
+{
+    table_max_staleness = max_staleness_ns;
+    __atomic_store_n(&table, sensor_table, __ATOMIC_RELEASE);
+}
+
+
+kern_return_t open_smc(void)
+{
+    return open_conn(&default_ctx.conn);
+}
+
+
+kern_return_t close_smc(void)
+{
+    return close_conn(default_ctx.conn);
+}
+
+
+bool is_key_valid(char *key)
+{
+    if (strlen(key) != SMC_KEY_SIZE) {
+        return false;
+    }
+
+    return smc_is_key_valid_u32(to_uint32_t(key));
+}
+
+
+bool smc_is_key_valid_u32(uint32_t key)
+{
+    bool ans = false;
+    kern_return_t result;
+    smc_value_t   result_smc;
+
+    if (smc_virtual_is_defined(key)) {
+        return true;
+    }
+
+    // Found by a probe? Keys don't come and go while the machine is up
+    if (__atomic_load_n(&probed, __ATOMIC_ACQUIRE)) {
+        smc_capabilities_t caps;
+
+        caps.present = probed_present;
+
+        if (smc_has_capability(&caps, key)) {
+            return true;
+        }
+    }
+
+    // Try a read and see if it succeeds. Absent keys are answered by the
+    // negative key cache after the first time.
+    result = read_smc(key, &result_smc);
+
+    if (result == kIOReturnSuccess && result_smc.kSMC == kSMCSuccess) {
+        ans = true;
+    }
+
+    return ans;
+}
+
+
+double get_tmp(char *key, tmp_unit_t unit)
+{
+    return smc_get_tmp_u32(to_uint32_t(key), unit);
+}
+
+
+double smc_get_tmp_u32(uint32_t key, tmp_unit_t unit)
+{
+    kern_return_t result;
+    smc_value_t   result_smc;
+
+    double tmp;
+
+    result = read_smc_cached(key, &result_smc);
+
+    if (result == kIOReturnSuccess && result_smc.dataSize == 2 &&
+        result_smc.dataType == SMC_TYPE_SP78) {
+        tmp = from_sp78(result_smc.data);
+    } else if (result == kIOReturnSuccess && smc_virtual_is_defined(key)) {
+        // Virtual keys are flt, anything else is an error
+        if (!smc_decode_value(&result_smc, &tmp)) {
+            return 0.0;
+        }
+    } else {
+        // Error
+        return 0.0;
+    }
+
+    switch (unit) {
+        case CELSIUS:
+            break;
+        case FAHRENHEIT:
+            tmp = to_fahrenheit(tmp);
+            break;
+        case KELVIN:
+            tmp = to_kelvin(tmp);
+            break;
+    }
+
+    return tmp;
+}
+
+
+kern_return_t smc_read_u32(uint32_t key, smc_value_t *value)
+{
+    kern_return_t result = smc_virtual_read(key, value);
+
+    if (result != kIOReturnNotFound) {
+        return result;
+    }
+
+    result = read_smc(key, value);
+
+    if (result == kIOReturnSuccess && value->kSMC != kSMCSuccess) {
+        return kIOReturnError;
+    }
+
+    return result;
+}
+
+
+kern_return_t smc_read_typed(uint32_t key, uint32_t dataType,
+                             uint32_t dataSize, smc_value_t *value)
+{
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+
+    memset(value, 0, sizeof(smc_value_t));
+    value->key = key;
+    value->dataType = dataType;
+    value->dataSize = dataSize;
+
+    if (dataSize > sizeof(value->data)) {
+        value->result = kIOReturnBadArgument;
+        return value->result;
+    }
+
+    // Computed, but the type and size are still the caller's
+    if (smc_virtual_is_defined(key)) {
+        value->result = smc_virtual_read(key, value);
+
+        if (value->result != kIOReturnSuccess ||
+            value->dataType != dataType || value->dataSize != dataSize) {
+            return kIOReturnError;
+        }
+
+        return kIOReturnSuccess;
+    }
+
+    if (key_cache_lookup(key)) {
+        value->kSMC = kSMCKeyNotFound;
+        return kIOReturnError;
+    }
+
+    memset(&inputStruct,  0, sizeof(SMCParamStruct));
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+    inputStruct.key = key;
+    inputStruct.data8 = kSMCReadKey;
+    inputStruct.keyInfo.dataSize = dataSize;
+
+    value->result = call_smc_conn(default_ctx.conn, &inputStruct,
+                                                    &outputStruct);
+    value->kSMC = outputStruct.result;
+
+    if (value->result != kIOReturnSuccess) {
+        return value->result;
+    }
+
+    // Not cached as absent, without the key info a not found may be transient
+    if (value->kSMC != kSMCSuccess) {
+        return kIOReturnError;
+    }
+
+    memcpy(value->data, outputStruct.bytes, dataSize);
+
+    return kIOReturnSuccess;
+}
+
+
+uint32_t smc_encode_key(char *key)
+{
+    return to_uint32_t(key);
+}
+
+
+kern_return_t smc_read_many(const uint32_t *keys, size_t n, smc_value_t *out)
+{
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+
+    memset(&inputStruct,  0, sizeof(SMCParamStruct));
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+    return read_many(default_ctx.conn, &inputStruct, &outputStruct, keys, n,
+                                                                    out);
+}
+
+
+smc_key_t *smc_prepare(char *key)
+{
+    if (strlen(key) != SMC_KEY_SIZE) {
+        return NULL;
+    }
+
+    return smc_prepare_u32(to_uint32_t(key));
+}
+
+
+smc_key_t *smc_prepare_u32(uint32_t key)
+{
+    uint8_t    kSMC;
+    smc_key_t *handle;
+
+    handle = malloc(sizeof(smc_key_t));
+
+    if (handle == NULL) {
+        return NULL;
+    }
+
+    memset(handle, 0, sizeof(smc_key_t));
+    handle->inputStruct.key = key;
+    handle->inputStruct.data8 = kSMCReadKey;
+
+    if (prepare_key_info(handle, &kSMC) != kIOReturnSuccess ||
+        kSMC != kSMCSuccess) {
+        free(handle);
+        return NULL;
+    }
+
+    return handle;
+}
+
+
+kern_return_t smc_read_prepared(smc_key_t *handle, smc_value_t *value)
+{
+    kern_return_t result = kIOReturnSuccess;
+
+    memset(value, 0, sizeof(smc_value_t));
+    value->key = handle->inputStruct.key;
+
+    if (!handle->keyInfoValid) {
+        result = prepare_key_info(handle, &value->kSMC);
+    }
+
+    if (result == kIOReturnSuccess && value->kSMC == kSMCSuccess) {
+        result = read_prepared(handle, value);
+
+        // Key info changed underneath us (size mismatch), fetch it again
+        // and retry once
+        if (result == kIOReturnSuccess &&
+            value->kSMC == kSMCKeySizeMismatch) {
+            result = prepare_key_info(handle, &value->kSMC);
+
+            if (result == kIOReturnSuccess && value->kSMC == kSMCSuccess) {
+                result = read_prepared(handle, value);
+            }
+        }
+    }
+
+    // Key is gone, don't trust the cached key info anymore
+    if (value->kSMC == kSMCKeyNotFound) {
+        handle->keyInfoValid = false;
+    }
+
+    value->dataType = handle->inputStruct.keyInfo.dataType;
+    value->dataSize = handle->inputStruct.keyInfo.dataSize;
+    value->result   = result;
+
+    if (result == kIOReturnSuccess && value->kSMC != kSMCSuccess) {
+        return kIOReturnError;
+    }
+
+    return result;
+}
+
+
+void smc_release_prepared(smc_key_t *handle)
+{
+    free(handle);
+}
+
+
+bool is_battery_powered(void)
+{
+    kern_return_t result;
+    smc_value_t   result_smc;
+
+    result = read_smc(SMC_KEY_BATT_PWR, &result_smc);
+
+    if (!(result == kIOReturnSuccess &&
+          result_smc.dataSize == 1   &&
+          result_smc.dataType == SMC_TYPE_FLAG)) {
+        // Error
+        return false;
+    }
+
+    return result_smc.data[0];
+}
+
+
+bool is_optical_disk_drive_full(void)
+{
+    kern_return_t result;
+    smc_value_t   result_smc;
+
+    result = read_smc(SMC_KEY_ODD_FULL, &result_smc);
+
+    if (!(result == kIOReturnSuccess &&
+          result_smc.dataSize == 1   &&
+          result_smc.dataType == SMC_TYPE_FLAG)) {
+        // Error
+        return false;
+    }
+
+    return result_smc.data[0];
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: FAN FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+bool get_fan_name(unsigned int fan_num, fan_name_t name)
+{
+    kern_return_t result;
+    smc_value_t   result_smc;
+    
+    result = read_smc(fan_key(fan_num, 'I', 'D'), &result_smc);
+
+    if (!(result == kIOReturnSuccess &&
+          result_smc.dataSize == 16   &&
+          result_smc.dataType == SMC_TYPE_SFDS)) {
+      return false;
+    }
+
+  
+    /*
+    We know the data size is 16 bytes and the type is "{fds", a custom
+    struct defined by the AppleSMC.kext. See TMP enum sources for the
+    struct.
+        
+    The last 12 bytes contain the name of the fan, an array of chars, hence
+    the loop range.
+    */
+    int index = 0; 
+    for (int i = 4; i < 16; i++) {
+        // Check if at the end (name may not be full 12 bytes)
+        // Could check for 0 (null), but instead we check for 32 (space). This
+        // is a hack to remove whitespace. :)
+        if (result_smc.data[i] == 32) {
+            break;
+        }
+
+        name[index] = result_smc.data[i];
+        index++;
+    }
+
+    return true;
+}
+
+
+int get_num_fans(void)
+{
+    kern_return_t result;
+    smc_value_t   result_smc;
+
+    result = read_smc(SMC_KEY_NUM_FANS, &result_smc);
+
+    if (!(result == kIOReturnSuccess &&
+          result_smc.dataSize == 1   &&
+          result_smc.dataType == SMC_TYPE_UINT8)) {
+        // Error
+        return -1;
+    }
+
+    return result_smc.data[0];
+}
+
+
+unsigned int get_fan_rpm(unsigned int fan_num)
+{
+    kern_return_t result;
+    smc_value_t   result_smc;
+
+    result = read_smc_cached(fan_key(fan_num, 'A', 'c'), &result_smc);
+
+    if (!(result == kIOReturnSuccess &&
+          result_smc.dataSize == 2   &&
+          result_smc.dataType == SMC_TYPE_FPE2)) {
+        // Error
+        return 0;
+    }
+
+    return from_fpe2(result_smc.data);
+}
+
+
+bool set_fan_min_rpm(unsigned int fan_num, unsigned int rpm, bool auth)
+{
+    // TODO: Add rpm val safety check
+    bool ans = false;
+    kern_return_t result;
+    smc_value_t   result_smc;
+
+    memset(&result_smc, 0, sizeof(smc_value_t));
+
+    // TODO: Don't use magic number
+    result_smc.dataSize = 2;
+    result_smc.dataType = SMC_TYPE_FPE2;
+    to_fpe2(rpm, result_smc.data);
+
+    result = write_smc(fan_key(fan_num, 'M', 'n'), &result_smc);
+
+    if (result == kIOReturnSuccess && result_smc.kSMC == kSMCSuccess) {
+        ans = true;
+    }
+
+    return ans;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: KEY ENUMERATION
+//------------------------------------------------------------------------------
+
+
+/**
+Walk a slice of the key index range. Thread entry point.
+
+:param: arg The enum_shard_t to walk
+*/
+static void *enumerate_shard(void *arg)
+{
+    enum_shard_t *shard = arg;
+    io_connect_t connection = default_ctx.conn;
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+
+    if (shard->own_conn) {
+        shard->result = open_conn(&connection);
+
+        if (shard->result != kIOReturnSuccess) {
+            return NULL;
+        }
+    }
+
+    memset(&inputStruct,  0, sizeof(SMCParamStruct));
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+    for (uint32_t i = shard->first; i < shard->last; i++) {
+        smc_key_info_t *info = &shard->keys[i];
+
+        // First call to AppleSMC - get the key at this index
+        inputStruct.key = 0;
+        inputStruct.data8 = kSMCGetKeyFromIndex;
+        inputStruct.data32 = i;
+
+        shard->result = call_smc_conn(connection, &inputStruct, &outputStruct);
+
+        if (shard->result != kIOReturnSuccess ||
+            outputStruct.result != kSMCSuccess) {
+            break;
+        }
+
+        // Second call to AppleSMC - get the key info for it
+        inputStruct.key = outputStruct.key;
+        inputStruct.data8 = kSMCGetKeyInfo;
+        inputStruct.data32 = 0;
+
+        shard->result = call_smc_conn(connection, &inputStruct, &outputStruct);
+
+        if (shard->result != kIOReturnSuccess ||
+            outputStruct.result != kSMCSuccess) {
+            break;
+        }
+
+        info->key        = inputStruct.key;
+        info->dataType   = outputStruct.keyInfo.dataType;
+        info->dataSize   = outputStruct.keyInfo.dataSize;
+        info->attributes = outputStruct.keyInfo.dataAttributes;
+    }
+
+    if (shard->result == kIOReturnSuccess &&
+        outputStruct.result != kSMCSuccess) {
+        shard->result = kIOReturnError;
+    }
+
+    if (shard->own_conn) {
+        close_conn(connection);
+    }
+
+    return NULL;
+}
+
+
+/**
+For sorting and searching catalog entries by key
+*/
+static int compare_key_info(const void *a, const void *b)
+{
+    uint32_t key_a = ((const smc_key_info_t *)a)->key;
+    uint32_t key_b = ((const smc_key_info_t *)b)->key;
+
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+
+kern_return_t smc_catalog_build(smc_catalog_t *catalog,
+                                unsigned int num_threads)
+{
+    kern_return_t result;
+    smc_value_t   result_smc;
+    uint32_t      count;
+
+    memset(catalog, 0, sizeof(smc_catalog_t));
+
+    result = read_smc(SMC_KEY_NUM_KEYS, &result_smc);
+
+    if (!(result == kIOReturnSuccess &&
+          result_smc.kSMC == kSMCSuccess &&
+          result_smc.dataSize == 4)) {
+        return kIOReturnError;
+    }
+
+    count = (uint32_t)result_smc.data[0] << 24 |
+            (uint32_t)result_smc.data[1] << 16 |
+            (uint32_t)result_smc.data[2] << 8  |
+            (uint32_t)result_smc.data[3];
+
+    if (count == 0) {
+        return kIOReturnSuccess;
+    }
+
+    if (num_threads == 0) {
+        num_threads = 1;
+    } else if (num_threads > count) {
+        num_threads = count;
+    }
+
+    catalog->keys = calloc(count, sizeof(smc_key_info_t));
+    enum_shard_t *shards = calloc(num_threads, sizeof(enum_shard_t));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    bool *started = calloc(num_threads, sizeof(bool));
+
+    if (catalog->keys == NULL || shards == NULL || threads == NULL ||
+        started == NULL) {
+        free(shards);
+        free(threads);
+        free(started);
+        smc_catalog_free(catalog);
+        return kIOReturnNoMemory;
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        shards[i].keys = catalog->keys;
+        shards[i].first = (uint32_t)((uint64_t)count * i / num_threads);
+        shards[i].last = (uint32_t)((uint64_t)count * (i + 1) / num_threads);
+        shards[i].own_conn = i > 0;
+    }
+
+    // First slice is walked on this thread, with the existing connection
+    for (unsigned int i = 1; i < num_threads; i++) {
+        started[i] = pthread_create(&threads[i], NULL, enumerate_shard,
+                                                      &shards[i]) == 0;
+    }
+
+    enumerate_shard(&shards[0]);
+
+    for (unsigned int i = 1; i < num_threads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            // Couldn't spawn a thread, walk it here instead
+            shards[i].own_conn = false;
+            enumerate_shard(&shards[i]);
+        }
+    }
+
+    for (unsigned int i = 0; i < num_threads; i++) {
+        if (shards[i].result != kIOReturnSuccess) {
+            result = shards[i].result;
+        }
+    }
+
+    free(shards);
+    free(threads);
+    free(started);
+
+    if (result != kIOReturnSuccess) {
+        smc_catalog_free(catalog);
+        return result;
+    }
+
+    catalog->count = count;
+    qsort(catalog->keys, count, sizeof(smc_key_info_t), compare_key_info);
+
+    return result;
+}
+
+
+const smc_key_info_t *smc_catalog_find(const smc_catalog_t *catalog,
+                                       uint32_t key)
+{
+    smc_key_info_t target;
+
+    if (catalog->count == 0) {
+        return NULL;
+    }
+
+    target.key = key;
+
+    return bsearch(&target, catalog->keys, catalog->count,
+                   sizeof(smc_key_info_t), compare_key_info);
+}
+
+
+kern_return_t smc_catalog_save(const smc_catalog_t *catalog, const char *path)
+{
+    kern_return_t    result = kIOReturnSuccess;
+    catalog_header_t header;
+    char             tmp_path[1024];
+    FILE            *file;
+
+    memset(&header, 0, sizeof(catalog_header_t));
+    header.magic       = CATALOG_MAGIC;
+    header.version     = CATALOG_VERSION;
+    header.count       = (uint32_t)catalog->count;
+    header.record_size = sizeof(smc_key_info_t);
+
+    if (get_machine_model(header.model) != kIOReturnSuccess) {
+        memset(header.model, 0, sizeof(io_name_t));
+    }
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) >=
+        (int)sizeof(tmp_path)) {
+        return kIOReturnBadArgument;
+    }
+
+    file = fopen(tmp_path, "wb");
+
+    if (file == NULL) {
+        return kIOReturnError;
+    }
+
+    if (fwrite(&header, sizeof(catalog_header_t), 1, file) != 1 ||
+        fwrite(catalog->keys, sizeof(smc_key_info_t), catalog->count, file) !=
+        catalog->count) {
+        result = kIOReturnError;
+    }
+
+    if (fclose(file) != 0) {
+        result = kIOReturnError;
+    }
+
+    // Rename into place so that readers never map a partial file
+    if (result != kIOReturnSuccess || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return kIOReturnError;
+    }
+
+    return result;
+}
+
+
+kern_return_t smc_catalog_map(smc_catalog_t *catalog, const char *path)
+{
+    int               fd;
+    struct stat       st;
+    void             *map;
+    catalog_header_t *header;
+
+    memset(catalog, 0, sizeof(smc_catalog_t));
+
+    fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return kIOReturnNotFound;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(catalog_header_t)) {
+        close(fd);
+        return kIOReturnError;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return kIOReturnError;
+    }
+
+    header = map;
+
+    if (header->magic != CATALOG_MAGIC     ||
+        header->version != CATALOG_VERSION ||
+        header->record_size != sizeof(smc_key_info_t) ||
+        (size_t)st.st_size != sizeof(catalog_header_t) +
+                              header->count * sizeof(smc_key_info_t)) {
+        munmap(map, (size_t)st.st_size);
+        return kIOReturnError;
+    }
+
+    catalog->keys     = (smc_key_info_t *)(header + 1);
+    catalog->count    = header->count;
+    catalog->map      = map;
+    catalog->map_size = (size_t)st.st_size;
+
+    return kIOReturnSuccess;
+}
+
+
+kern_return_t smc_catalog_load(smc_catalog_t *catalog, const char *dir,
+                               unsigned int num_threads)
+{
+    kern_return_t result;
+    io_name_t     model;
+    char          path[1024];
+
+    memset(catalog, 0, sizeof(smc_catalog_t));
+
+    result = get_machine_model(model);
+
+    if (result != kIOReturnSuccess) {
+        return result;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s.smccat", dir, model) >=
+        (int)sizeof(path)) {
+        return kIOReturnBadArgument;
+    }
+
+    if (smc_catalog_map(catalog, path) == kIOReturnSuccess) {
+        catalog_header_t *header = catalog->map;
+
+        if (strncmp(header->model, model, sizeof(io_name_t)) == 0) {
+            return kIOReturnSuccess;
+        }
+
+        smc_catalog_free(catalog);
+    }
+
+    result = smc_catalog_build(catalog, num_threads);
+
+    if (result == kIOReturnSuccess) {
+        smc_catalog_save(catalog, path);
+    }
+
+    return result;
+}
+
+
+void smc_catalog_free(smc_catalog_t *catalog)
+{
+    if (catalog->map != NULL) {
+        munmap(catalog->map, catalog->map_size);
+    } else {
+        free(catalog->keys);
+    }
+
+    memset(catalog, 0, sizeof(smc_catalog_t));
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: TRANSPORT SELECTION & SIMULATED SMC
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_set_transport(smc_transport_type_t type)
+{
+    switch (type) {
+        case SMC_TRANSPORT_IOKIT:
+#ifdef __APPLE__
+            smc_clear_key_cache();
+            transport = &iokit_transport;
+            return kIOReturnSuccess;
+#else
+            return kIOReturnUnsupported;
+#endif
+        case SMC_TRANSPORT_SIM:
+            smc_clear_key_cache();
+            transport = &sim_transport;
+            return kIOReturnSuccess;
+        case SMC_TRANSPORT_REPLAY:
+            if (replay_records == NULL) {
+                return kIOReturnNotOpen;
+            }
+
+            smc_clear_key_cache();
+            transport = &replay_transport;
+            return kIOReturnSuccess;
+    }
+
+    return kIOReturnBadArgument;
+}
+
+
+kern_return_t smc_sim_set_key(uint32_t key, uint32_t dataType,
+                                            uint32_t dataSize,
+                                            uint8_t  attributes,
+                                            const uint8_t *data)
+{
+    kern_return_t result;
+    sim_key_t     entry;
+
+    if (dataSize > sizeof(entry.data)) {
+        return kIOReturnBadArgument;
+    }
+
+    memset(&entry, 0, sizeof(sim_key_t));
+    entry.key        = key;
+    entry.dataType   = dataType;
+    entry.dataSize   = dataSize;
+    entry.attributes = attributes;
+
+    if (data != NULL) {
+        memcpy(entry.data, data, dataSize);
+    }
+
+    pthread_rwlock_wrlock(&sim_lock);
+
+    result = sim_upsert(&entry);
+
+    if (result == kIOReturnSuccess) {
+        result = sim_update_key_count();
+    }
+
+    pthread_rwlock_unlock(&sim_lock);
+
+    // The key may have been cached as absent
+    if (__atomic_load_n(&key_cache_entries, __ATOMIC_RELAXED) != 0) {
+        smc_clear_key_cache();
+    }
+
+    return result;
+}
+
+
+kern_return_t smc_sim_get_key(uint32_t key, smc_value_t *value)
+{
+    bool   found;
+    size_t i;
+
+    memset(value, 0, sizeof(smc_value_t));
+    value->key = key;
+
+    pthread_rwlock_rdlock(&sim_lock);
+
+    i = sim_find(key, &found);
+
+    if (found) {
+        value->dataType = sim_keys[i].dataType;
+        value->dataSize = sim_keys[i].dataSize;
+        memcpy(value->data, sim_keys[i].data, sizeof(value->data));
+    } else {
+        value->kSMC = kSMCKeyNotFound;
+    }
+
+    pthread_rwlock_unlock(&sim_lock);
+
+    return found ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+
+kern_return_t smc_sim_populate(size_t num_keys)
+{
+    // Temperature sensors, all sp78
+    static const uint32_t tmp_keys[] = {
+        SMC_KEY_AMBIENT_AIR_0, SMC_KEY_AMBIENT_AIR_1, SMC_KEY_CPU_0_DIODE,
+        SMC_KEY_CPU_0_HEATSINK, SMC_KEY_CPU_0_PROXIMITY,
+        SMC_KEY_ENCLOSURE_BASE_0, SMC_KEY_ENCLOSURE_BASE_1,
+        SMC_KEY_ENCLOSURE_BASE_2, SMC_KEY_ENCLOSURE_BASE_3,
+        SMC_KEY_GPU_0_DIODE, SMC_KEY_GPU_0_HEATSINK, SMC_KEY_GPU_0_PROXIMITY,
+        SMC_KEY_HARD_DRIVE_BAY, SMC_KEY_MEMORY_SLOT_0,
+        SMC_KEY_MEMORY_SLOTS_PROXIMITY, SMC_KEY_NORTHBRIDGE,
+        SMC_KEY_NORTHBRIDGE_DIODE, SMC_KEY_NORTHBRIDGE_PROXIMITY,
+        SMC_KEY_THUNDERBOLT_0, SMC_KEY_THUNDERBOLT_1, SMC_KEY_WIRELESS_MODULE
+    };
+
+    // Fan speeds, all fpe2
+    static const uint32_t fan_keys[] = {
+        SMC_KEY_FAN_0, SMC_KEY_FAN_0_MIN_RPM, SMC_KEY_FAN_0_MAX_RPM,
+        SMC_KEY_FAN_0_SAFE_RPM, SMC_KEY_FAN_0_TARGET_RPM,
+        SMC_KEY_FAN_1, SMC_KEY_FAN_1_MIN_RPM, SMC_KEY_FAN_1_MAX_RPM,
+        SMC_KEY_FAN_1_SAFE_RPM, SMC_KEY_FAN_1_TARGET_RPM
+    };
+    static const unsigned int fan_rpm[] = { 2000, 1200, 6000, 3500, 2000 };
+
+    // Characters for synthetic key names
+    static const char name_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    static const uint32_t filler_types[] = {
+        SMC_TYPE_UINT8, SMC_TYPE_UINT16, SMC_TYPE_UINT32, SMC_TYPE_FLAG,
+        SMC_TYPE_FPE2, SMC_TYPE_SP78
+    };
+    static const uint32_t filler_sizes[] = { 1, 2, 4, 1, 2, 2 };
+
+    kern_return_t result = kIOReturnSuccess;
+    uint8_t data[32];
+
+    for (size_t i = 0; i < sizeof(tmp_keys) / sizeof(tmp_keys[0]); i++) {
+        memset(data, 0, sizeof(data));
+        data[0] = 40 + i % 20;
+        data[1] = 0x80;
+        result = smc_sim_set_key(tmp_keys[i], SMC_TYPE_SP78, 2, 0x80, data);
+
+        if (result != kIOReturnSuccess) {
+            return result;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(fan_keys) / sizeof(fan_keys[0]); i++) {
+        memset(data, 0, sizeof(data));
+        to_fpe2(fan_rpm[i % 5], data);
+        result = smc_sim_set_key(fan_keys[i], SMC_TYPE_FPE2, 2, 0xc0, data);
+
+        if (result != kIOReturnSuccess) {
+            return result;
+        }
+    }
+
+    for (unsigned int fan = 0; fan < 2; fan++) {
+        // {fds - type, zone, location, then 12 bytes of name
+        memset(data, 0, sizeof(data));
+        snprintf((char *)&data[4], 13, "%-12s", fan ? "Right Side" :
+                                                      "Left Side");
+        result = smc_sim_set_key(fan_key(fan, 'I', 'D'), SMC_TYPE_SFDS, 16,
+                                 0x80, data);
+
+        if (result != kIOReturnSuccess) {
+            return result;
+        }
+    }
+
+    memset(data, 0, sizeof(data));
+    data[0] = 2;
+
+    if (smc_sim_set_key(SMC_KEY_NUM_FANS, SMC_TYPE_UINT8, 1, 0x80, data) !=
+        kIOReturnSuccess) {
+        return kIOReturnError;
+    }
+
+    data[0] = 0;
+
+    if (smc_sim_set_key(SMC_KEY_BATT_PWR, SMC_TYPE_FLAG, 1, 0x80, data) !=
+        kIOReturnSuccess ||
+        smc_sim_set_key(SMC_KEY_ODD_FULL, SMC_TYPE_FLAG, 1, 0x80, data) !=
+        kIOReturnSuccess) {
+        return kIOReturnError;
+    }
+
+    // Pad out with synthetic keys, "Z000", "Z001" etc.
+    for (size_t i = 0; result == kIOReturnSuccess && sim_count < num_keys;
+         i++) {
+        char key[5];
+        size_t type = i % (sizeof(filler_types) / sizeof(filler_types[0]));
+
+        if (i >= 36 * 36 * 36) {
+            return kIOReturnNoResources;
+        }
+
+        key[0] = 'Z';
+        key[1] = name_chars[i / (36 * 36)];
+        key[2] = name_chars[i / 36 % 36];
+        key[3] = name_chars[i % 36];
+        key[4] = '\0';
+
+        memset(data, 0, sizeof(data));
+        data[0] = i;
+        result = smc_sim_set_key(to_uint32_t(key), filler_types[type],
+                                 filler_sizes[type], 0x80, data);
+    }
+
+    return result;
+}
+
+
+void smc_sim_reset(void)
+{
+    pthread_rwlock_wrlock(&sim_lock);
+
+    free(sim_keys);
+    sim_keys = NULL;
+    sim_count = 0;
+    sim_capacity = 0;
+
+    sim_latency = 0;
+    sim_jitter = 0;
+    sim_not_found_rate = 0;
+    sim_error_rate = 0;
+    sim_io_error_rate = 0;
+
+    sim_write_hook = NULL;
+    sim_write_context = NULL;
+
+    pthread_rwlock_unlock(&sim_lock);
+
+    __atomic_store_n(&sim_calls, 0, __ATOMIC_RELAXED);
+
+    smc_clear_key_cache();
+}
+
+
+void smc_sim_set_latency(uint64_t latency_ns, uint64_t jitter_ns)
+{
+    sim_latency = latency_ns;
+    sim_jitter = jitter_ns;
+}
+
+
+void smc_sim_set_error_rates(double not_found_rate, double error_rate)
+{
+    sim_not_found_rate = not_found_rate;
+    sim_error_rate = error_rate;
+}
+
+
+void smc_sim_set_io_error(kern_return_t code, double rate)
+{
+    sim_io_error_code = code;
+    sim_io_error_rate = rate;
+}
+
+
+uint64_t smc_sim_get_call_count(void)
+{
+    return __atomic_load_n(&sim_calls, __ATOMIC_RELAXED);
+}
+
+
+void smc_sim_set_write_hook(smc_sim_write_hook_t hook, void *context)
+{
+    pthread_rwlock_wrlock(&sim_lock);
+    sim_write_hook = hook;
+    sim_write_context = context;
+    pthread_rwlock_unlock(&sim_lock);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: CONTEXTS
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_ctx_open(smc_ctx_t **ctx)
+{
+    kern_return_t result;
+    smc_ctx_t *new_ctx = calloc(1, sizeof(smc_ctx_t));
+
+    *ctx = NULL;
+
+    if (new_ctx == NULL) {
+        return kIOReturnNoMemory;
+    }
+
+    result = open_conn(&new_ctx->conn);
+
+    if (result != kIOReturnSuccess) {
+        free(new_ctx);
+        return result;
+    }
+
+    *ctx = new_ctx;
+
+    return result;
+}
+
+
+kern_return_t smc_ctx_close(smc_ctx_t *ctx)
+{
+    kern_return_t result;
+
+    if (ctx == NULL) {
+        return kIOReturnSuccess;
+    }
+
+    result = close_conn(ctx->conn);
+    free(ctx);
+
+    return result;
+}
+
+
+kern_return_t smc_ctx_read(smc_ctx_t *ctx, uint32_t key, smc_value_t *value)
+{
+    value->result = read_key(ctx->conn, key, &ctx->inputStruct,
+                                             &ctx->outputStruct, value);
+
+    if (value->result == kIOReturnSuccess && value->kSMC != kSMCSuccess) {
+        return kIOReturnError;
+    }
+
+    return value->result;
+}
+
+
+kern_return_t smc_ctx_read_many(smc_ctx_t *ctx, const uint32_t *keys, size_t n,
+                                                smc_value_t *out)
+{
+    return read_many(ctx->conn, &ctx->inputStruct, &ctx->outputStruct, keys, n,
+                                                                      out);
+}
+
+
+kern_return_t smc_ctx_write(smc_ctx_t *ctx, uint32_t key, smc_value_t *value)
+{
+    value->result = write_key(ctx->conn, key, &ctx->inputStruct,
+                                              &ctx->outputStruct, value);
+
+    if (value->result == kIOReturnSuccess && value->kSMC != kSMCSuccess) {
+        return kIOReturnError;
+    }
+
+    return value->result;
+}
+
+
+/**
+Thread specific key destructor of a pool. Closes the context of an exiting
+thread, and takes it out of the pool's contexts.
+*/
+static void pool_release(void *value)
+{
+    smc_ctx_t *ctx = value;
+    smc_ctx_pool_t *pool = ctx->pool;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (size_t i = 0; i < pool->num_ctxs; i++) {
+        if (pool->ctxs[i] == ctx) {
+            pool->ctxs[i] = pool->ctxs[--pool->num_ctxs];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    smc_ctx_close(ctx);
+}
+
+
+smc_ctx_pool_t *smc_ctx_pool_create(void)
+{
+    smc_ctx_pool_t *pool = calloc(1, sizeof(smc_ctx_pool_t));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    if (pthread_key_create(&pool->key, pool_release) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+
+smc_ctx_t *smc_ctx_pool_get(smc_ctx_pool_t *pool)
+{
+    smc_ctx_t  *ctx = pthread_getspecific(pool->key);
+    smc_ctx_t **ctxs;
+
+    if (ctx != NULL) {
+        return ctx;
+    }
+
+    // First use on this thread, open its context. The lock is only taken
+    // here, never on the read path.
+    if (smc_ctx_open(&ctx) != kIOReturnSuccess) {
+        return NULL;
+    }
+
+    ctx->pool = pool;
+
+    // Bound to the thread before it's published to ctxs, so a failure on
+    // either side never has to take it back out of the array
+    if (pthread_setspecific(pool->key, ctx) != 0) {
+        smc_ctx_close(ctx);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    ctxs = realloc(pool->ctxs, (pool->num_ctxs + 1) * sizeof(smc_ctx_t *));
+
+    if (ctxs != NULL) {
+        pool->ctxs = ctxs;
+        pool->ctxs[pool->num_ctxs++] = ctx;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (ctxs == NULL) {
+        // Can't track it, so can't hand it out
+        pthread_setspecific(pool->key, NULL);
+        smc_ctx_close(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+
+void smc_ctx_pool_destroy(smc_ctx_pool_t *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < pool->num_ctxs; i++) {
+        smc_ctx_close(pool->ctxs[i]);
+    }
+
+    pthread_key_delete(pool->key);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->ctxs);
+    free(pool);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: RECORD & REPLAY
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_record_start(const char *path)
+{
+    recording_header_t header;
+    FILE *file;
+
+    if (__atomic_load_n(&record_file, __ATOMIC_RELAXED) != NULL) {
+        return kIOReturnBusy;
+    }
+
+    memset(&header, 0, sizeof(recording_header_t));
+    header.magic       = RECORDING_MAGIC;
+    header.version     = RECORDING_VERSION;
+    header.record_size = sizeof(record_t);
+
+    if (get_machine_model(header.model) != kIOReturnSuccess) {
+        memset(header.model, 0, sizeof(io_name_t));
+    }
+
+    file = fopen(path, "wb");
+
+    if (file == NULL) {
+        return kIOReturnError;
+    }
+
+    // Records are small, batch them into large writes
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+
+    if (fwrite(&header, sizeof(recording_header_t), 1, file) != 1) {
+        fclose(file);
+        return kIOReturnError;
+    }
+
+    pthread_mutex_lock(&record_lock);
+    record_start = monotonic_ns();
+    __atomic_store_n(&record_file, file, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_lock);
+
+    return kIOReturnSuccess;
+}
+
+
+kern_return_t smc_record_stop(void)
+{
+    FILE *file;
+
+    pthread_mutex_lock(&record_lock);
+    file = record_file;
+    __atomic_store_n(&record_file, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_lock);
+
+    if (file == NULL) {
+        return kIOReturnNotOpen;
+    }
 
-kern_return_t open_smc(void)
+    return fclose(file) == 0 ? kIOReturnSuccess : kIOReturnError;
+}
+
+
+kern_return_t smc_replay_load(const char *path, smc_replay_mode_t mode)
 {
-    kern_return_t result;
-    io_service_t service;
+    recording_header_t header;
+    size_t capacity = 0;
+    FILE *file = fopen(path, "rb");
 
-    service = IOServiceGetMatchingService(kIOMasterPortDefault,
-                                          IOServiceMatching(IOSERVICE_SMC));
+    if (file == NULL) {
+        return kIOReturnNotFound;
+    }
 
-    if (service == 0) {
-        // NOTE: IOServiceMatching documents 0 on failure
-        printf("ERROR: %s NOT FOUND\n", IOSERVICE_SMC);
-        return kIOReturnError;
+    if (fread(&header, sizeof(recording_header_t), 1, file) != 1 ||
+        header.magic != RECORDING_MAGIC ||
+        header.version != RECORDING_VERSION ||
+        header.record_size != sizeof(record_t)) {
+        fclose(file);
+        return kIOReturnBadArgument;
     }
 
-    result = IOServiceOpen(service, mach_task_self(), 0, &conn);
-    IOObjectRelease(service);
+    replay_free();
 
-    return result;
+    for (;;) {
+        replay_record_t entry;
+
+        memset(&entry, 0, sizeof(replay_record_t));
+
+        if (fread(&entry.record, sizeof(record_t), 1, file) != 1) {
+            break;
+        }
+
+        if (entry.record.payload_size > sizeof(entry.payload) ||
+            fread(entry.payload, 1, entry.record.payload_size, file) !=
+            entry.record.payload_size) {
+            // Truncated, the recording was probably cut short. Keep what was
+            // read in full.
+            break;
+        }
+
+        if (replay_num_records == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 1024;
+            replay_record_t *records = realloc(replay_records, new_capacity *
+                                                      sizeof(replay_record_t));
+
+            if (records == NULL) {
+                fclose(file);
+                replay_free();
+                return kIOReturnNoMemory;
+            }
+
+            replay_records = records;
+            capacity = new_capacity;
+        }
+
+        replay_records[replay_num_records++] = entry;
+    }
+
+    fclose(file);
+
+    if (replay_num_records == 0) {
+        replay_free();
+        return kIOReturnBadArgument;
+    }
+
+    // Group the calls by what they are matched on
+    replay_order  = malloc(replay_num_records * sizeof(size_t));
+    replay_groups = malloc(replay_num_records * sizeof(replay_group_t));
+
+    if (replay_order == NULL || replay_groups == NULL) {
+        replay_free();
+        return kIOReturnNoMemory;
+    }
+
+    for (size_t i = 0; i < replay_num_records; i++) {
+        replay_order[i] = i;
+    }
+
+    qsort(replay_order, replay_num_records, sizeof(size_t),
+          compare_replay_order);
+
+    for (size_t i = 0; i < replay_num_records; i++) {
+        const record_t *record = &replay_records[replay_order[i]].record;
+        uint32_t match = replay_match(record->selector, record->key,
+                                                        record->data32);
+        replay_group_t *group = replay_num_groups == 0 ? NULL :
+                                &replay_groups[replay_num_groups - 1];
+
+        if (group == NULL || group->match != match ||
+            group->selector != record->selector) {
+            group = &replay_groups[replay_num_groups++];
+            group->match    = match;
+            group->selector = record->selector;
+            group->first    = i;
+            group->count    = 0;
+            group->cursor   = 0;
+        }
+
+        group->count++;
+    }
+
+    memcpy(replay_model, header.model, sizeof(io_name_t));
+    replay_model[sizeof(io_name_t) - 1] = '\0';
+    replay_mode   = mode;
+    replay_start  = monotonic_ns();
+    replay_misses = 0;
+
+    return kIOReturnSuccess;
 }
 
 
-kern_return_t close_smc(void)
+void smc_replay_rewind(void)
 {
-    return IOServiceClose(conn);
+    for (size_t i = 0; i < replay_num_groups; i++) {
+        replay_groups[i].cursor = 0;
+    }
+
+    replay_start  = monotonic_ns();
+    replay_misses = 0;
 }
 
 
-bool is_key_valid(char *key)
+uint64_t smc_replay_get_misses(void)
 {
-    bool ans = false;
-    kern_return_t result;
-    smc_return_t  result_smc;
+    return __atomic_load_n(&replay_misses, __ATOMIC_RELAXED);
+}
 
-    if (strlen(key) != SMC_KEY_SIZE) {
-        printf("ERROR: Invalid key size - must be 4 chars\n");
-        return ans;
+
+//------------------------------------------------------------------------------
+// MARK: STATISTICS
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_get_stats(smc_stats_t *stats)
+{
+    memset(stats, 0, sizeof(smc_stats_t));
+
+#ifdef SMC_NO_STATS
+    return kIOReturnUnsupported;
+#else
+    size_t count = 0;
+
+    pthread_mutex_lock(&stats_lock);
+
+    stats_merge(stats, &stats_retired);
+
+    for (stats_block_t *block = stats_blocks; block != NULL;
+         block = block->next) {
+        // Not reset by its thread yet, its counters are from before
+        if (__atomic_load_n(&block->epoch, __ATOMIC_ACQUIRE) == stats_epoch) {
+            stats_merge(stats, &block->stats);
+        }
     }
 
-    // Try a read and see if it succeeds
-    result = read_smc(key, &result_smc);
+    pthread_mutex_unlock(&stats_lock);
 
-    if (result == kIOReturnSuccess && result_smc.kSMC == kSMCSuccess) {
-        ans = true;
+    // Hash table to a sorted list
+    for (size_t i = 0; i < SMC_STATS_MAX_KEYS; i++) {
+        if (stats->keys[i].key != 0) {
+            stats->keys[count++] = stats->keys[i];
+        }
     }
 
-    return ans;
+    memset(&stats->keys[count], 0,
+           (SMC_STATS_MAX_KEYS - count) * sizeof(smc_key_stats_t));
+    qsort(stats->keys, count, sizeof(smc_key_stats_t), compare_key_stats);
+    stats->num_keys = count;
+
+    return kIOReturnSuccess;
+#endif
 }
 
 
-double get_tmp(char *key, tmp_unit_t unit)
+void smc_reset_stats(void)
 {
-    kern_return_t result;
-    smc_return_t  result_smc;
+#ifndef SMC_NO_STATS
+    pthread_mutex_lock(&stats_lock);
+    memset(&stats_retired, 0, sizeof(smc_stats_t));
+    __atomic_add_fetch(&stats_epoch, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&stats_lock);
+#endif
+}
 
-    result = read_smc(key, &result_smc);
 
-    if (!(result == kIOReturnSuccess &&
-          result_smc.dataSize == 2   &&
-          result_smc.dataType == to_uint32_t(DATA_TYPE_SP78))) {
-        // Error
-        return 0.0;
+//------------------------------------------------------------------------------
+// MARK: CAPABILITIES
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_probe_capabilities(smc_capabilities_t *caps)
+{
+    kern_return_t  result = kIOReturnSuccess;
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+    uint64_t       present = 0;
+
+    memset(caps, 0, sizeof(smc_capabilities_t));
+
+    if (__atomic_load_n(&probed, __ATOMIC_ACQUIRE)) {
+        present = probed_present;
+    } else {
+        memset(&inputStruct,  0, sizeof(SMCParamStruct));
+        memset(&outputStruct, 0, sizeof(SMCParamStruct));
+
+        for (size_t i = 0; i < SMC_PROBE_KEYS; i++) {
+            if (key_cache_lookup(probe_keys[i])) {
+                continue;
+            }
+
+            // The key info is enough to tell if a key exists
+            inputStruct.key = probe_keys[i];
+            inputStruct.data8 = kSMCGetKeyInfo;
+
+            result = call_smc_conn(default_ctx.conn, &inputStruct,
+                                                     &outputStruct);
+
+            if (result != kIOReturnSuccess) {
+                break;
+            }
+
+            if (outputStruct.result == kSMCSuccess) {
+                present |= (uint64_t)1 << i;
+            } else if (outputStruct.result == kSMCKeyNotFound) {
+                key_cache_insert(probe_keys[i]);
+            }
+        }
+
+        // Only a complete pass is kept
+        if (result == kIOReturnSuccess) {
+            probed_present = present;
+            __atomic_store_n(&probed, true, __ATOMIC_RELEASE);
+        }
     }
 
-    // TODO: Create from_sp78() convert function
-    double tmp = result_smc.data[0];
+    caps->present = present;
 
-    switch (unit) {
-        case CELSIUS:
-            break;
-        case FAHRENHEIT:
-            tmp = to_fahrenheit(tmp);
-            break;
-        case KELVIN:
-            tmp = to_kelvin(tmp);
-            break;
+    for (size_t i = 0; i < SMC_PROBE_KEYS; i++) {
+        if (!(present & ((uint64_t)1 << i))) {
+            continue;
+        }
+
+        caps->num_present++;
+
+        if ((probe_keys[i] >> 24) == 'T') {
+            caps->num_tmp++;
+        } else if ((probe_keys[i] & 0xffff) == ('A' << 8 | 'c')) {
+            caps->num_fans++;
+        }
     }
 
-    return tmp;
+    return result;
 }
 
 
-bool is_battery_powered(void)
+size_t smc_get_probe_keys(const uint32_t **keys)
 {
-    kern_return_t result;
-    smc_return_t  result_smc;
+    *keys = probe_keys;
+
+    return SMC_PROBE_KEYS;
+}
 
-    result = read_smc(BATT_PWR, &result_smc);
 
-    if (!(result == kIOReturnSuccess &&
-          result_smc.dataSize == 1   &&
-          result_smc.dataType == to_uint32_t(DATA_TYPE_FLAG))) {
-        // Error
-        return false;
+bool smc_has_capability(const smc_capabilities_t *caps, uint32_t key)
+{
+    for (size_t i = 0; i < SMC_PROBE_KEYS; i++) {
+        if (probe_keys[i] == key) {
+            return caps->present & ((uint64_t)1 << i);
+        }
     }
 
-    return result_smc.data[0];
+    return false;
 }
 
 
-bool is_optical_disk_drive_full(void)
+void smc_clear_key_cache(void)
 {
-    kern_return_t result;
-    smc_return_t  result_smc;
+    __atomic_store_n(&probed, false, __ATOMIC_RELEASE);
 
-    result = read_smc(ODD_FULL, &result_smc);
-
-    if (!(result == kIOReturnSuccess &&
-          result_smc.dataSize == 1   &&
-          result_smc.dataType == to_uint32_t(DATA_TYPE_FLAG))) {
-        // Error
-        return false;
+    for (size_t i = 0; i < KEY_CACHE_SLOTS; i++) {
+        __atomic_store_n(&key_cache[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&key_cache_expiry[i], 0, __ATOMIC_RELAXED);
     }
 
-    return result_smc.data[0];
+    __atomic_store_n(&key_cache_entries, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&key_cache_hits, 0, __ATOMIC_RELAXED);
+
+#ifndef SMC_NO_STATS
+    pthread_mutex_lock(&stats_lock);
+    misses_cleared = stats_total_misses();
+    pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+
+void smc_get_key_cache_stats(smc_key_cache_stats_t *stats)
+{
+    stats->hits    = __atomic_load_n(&key_cache_hits, __ATOMIC_RELAXED);
+    stats->misses  = 0;
+    stats->entries = __atomic_load_n(&key_cache_entries, __ATOMIC_RELAXED);
+
+#ifndef SMC_NO_STATS
+    pthread_mutex_lock(&stats_lock);
+    stats->misses = stats_total_misses() - misses_cleared;
+    pthread_mutex_unlock(&stats_lock);
+#endif
 }
 
 
 //------------------------------------------------------------------------------
-// MARK: FAN FUNCTIONS
+// MARK: WRITE BATCH
 //------------------------------------------------------------------------------
 
 
-bool get_fan_name(unsigned int fan_num, fan_name_t name)
+/**
+Find the state of a key, adding it if new. Batches are small, a linear scan is
+fine.
+*/
+static write_state_t *write_batch_state(smc_write_batch_t *batch, uint32_t key)
 {
-    char key[5];
-    kern_return_t result;
-    smc_return_t  result_smc;
-    
-    sprintf(key, "F%dID", fan_num);
-    result = read_smc(key, &result_smc);
+    for (size_t i = 0; i < batch->num_states; i++) {
+        if (batch->states[i].key == key) {
+            return &batch->states[i];
+        }
+    }
 
-    if (!(result == kIOReturnSuccess &&
-          result_smc.dataSize == 16   &&
-          result_smc.dataType == to_uint32_t(DATA_TYPE_SFDS))) {
-      return false;
+    if (batch->num_states == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 8;
+        write_state_t *states = realloc(batch->states,
+                                        capacity * sizeof(write_state_t));
+
+        if (states == NULL) {
+            return NULL;
+        }
+
+        batch->states = states;
+        batch->capacity = capacity;
     }
 
-  
-    /*
-    We know the data size is 16 bytes and the type is "{fds", a custom
-    struct defined by the AppleSMC.kext. See TMP enum sources for the
-    struct.
-        
-    The last 12 bytes contain the name of the fan, an array of chars, hence
-    the loop range.
-    */
-    int index = 0; 
-    for (int i = 4; i < 16; i++) {
-        // Check if at the end (name may not be full 12 bytes)
-        // Could check for 0 (null), but instead we check for 32 (space). This
-        // is a hack to remove whitespace. :)
-        if (result_smc.data[i] == 32) {
+    write_state_t *state = &batch->states[batch->num_states++];
+
+    memset(state, 0, sizeof(write_state_t));
+    state->key = key;
+
+    return state;
+}
+
+
+/**
+Write one queued value, fetching the key info only if not cached.
+
+:returns: Status of the write, with result and kSMC filled in
+*/
+static smc_write_status_t write_batch_entry(io_connect_t    connection,
+                                            SMCParamStruct *inputStruct,
+                                            SMCParamStruct *outputStruct,
+                                            write_state_t  *state,
+                                            smc_value_t    *value,
+                                            bool            verify)
+{
+    value->result = kIOReturnSuccess;
+    value->kSMC = kSMCSuccess;
+
+    // Already there, as far as we know
+    if (state->keyInfoValid && state->confirmed &&
+        memcmp(state->data, value->data, value->dataSize) == 0) {
+        return SMC_WRITE_SKIPPED;
+    }
+
+    // At most one retry, when the cached key info turns out to be stale
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!state->keyInfoValid) {
+            inputStruct->key = state->key;
+            inputStruct->data8 = kSMCGetKeyInfo;
+            inputStruct->keyInfo.dataSize = 0;
+
+            value->result = call_smc_conn(connection, inputStruct,
+                                                      outputStruct);
+            value->kSMC = outputStruct->result;
+
+            if (value->result != kIOReturnSuccess ||
+                value->kSMC != kSMCSuccess) {
+                return SMC_WRITE_FAILED;
+            }
+
+            state->keyInfo = outputStruct->keyInfo;
+            state->keyInfoValid = true;
+        }
+
+        if (value->dataSize != state->keyInfo.dataSize ||
+            value->dataType != state->keyInfo.dataType) {
+            value->result = kIOReturnBadArgument;
+            return SMC_WRITE_FAILED;
+        }
+
+        inputStruct->key = state->key;
+        inputStruct->data8 = kSMCWriteKey;
+        inputStruct->keyInfo.dataSize = state->keyInfo.dataSize;
+        memcpy(inputStruct->bytes, value->data, sizeof(value->data));
+
+        value->result = call_smc_conn(connection, inputStruct, outputStruct);
+        value->kSMC = outputStruct->result;
+
+        if (value->result != kIOReturnSuccess ||
+            (value->kSMC != kSMCKeySizeMismatch &&
+             value->kSMC != kSMCKeyNotFound)) {
             break;
         }
 
-        name[index] = result_smc.data[i];
-        index++;
+        state->keyInfoValid = false;
     }
 
-    return true;
+    state->confirmed = false;
+
+    if (value->result != kIOReturnSuccess || value->kSMC != kSMCSuccess) {
+        return SMC_WRITE_FAILED;
+    }
+
+    if (verify) {
+        inputStruct->data8 = kSMCReadKey;
+
+        value->result = call_smc_conn(connection, inputStruct, outputStruct);
+        value->kSMC = outputStruct->result;
+
+        if (value->result != kIOReturnSuccess || value->kSMC != kSMCSuccess) {
+            return SMC_WRITE_FAILED;
+        }
+
+        // The SMC may clamp or ignore a value
+        if (memcmp(outputStruct->bytes, value->data, value->dataSize) != 0) {
+            return SMC_WRITE_MISMATCH;
+        }
+    }
+
+    state->confirmed = true;
+    memcpy(state->data, value->data, sizeof(state->data));
+
+    return SMC_WRITE_OK;
 }
 
 
-int get_num_fans(void)
+smc_write_batch_t *smc_write_batch_create(smc_ctx_t *ctx)
 {
-    kern_return_t result;
-    smc_return_t  result_smc;
+    smc_write_batch_t *batch = calloc(1, sizeof(smc_write_batch_t));
 
-    result = read_smc(NUM_FANS, &result_smc);
-
-    if (!(result == kIOReturnSuccess &&
-          result_smc.dataSize == 1   &&
-          result_smc.dataType == to_uint32_t(DATA_TYPE_UINT8))) {
-        // Error
-        return -1;
+    if (batch != NULL) {
+        batch->ctx = ctx;
     }
 
-    return result_smc.data[0];
+    return batch;
 }
 
 
-unsigned int get_fan_rpm(unsigned int fan_num)
+kern_return_t smc_write_batch_add(smc_write_batch_t *batch, uint32_t key,
+                                  const smc_value_t *value)
 {
-    char key[5];
-    kern_return_t result;
-    smc_return_t  result_smc;
+    if (value->dataSize > sizeof(value->data)) {
+        return kIOReturnBadArgument;
+    }
 
-    sprintf(key, "F%dAc", fan_num);
-    result = read_smc(key, &result_smc);
+    // A later write to a queued key replaces it, in place
+    for (size_t i = 0; i < batch->num_queued; i++) {
+        if (batch->queue[i].key == key) {
+            batch->queue[i] = *value;
+            batch->queue[i].key = key;
+            return kIOReturnSuccess;
+        }
+    }
 
-    if (!(result == kIOReturnSuccess &&
-          result_smc.dataSize == 2   &&
-          result_smc.dataType == to_uint32_t(DATA_TYPE_FPE2))) {
-        // Error
-        return 0;
+    if (batch->num_queued == batch->queue_capacity) {
+        size_t capacity = batch->queue_capacity ? batch->queue_capacity * 2 : 8;
+        smc_value_t *queue = realloc(batch->queue,
+                                     capacity * sizeof(smc_value_t));
+
+        if (queue == NULL) {
+            return kIOReturnNoMemory;
+        }
+
+        batch->queue = queue;
+        batch->queue_capacity = capacity;
     }
 
-    return from_fpe2(result_smc.data);
+    batch->queue[batch->num_queued] = *value;
+    batch->queue[batch->num_queued].key = key;
+    batch->num_queued++;
+
+    return kIOReturnSuccess;
 }
 
 
-bool set_fan_min_rpm(unsigned int fan_num, unsigned int rpm, bool auth)
+size_t smc_write_batch_count(const smc_write_batch_t *batch)
 {
-    // TODO: Add rpm val safety check
-    char key[5];
-    bool ans = false;
-    kern_return_t result;
-    smc_return_t  result_smc;
+    return batch->num_queued;
+}
 
-    memset(&result_smc, 0, sizeof(smc_return_t));
 
-    // TODO: Don't use magic number
-    result_smc.dataSize = 2;
-    result_smc.dataType = to_uint32_t(DATA_TYPE_FPE2); 
-    to_fpe2(rpm, result_smc.data);
+kern_return_t smc_write_batch_apply(smc_write_batch_t *batch, bool verify,
+                                    smc_write_result_t *results)
+{
+    kern_return_t  result = kIOReturnSuccess;
+    SMCParamStruct inputStruct;
+    SMCParamStruct outputStruct;
+    io_connect_t   connection = batch->ctx ? batch->ctx->conn :
+                                             default_ctx.conn;
 
-    sprintf(key, "F%dMn", fan_num);
-    result = write_smc(key, &result_smc);
+    memset(&inputStruct,  0, sizeof(SMCParamStruct));
+    memset(&outputStruct, 0, sizeof(SMCParamStruct));
 
-    if (result == kIOReturnSuccess && result_smc.kSMC == kSMCSuccess) {
-        ans = true;
+    for (size_t i = 0; i < batch->num_queued; i++) {
+        smc_value_t *value = &batch->queue[i];
+        write_state_t *state = write_batch_state(batch, value->key);
+        smc_write_status_t status;
+
+        if (state == NULL) {
+            value->result = kIOReturnNoMemory;
+            value->kSMC = kSMCSuccess;
+            status = SMC_WRITE_FAILED;
+        } else {
+            status = write_batch_entry(connection, &inputStruct,
+                                                   &outputStruct, state,
+                                                   value, verify);
+        }
+
+        if (status == SMC_WRITE_FAILED || status == SMC_WRITE_MISMATCH) {
+            result = kIOReturnError;
+        }
+
+        if (results != NULL) {
+            results[i].key    = value->key;
+            results[i].status = status;
+            results[i].result = value->result;
+            results[i].kSMC   = value->kSMC;
+        }
     }
 
-    return ans;
+    batch->num_queued = 0;
+
+    return result;
+}
+
+
+void smc_write_batch_invalidate(smc_write_batch_t *batch)
+{
+    for (size_t i = 0; i < batch->num_states; i++) {
+        batch->states[i].keyInfoValid = false;
+        batch->states[i].confirmed = false;
+    }
+}
+
+
+void smc_write_batch_destroy(smc_write_batch_t *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+
+    free(batch->queue);
+    free(batch->states);
+    free(batch);
 }
@@ -0,0 +1,358 @@
+/*
+ * Latest-value sensor table. A single refresher keeps one slot per key up to
+ * date, any number of threads read it wait-free through a sequence lock.
+ *
+ * table.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Size of a cache line. Each slot is exactly one, so readers of one key never
+contend with the refresher writing another.
+*/
+#define CACHE_LINE 64
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Slot of the table, one cache line.
+
+- sequence  : Sequence lock. Odd while the slot is being written.
+- key       : SMC key, fixed at creation
+- dataType  : Type of data
+- dataSize  : Number of valid bytes in data
+- kSMC      : SMC return code of the last read
+- valid     : Has the slot been read successfully yet?
+- value     : Decoded value, NAN if the type is not known
+- timestamp : When the slot was last refreshed, see smc_time_ns()
+- data      : Raw bytes, as returned by the SMC
+*/
+typedef struct {
+    uint32_t sequence;
+    uint32_t key;
+    uint32_t dataType;
+    uint8_t  dataSize;
+    uint8_t  kSMC;
+    uint8_t  valid;
+    uint8_t  reserved;
+    double   value;
+    uint64_t timestamp;
+    uint8_t  data[32];
+} slot_t;
+
+
+/**
+Sensor table
+
+- slots     : One per key, sorted by key. Cache line aligned.
+- handles   : Prepared keys, one per slot. NULL where a key couldn't be
+              prepared.
+- num_slots : Number of slots
+- period    : Refresh period of the refresher thread, in nanoseconds
+- thread    : Refresher thread
+- running   : Is the refresher thread running?
+- stop      : Set to ask the refresher thread to stop
+*/
+struct smc_table_s {
+    slot_t     *slots;
+    smc_key_t **handles;
+    size_t      num_slots;
+    uint64_t    period;
+    pthread_t   thread;
+    bool        running;
+    bool        stop;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint32_t key_a = *(const uint32_t *)a;
+    uint32_t key_b = *(const uint32_t *)b;
+
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+
+/**
+Find the slot of a key. Keys never change after creation, so this needs no
+locking.
+*/
+static const slot_t *find_slot(const smc_table_t *table, uint32_t key)
+{
+    size_t lo = 0;
+    size_t hi = table->num_slots;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (table->slots[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < table->num_slots && table->slots[lo].key == key) {
+        return &table->slots[lo];
+    }
+
+    return NULL;
+}
+
+
+/**
+Write a value into a slot, under the sequence lock. Only the single refresher
+writes.
+*/
+static void write_slot(slot_t *slot, const smc_value_t *value, double decoded,
+                                     uint64_t timestamp)
+{
+    uint32_t sequence = slot->sequence;
+
+    // Odd - readers retry until the write is done
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->dataType  = value->dataType;
+    slot->dataSize  = (uint8_t)value->dataSize;
+    slot->kSMC      = value->kSMC;
+    slot->valid     = value->result == kIOReturnSuccess && value->kSMC == 0;
+    slot->value     = decoded;
+    slot->timestamp = timestamp;
+    memcpy(slot->data, value->data, sizeof(slot->data));
+
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+static void refresher_run(void *context, uint64_t now_ns)
+{
+    smc_table_refresh(context);
+}
+
+
+static void *refresher_thread(void *arg)
+{
+    smc_table_t *table = arg;
+
+    smc_run_periodic(table->period, &table->stop, refresher_run, table);
+
+    return NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+smc_table_t *smc_table_create(const uint32_t *keys, size_t num_keys)
+{
+    void        *slots;
+    uint32_t    *sorted;
+    size_t       count = 0;
+    smc_table_t *table = calloc(1, sizeof(smc_table_t));
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    sorted = malloc((num_keys ? num_keys : 1) * sizeof(uint32_t));
+
+    if (sorted == NULL ||
+        posix_memalign(&slots, CACHE_LINE,
+                       (num_keys ? num_keys : 1) * sizeof(slot_t)) != 0) {
+        free(sorted);
+        free(table);
+        return NULL;
+    }
+
+    table->slots = slots;
+
+    // Sort and drop duplicates, so lookups can binary search
+    memcpy(sorted, keys, num_keys * sizeof(uint32_t));
+    qsort(sorted, num_keys, sizeof(uint32_t), compare_keys);
+
+    for (size_t i = 0; i < num_keys; i++) {
+        if (count == 0 || sorted[i] != sorted[count - 1]) {
+            sorted[count++] = sorted[i];
+        }
+    }
+
+    table->num_slots = count;
+    table->handles = calloc(count ? count : 1, sizeof(smc_key_t *));
+
+    if (table->handles == NULL) {
+        free(sorted);
+        smc_table_destroy(table);
+        return NULL;
+    }
+
+    memset(table->slots, 0, count * sizeof(slot_t));
+
+    for (size_t i = 0; i < count; i++) {
+        table->slots[i].key = sorted[i];
+        table->slots[i].value = NAN;
+        table->handles[i] = smc_prepare_u32(sorted[i]);
+    }
+
+    free(sorted);
+
+    return table;
+}
+
+
+kern_return_t smc_table_refresh(smc_table_t *table)
+{
+    kern_return_t result = kIOReturnSuccess;
+    smc_value_t   value;
+
+    for (size_t i = 0; i < table->num_slots; i++) {
+        double decoded = NAN;
+
+        if (table->handles[i] == NULL) {
+            result = kIOReturnError;
+            continue;
+        }
+
+        if (smc_read_prepared(table->handles[i], &value) != kIOReturnSuccess) {
+            result = kIOReturnError;
+        } else {
+            smc_decode_value(&value, &decoded);
+        }
+
+        write_slot(&table->slots[i], &value, decoded, smc_time_ns());
+    }
+
+    return result;
+}
+
+
+kern_return_t smc_table_start(smc_table_t *table, uint64_t period_ns)
+{
+    if (table->running) {
+        return kIOReturnSuccess;
+    }
+
+    table->period = period_ns;
+    table->stop = false;
+
+    if (pthread_create(&table->thread, NULL, refresher_thread, table) != 0) {
+        return kIOReturnNoResources;
+    }
+
+    table->running = true;
+
+    return kIOReturnSuccess;
+}
+
+
+void smc_table_stop(smc_table_t *table)
+{
+    if (!table->running) {
+        return;
+    }
+
+    __atomic_store_n(&table->stop, true, __ATOMIC_RELEASE);
+    pthread_join(table->thread, NULL);
+    table->running = false;
+}
+
+
+void smc_table_destroy(smc_table_t *table)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    smc_table_stop(table);
+
+    for (size_t i = 0; table->handles != NULL && i < table->num_slots; i++) {
+        smc_release_prepared(table->handles[i]);
+    }
+
+    free(table->handles);
+    free(table->slots);
+    free(table);
+}
+
+
+bool smc_table_get(const smc_table_t *table, uint32_t key,
+                   smc_table_entry_t *entry)
+{
+    uint32_t      before;
+    uint32_t      after;
+    slot_t        copy;
+    const slot_t *slot = find_slot(table, key);
+
+    if (slot == NULL) {
+        return false;
+    }
+
+    do {
+        before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+        // Being written, try again
+        if (before & 1) {
+            continue;
+        }
+
+        memcpy(&copy, slot, sizeof(slot_t));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    if (!copy.valid) {
+        return false;
+    }
+
+    memset(entry, 0, sizeof(smc_table_entry_t));
+    entry->value.key      = key;
+    entry->value.dataType = copy.dataType;
+    entry->value.dataSize = copy.dataSize;
+    entry->value.result   = kIOReturnSuccess;
+    entry->value.kSMC     = copy.kSMC;
+    memcpy(entry->value.data, copy.data, sizeof(copy.data));
+    entry->decoded   = copy.value;
+    entry->timestamp = copy.timestamp;
+
+    return true;
+}
@@ -0,0 +1,832 @@
+/*
+ * Virtual keys. Expressions over real keys are parsed into a single graph of
+ * nodes shared by every virtual key, one node per real key and per distinct
+ * subexpression. Reading a virtual key evaluates only the nodes it depends on,
+ * memoizing each for the current epoch.
+ *
+ * virtual.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Deepest nesting of an expression, so a malformed one can't exhaust the stack
+while parsing
+*/
+#define MAX_DEPTH 64
+
+
+/**
+Tallest node of the graph, bounding the recursion of evaluate(). Long chains
+such as a + b + c ... add a level per operator.
+*/
+#define MAX_HEIGHT 256
+
+
+/**
+Most arguments of a function call
+*/
+#define MAX_ARGS 32
+
+
+/**
+Epoch of a node that has never been evaluated
+*/
+#define NO_EPOCH UINT64_MAX
+
+
+//------------------------------------------------------------------------------
+// MARK: ENUMS
+//------------------------------------------------------------------------------
+
+
+typedef enum {
+    NODE_CONST,
+    NODE_KEY,
+    NODE_ADD,
+    NODE_SUB,
+    NODE_MUL,
+    NODE_DIV,
+    NODE_NEG,
+    NODE_ABS,
+    NODE_MAX,
+    NODE_MIN,
+    NODE_AVG
+} node_kind_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Node of the expression graph. Children come before their parents in nodes, so
+the graph can't have cycles.
+
+- kind     : What the node computes
+- key      : Real key read, for NODE_KEY
+- handle   : Prepared key, for NODE_KEY. NULL until first read.
+- absent   : The key couldn't be prepared, for NODE_KEY. Not retried.
+- first    : Index of the first child in args
+- num_args : Number of children
+- height   : Longest path down to a key or constant, which has height 0
+- value    : The constant, for NODE_CONST. Otherwise the value memoized.
+- epoch    : Epoch value was computed in, NO_EPOCH if never
+*/
+typedef struct {
+    node_kind_t kind;
+    uint32_t    key;
+    smc_key_t  *handle;
+    bool        absent;
+    size_t      first;
+    size_t      num_args;
+    size_t      height;
+    double      value;
+    uint64_t    epoch;
+} node_t;
+
+
+/**
+Virtual key
+
+- key  : The key, as a uint32_t
+- root : Node of its expression
+*/
+typedef struct {
+    uint32_t key;
+    size_t   root;
+} virtual_t;
+
+
+/**
+Expression parser state
+
+- pos   : Next character
+- depth : Current nesting
+*/
+typedef struct {
+    const char *pos;
+    int         depth;
+} parser_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: GLOBAL VARS
+//------------------------------------------------------------------------------
+
+
+/**
+Guards everything below. Expressions are evaluated under it.
+*/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+Expression graph: nodes, and the child indexes of every node, back to back
+*/
+static node_t *nodes;
+static size_t  num_nodes;
+static size_t  nodes_capacity;
+static size_t *args;
+static size_t  num_args;
+static size_t  args_capacity;
+
+
+/**
+Virtual keys. num_virtual is also read without the lock, so getters skip the
+lock entirely when there are none.
+*/
+static virtual_t *virtuals;
+static size_t     num_virtual;
+static size_t     virtuals_capacity;
+
+
+/**
+Epochs: epoch_period is their length in nanoseconds (zero for one per read),
+epoch_count counts reads or forced epochs
+*/
+static uint64_t epoch_period;
+static uint64_t epoch_count;
+
+
+static smc_virtual_stats_t stats;
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - GRAPH
+//------------------------------------------------------------------------------
+
+
+static bool grow(void **array, size_t *capacity, size_t needed, size_t size)
+{
+    if (needed <= *capacity) {
+        return true;
+    }
+
+    size_t new_capacity = *capacity ? *capacity : 16;
+
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+
+    void *grown = realloc(*array, new_capacity * size);
+
+    if (grown == NULL) {
+        return false;
+    }
+
+    *array = grown;
+    *capacity = new_capacity;
+
+    return true;
+}
+
+
+static const virtual_t *find_virtual(uint32_t key)
+{
+    for (size_t i = 0; i < num_virtual; i++) {
+        if (virtuals[i].key == key) {
+            return &virtuals[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+Add a node, or find the identical one already in the graph, so common
+subexpressions are shared
+
+:param: children Child node indexes
+:returns: The node's index, SIZE_MAX if out of memory or taller than
+          MAX_HEIGHT
+*/
+static size_t add_node(node_kind_t kind, uint32_t key, double value,
+                       const size_t *children, size_t n)
+{
+    for (size_t i = 0; i < num_nodes; i++) {
+        const node_t *node = &nodes[i];
+
+        if (node->kind != kind || node->num_args != n ||
+            (kind == NODE_KEY && node->key != key) ||
+            (kind == NODE_CONST && node->value != value) ||
+            (n > 0 &&
+             memcmp(&args[node->first], children, n * sizeof(size_t)) != 0)) {
+            continue;
+        }
+
+        return i;
+    }
+
+    size_t height = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        if (nodes[children[i]].height >= height) {
+            height = nodes[children[i]].height + 1;
+        }
+    }
+
+    if (height > MAX_HEIGHT ||
+        !grow((void **)&nodes, &nodes_capacity, num_nodes + 1,
+              sizeof(node_t)) ||
+        !grow((void **)&args, &args_capacity, num_args + n, sizeof(size_t))) {
+        return SIZE_MAX;
+    }
+
+    node_t *node = &nodes[num_nodes];
+
+    memset(node, 0, sizeof(node_t));
+    node->kind     = kind;
+    node->key      = key;
+    node->value    = value;
+    node->first    = num_args;
+    node->num_args = n;
+    node->height   = height;
+    node->epoch    = NO_EPOCH;
+
+    if (n > 0) {
+        memcpy(&args[num_args], children, n * sizeof(size_t));
+        num_args += n;
+    }
+
+    return num_nodes++;
+}
+
+
+static double evaluate(size_t index, uint64_t epoch);
+
+
+/**
+Fold a constant node's children into its value
+*/
+static size_t fold(size_t index)
+{
+    if (index == SIZE_MAX) {
+        return SIZE_MAX;
+    }
+
+    node_t *node = &nodes[index];
+
+    if (node->kind == NODE_CONST || node->kind == NODE_KEY) {
+        return index;
+    }
+
+    for (size_t i = 0; i < node->num_args; i++) {
+        if (nodes[args[node->first + i]].kind != NODE_CONST) {
+            return index;
+        }
+    }
+
+    double value = evaluate(index, NO_EPOCH - 1);
+
+    // Drop the operation if it was just added, nothing else refers to it
+    if (index == num_nodes - 1) {
+        num_args -= node->num_args;
+        num_nodes--;
+    }
+
+    return add_node(NODE_CONST, 0, value, NULL, 0);
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - PARSER
+//------------------------------------------------------------------------------
+
+
+static size_t parse_expr(parser_t *parser);
+
+
+static void skip_spaces(parser_t *parser)
+{
+    while (isspace((unsigned char)*parser->pos)) {
+        parser->pos++;
+    }
+}
+
+
+static bool accept(parser_t *parser, char c)
+{
+    skip_spaces(parser);
+
+    if (*parser->pos != c) {
+        return false;
+    }
+
+    parser->pos++;
+
+    return true;
+}
+
+
+/**
+Node of a key named in an expression: the root of a virtual key, or a real key
+*/
+static size_t key_node(uint32_t key)
+{
+    const virtual_t *virtual = find_virtual(key);
+
+    if (virtual != NULL) {
+        return virtual->root;
+    }
+
+    return add_node(NODE_KEY, key, 0, NULL, 0);
+}
+
+
+static size_t parse_call(parser_t *parser, const char *name, size_t length)
+{
+    static const struct {
+        const char *name;
+        node_kind_t kind;
+    } functions[] = {
+        { "abs", NODE_ABS },
+        { "avg", NODE_AVG },
+        { "max", NODE_MAX },
+        { "min", NODE_MIN }
+    };
+    size_t children[MAX_ARGS];
+    size_t n = 0;
+    node_kind_t kind = NODE_CONST;
+
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (strlen(functions[i].name) == length &&
+            strncmp(functions[i].name, name, length) == 0) {
+            kind = functions[i].kind;
+        }
+    }
+
+    if (kind == NODE_CONST) {
+        return SIZE_MAX;
+    }
+
+    do {
+        if (n == MAX_ARGS ||
+            (children[n++] = parse_expr(parser)) == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+    } while (accept(parser, ','));
+
+    if (!accept(parser, ')') || (kind == NODE_ABS && n != 1)) {
+        return SIZE_MAX;
+    }
+
+    return add_node(kind, 0, 0, children, n);
+}
+
+
+static size_t parse_primary(parser_t *parser)
+{
+    skip_spaces(parser);
+
+    const char *start = parser->pos;
+
+    // Number
+    if (isdigit((unsigned char)*start) || *start == '.') {
+        char *end;
+        double value = strtod(start, &end);
+
+        if (end == start) {
+            return SIZE_MAX;
+        }
+
+        parser->pos = end;
+
+        return add_node(NODE_CONST, 0, value, NULL, 0);
+    }
+
+    // Quoted key, any 4 characters
+    if (*start == '\'') {
+        if (strnlen(start + 1, 5) < 5 || start[5] != '\'') {
+            return SIZE_MAX;
+        }
+
+        parser->pos = start + 6;
+
+        return key_node(SMC_FOURCC(start[1], start[2], start[3], start[4]));
+    }
+
+    // Key or function name
+    if (isalpha((unsigned char)*start)) {
+        while (isalnum((unsigned char)*parser->pos)) {
+            parser->pos++;
+        }
+
+        size_t length = parser->pos - start;
+
+        if (accept(parser, '(')) {
+            return parse_call(parser, start, length);
+        }
+
+        if (length != 4) {
+            return SIZE_MAX;
+        }
+
+        return key_node(SMC_FOURCC(start[0], start[1], start[2], start[3]));
+    }
+
+    if (accept(parser, '(')) {
+        size_t node = parse_expr(parser);
+
+        return node != SIZE_MAX && accept(parser, ')') ? node : SIZE_MAX;
+    }
+
+    return SIZE_MAX;
+}
+
+
+static size_t parse_unary(parser_t *parser)
+{
+    bool negate = false;
+
+    // Iterative, a run of minus signs mustn't recurse. Pairs cancel out.
+    while (accept(parser, '-')) {
+        negate = !negate;
+    }
+
+    size_t child = parse_primary(parser);
+
+    if (child == SIZE_MAX || !negate) {
+        return child;
+    }
+
+    return fold(add_node(NODE_NEG, 0, 0, &child, 1));
+}
+
+
+static size_t parse_term(parser_t *parser)
+{
+    size_t children[2];
+
+    children[0] = parse_unary(parser);
+
+    while (children[0] != SIZE_MAX) {
+        node_kind_t kind;
+
+        if (accept(parser, '*')) {
+            kind = NODE_MUL;
+        } else if (accept(parser, '/')) {
+            kind = NODE_DIV;
+        } else {
+            break;
+        }
+
+        if ((children[1] = parse_unary(parser)) == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+
+        children[0] = fold(add_node(kind, 0, 0, children, 2));
+    }
+
+    return children[0];
+}
+
+
+static size_t parse_expr(parser_t *parser)
+{
+    size_t children[2];
+
+    if (++parser->depth > MAX_DEPTH) {
+        return SIZE_MAX;
+    }
+
+    children[0] = parse_term(parser);
+
+    while (children[0] != SIZE_MAX) {
+        node_kind_t kind;
+
+        if (accept(parser, '+')) {
+            kind = NODE_ADD;
+        } else if (accept(parser, '-')) {
+            kind = NODE_SUB;
+        } else {
+            break;
+        }
+
+        if ((children[1] = parse_term(parser)) == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+
+        children[0] = fold(add_node(kind, 0, 0, children, 2));
+    }
+
+    parser->depth--;
+
+    return children[0];
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - EVALUATION
+//------------------------------------------------------------------------------
+
+
+static double read_key(node_t *node)
+{
+    smc_value_t value;
+    double decoded = NAN;
+
+    if (node->handle == NULL && !node->absent) {
+        node->handle = smc_prepare_u32(node->key);
+        node->absent = node->handle == NULL;
+    }
+
+    if (node->handle == NULL) {
+        return NAN;
+    }
+
+    stats.physical_reads++;
+
+    if (smc_read_prepared(node->handle, &value) == kIOReturnSuccess) {
+        smc_decode_value(&value, &decoded);
+    }
+
+    return decoded;
+}
+
+
+/**
+Value of a node in an epoch, computed at most once per epoch
+*/
+static double evaluate(size_t index, uint64_t epoch)
+{
+    node_t *node = &nodes[index];
+    const size_t *children = &args[node->first];
+    double value;
+
+    if (node->kind == NODE_CONST) {
+        return node->value;
+    }
+
+    if (node->epoch == epoch) {
+        stats.memo_hits++;
+        return node->value;
+    }
+
+    switch (node->kind) {
+        case NODE_KEY:
+            value = read_key(node);
+            break;
+        case NODE_ADD:
+            value = evaluate(children[0], epoch) + evaluate(children[1], epoch);
+            break;
+        case NODE_SUB:
+            value = evaluate(children[0], epoch) - evaluate(children[1], epoch);
+            break;
+        case NODE_MUL:
+            value = evaluate(children[0], epoch) * evaluate(children[1], epoch);
+            break;
+        case NODE_DIV:
+            value = evaluate(children[0], epoch) / evaluate(children[1], epoch);
+            break;
+        case NODE_NEG:
+            value = -evaluate(children[0], epoch);
+            break;
+        case NODE_ABS:
+            value = fabs(evaluate(children[0], epoch));
+            break;
+        default: {
+            // max, min and avg skip arguments that can't be read
+            double sum = 0;
+            size_t count = 0;
+
+            value = NAN;
+
+            for (size_t i = 0; i < node->num_args; i++) {
+                double arg = evaluate(children[i], epoch);
+
+                if (isnan(arg)) {
+                    continue;
+                }
+
+                if (count++ == 0 ||
+                    (node->kind == NODE_MAX && arg > value) ||
+                    (node->kind == NODE_MIN && arg < value)) {
+                    value = arg;
+                }
+
+                sum += arg;
+            }
+
+            if (node->kind == NODE_AVG && count > 0) {
+                value = sum / count;
+            }
+
+            break;
+        }
+    }
+
+    node->value = value;
+    node->epoch = epoch;
+
+    return value;
+}
+
+
+/**
+Epoch of a read starting now
+*/
+static uint64_t current_epoch(void)
+{
+    if (epoch_period == 0) {
+        return ++epoch_count;
+    }
+
+    return smc_time_ns() / epoch_period + epoch_count;
+}
+
+
+static void reset_epochs(void)
+{
+    for (size_t i = 0; i < num_nodes; i++) {
+        nodes[i].epoch = NO_EPOCH;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+kern_return_t smc_virtual_define(char *key, const char *expression)
+{
+    uint32_t code = smc_encode_key(key);
+    kern_return_t result = kIOReturnSuccess;
+    parser_t parser;
+
+    // A key on the SMC would be shadowed by the getters
+    if (code == 0 || smc_virtual_is_defined(code) ||
+        smc_is_key_valid_u32(code)) {
+        return kIOReturnBadArgument;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    size_t saved_nodes = num_nodes;
+    size_t saved_args = num_args;
+
+    parser.pos   = expression;
+    parser.depth = 0;
+
+    size_t root = parse_expr(&parser);
+
+    skip_spaces(&parser);
+
+    if (root == SIZE_MAX || *parser.pos != '\0' || find_virtual(code) != NULL ||
+        !grow((void **)&virtuals, &virtuals_capacity, num_virtual + 1,
+              sizeof(virtual_t))) {
+        // Drop the nodes added. None of them has a prepared key yet.
+        num_nodes = saved_nodes;
+        num_args  = saved_args;
+        result    = kIOReturnBadArgument;
+    } else {
+        virtuals[num_virtual].key  = code;
+        virtuals[num_virtual].root = root;
+        __atomic_store_n(&num_virtual, num_virtual + 1, __ATOMIC_RELEASE);
+        stats.nodes = num_nodes;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+
+void smc_virtual_clear(void)
+{
+    pthread_mutex_lock(&lock);
+
+    for (size_t i = 0; i < num_nodes; i++) {
+        smc_release_prepared(nodes[i].handle);
+    }
+
+    free(nodes);
+    free(args);
+    free(virtuals);
+    nodes             = NULL;
+    args              = NULL;
+    virtuals          = NULL;
+    num_nodes         = 0;
+    num_args          = 0;
+    nodes_capacity    = 0;
+    args_capacity     = 0;
+    virtuals_capacity = 0;
+    stats.nodes       = 0;
+    __atomic_store_n(&num_virtual, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&lock);
+}
+
+
+void smc_virtual_set_epoch(uint64_t period_ns)
+{
+    pthread_mutex_lock(&lock);
+    epoch_period = period_ns;
+    epoch_count  = 0;
+    reset_epochs();
+    pthread_mutex_unlock(&lock);
+}
+
+
+void smc_virtual_next_epoch(void)
+{
+    pthread_mutex_lock(&lock);
+    epoch_count++;
+    pthread_mutex_unlock(&lock);
+}
+
+
+kern_return_t smc_virtual_read(uint32_t key, smc_value_t *value)
+{
+    if (__atomic_load_n(&num_virtual, __ATOMIC_ACQUIRE) == 0) {
+        return kIOReturnNotFound;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    const virtual_t *virtual = find_virtual(key);
+
+    if (virtual == NULL) {
+        pthread_mutex_unlock(&lock);
+        return kIOReturnNotFound;
+    }
+
+    stats.reads++;
+
+    double decoded = evaluate(virtual->root, current_epoch());
+
+    pthread_mutex_unlock(&lock);
+
+    // flt is in host (little endian) order, see smc_decode()
+    float single = (float)decoded;
+    uint32_t raw;
+
+    memcpy(&raw, &single, sizeof(raw));
+    memset(value, 0, sizeof(smc_value_t));
+    value->key      = key;
+    value->dataType = SMC_TYPE_FLT;
+    value->dataSize = 4;
+    value->data[0]  = raw;
+    value->data[1]  = raw >> 8;
+    value->data[2]  = raw >> 16;
+    value->data[3]  = raw >> 24;
+    value->result   = isnan(decoded) ? kIOReturnError : kIOReturnSuccess;
+
+    return value->result;
+}
+
+
+bool smc_virtual_is_defined(uint32_t key)
+{
+    bool defined;
+
+    if (__atomic_load_n(&num_virtual, __ATOMIC_ACQUIRE) == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    defined = find_virtual(key) != NULL;
+    pthread_mutex_unlock(&lock);
+
+    return defined;
+}
+
+
+void smc_virtual_get_stats(smc_virtual_stats_t *stats_out)
+{
+    pthread_mutex_lock(&lock);
+    *stats_out = stats;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,563 @@
+/*
+ * Threshold watches. A watcher reads each watched key once per sweep, shared
+ * by every watch on it, and runs each watch's state machine (threshold,
+ * hysteresis and debounce), calling back only on its edges.
+ *
+ * watch.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+State of a watch
+
+- config    : Configuration, as given to smc_watch_add()
+- callback  : Called on its edges
+- userdata  : Passed to the callback
+- id        : Id returned by smc_watch_add()
+- key_index : Index of its key in the watcher's keys, SIZE_MAX until the keys
+              are next built
+- above     : Has it fired a rising edge and not yet fallen back?
+- pending   : Is the value past the next edge, waiting out the debounce?
+- since     : When the value went past the next edge
+*/
+typedef struct {
+    smc_watch_config_t   config;
+    smc_watch_callback_t callback;
+    void                *userdata;
+    uint32_t             id;
+    size_t               key_index;
+    bool                 above;
+    bool                 pending;
+    uint64_t             since;
+} watch_t;
+
+
+/**
+Callback to make once a sweep has let go of the lock
+*/
+typedef struct {
+    smc_watch_callback_t callback;
+    void                *userdata;
+    smc_watch_event_t    event;
+} fired_t;
+
+
+/**
+Watcher
+
+- watches     : Watches, in no particular order
+- num_watches : Number of watches
+- capacity    : Size of watches and fired
+- keys        : Keys watched, sorted and each once. Only built and read by
+                sweeps, so sweep_lock guards it along with handles and values
+                (lock is also taken while building it).
+- handles     : Prepared keys, NULL where a key couldn't be prepared
+- values      : Decoded value of each key in the current sweep, NAN if the
+                read failed
+- num_keys    : Number of keys
+- dirty       : Have watches been added or removed since keys was built?
+- next_id     : Id of the next watch added
+- fired       : Callbacks of the current sweep
+- period      : Sweep period of the watcher thread, in nanoseconds
+- lock        : Guards the watches and counters. Never held while reading the
+                SMC.
+- sweep_lock  : Held for a whole sweep, reads and callbacks included
+- stats       : Counters
+- thread      : Watcher thread
+- running     : Is the watcher thread running?
+- stop        : Set to ask the watcher thread to stop
+*/
+struct smc_watcher_s {
+    watch_t            *watches;
+    size_t              num_watches;
+    size_t              capacity;
+    uint32_t           *keys;
+    smc_key_t         **handles;
+    double             *values;
+    size_t              num_keys;
+    bool                dirty;
+    uint32_t            next_id;
+    fired_t            *fired;
+    uint64_t            period;
+    pthread_mutex_t     lock;
+    pthread_mutex_t     sweep_lock;
+    smc_watcher_stats_t stats;
+    pthread_t           thread;
+    bool                running;
+    bool                stop;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint32_t key_a = *(const uint32_t *)a;
+    uint32_t key_b = *(const uint32_t *)b;
+
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+
+static void release_keys(smc_watcher_t *watcher)
+{
+    for (size_t i = 0; i < watcher->num_keys; i++) {
+        smc_release_prepared(watcher->handles[i]);
+    }
+
+    free(watcher->keys);
+    free(watcher->handles);
+    free(watcher->values);
+    watcher->keys     = NULL;
+    watcher->handles  = NULL;
+    watcher->values   = NULL;
+    watcher->num_keys = 0;
+}
+
+
+/**
+Rebuild the set of keys watched, each once, and point every watch at its key.
+Keys already prepared keep their handle, new ones are left for prepare_keys().
+Must hold both locks.
+*/
+static kern_return_t build_keys(smc_watcher_t *watcher)
+{
+    size_t n = watcher->num_watches;
+    uint32_t *keys = malloc((n ? n : 1) * sizeof(uint32_t));
+    smc_key_t **handles = calloc(n ? n : 1, sizeof(smc_key_t *));
+    double *values = malloc((n ? n : 1) * sizeof(double));
+    size_t num_keys = 0;
+
+    if (keys == NULL || handles == NULL || values == NULL) {
+        free(keys);
+        free(handles);
+        free(values);
+        return kIOReturnNoMemory;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = watcher->watches[i].config.key;
+    }
+
+    qsort(keys, n, sizeof(uint32_t), compare_keys);
+
+    for (size_t i = 0; i < n; i++) {
+        if (num_keys == 0 || keys[num_keys - 1] != keys[i]) {
+            keys[num_keys++] = keys[i];
+        }
+    }
+
+    // Carry over the handles of keys still watched, release the rest
+    for (size_t i = 0; i < watcher->num_keys; i++) {
+        uint32_t *found = bsearch(&watcher->keys[i], keys, num_keys,
+                                  sizeof(uint32_t), compare_keys);
+
+        if (found != NULL) {
+            handles[found - keys] = watcher->handles[i];
+        } else {
+            smc_release_prepared(watcher->handles[i]);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t *found = bsearch(&watcher->watches[i].config.key, keys,
+                                  num_keys, sizeof(uint32_t), compare_keys);
+
+        watcher->watches[i].key_index = found - keys;
+    }
+
+    free(watcher->keys);
+    free(watcher->handles);
+    free(watcher->values);
+    watcher->keys     = keys;
+    watcher->handles  = handles;
+    watcher->values   = values;
+    watcher->num_keys = num_keys;
+    watcher->dirty    = false;
+
+    return kIOReturnSuccess;
+}
+
+
+/**
+Prepare the keys of a fresh build. Keys that couldn't be prepared are retried
+on the next build. Holds sweep_lock only, as it calls the SMC.
+*/
+static void prepare_keys(smc_watcher_t *watcher)
+{
+    for (size_t i = 0; i < watcher->num_keys; i++) {
+        if (watcher->handles[i] == NULL) {
+            watcher->handles[i] = smc_prepare_u32(watcher->keys[i]);
+        }
+    }
+}
+
+
+/**
+Read every key watched, once. Holds sweep_lock only.
+
+:returns: Number of keys that couldn't be read
+*/
+static size_t read_keys(smc_watcher_t *watcher)
+{
+    smc_value_t value;
+    size_t errors = 0;
+
+    for (size_t i = 0; i < watcher->num_keys; i++) {
+        double decoded = NAN;
+
+        if (watcher->handles[i] != NULL &&
+            smc_read_prepared(watcher->handles[i], &value) ==
+            kIOReturnSuccess) {
+            smc_decode_value(&value, &decoded);
+        }
+
+        if (isnan(decoded)) {
+            errors++;
+        }
+
+        watcher->values[i] = decoded;
+    }
+
+    return errors;
+}
+
+
+/**
+Step a watch's state machine. On the other side of its next edge for the
+debounce time, it fires.
+
+:returns: The edge fired, zero for none
+*/
+static unsigned int evaluate(watch_t *watch, double value, uint64_t now)
+{
+    // Failed read, hold the state as is
+    if (isnan(value)) {
+        return 0;
+    }
+
+    bool past = watch->above ?
+                value < watch->config.threshold - watch->config.hysteresis :
+                value > watch->config.threshold;
+
+    if (!past) {
+        watch->pending = false;
+        return 0;
+    }
+
+    if (!watch->pending) {
+        watch->pending = true;
+        watch->since   = now;
+    }
+
+    if (now - watch->since < watch->config.debounce_ns) {
+        return 0;
+    }
+
+    watch->pending = false;
+    watch->above   = !watch->above;
+
+    return watch->above ? SMC_WATCH_RISING : SMC_WATCH_FALLING;
+}
+
+
+static void watcher_run(void *context, uint64_t now_ns)
+{
+    smc_watcher_sweep(context, now_ns);
+}
+
+
+static void *watcher_thread(void *arg)
+{
+    smc_watcher_t *watcher = arg;
+
+    smc_run_periodic(watcher->period, &watcher->stop, watcher_run, watcher);
+
+    return NULL;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+smc_watcher_t *smc_watcher_create(uint64_t period_ns)
+{
+    if (period_ns == 0) {
+        return NULL;
+    }
+
+    smc_watcher_t *watcher = calloc(1, sizeof(smc_watcher_t));
+
+    if (watcher == NULL) {
+        return NULL;
+    }
+
+    watcher->period  = period_ns;
+    watcher->next_id = 1;
+
+    if (pthread_mutex_init(&watcher->lock, NULL) != 0) {
+        free(watcher);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&watcher->sweep_lock, NULL) != 0) {
+        pthread_mutex_destroy(&watcher->lock);
+        free(watcher);
+        return NULL;
+    }
+
+    return watcher;
+}
+
+
+kern_return_t smc_watch_add(smc_watcher_t *watcher,
+                            const smc_watch_config_t *config,
+                            smc_watch_callback_t callback, void *userdata,
+                            uint32_t *id)
+{
+    if (callback == NULL || isnan(config->threshold) ||
+        !(config->hysteresis >= 0) || config->edges == 0 ||
+        (config->edges & ~(SMC_WATCH_RISING | SMC_WATCH_FALLING)) != 0) {
+        return kIOReturnBadArgument;
+    }
+
+    pthread_mutex_lock(&watcher->lock);
+
+    if (watcher->num_watches == watcher->capacity) {
+        size_t capacity = watcher->capacity ? watcher->capacity * 2 : 16;
+        watch_t *watches = realloc(watcher->watches,
+                                   capacity * sizeof(watch_t));
+        fired_t *fired = NULL;
+
+        if (watches != NULL) {
+            watcher->watches = watches;
+            fired = realloc(watcher->fired, capacity * sizeof(fired_t));
+        }
+
+        if (fired == NULL) {
+            pthread_mutex_unlock(&watcher->lock);
+            return kIOReturnNoMemory;
+        }
+
+        watcher->fired    = fired;
+        watcher->capacity = capacity;
+    }
+
+    watch_t *watch = &watcher->watches[watcher->num_watches++];
+
+    memset(watch, 0, sizeof(watch_t));
+    watch->config    = *config;
+    watch->callback  = callback;
+    watch->userdata  = userdata;
+    watch->id        = watcher->next_id++;
+    watch->key_index = SIZE_MAX;
+    watcher->dirty   = true;
+
+    if (id != NULL) {
+        *id = watch->id;
+    }
+
+    pthread_mutex_unlock(&watcher->lock);
+
+    return kIOReturnSuccess;
+}
+
+
+kern_return_t smc_watch_remove(smc_watcher_t *watcher, uint32_t id)
+{
+    kern_return_t result = kIOReturnNotFound;
+
+    pthread_mutex_lock(&watcher->lock);
+
+    for (size_t i = 0; i < watcher->num_watches; i++) {
+        if (watcher->watches[i].id == id) {
+            watcher->watches[i] = watcher->watches[--watcher->num_watches];
+            watcher->dirty = true;
+            result = kIOReturnSuccess;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&watcher->lock);
+
+    return result;
+}
+
+
+size_t smc_watcher_sweep(smc_watcher_t *watcher, uint64_t now_ns)
+{
+    size_t num_fired = 0;
+    size_t num_evaluated = 0;
+    size_t errors = 0;
+    bool built;
+    bool ready;
+
+    pthread_mutex_lock(&watcher->sweep_lock);
+
+    uint64_t start = smc_time_ns();
+
+    pthread_mutex_lock(&watcher->lock);
+    built = watcher->dirty;
+    ready = !built || build_keys(watcher) == kIOReturnSuccess;
+    pthread_mutex_unlock(&watcher->lock);
+
+    // Under sweep_lock alone, so adding and removing watches and getting the
+    // stats don't wait on the SMC
+    if (ready) {
+        if (built) {
+            prepare_keys(watcher);
+        }
+
+        errors = read_keys(watcher);
+    }
+
+    pthread_mutex_lock(&watcher->lock);
+
+    for (size_t i = 0; ready && i < watcher->num_watches; i++) {
+        watch_t *watch = &watcher->watches[i];
+
+        // Added since the keys were built, evaluated from the next sweep
+        if (watch->key_index >= watcher->num_keys) {
+            continue;
+        }
+
+        double value = watcher->values[watch->key_index];
+        unsigned int edge = evaluate(watch, value, now_ns);
+
+        num_evaluated++;
+
+        if ((edge & watch->config.edges) == 0) {
+            continue;
+        }
+
+        fired_t *fired = &watcher->fired[num_fired++];
+
+        fired->callback        = watch->callback;
+        fired->userdata        = watch->userdata;
+        fired->event.id        = watch->id;
+        fired->event.key       = watch->config.key;
+        fired->event.edge      = edge;
+        fired->event.value     = value;
+        fired->event.timestamp = now_ns;
+    }
+
+    if (ready) {
+        watcher->stats.reads       += watcher->num_keys;
+        watcher->stats.read_errors += errors;
+        watcher->stats.evaluations += num_evaluated;
+    }
+
+    uint64_t elapsed = smc_time_ns() - start;
+
+    watcher->stats.sweeps++;
+    watcher->stats.events   += num_fired;
+    watcher->stats.total_ns += elapsed;
+
+    if (elapsed > watcher->stats.max_ns) {
+        watcher->stats.max_ns = elapsed;
+    }
+
+    pthread_mutex_unlock(&watcher->lock);
+
+    // Outside the lock, so callbacks may add and remove watches. Adding may
+    // move fired, take a copy of each entry first.
+    for (size_t i = 0; i < num_fired; i++) {
+        pthread_mutex_lock(&watcher->lock);
+        fired_t fired = watcher->fired[i];
+        pthread_mutex_unlock(&watcher->lock);
+
+        fired.callback(&fired.event, fired.userdata);
+    }
+
+    pthread_mutex_unlock(&watcher->sweep_lock);
+
+    return num_fired;
+}
+
+
+void smc_watcher_get_stats(smc_watcher_t *watcher, smc_watcher_stats_t *stats)
+{
+    pthread_mutex_lock(&watcher->lock);
+    *stats = watcher->stats;
+    pthread_mutex_unlock(&watcher->lock);
+}
+
+
+kern_return_t smc_watcher_start(smc_watcher_t *watcher)
+{
+    if (watcher->running) {
+        return kIOReturnSuccess;
+    }
+
+    watcher->stop = false;
+
+    if (pthread_create(&watcher->thread, NULL, watcher_thread, watcher) != 0) {
+        return kIOReturnNoResources;
+    }
+
+    watcher->running = true;
+
+    return kIOReturnSuccess;
+}
+
+
+void smc_watcher_stop(smc_watcher_t *watcher)
+{
+    if (!watcher->running) {
+        return;
+    }
+
+    __atomic_store_n(&watcher->stop, true, __ATOMIC_RELEASE);
+    pthread_join(watcher->thread, NULL);
+    watcher->running = false;
+}
+
+
+void smc_watcher_destroy(smc_watcher_t *watcher)
+{
+    if (watcher == NULL) {
+        return;
+    }
+
+    smc_watcher_stop(watcher);
+    release_keys(watcher);
+    pthread_mutex_destroy(&watcher->sweep_lock);
+    pthread_mutex_destroy(&watcher->lock);
+    free(watcher->watches);
+    free(watcher->fired);
+    free(watcher);
+}
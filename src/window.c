@@ -0,0 +1,626 @@
+/*
+ * Windowed statistics. Each key keeps a ring of its recent samples, and each
+ * window over it keeps its summaries up to date as samples enter and leave:
+ * monotonic deques for the min and max, Welford's running mean and variance
+ * (with removal), and a fixed histogram for quantiles.
+ *
+ * window.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+One window over a key. Samples are named by their sequence number in the key's
+ring, the window holds those from oldest up to the key's next, at most
+mask + 1 of them.
+
+- span      : Length of the window, in nanoseconds
+- mask      : Capacity of the window and its deques, minus one
+- oldest    : Sequence number of the oldest sample in the window
+- min_head  : Front of min_deque, its oldest entry
+- min_tail  : Back of min_deque
+- min_deque : Sequence numbers of the samples that may yet be the min, values
+              increasing from front to back
+- max_head  : Front of max_deque
+- max_tail  : Back of max_deque
+- max_deque : Same as min_deque, values decreasing
+- mean      : Running mean
+- m2        : Running sum of squared differences from the mean
+- removals  : Samples removed since the mean and m2 were last recomputed
+- bins      : Histogram of the samples, SMC_WINDOW_BINS bins
+*/
+typedef struct {
+    uint64_t  span;
+    uint32_t  mask;
+    uint32_t  oldest;
+    uint32_t  min_head;
+    uint32_t  min_tail;
+    uint32_t *min_deque;
+    uint32_t  max_head;
+    uint32_t  max_tail;
+    uint32_t *max_deque;
+    double    mean;
+    double    m2;
+    uint32_t  removals;
+    uint32_t *bins;
+} window_t;
+
+
+/**
+Samples and windows of one key
+
+- key         : SMC key, as a uint32_t
+- lo          : Low end of the histograms
+- scale       : Histogram bins per unit of the value
+- mask        : Capacity of the ring, minus one. At least that of every window.
+- next        : Sequence number of the next sample
+- last_time   : Time of the latest sample, in nanoseconds
+- times       : Ring of sample times
+- values      : Ring of sample values
+- windows     : Windows over the key
+*/
+typedef struct {
+    uint32_t  key;
+    double    lo;
+    double    scale;
+    uint32_t  mask;
+    uint32_t  next;
+    uint64_t  last_time;
+    uint64_t *times;
+    double   *values;
+    window_t  windows[SMC_WINDOW_MAX];
+} series_t;
+
+
+/**
+Windowed statistics
+
+- series      : One per key, sorted by key
+- num_series  : Number of keys
+- num_windows : Number of windows per key
+- lock        : Appends take it for writing, queries for reading
+*/
+struct smc_window_s {
+    series_t        *series;
+    size_t           num_series;
+    size_t           num_windows;
+    pthread_rwlock_t lock;
+};
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static uint32_t round_up_pow2(uint64_t n)
+{
+    uint32_t pow2 = 1;
+
+    while (pow2 < n && pow2 < (1u << 31)) {
+        pow2 <<= 1;
+    }
+
+    return pow2;
+}
+
+
+static int compare_series(const void *a, const void *b)
+{
+    uint32_t key_a = ((const series_t *)a)->key;
+    uint32_t key_b = ((const series_t *)b)->key;
+
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+
+static series_t *find_series(smc_window_t *window, uint32_t key)
+{
+    series_t target;
+
+    target.key = key;
+
+    return bsearch(&target, window->series, window->num_series,
+                   sizeof(series_t), compare_series);
+}
+
+
+static window_t *find_window(series_t *series, size_t num_windows,
+                             uint64_t span)
+{
+    for (size_t i = 0; i < num_windows; i++) {
+        if (series->windows[i].span == span) {
+            return &series->windows[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static uint32_t bin_of(const series_t *series, double value)
+{
+    double bin = (value - series->lo) * series->scale;
+
+    if (!(bin > 0)) {
+        return 0;
+    }
+
+    return bin < SMC_WINDOW_BINS ? (uint32_t)bin : SMC_WINDOW_BINS - 1;
+}
+
+
+/**
+Recompute the mean and m2 of a window from its samples, to shed the rounding
+error that removals accumulate. Done once per window's worth of removals, so
+still O(1) amortized.
+*/
+static void refresh_moments(const series_t *series, window_t *window)
+{
+    uint32_t count = series->next - window->oldest;
+    double sum = 0;
+    double m2 = 0;
+
+    for (uint32_t seq = window->oldest; seq != series->next; seq++) {
+        sum += series->values[seq & series->mask];
+    }
+
+    double mean = count ? sum / count : 0;
+
+    for (uint32_t seq = window->oldest; seq != series->next; seq++) {
+        double delta = series->values[seq & series->mask] - mean;
+
+        m2 += delta * delta;
+    }
+
+    window->mean     = mean;
+    window->m2       = m2;
+    window->removals = 0;
+}
+
+
+/**
+Add the sample of sequence number seq, already in the ring, to a window
+*/
+static void window_add(const series_t *series, window_t *window, uint32_t seq)
+{
+    const double *values = series->values;
+    uint32_t smask = series->mask;
+    double value = values[seq & smask];
+    uint32_t count = seq - window->oldest + 1;
+    double delta = value - window->mean;
+
+    window->mean += delta / count;
+    window->m2   += delta * (value - window->mean);
+
+    window->bins[bin_of(series, value)]++;
+
+    // Samples no smaller than this one can never be the min again
+    while (window->min_tail != window->min_head &&
+           values[window->min_deque[(window->min_tail - 1) & window->mask] &
+                  smask] >= value) {
+        window->min_tail--;
+    }
+
+    window->min_deque[window->min_tail++ & window->mask] = seq;
+
+    while (window->max_tail != window->max_head &&
+           values[window->max_deque[(window->max_tail - 1) & window->mask] &
+                  smask] <= value) {
+        window->max_tail--;
+    }
+
+    window->max_deque[window->max_tail++ & window->mask] = seq;
+}
+
+
+/**
+Remove the oldest sample from a window
+*/
+static void window_remove(const series_t *series, window_t *window)
+{
+    uint32_t seq = window->oldest;
+    double value = series->values[seq & series->mask];
+    uint32_t count = series->next - seq;
+
+    if (count <= 1) {
+        window->mean = 0;
+        window->m2   = 0;
+    } else {
+        double delta = value - window->mean;
+
+        window->mean -= delta / (count - 1);
+        window->m2   -= delta * (value - window->mean);
+
+        if (window->m2 < 0) {
+            window->m2 = 0;
+        }
+    }
+
+    window->bins[bin_of(series, value)]--;
+
+    if (window->min_deque[window->min_head & window->mask] == seq) {
+        window->min_head++;
+    }
+
+    if (window->max_deque[window->max_head & window->mask] == seq) {
+        window->max_head++;
+    }
+
+    window->oldest++;
+
+    if (++window->removals > window->mask) {
+        refresh_moments(series, window);
+    }
+}
+
+
+static kern_return_t append(smc_window_t *window, series_t *series,
+                            uint64_t timestamp, double value)
+{
+    if (timestamp < series->last_time) {
+        return kIOReturnBadArgument;
+    }
+
+    series->last_time = timestamp;
+
+    for (size_t i = 0; i < window->num_windows; i++) {
+        window_t *w = &series->windows[i];
+
+        // Age out samples by time, and the oldest if the window is full
+        while (w->oldest != series->next &&
+               series->times[w->oldest & series->mask] + w->span <= timestamp) {
+            window_remove(series, w);
+        }
+
+        if (!isnan(value) && series->next - w->oldest > w->mask) {
+            window_remove(series, w);
+        }
+    }
+
+    if (isnan(value)) {
+        return kIOReturnSuccess;
+    }
+
+    uint32_t seq = series->next;
+
+    series->times[seq & series->mask]  = timestamp;
+    series->values[seq & series->mask] = value;
+
+    for (size_t i = 0; i < window->num_windows; i++) {
+        window_add(series, &series->windows[i], seq);
+    }
+
+    series->next++;
+
+    return kIOReturnSuccess;
+}
+
+
+/**
+Quantiles from a window's histogram, in one pass. Samples are taken as spread
+evenly across their bin, and the results are kept within the window's min and
+max.
+
+:param: qs Quantiles, 0 to 1, in increasing order
+:param: out One result per quantile
+*/
+static void quantiles(const series_t *series, const window_t *window,
+                      const double *qs, size_t n, double min, double max,
+                      double *out)
+{
+    uint32_t count = series->next - window->oldest;
+    double cumulative = 0;
+    uint32_t bin = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        // Rank of the quantile among the samples, from zero
+        double rank = qs[i] * (count - 1);
+
+        while (bin < SMC_WINDOW_BINS - 1 &&
+               cumulative + window->bins[bin] <= rank) {
+            cumulative += window->bins[bin++];
+        }
+
+        double value = series->lo + (bin + (rank - cumulative + 0.5) /
+                                           window->bins[bin]) / series->scale;
+
+        out[i] = value < min ? min : value > max ? max : value;
+    }
+}
+
+
+static void free_series(series_t *series, size_t num_windows)
+{
+    for (size_t i = 0; i < num_windows; i++) {
+        free(series->windows[i].min_deque);
+        free(series->windows[i].max_deque);
+        free(series->windows[i].bins);
+    }
+
+    free(series->times);
+    free(series->values);
+}
+
+
+static kern_return_t init_series(series_t *series, const smc_window_key_t *key,
+                                 const uint64_t *windows_ns, size_t num_windows,
+                                 uint64_t period_ns)
+{
+    uint32_t capacity = 1;
+
+    series->key   = key->key;
+    series->lo    = key->min;
+    series->scale = SMC_WINDOW_BINS / (key->max - key->min);
+
+    for (size_t i = 0; i < num_windows; i++) {
+        window_t *w = &series->windows[i];
+        uint32_t size = round_up_pow2(windows_ns[i] / period_ns + 1);
+
+        w->span      = windows_ns[i];
+        w->mask      = size - 1;
+        w->min_deque = malloc(size * sizeof(uint32_t));
+        w->max_deque = malloc(size * sizeof(uint32_t));
+        w->bins      = calloc(SMC_WINDOW_BINS, sizeof(uint32_t));
+
+        if (w->min_deque == NULL || w->max_deque == NULL || w->bins == NULL) {
+            return kIOReturnNoMemory;
+        }
+
+        if (size > capacity) {
+            capacity = size;
+        }
+    }
+
+    series->mask   = capacity - 1;
+    series->times  = malloc(capacity * sizeof(uint64_t));
+    series->values = malloc(capacity * sizeof(double));
+
+    if (series->times == NULL || series->values == NULL) {
+        return kIOReturnNoMemory;
+    }
+
+    return kIOReturnSuccess;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: "PUBLIC" FUNCTIONS
+//------------------------------------------------------------------------------
+
+
+smc_window_t *smc_window_create(const smc_window_key_t *keys, size_t num_keys,
+                                const uint64_t *windows_ns, size_t num_windows,
+                                uint64_t period_ns)
+{
+    if (num_keys == 0 || num_windows == 0 || num_windows > SMC_WINDOW_MAX ||
+        period_ns == 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < num_windows; i++) {
+        // Each window can hold at most 2^31 samples
+        if (windows_ns[i] == 0 || windows_ns[i] / period_ns >= (1u << 31)) {
+            return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < num_keys; i++) {
+        if (!(keys[i].min < keys[i].max)) {
+            return NULL;
+        }
+    }
+
+    smc_window_t *window = calloc(1, sizeof(smc_window_t));
+
+    if (window == NULL) {
+        return NULL;
+    }
+
+    window->series      = calloc(num_keys, sizeof(series_t));
+    window->num_series  = num_keys;
+    window->num_windows = num_windows;
+
+    if (window->series == NULL ||
+        pthread_rwlock_init(&window->lock, NULL) != 0) {
+        free(window->series);
+        free(window);
+        return NULL;
+    }
+
+    bool ok = true;
+
+    for (size_t i = 0; ok && i < num_keys; i++) {
+        ok = init_series(&window->series[i], &keys[i], windows_ns, num_windows,
+                         period_ns) == kIOReturnSuccess;
+    }
+
+    if (ok) {
+        qsort(window->series, num_keys, sizeof(series_t), compare_series);
+
+        for (size_t i = 1; ok && i < num_keys; i++) {
+            ok = window->series[i].key != window->series[i - 1].key;
+        }
+    }
+
+    if (!ok) {
+        smc_window_destroy(window);
+        return NULL;
+    }
+
+    return window;
+}
+
+
+void smc_window_destroy(smc_window_t *window)
+{
+    if (window == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < window->num_series; i++) {
+        free_series(&window->series[i], window->num_windows);
+    }
+
+    pthread_rwlock_destroy(&window->lock);
+    free(window->series);
+    free(window);
+}
+
+
+kern_return_t smc_window_append(smc_window_t *window, uint32_t key,
+                                uint64_t timestamp, double value)
+{
+    kern_return_t result = kIOReturnNotFound;
+
+    pthread_rwlock_wrlock(&window->lock);
+
+    series_t *series = find_series(window, key);
+
+    if (series != NULL) {
+        result = append(window, series, timestamp, value);
+    }
+
+    pthread_rwlock_unlock(&window->lock);
+
+    return result;
+}
+
+
+kern_return_t smc_window_append_frame(smc_window_t *window,
+                                      const uint32_t *keys, size_t num_keys,
+                                      uint64_t timestamp, const double *values)
+{
+    kern_return_t result = kIOReturnSuccess;
+    series_t *series = NULL;
+
+    pthread_rwlock_wrlock(&window->lock);
+
+    for (size_t i = 0; i < num_keys; i++) {
+        kern_return_t key_result = kIOReturnNotFound;
+
+        // Frames usually list keys in order, try the next series first
+        if (series != NULL && series + 1 < window->series + window->num_series &&
+            series[1].key == keys[i]) {
+            series++;
+        } else {
+            series = find_series(window, keys[i]);
+        }
+
+        if (series != NULL) {
+            key_result = append(window, series, timestamp, values[i]);
+        }
+
+        if (key_result != kIOReturnSuccess) {
+            result = key_result;
+        }
+    }
+
+    pthread_rwlock_unlock(&window->lock);
+
+    return result;
+}
+
+
+kern_return_t smc_window_get(smc_window_t *window, uint32_t key,
+                             uint64_t window_ns, smc_window_stats_t *stats)
+{
+    static const double qs[] = { 0.50, 0.95, 0.99 };
+    kern_return_t result = kIOReturnSuccess;
+    double ps[3];
+
+    stats->count  = 0;
+    stats->min    = NAN;
+    stats->max    = NAN;
+    stats->mean   = NAN;
+    stats->stddev = NAN;
+    stats->p50    = NAN;
+    stats->p95    = NAN;
+    stats->p99    = NAN;
+
+    pthread_rwlock_rdlock(&window->lock);
+
+    series_t *series = find_series(window, key);
+    window_t *w = NULL;
+
+    if (series == NULL) {
+        result = kIOReturnNotFound;
+    } else if ((w = find_window(series, window->num_windows, window_ns)) ==
+               NULL) {
+        result = kIOReturnBadArgument;
+    } else if (series->next != w->oldest) {
+        uint32_t count = series->next - w->oldest;
+        const double *values = series->values;
+
+        stats->count  = count;
+        stats->min    = values[w->min_deque[w->min_head & w->mask] &
+                               series->mask];
+        stats->max    = values[w->max_deque[w->max_head & w->mask] &
+                               series->mask];
+        stats->mean   = w->mean;
+        stats->stddev = count > 1 ? sqrt(w->m2 / (count - 1)) : 0;
+        quantiles(series, w, qs, 3, stats->min, stats->max, ps);
+
+        stats->p50    = ps[0];
+        stats->p95    = ps[1];
+        stats->p99    = ps[2];
+    }
+
+    pthread_rwlock_unlock(&window->lock);
+
+    return result;
+}
+
+
+double smc_window_quantile(smc_window_t *window, uint32_t key,
+                           uint64_t window_ns, double q)
+{
+    double value = NAN;
+
+    pthread_rwlock_rdlock(&window->lock);
+
+    series_t *series = find_series(window, key);
+    window_t *w = series ? find_window(series, window->num_windows, window_ns)
+                         : NULL;
+
+    if (w != NULL && series->next != w->oldest && q >= 0 && q <= 1) {
+        double min = series->values[w->min_deque[w->min_head & w->mask] &
+                                    series->mask];
+        double max = series->values[w->max_deque[w->max_head & w->mask] &
+                                    series->mask];
+
+        quantiles(series, w, &q, 1, min, max, &value);
+    }
+
+    pthread_rwlock_unlock(&window->lock);
+
+    return value;
+}
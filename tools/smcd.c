@@ -0,0 +1,220 @@
+/*
+ * smcd - samples a set of SMC keys and publishes them in a shared-memory
+ * sensor table, so any number of monitoring processes can read them with
+ * smc_shm_open()/smc_shm_get() without each polling the driver.
+ *
+ * usage: smcd [--name name] [--period ms] [--keys KEY,KEY,...] [--sim n]
+ *
+ * By default every key of a known data type is published, once a second,
+ * under SMC_SHM_NAME. --sim selects the simulated SMC, populated with n keys.
+ * It is the only transport on platforms other than OS X.
+ *
+ * smcd.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: GLOBAL VARS
+//------------------------------------------------------------------------------
+
+
+/**
+Set by SIGINT/SIGTERM to shut down. A lock free atomic, so safe to set from the
+signal handler.
+*/
+static bool stop;
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS
+//------------------------------------------------------------------------------
+
+
+static void handle_signal(int sig)
+{
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+}
+
+
+static void publisher_run(void *context, uint64_t now_ns)
+{
+    smc_publisher_refresh(context);
+}
+
+
+/**
+Parse a comma separated list of 4 character keys.
+
+:returns: Number of keys, zero on a malformed list
+*/
+static size_t parse_keys(const char *list, uint32_t **keys)
+{
+    size_t count = (strlen(list) + 1) / 5;
+
+    *keys = malloc((count ? count : 1) * sizeof(uint32_t));
+
+    if (*keys == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const char *key = list + i * 5;
+
+        if (key[4] != ',' && key[4] != '\0') {
+            return 0;
+        }
+
+        (*keys)[i] = SMC_FOURCC(key[0], key[1], key[2], key[3]);
+    }
+
+    return strlen(list) == count * 5 - 1 ? count : 0;
+}
+
+
+/**
+Every key on the SMC with a data type smc_decode() knows.
+
+:returns: Number of keys
+*/
+static size_t catalog_keys(uint32_t **keys)
+{
+    smc_catalog_t catalog;
+    uint8_t data[32];
+    size_t count = 0;
+
+    memset(data, 0, sizeof(data));
+
+    if (smc_catalog_build(&catalog, 1) != kIOReturnSuccess) {
+        return 0;
+    }
+
+    *keys = malloc((catalog.count ? catalog.count : 1) * sizeof(uint32_t));
+
+    for (size_t i = 0; *keys != NULL && i < catalog.count; i++) {
+        double value;
+
+        if (smc_decode(catalog.keys[i].dataType, data,
+                       catalog.keys[i].dataSize, &value)) {
+            (*keys)[count++] = catalog.keys[i].key;
+        }
+    }
+
+    smc_catalog_free(&catalog);
+
+    return count;
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: MAIN
+//------------------------------------------------------------------------------
+
+
+int main(int argc, char *argv[])
+{
+    const char *name = SMC_SHM_NAME;
+    const char *key_list = NULL;
+    uint64_t period = 1000;
+    long sim_keys = -1;
+    uint32_t *keys = NULL;
+    size_t num_keys;
+    smc_publisher_t *publisher;
+    struct sigaction action;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--name") == 0) {
+            name = argv[i + 1];
+        } else if (strcmp(argv[i], "--period") == 0) {
+            period = strtoull(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--keys") == 0) {
+            key_list = argv[i + 1];
+        } else if (strcmp(argv[i], "--sim") == 0) {
+            sim_keys = strtol(argv[i + 1], NULL, 10);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (period == 0) {
+        fprintf(stderr, "period must be at least 1 ms\n");
+        return -1;
+    }
+
+#ifndef __APPLE__
+    // No I/O Kit, the simulated SMC is the only option
+    if (sim_keys < 0) {
+        sim_keys = 64;
+    }
+#endif
+
+    if (sim_keys >= 0 &&
+        (smc_set_transport(SMC_TRANSPORT_SIM) != kIOReturnSuccess ||
+         smc_sim_populate((size_t)sim_keys) != kIOReturnSuccess)) {
+        fprintf(stderr, "failed to set up the simulated SMC\n");
+        return -1;
+    }
+
+    if (open_smc() != kIOReturnSuccess) {
+        fprintf(stderr, "failed to open a connection to the SMC\n");
+        return -1;
+    }
+
+    num_keys = key_list ? parse_keys(key_list, &keys) : catalog_keys(&keys);
+
+    if (num_keys == 0) {
+        fprintf(stderr, "no keys to publish\n");
+        free(keys);
+        close_smc();
+        return -1;
+    }
+
+    publisher = smc_publisher_create(name, keys, num_keys, period * 1000000);
+    free(keys);
+
+    if (publisher == NULL) {
+        fprintf(stderr, "failed to publish %s\n", name);
+        close_smc();
+        return -1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("smcd: publishing %zu keys as %s every %llu ms\n", num_keys, name,
+           (unsigned long long)period);
+    fflush(stdout);
+
+    // Refresh at fixed deadlines, so the period doesn't drift
+    smc_run_periodic(period * 1000000, &stop, publisher_run, publisher);
+
+    smc_publisher_destroy(publisher);
+    close_smc();
+
+    return 0;
+}
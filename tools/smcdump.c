@@ -0,0 +1,690 @@
+/*
+ * smcdump - dumps every key on the SMC with its decoded value, as CSV, JSON
+ * Lines or a compact binary format. With --watch, re-reads every key at an
+ * interval and only writes the keys whose value changed.
+ *
+ * usage: smcdump [--format csv|jsonl|bin] [--watch ms] [--count n]
+ *                [--threads n] [--sim n] [--stats]
+ *
+ * Keys are enumerated once (see smc_catalog_build()), then each dump reads
+ * every key with a single call (see smc_read_typed()). Output goes through a
+ * preallocated buffer, formatted by hand rather than by printf. --count stops
+ * after n dumps, by default one, or until SIGINT/SIGTERM with --watch. --stats
+ * prints the enumeration and dump times and the output throughput to stderr.
+ * --sim selects the simulated SMC, populated with n keys. It is the only
+ * transport on platforms other than OS X.
+ *
+ * Every line or record of a dump carries the time of the dump, wall-clock
+ * nanoseconds since the Unix epoch, so dumps from different runs or hosts line
+ * up:
+ *
+ * - csv   : time,key,type,size,value,raw - with a header line. value is empty
+ *           if the type is not known or the read failed, raw is the data in
+ *           hex, empty if the read failed.
+ * - jsonl : {"time":..,"key":"..","type":"..","size":..,"value":..,"raw":".."}
+ *           - value is null if the type is not known or the read failed.
+ * - bin   : Per dump, a header of magic "SMCD", version (1 byte), 3 reserved
+ *           bytes, time (8 bytes) and number of records (4 bytes). Then per
+ *           key, key (4 bytes), type (4 bytes), size (1 byte), kSMC (1 byte,
+ *           zero if read, 0xff if the call failed) and the data (size bytes,
+ *           none if not read). Numbers are big endian, as on the SMC.
+ *
+ * smcdump.c
+ * libsmc
+ *
+ * Copyright (C) 2014  beltex <https://github.com/beltex>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/smc.h"
+
+
+//------------------------------------------------------------------------------
+// MARK: MACROS
+//------------------------------------------------------------------------------
+
+
+/**
+Size of the output buffer, and the most a single line or record can take. The
+buffer is flushed when less than that is left.
+*/
+#define OUT_SIZE   65536
+#define MAX_RECORD 512
+
+
+/**
+Binary format version
+*/
+#define BIN_VERSION 1
+
+
+//------------------------------------------------------------------------------
+// MARK: ENUMS
+//------------------------------------------------------------------------------
+
+
+typedef enum {
+    FORMAT_CSV,
+    FORMAT_JSONL,
+    FORMAT_BIN
+} format_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: STRUCTS
+//------------------------------------------------------------------------------
+
+
+/**
+Output buffer, written to fd when full
+
+- data  : Buffer, OUT_SIZE bytes
+- len   : Bytes in the buffer
+- total : Bytes written so far, flushed or not
+- fd    : File descriptor to flush to
+- error : Did a write fail?
+*/
+typedef struct {
+    char    *data;
+    size_t   len;
+    uint64_t total;
+    int      fd;
+    bool     error;
+} out_t;
+
+
+/**
+State of the dumps, see dump()
+
+- catalog  : Keys to dump
+- values   : Values read by this dump
+- last     : Values read by the last dump
+- out      : Output
+- format   : Output format
+- count    : Number of dumps to make, zero for no limit
+- dumps    : Number of dumps made
+- records  : Number of keys written
+- read_ns  : Time spent reading
+- write_ns : Time spent formatting and writing
+*/
+typedef struct {
+    const smc_catalog_t *catalog;
+    smc_value_t         *values;
+    smc_value_t         *last;
+    out_t                out;
+    format_t             format;
+    unsigned long        count;
+    unsigned long        dumps;
+    uint64_t             records;
+    uint64_t             read_ns;
+    uint64_t             write_ns;
+} dump_t;
+
+
+//------------------------------------------------------------------------------
+// MARK: GLOBAL VARS
+//------------------------------------------------------------------------------
+
+
+/**
+Set by SIGINT/SIGTERM, or once the last dump is made, to shut down. A lock free
+atomic, so safe to set from the signal handler.
+*/
+static bool stop;
+
+
+static const char hex_digits[] = "0123456789abcdef";
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - OUTPUT
+//------------------------------------------------------------------------------
+
+
+static void handle_signal(int sig)
+{
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+}
+
+
+static void out_flush(out_t *out)
+{
+    size_t done = 0;
+
+    while (done < out->len && !out->error) {
+        ssize_t written = write(out->fd, out->data + done, out->len - done);
+
+        if (written < 0 && errno != EINTR) {
+            out->error = true;
+        } else if (written > 0) {
+            done += written;
+        }
+    }
+
+    out->len = 0;
+}
+
+
+/**
+Make room for a line or record
+*/
+static void out_reserve(out_t *out)
+{
+    if (OUT_SIZE - out->len < MAX_RECORD) {
+        out_flush(out);
+    }
+}
+
+
+static void out_char(out_t *out, char c)
+{
+    out->data[out->len++] = c;
+    out->total++;
+}
+
+
+static void out_str(out_t *out, const char *str)
+{
+    while (*str != '\0') {
+        out_char(out, *str++);
+    }
+}
+
+
+static void out_u64(out_t *out, uint64_t value)
+{
+    char digits[20];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    while (n > 0) {
+        out_char(out, digits[--n]);
+    }
+}
+
+
+/**
+Write a decoded value, to 6 decimal places with trailing zeros dropped. Every
+fixed point type of the SMC fits, larger floats fall back to snprintf().
+*/
+static void out_double(out_t *out, double value)
+{
+    if (!(fabs(value) < 1e12)) {
+        char str[32];
+        int n = snprintf(str, sizeof(str), "%.17g", value);
+
+        for (int i = 0; i < n && i < (int)sizeof(str) - 1; i++) {
+            out_char(out, str[i]);
+        }
+
+        return;
+    }
+
+    uint64_t scaled = (uint64_t)llround(fabs(value) * 1e6);
+    uint64_t frac = scaled % 1000000;
+
+    if (value < 0 && scaled != 0) {
+        out_char(out, '-');
+    }
+
+    out_u64(out, scaled / 1000000);
+
+    if (frac == 0) {
+        return;
+    }
+
+    char digits[6];
+    int n = 6;
+
+    for (int i = 5; i >= 0; i--) {
+        digits[i] = '0' + frac % 10;
+        frac /= 10;
+    }
+
+    while (digits[n - 1] == '0') {
+        n--;
+    }
+
+    out_char(out, '.');
+
+    for (int i = 0; i < n; i++) {
+        out_char(out, digits[i]);
+    }
+}
+
+
+/**
+Write a key or data type code as its characters. Trailing spaces are dropped,
+characters that aren't printable or would need escaping become '?'.
+*/
+static void out_code(out_t *out, uint32_t code)
+{
+    char chars[4];
+    int n = 4;
+
+    for (int i = 0; i < 4; i++) {
+        char c = (char)(code >> (24 - 8 * i));
+
+        chars[i] = (c < 0x20 || c > 0x7e || c == '"' || c == '\\' ||
+                    c == ',') ? '?' : c;
+    }
+
+    while (n > 1 && chars[n - 1] == ' ') {
+        n--;
+    }
+
+    for (int i = 0; i < n; i++) {
+        out_char(out, chars[i]);
+    }
+}
+
+
+static void out_hex(out_t *out, const uint8_t *data, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        out_char(out, hex_digits[data[i] >> 4]);
+        out_char(out, hex_digits[data[i] & 0xf]);
+    }
+}
+
+
+static void out_be(out_t *out, uint64_t value, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--) {
+        out_char(out, (char)(value >> (8 * i)));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - FORMATS
+//------------------------------------------------------------------------------
+
+
+static void write_header(out_t *out, format_t format, uint64_t time,
+                         size_t count)
+{
+    out_reserve(out);
+
+    if (format == FORMAT_BIN) {
+        out_str(out, "SMCD");
+        out_char(out, BIN_VERSION);
+        out_be(out, 0, 3);
+        out_be(out, time, 8);
+        out_be(out, count, 4);
+    }
+}
+
+
+/**
+Write a key's line or record
+
+:param: value Value read, its result and kSMC say whether the read worked
+*/
+static void write_key(out_t *out, format_t format, uint64_t time,
+                      const smc_key_info_t *info, const smc_value_t *value)
+{
+    bool read = value->result == kIOReturnSuccess && value->kSMC == 0;
+    double decoded = NAN;
+
+    out_reserve(out);
+
+    if (format == FORMAT_BIN) {
+        out_be(out, info->key, 4);
+        out_be(out, info->dataType, 4);
+        out_char(out, (char)info->dataSize);
+
+        if (!read) {
+            out_char(out, value->result == kIOReturnSuccess ?
+                          (char)value->kSMC : (char)0xff);
+            return;
+        }
+
+        out_char(out, 0);
+
+        for (uint32_t i = 0; i < info->dataSize; i++) {
+            out_char(out, value->data[i]);
+        }
+
+        return;
+    }
+
+    if (read) {
+        smc_decode(info->dataType, value->data, info->dataSize, &decoded);
+    }
+
+    if (format == FORMAT_CSV) {
+        out_u64(out, time);
+        out_char(out, ',');
+        out_code(out, info->key);
+        out_char(out, ',');
+        out_code(out, info->dataType);
+        out_char(out, ',');
+        out_u64(out, info->dataSize);
+        out_char(out, ',');
+
+        if (!isnan(decoded)) {
+            out_double(out, decoded);
+        }
+
+        out_char(out, ',');
+
+        if (read) {
+            out_hex(out, value->data, info->dataSize);
+        }
+
+        out_char(out, '\n');
+        return;
+    }
+
+    out_str(out, "{\"time\":");
+    out_u64(out, time);
+    out_str(out, ",\"key\":\"");
+    out_code(out, info->key);
+    out_str(out, "\",\"type\":\"");
+    out_code(out, info->dataType);
+    out_str(out, "\",\"size\":");
+    out_u64(out, info->dataSize);
+    out_str(out, ",\"value\":");
+
+    if (isnan(decoded) || isinf(decoded)) {
+        out_str(out, "null");
+    } else {
+        out_double(out, decoded);
+    }
+
+    out_str(out, ",\"raw\":");
+
+    if (read) {
+        out_char(out, '"');
+        out_hex(out, value->data, info->dataSize);
+        out_char(out, '"');
+    } else {
+        out_str(out, "null");
+    }
+
+    out_str(out, "}\n");
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: HELPERS - DUMP
+//------------------------------------------------------------------------------
+
+
+/**
+Read every key of the catalog, one call each. Each value keeps its own result
+and kSMC.
+*/
+static void read_keys(const smc_catalog_t *catalog, smc_value_t *values)
+{
+    for (size_t i = 0; i < catalog->count; i++) {
+        const smc_key_info_t *info = &catalog->keys[i];
+
+        smc_read_typed(info->key, info->dataType, info->dataSize,
+                       &values[i]);
+    }
+}
+
+
+/**
+Has a key's value changed since the last dump? A failed read counts as a value
+of its own.
+*/
+static bool changed(const smc_value_t *value, const smc_value_t *last,
+                    uint32_t dataSize)
+{
+    if (value->result != last->result || value->kSMC != last->kSMC) {
+        return true;
+    }
+
+    return value->result == kIOReturnSuccess && value->kSMC == 0 &&
+           memcmp(value->data, last->data, dataSize) != 0;
+}
+
+
+/**
+Wall-clock time of a dump, in nanoseconds since the Unix epoch. Intervals and
+--stats timings stay on the monotonic smc_time_ns().
+*/
+static uint64_t wall_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/**
+Make one dump, see smc_run_periodic(). The first dump writes every key, later
+ones only what changed. Stops after the last dump, or a failed write.
+*/
+static void dump(void *context, uint64_t now_ns)
+{
+    dump_t *state = context;
+    const smc_catalog_t *catalog = state->catalog;
+    uint64_t stamp = wall_ns();
+    size_t num_changed = 0;
+
+    read_keys(catalog, state->values);
+
+    uint64_t read_end = smc_time_ns();
+
+    for (size_t i = 0; i < catalog->count; i++) {
+        if (state->dumps == 0 ||
+            changed(&state->values[i], &state->last[i],
+                    catalog->keys[i].dataSize)) {
+            num_changed++;
+        }
+    }
+
+    if (num_changed > 0) {
+        write_header(&state->out, state->format, stamp, num_changed);
+    }
+
+    for (size_t i = 0; i < catalog->count; i++) {
+        if (state->dumps == 0 ||
+            changed(&state->values[i], &state->last[i],
+                    catalog->keys[i].dataSize)) {
+            write_key(&state->out, state->format, stamp, &catalog->keys[i],
+                      &state->values[i]);
+        }
+    }
+
+    out_flush(&state->out);
+
+    smc_value_t *swap = state->last;
+
+    state->last   = state->values;
+    state->values = swap;
+    state->records += num_changed;
+    state->dumps++;
+    state->read_ns  += read_end - now_ns;
+    state->write_ns += smc_time_ns() - read_end;
+
+    if (state->out.error ||
+        (state->count > 0 && state->dumps >= state->count)) {
+        __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MARK: MAIN
+//------------------------------------------------------------------------------
+
+
+int main(int argc, char *argv[])
+{
+    format_t format = FORMAT_CSV;
+    uint64_t interval = 0;
+    unsigned long count = 0;
+    unsigned int threads = 1;
+    long sim_keys = -1;
+    bool print_stats = false;
+    smc_catalog_t catalog;
+    struct sigaction action;
+    dump_t state;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+            continue;
+        }
+
+        if (i + 1 == argc) {
+            fprintf(stderr, "missing value for %s\n", argv[i]);
+            return -1;
+        }
+
+        const char *arg = argv[++i];
+
+        if (strcmp(argv[i - 1], "--format") == 0) {
+            if (strcmp(arg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp(arg, "jsonl") == 0) {
+                format = FORMAT_JSONL;
+            } else if (strcmp(arg, "bin") == 0) {
+                format = FORMAT_BIN;
+            } else {
+                fprintf(stderr, "unknown format %s\n", arg);
+                return -1;
+            }
+        } else if (strcmp(argv[i - 1], "--watch") == 0) {
+            interval = strtoull(arg, NULL, 10) * 1000000;
+        } else if (strcmp(argv[i - 1], "--count") == 0) {
+            count = strtoul(arg, NULL, 10);
+        } else if (strcmp(argv[i - 1], "--threads") == 0) {
+            threads = (unsigned int)strtoul(arg, NULL, 10);
+        } else if (strcmp(argv[i - 1], "--sim") == 0) {
+            sim_keys = strtol(arg, NULL, 10);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i - 1]);
+            return -1;
+        }
+    }
+
+    if (count == 0 && interval == 0) {
+        count = 1;
+    }
+
+#ifndef __APPLE__
+    // No I/O Kit, the simulated SMC is the only option
+    if (sim_keys < 0) {
+        sim_keys = 64;
+    }
+#endif
+
+    if (sim_keys >= 0 &&
+        (smc_set_transport(SMC_TRANSPORT_SIM) != kIOReturnSuccess ||
+         smc_sim_populate((size_t)sim_keys) != kIOReturnSuccess)) {
+        fprintf(stderr, "failed to set up the simulated SMC\n");
+        return -1;
+    }
+
+    if (open_smc() != kIOReturnSuccess) {
+        fprintf(stderr, "failed to open a connection to the SMC\n");
+        return -1;
+    }
+
+    uint64_t start = smc_time_ns();
+
+    if (smc_catalog_build(&catalog, threads) != kIOReturnSuccess) {
+        fprintf(stderr, "failed to enumerate the keys\n");
+        close_smc();
+        return -1;
+    }
+
+    uint64_t enumerate_ns = smc_time_ns() - start;
+
+    memset(&state, 0, sizeof(dump_t));
+    state.catalog  = &catalog;
+    state.values   = calloc(catalog.count ? catalog.count : 1,
+                            sizeof(smc_value_t));
+    state.last     = calloc(catalog.count ? catalog.count : 1,
+                            sizeof(smc_value_t));
+    state.out.data = malloc(OUT_SIZE);
+    state.out.fd   = STDOUT_FILENO;
+    state.format   = format;
+    state.count    = count;
+
+    if (state.values == NULL || state.last == NULL || state.out.data == NULL) {
+        fprintf(stderr, "out of memory\n");
+        free(state.values);
+        free(state.last);
+        free(state.out.data);
+        smc_catalog_free(&catalog);
+        close_smc();
+        return -1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (format == FORMAT_CSV) {
+        out_str(&state.out, "time,key,type,size,value,raw\n");
+    }
+
+    // Dumps at fixed deadlines, back to back without --watch
+    smc_run_periodic(interval, &stop, dump, &state);
+
+    // Output throughput is over the time spent formatting and writing alone
+    if (print_stats) {
+        fprintf(stderr, "{\"keys\":%zu,\"enumerate_ms\":%.3f,\"dumps\":%lu,"
+                "\"records\":%llu,\"bytes\":%llu,\"read_ms\":%.3f,"
+                "\"write_ms\":%.3f,\"keys_per_sec\":%.0f,"
+                "\"mb_per_sec\":%.1f}\n", catalog.count, enumerate_ns / 1e6,
+                state.dumps, (unsigned long long)state.records,
+                (unsigned long long)state.out.total, state.read_ns / 1e6,
+                state.write_ns / 1e6,
+                state.read_ns + state.write_ns > 0 ?
+                state.dumps * catalog.count /
+                ((state.read_ns + state.write_ns) / 1e9) : 0,
+                state.write_ns > 0 ?
+                state.out.total / (state.write_ns / 1e9) / 1e6 : 0);
+    }
+
+    bool error = state.out.error;
+
+    free(state.values);
+    free(state.last);
+    free(state.out.data);
+    smc_catalog_free(&catalog);
+    close_smc();
+
+    if (error) {
+        fprintf(stderr, "failed to write the output\n");
+        return -1;
+    }
+
+    return 0;
+}